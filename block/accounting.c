@@ -26,6 +26,7 @@
 #include "qemu/osdep.h"
 #include "block/accounting.h"
 #include "block/block_int.h"
+#include "qemu/host-utils.h"
 #include "qemu/timer.h"
 #include "sysemu/qtest.h"
 
@@ -250,6 +251,74 @@ void block_acct_invalid(BlockAcctStats *stats, enum BlockAcctType type)
     qemu_mutex_unlock(&stats->lock);
 }
 
+int64_t block_node_stats_start(void)
+{
+    return qemu_clock_get_ns(clock_type);
+}
+
+static int block_node_stats_bucket(uint64_t value, int shift, int nbuckets)
+{
+    int i;
+
+    if (value < (1ULL << shift)) {
+        return 0;
+    }
+    i = 64 - clz64(value) - shift;
+    return MIN(i, nbuckets - 1);
+}
+
+void block_node_stats_done(BlockNodeStats *stats, enum BlockAcctType type,
+                           int64_t bytes, int64_t start_ns, int ret)
+{
+    BlockNodeOpStats *s = &stats->op[type];
+    int64_t latency_ns = qemu_clock_get_ns(clock_type) - start_ns;
+
+    assert(type > BLOCK_ACCT_NONE && type < BLOCK_MAX_IOTYPE);
+
+    if (qtest_enabled()) {
+        latency_ns = qtest_latency_ns;
+    }
+
+    if (ret < 0) {
+        stat64_add(&s->failed_ops, 1);
+        return;
+    }
+
+    stat64_add(&s->ops, 1);
+    stat64_add(&s->bytes, bytes);
+    stat64_add(&s->total_time_ns, latency_ns);
+    stat64_add(&s->latency[block_node_stats_bucket(latency_ns,
+                                                   BLOCK_NODE_LATENCY_SHIFT,
+                                                   BLOCK_NODE_LATENCY_BUCKETS)],
+               1);
+    if (type != BLOCK_ACCT_FLUSH) {
+        stat64_add(&s->size[block_node_stats_bucket(bytes,
+                                                    BLOCK_NODE_SIZE_SHIFT,
+                                                    BLOCK_NODE_SIZE_BUCKETS)],
+                   1);
+    }
+}
+
+void block_node_stats_clear(BlockNodeStats *stats)
+{
+    BlockNodeOpStats *s;
+    int i;
+
+    /* Racing updates may survive, which is fine for statistics */
+    for (s = stats->op; s < stats->op + BLOCK_MAX_IOTYPE; s++) {
+        stat64_init(&s->ops, 0);
+        stat64_init(&s->failed_ops, 0);
+        stat64_init(&s->bytes, 0);
+        stat64_init(&s->total_time_ns, 0);
+        for (i = 0; i < BLOCK_NODE_LATENCY_BUCKETS; i++) {
+            stat64_init(&s->latency[i], 0);
+        }
+        for (i = 0; i < BLOCK_NODE_SIZE_BUCKETS; i++) {
+            stat64_init(&s->size[i], 0);
+        }
+    }
+}
+
 void block_acct_merge_done(BlockAcctStats *stats, enum BlockAcctType type,
                       int num_requests)
 {
@@ -2429,6 +2429,47 @@ int coroutine_fn blk_co_copy_range(BlockBackend *blk_in, int64_t off_in,
                               bytes, read_flags, write_flags);
 }
 
+bool blk_can_sendfile(BlockBackend *blk)
+{
+    BlockDriverState *bs = blk_bs(blk);
+
+    return bs && bdrv_can_sendfile(bs);
+}
+
+/*
+ * Zero-copy read of @bytes at @offset into @out_fd.  See
+ * bdrv_co_sendfile() for the return value semantics.
+ */
+int coroutine_fn blk_co_sendfile(BlockBackend *blk, int64_t offset,
+                                 int bytes, int out_fd)
+{
+    int ret;
+
+    blk_inc_in_flight(blk);
+    blk_wait_while_drained(blk);
+
+    ret = blk_check_byte_request(blk, offset, bytes);
+    if (ret < 0) {
+        goto out;
+    }
+
+    ret = bdrv_co_sendfile(blk->root, offset, bytes, out_fd);
+
+    /*
+     * throttling disk I/O: only what was actually sent is accounted, because
+     * the caller retries the rest when @out_fd was full.  Accounting after
+     * the fact delays the next request instead of this one.
+     */
+    if (ret > 0 && blk->public.throttle_group_member.throttle_state) {
+        throttle_group_co_io_limits_intercept(&blk->public.throttle_group_member,
+                ret, false);
+    }
+
+out:
+    blk_dec_in_flight(blk);
+    return ret;
+}
+
 const BdrvChild *blk_root(BlockBackend *blk)
 {
     return blk->root;
@@ -19,6 +19,7 @@
 #include "block/block-copy.h"
 #include "sysemu/block-backend.h"
 #include "qemu/units.h"
+#include "qemu/cutils.h"
 #include "qemu/coroutine.h"
 #include "block/aio_task.h"
 
@@ -28,6 +29,14 @@
 #define BLOCK_COPY_MAX_WORKERS 64
 #define BLOCK_COPY_SLICE_TIME 100000000ULL /* ns */
 
+/* Adaptive tuning of chunk size and number of workers */
+#define BLOCK_COPY_ADAPT_MAX_CHUNK (16 * MiB)
+#define BLOCK_COPY_ADAPT_INIT_WORKERS 8
+#define BLOCK_COPY_ADAPT_WINDOW_NS 200000000LL
+#define BLOCK_COPY_ADAPT_WINDOW_TASKS 4
+/* Throughput changes within this many percent are considered noise */
+#define BLOCK_COPY_ADAPT_NOISE_PCT 5
+
 static coroutine_fn int block_copy_task_entry(AioTask *task);
 
 typedef struct BlockCopyCallState {
@@ -37,6 +46,7 @@ typedef struct BlockCopyCallState {
     int64_t bytes;
     int max_workers;
     int64_t max_chunk;
+    bool adaptive;
     bool ignore_ratelimit;
     BlockCopyAsyncCallbackFunc cb;
     void *cb_opaque;
@@ -53,6 +63,27 @@ typedef struct BlockCopyCallState {
     QemuCoSleepState *sleep_state;
     bool cancelled;
 
+    /*
+     * Adaptive tuning, only used if @adaptive is set.  See
+     * block_copy_adapt().
+     */
+    struct {
+        int workers;
+        int64_t chunk;
+        bool tune_chunk;    /* The knob changed by the next step */
+        bool grow;          /* The direction of the next step */
+
+        /* Measurement window */
+        int64_t start_ns;
+        int64_t bytes;
+        int64_t latency_ns;
+        int tasks;
+
+        /* Results of the previous window */
+        uint64_t last_rate;
+        int64_t last_latency_ns;
+    } adapt;
+
     /* OUT parameters */
     bool error_is_read;
 } BlockCopyCallState;
@@ -65,6 +96,7 @@ typedef struct BlockCopyTask {
     int64_t offset;
     int64_t bytes;
     bool zeroes;
+    int64_t start_ns;
     QLIST_ENTRY(BlockCopyTask) list;
     CoQueue wait_queue; /* coroutines blocked on this task */
 } BlockCopyTask;
@@ -117,6 +149,33 @@ typedef struct BlockCopyState {
     RateLimit rate_limit;
 } BlockCopyState;
 
+static uint32_t block_copy_max_transfer(BdrvChild *source, BdrvChild *target)
+{
+    return MIN_NON_ZERO(INT_MAX,
+                        MIN_NON_ZERO(source->bs->bl.max_transfer,
+                                     target->bs->bl.max_transfer));
+}
+
+/*
+ * Maximum length of one task.  Adaptive calls may go beyond the default
+ * request size for buffered copies, up to the max_transfer of the nodes.
+ */
+static int64_t block_copy_chunk_limit(BlockCopyCallState *call_state)
+{
+    BlockCopyState *s = call_state->s;
+    int64_t limit = s->copy_size;
+
+    if (call_state->adaptive && !(s->write_flags & BDRV_REQ_WRITE_COMPRESSED)) {
+        limit = MAX(limit,
+                    MIN(BLOCK_COPY_ADAPT_MAX_CHUNK,
+                        QEMU_ALIGN_DOWN(block_copy_max_transfer(s->source,
+                                                                s->target),
+                                        s->cluster_size)));
+    }
+
+    return MIN_NON_ZERO(limit, call_state->max_chunk);
+}
+
 static BlockCopyTask *find_conflicting_task(BlockCopyState *s,
                                             int64_t offset, int64_t bytes)
 {
@@ -158,7 +217,11 @@ static BlockCopyTask *block_copy_task_create(BlockCopyState *s,
                                              int64_t offset, int64_t bytes)
 {
     BlockCopyTask *task;
-    int64_t max_chunk = MIN_NON_ZERO(s->copy_size, call_state->max_chunk);
+    int64_t max_chunk = block_copy_chunk_limit(call_state);
+
+    if (call_state->adaptive) {
+        max_chunk = MIN(max_chunk, call_state->adapt.chunk);
+    }
 
     if (!bdrv_dirty_bitmap_next_dirty_area(s->copy_bitmap,
                                            offset, offset + bytes,
@@ -235,13 +298,6 @@ void block_copy_state_free(BlockCopyState *s)
     g_free(s);
 }
 
-static uint32_t block_copy_max_transfer(BdrvChild *source, BdrvChild *target)
-{
-    return MIN_NON_ZERO(INT_MAX,
-                        MIN_NON_ZERO(source->bs->bl.max_transfer,
-                                     target->bs->bl.max_transfer));
-}
-
 BlockCopyState *block_copy_state_new(BdrvChild *source, BdrvChild *target,
                                      int64_t cluster_size, bool use_copy_range,
                                      BdrvRequestFlags write_flags, Error **errp)
@@ -332,6 +388,47 @@ static coroutine_fn int block_copy_task_run(AioTaskPool *pool,
     return 0;
 }
 
+/*
+ * block_copy_write_buffer
+ *
+ * Write data that was read from the source to the target.  Clusters that
+ * turned out to be zero are written with write-zeroes requests, the rest
+ * with normal writes, splitting the buffer in a single pass.
+ */
+static int coroutine_fn block_copy_write_buffer(BlockCopyState *s,
+                                                int64_t offset, int64_t bytes,
+                                                uint8_t *buf)
+{
+    int ret;
+
+    while (bytes > 0) {
+        bool is_zero;
+        int64_t n = buffer_find_zero_extent(buf, bytes, s->cluster_size,
+                                            &is_zero);
+
+        if (is_zero) {
+            ret = bdrv_co_pwrite_zeroes(s->target, offset, n, s->write_flags &
+                                        ~BDRV_REQ_WRITE_COMPRESSED);
+            if (ret < 0) {
+                trace_block_copy_write_zeroes_fail(s, offset, ret);
+                return ret;
+            }
+        } else {
+            ret = bdrv_co_pwrite(s->target, offset, n, buf, s->write_flags);
+            if (ret < 0) {
+                trace_block_copy_write_fail(s, offset, ret);
+                return ret;
+            }
+        }
+
+        offset += n;
+        bytes -= n;
+        buf += n;
+    }
+
+    return 0;
+}
+
 /*
  * block_copy_do_copy
  *
@@ -415,10 +512,8 @@ static int coroutine_fn block_copy_do_copy(BlockCopyState *s,
         goto out;
     }
 
-    ret = bdrv_co_pwrite(s->target, offset, nbytes, bounce_buffer,
-                         s->write_flags);
+    ret = block_copy_write_buffer(s, offset, nbytes, bounce_buffer);
     if (ret < 0) {
-        trace_block_copy_write_fail(s, offset, ret);
         *error_is_read = false;
         goto out;
     }
@@ -429,6 +524,118 @@ out:
     return ret;
 }
 
+/*
+ * block_copy_adapt
+ *
+ * Hill climbing on the throughput of the last measurement window.  Each step
+ * doubles or halves either the chunk size or the number of workers:
+ *
+ * - If throughput improved, take another step in the same direction.
+ * - If it got worse, undo the last step and try the other knob.
+ * - If it did not change much, the last step was useless.  If latency went
+ *   up, requests are only queueing on the storage, so reduce the number of
+ *   workers.  Otherwise try growing the other knob.
+ *
+ * The chunk size stays between the cluster size and
+ * block_copy_chunk_limit(), the number of workers between 1 and
+ * @max_workers.
+ */
+static void block_copy_adapt(BlockCopyCallState *call_state, int64_t now)
+{
+    BlockCopyState *s = call_state->s;
+    int64_t elapsed = now - call_state->adapt.start_ns;
+    uint64_t rate = muldiv64(call_state->adapt.bytes, NANOSECONDS_PER_SECOND,
+                             MAX(elapsed, 1));
+    int64_t latency_ns = call_state->adapt.latency_ns /
+                         call_state->adapt.tasks;
+    uint64_t last_rate = call_state->adapt.last_rate;
+    uint64_t noise = last_rate / 100 * BLOCK_COPY_ADAPT_NOISE_PCT;
+    int64_t chunk_limit = block_copy_chunk_limit(call_state);
+    int64_t old_chunk = call_state->adapt.chunk;
+    int old_workers = call_state->adapt.workers;
+    bool undo = false;
+    int i;
+
+    if (!last_rate) {
+        /* First window, keep the initial direction */
+    } else if (rate + noise < last_rate) {
+        undo = true;
+        call_state->adapt.grow = !call_state->adapt.grow;
+    } else if (rate <= last_rate + noise) {
+        if (latency_ns > call_state->adapt.last_latency_ns +
+                         call_state->adapt.last_latency_ns / 4) {
+            call_state->adapt.tune_chunk = false;
+            call_state->adapt.grow = false;
+        } else {
+            call_state->adapt.tune_chunk = !call_state->adapt.tune_chunk;
+            call_state->adapt.grow = true;
+        }
+    }
+
+    /* If the chosen knob is at its bound, use the other one */
+    for (i = 0; i < 2; i++) {
+        if (call_state->adapt.tune_chunk) {
+            int64_t chunk = call_state->adapt.grow ?
+                            old_chunk * 2 :
+                            QEMU_ALIGN_DOWN(old_chunk / 2, s->cluster_size);
+
+            chunk = MIN(MAX(chunk, s->cluster_size), chunk_limit);
+            if (chunk != old_chunk) {
+                call_state->adapt.chunk = chunk;
+                break;
+            }
+        } else {
+            int workers = call_state->adapt.grow ?
+                          old_workers * 2 : old_workers / 2;
+
+            workers = MIN(MAX(workers, 1), call_state->max_workers);
+            if (workers != old_workers) {
+                call_state->adapt.workers = workers;
+                break;
+            }
+        }
+        call_state->adapt.tune_chunk = !call_state->adapt.tune_chunk;
+    }
+
+    trace_block_copy_adapt(s, rate, latency_ns, call_state->adapt.chunk,
+                           call_state->adapt.workers);
+
+    /* After undoing a step, continue on the other knob */
+    if (undo) {
+        call_state->adapt.tune_chunk = !call_state->adapt.tune_chunk;
+        call_state->adapt.grow = true;
+    }
+
+    call_state->adapt.last_rate = rate;
+    call_state->adapt.last_latency_ns = latency_ns;
+    call_state->adapt.start_ns = now;
+    call_state->adapt.bytes = 0;
+    call_state->adapt.latency_ns = 0;
+    call_state->adapt.tasks = 0;
+}
+
+static void block_copy_adapt_account(BlockCopyTask *task)
+{
+    BlockCopyCallState *call_state = task->call_state;
+    int64_t now;
+
+    /* Zero writes don't say anything about the data path */
+    if (!call_state->adaptive || task->zeroes) {
+        return;
+    }
+
+    now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    call_state->adapt.bytes += task->bytes;
+    call_state->adapt.latency_ns += now - task->start_ns;
+    call_state->adapt.tasks++;
+
+    if (now - call_state->adapt.start_ns >= BLOCK_COPY_ADAPT_WINDOW_NS &&
+        call_state->adapt.tasks >= BLOCK_COPY_ADAPT_WINDOW_TASKS)
+    {
+        block_copy_adapt(call_state, now);
+    }
+}
+
 static coroutine_fn int block_copy_task_entry(AioTask *task)
 {
     BlockCopyTask *t = container_of(task, BlockCopyTask, task);
@@ -442,6 +649,9 @@ static coroutine_fn int block_copy_task_entry(AioTask *task)
         t->call_state->error_is_read = error_is_read;
     } else {
         progress_work_done(t->s->progress, t->bytes);
+        if (ret >= 0) {
+            block_copy_adapt_account(t);
+        }
     }
     co_put_to_shres(t->s->mem, t->bytes);
     block_copy_task_end(t, ret);
@@ -640,9 +850,15 @@ block_copy_dirty_clusters(BlockCopyCallState *call_state)
         bytes = end - offset;
 
         if (!aio && bytes) {
-            aio = aio_task_pool_new(call_state->max_workers);
+            aio = aio_task_pool_new(call_state->adaptive ?
+                                    call_state->adapt.workers :
+                                    call_state->max_workers);
+        } else if (aio && call_state->adaptive) {
+            aio_task_pool_set_max_busy_tasks(aio, call_state->adapt.workers);
         }
 
+        task->start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
         ret = block_copy_task_run(aio, task);
         if (ret < 0) {
             goto out;
@@ -744,6 +960,7 @@ static void coroutine_fn block_copy_async_co_entry(void *opaque)
 BlockCopyCallState *block_copy_async(BlockCopyState *s,
                                      int64_t offset, int64_t bytes,
                                      int max_workers, int64_t max_chunk,
+                                     bool adaptive,
                                      BlockCopyAsyncCallbackFunc cb,
                                      void *cb_opaque)
 {
@@ -755,12 +972,24 @@ BlockCopyCallState *block_copy_async(BlockCopyState *s,
         .bytes = bytes,
         .max_workers = max_workers,
         .max_chunk = max_chunk,
+        .adaptive = adaptive,
         .cb = cb,
         .cb_opaque = cb_opaque,
 
         .co = qemu_coroutine_create(block_copy_async_co_entry, call_state),
     };
 
+    if (adaptive) {
+        call_state->adapt.workers = MIN(max_workers,
+                                        BLOCK_COPY_ADAPT_INIT_WORKERS);
+        call_state->adapt.chunk = MIN(block_copy_chunk_limit(call_state),
+                                      MAX(s->cluster_size,
+                                          BLOCK_COPY_MAX_BUFFER));
+        call_state->adapt.tune_chunk = true;
+        call_state->adapt.grow = true;
+        call_state->adapt.start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    }
+
     qemu_coroutine_enter(call_state->co);
 
     return call_state;
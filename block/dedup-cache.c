@@ -0,0 +1,776 @@
+/*
+ * Content-addressed deduplicating read cache filter
+ *
+ * Many nodes often read the same data, for example when hundreds of guests
+ * are started from overlays on top of one base image.  This filter keeps the
+ * clusters that are read through it in a cache in host memory that is shared
+ * by all dedup-cache nodes of the process:
+ *
+ * - Nodes whose child has the same file name and format share a cluster
+ *   index (DedupImage), so a cluster read by one of them is a cache hit for
+ *   all others.
+ *
+ * - Cached data is stored by content (DedupEntry).  A cluster whose content
+ *   matches one that is already cached, possibly from a different image,
+ *   shares the existing copy.  Entries are looked up by a crc32c of their
+ *   content and compared byte by byte, so hash collisions are harmless.
+ *
+ * The memory used for cached data is bounded by the largest cache-size of
+ * all open nodes.  Entries are evicted with LRU-2: entries that have only
+ * been accessed once go first, in the order they were loaded, so that a
+ * sequential scan does not flush the working set.  Otherwise the entry whose
+ * second most recent access is the oldest is evicted.
+ *
+ * Writes, zero writes, discards and truncation through the filter invalidate
+ * the affected clusters of the image.  The filter does not share write
+ * permissions on its child, so there are no writes that bypass it.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "block/block_int.h"
+#include "qemu/crc32c.h"
+#include "qemu/module.h"
+#include "qemu/option.h"
+#include "qemu/units.h"
+#include "qapi/error.h"
+#include "trace.h"
+
+#define DEDUP_CACHE_OPT_CACHE_SIZE      "cache-size"
+#define DEDUP_CACHE_OPT_CLUSTER_SIZE    "cluster-size"
+
+#define DEDUP_CACHE_DEFAULT_CACHE_SIZE      (64 * MiB)
+#define DEDUP_CACHE_DEFAULT_CLUSTER_SIZE    (64 * KiB)
+#define DEDUP_CACHE_MIN_CLUSTER_SIZE        (4 * KiB)
+#define DEDUP_CACHE_MAX_CLUSTER_SIZE        (2 * MiB)
+
+typedef struct DedupEntry DedupEntry;
+typedef struct DedupImage DedupImage;
+
+/* A cluster of an image that is present in the cache */
+typedef struct DedupRef {
+    uint64_t cluster;           /* key in DedupImage.clusters */
+    DedupImage *image;
+    DedupEntry *entry;
+    QLIST_ENTRY(DedupRef) next;
+} DedupRef;
+
+/* Cached cluster data */
+struct DedupEntry {
+    uint32_t hash;              /* crc32c of @data */
+    size_t size;
+    void *data;
+
+    /* Other entries with the same hash */
+    DedupEntry *hash_next;
+
+    /* All image clusters with this content; the entry is freed with the last */
+    QLIST_HEAD(, DedupRef) refs;
+
+    /*
+     * LRU-2 bookkeeping.  Entries with @prev_access == 0 have been accessed
+     * once and are on dedup_cache.cold, all others are in dedup_cache.hot.
+     */
+    uint64_t last_access;
+    uint64_t prev_access;
+    QTAILQ_ENTRY(DedupEntry) cold_next;
+};
+
+/* Cluster index shared by all nodes whose child is the same image */
+struct DedupImage {
+    char *key;
+    int refcnt;
+
+    /*
+     * Incremented by every invalidation, so that a cache miss can detect a
+     * write that raced with its read of the child
+     */
+    uint64_t write_gen;
+
+    GHashTable *clusters;       /* uint64_t cluster -> DedupRef */
+};
+
+typedef struct BDRVDedupCacheState {
+    DedupImage *image;
+    uint64_t cache_size;
+    uint64_t cluster_size;
+
+    struct {
+        uint64_t hits;
+        uint64_t misses;
+    } stats;
+
+    QLIST_ENTRY(BDRVDedupCacheState) next;
+} BDRVDedupCacheState;
+
+/*
+ * Process-wide cache state.  Nodes can be in different AioContexts, so
+ * everything is protected by @lock.  Cache hits copy data while holding the
+ * lock; the critical section is short compared to reading from the child.
+ */
+static struct {
+    QemuMutex lock;
+
+    QLIST_HEAD(, BDRVDedupCacheState) nodes;
+    GHashTable *images;         /* DedupImage.key -> DedupImage */
+    GHashTable *entries;        /* DedupEntry.hash -> DedupEntry chain */
+
+    QTAILQ_HEAD(, DedupEntry) cold;
+    GTree *hot;                 /* DedupEntry ordered by prev_access */
+    uint64_t clock;
+
+    uint64_t used;
+    uint64_t budget;
+
+    uint64_t nb_entries;
+    uint64_t deduplicated;
+    uint64_t evictions;
+} dedup_cache;
+
+static gint dedup_entry_cmp(gconstpointer a, gconstpointer b)
+{
+    const DedupEntry *ea = a;
+    const DedupEntry *eb = b;
+
+    return ea->prev_access < eb->prev_access ? -1 :
+           ea->prev_access > eb->prev_access;
+}
+
+/* Record an access to @entry for LRU-2.  Called with dedup_cache.lock held */
+static void dedup_entry_touch(DedupEntry *entry)
+{
+    if (entry->prev_access) {
+        g_tree_remove(dedup_cache.hot, entry);
+    } else {
+        QTAILQ_REMOVE(&dedup_cache.cold, entry, cold_next);
+    }
+
+    entry->prev_access = entry->last_access;
+    entry->last_access = ++dedup_cache.clock;
+    g_tree_insert(dedup_cache.hot, entry, entry);
+}
+
+static gboolean dedup_entry_first(gpointer key, gpointer value, gpointer data)
+{
+    *(DedupEntry **)data = value;
+    return TRUE;
+}
+
+/* Returns the entry that LRU-2 evicts next, or NULL if the cache is empty */
+static DedupEntry *dedup_cache_victim(void)
+{
+    DedupEntry *entry = QTAILQ_FIRST(&dedup_cache.cold);
+
+    if (!entry) {
+        g_tree_foreach(dedup_cache.hot, dedup_entry_first, &entry);
+    }
+    return entry;
+}
+
+/* Called with dedup_cache.lock held */
+static void dedup_entry_free(DedupEntry *entry)
+{
+    DedupEntry *head, **p;
+    DedupRef *ref, *next_ref;
+
+    if (entry->prev_access) {
+        g_tree_remove(dedup_cache.hot, entry);
+    } else {
+        QTAILQ_REMOVE(&dedup_cache.cold, entry, cold_next);
+    }
+
+    head = g_hash_table_lookup(dedup_cache.entries,
+                               GUINT_TO_POINTER(entry->hash));
+    if (head == entry) {
+        if (entry->hash_next) {
+            g_hash_table_insert(dedup_cache.entries,
+                                GUINT_TO_POINTER(entry->hash),
+                                entry->hash_next);
+        } else {
+            g_hash_table_remove(dedup_cache.entries,
+                                GUINT_TO_POINTER(entry->hash));
+        }
+    } else {
+        for (p = &head->hash_next; *p != entry; p = &(*p)->hash_next) {
+            assert(*p);
+        }
+        *p = entry->hash_next;
+    }
+
+    QLIST_FOREACH_SAFE(ref, &entry->refs, next, next_ref) {
+        g_hash_table_remove(ref->image->clusters, &ref->cluster);
+        g_free(ref);
+    }
+
+    dedup_cache.used -= entry->size;
+    dedup_cache.nb_entries--;
+    g_free(entry->data);
+    g_free(entry);
+}
+
+/* Evict entries until @size more bytes fit.  Called with the lock held */
+static bool dedup_cache_make_room(uint64_t size)
+{
+    DedupEntry *entry;
+
+    while (dedup_cache.used + size > dedup_cache.budget) {
+        entry = dedup_cache_victim();
+        if (!entry) {
+            return false;
+        }
+        trace_dedup_cache_evict(entry, entry->last_access, entry->prev_access);
+        dedup_entry_free(entry);
+        dedup_cache.evictions++;
+    }
+    return true;
+}
+
+/* Called with dedup_cache.lock held */
+static void dedup_ref_free(DedupRef *ref)
+{
+    DedupEntry *entry = ref->entry;
+
+    QLIST_REMOVE(ref, next);
+    g_hash_table_remove(ref->image->clusters, &ref->cluster);
+    g_free(ref);
+
+    if (QLIST_EMPTY(&entry->refs)) {
+        dedup_entry_free(entry);
+    }
+}
+
+/*
+ * Drop clusters [@first, @last] of @image from the cache.  Called with
+ * dedup_cache.lock held.
+ */
+static void dedup_image_invalidate_locked(DedupImage *image, uint64_t first,
+                                          uint64_t last)
+{
+    image->write_gen++;
+
+    if (last - first >= g_hash_table_size(image->clusters)) {
+        GHashTableIter iter;
+        DedupRef *ref;
+        GSList *refs = NULL, *l;
+
+        g_hash_table_iter_init(&iter, image->clusters);
+        while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&ref)) {
+            if (ref->cluster >= first && ref->cluster <= last) {
+                refs = g_slist_prepend(refs, ref);
+            }
+        }
+        for (l = refs; l; l = l->next) {
+            dedup_ref_free(l->data);
+        }
+        g_slist_free(refs);
+    } else {
+        uint64_t cluster;
+
+        for (cluster = first; cluster <= last; cluster++) {
+            DedupRef *ref = g_hash_table_lookup(image->clusters, &cluster);
+            if (ref) {
+                dedup_ref_free(ref);
+            }
+        }
+    }
+}
+
+static void dedup_image_invalidate(DedupImage *image, uint64_t first,
+                                   uint64_t last)
+{
+    qemu_mutex_lock(&dedup_cache.lock);
+    dedup_image_invalidate_locked(image, first, last);
+    qemu_mutex_unlock(&dedup_cache.lock);
+}
+
+static void dedup_cache_invalidate(BlockDriverState *bs, uint64_t offset,
+                                   uint64_t bytes)
+{
+    BDRVDedupCacheState *s = bs->opaque;
+
+    if (!bytes) {
+        return;
+    }
+    dedup_image_invalidate(s->image, offset / s->cluster_size,
+                           (offset + bytes - 1) / s->cluster_size);
+}
+
+static void dedup_cache_invalidate_all(BlockDriverState *bs)
+{
+    BDRVDedupCacheState *s = bs->opaque;
+
+    dedup_image_invalidate(s->image, 0, UINT64_MAX);
+}
+
+/*
+ * Copy @bytes at @offset_in_cluster of @cluster to @qiov if the cluster is
+ * cached
+ */
+static bool dedup_cache_read(BDRVDedupCacheState *s, uint64_t cluster,
+                             size_t offset_in_cluster, size_t bytes,
+                             QEMUIOVector *qiov, size_t qiov_offset)
+{
+    DedupRef *ref;
+
+    qemu_mutex_lock(&dedup_cache.lock);
+    ref = g_hash_table_lookup(s->image->clusters, &cluster);
+    if (ref) {
+        dedup_entry_touch(ref->entry);
+        qemu_iovec_from_buf(qiov, qiov_offset,
+                            ref->entry->data + offset_in_cluster, bytes);
+    }
+    qemu_mutex_unlock(&dedup_cache.lock);
+
+    return ref != NULL;
+}
+
+/*
+ * Add @data, which holds @cluster as read from the child before @write_gen,
+ * to the cache.  Takes ownership of @data.
+ */
+static void dedup_cache_insert(BDRVDedupCacheState *s, uint64_t cluster,
+                               void *data, uint64_t write_gen)
+{
+    DedupImage *image = s->image;
+    uint32_t hash = crc32c(0xffffffff, data, s->cluster_size);
+    DedupEntry *entry, *head;
+    DedupRef *ref;
+
+    qemu_mutex_lock(&dedup_cache.lock);
+
+    /* A concurrent write makes @data stale, another read may have won */
+    if (image->write_gen != write_gen ||
+        g_hash_table_contains(image->clusters, &cluster)) {
+        goto out_free;
+    }
+
+    head = g_hash_table_lookup(dedup_cache.entries, GUINT_TO_POINTER(hash));
+    for (entry = head; entry; entry = entry->hash_next) {
+        if (entry->size == s->cluster_size &&
+            !memcmp(entry->data, data, s->cluster_size)) {
+            break;
+        }
+    }
+
+    if (entry) {
+        dedup_cache.deduplicated++;
+        dedup_entry_touch(entry);
+        g_free(data);
+    } else {
+        if (!dedup_cache_make_room(s->cluster_size)) {
+            goto out_free;
+        }
+
+        /* Eviction may have changed the chain */
+        head = g_hash_table_lookup(dedup_cache.entries,
+                                   GUINT_TO_POINTER(hash));
+        entry = g_new(DedupEntry, 1);
+        *entry = (DedupEntry) {
+            .hash           = hash,
+            .size           = s->cluster_size,
+            .data           = data,
+            .hash_next      = head,
+            .last_access    = ++dedup_cache.clock,
+        };
+        QLIST_INIT(&entry->refs);
+        QTAILQ_INSERT_TAIL(&dedup_cache.cold, entry, cold_next);
+        g_hash_table_insert(dedup_cache.entries, GUINT_TO_POINTER(hash),
+                            entry);
+        dedup_cache.used += entry->size;
+        dedup_cache.nb_entries++;
+    }
+
+    ref = g_new(DedupRef, 1);
+    *ref = (DedupRef) {
+        .cluster    = cluster,
+        .image      = image,
+        .entry      = entry,
+    };
+    QLIST_INSERT_HEAD(&entry->refs, ref, next);
+    g_hash_table_insert(image->clusters, &ref->cluster, ref);
+
+    qemu_mutex_unlock(&dedup_cache.lock);
+    return;
+
+out_free:
+    qemu_mutex_unlock(&dedup_cache.lock);
+    g_free(data);
+}
+
+/* Called with dedup_cache.lock held */
+static void dedup_cache_update_budget(void)
+{
+    BDRVDedupCacheState *s;
+
+    dedup_cache.budget = 0;
+    QLIST_FOREACH(s, &dedup_cache.nodes, next) {
+        dedup_cache.budget = MAX(dedup_cache.budget, s->cache_size);
+    }
+    dedup_cache_make_room(0);
+}
+
+/* Called with dedup_cache.lock held */
+static DedupImage *dedup_image_get(const char *key)
+{
+    DedupImage *image = g_hash_table_lookup(dedup_cache.images, key);
+
+    if (!image) {
+        image = g_new0(DedupImage, 1);
+        image->key = g_strdup(key);
+        image->clusters = g_hash_table_new(g_int64_hash, g_int64_equal);
+        g_hash_table_insert(dedup_cache.images, image->key, image);
+    }
+    image->refcnt++;
+    return image;
+}
+
+/* Called with dedup_cache.lock held */
+static void dedup_image_put(DedupImage *image)
+{
+    if (--image->refcnt) {
+        return;
+    }
+
+    dedup_image_invalidate_locked(image, 0, UINT64_MAX);
+    g_hash_table_remove(dedup_cache.images, image->key);
+    g_hash_table_destroy(image->clusters);
+    g_free(image->key);
+    g_free(image);
+}
+
+static QemuOptsList dedup_cache_runtime_opts = {
+    .name = "dedup-cache",
+    .head = QTAILQ_HEAD_INITIALIZER(dedup_cache_runtime_opts.head),
+    .desc = {
+        {
+            .name = DEDUP_CACHE_OPT_CACHE_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "memory budget of the cache shared by all dedup-cache "
+                    "nodes, default 64M",
+        },
+        {
+            .name = DEDUP_CACHE_OPT_CLUSTER_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "cache granularity, default 64k",
+        },
+        { /* end of list */ }
+    },
+};
+
+static int dedup_cache_open(BlockDriverState *bs, QDict *options, int flags,
+                            Error **errp)
+{
+    BDRVDedupCacheState *s = bs->opaque;
+    QemuOpts *opts;
+    char *key;
+
+    opts = qemu_opts_create(&dedup_cache_runtime_opts, NULL, 0, &error_abort);
+    if (!qemu_opts_absorb_qdict(opts, options, errp)) {
+        qemu_opts_del(opts);
+        return -EINVAL;
+    }
+    s->cache_size = qemu_opt_get_size(opts, DEDUP_CACHE_OPT_CACHE_SIZE,
+                                      DEDUP_CACHE_DEFAULT_CACHE_SIZE);
+    s->cluster_size = qemu_opt_get_size(opts, DEDUP_CACHE_OPT_CLUSTER_SIZE,
+                                        DEDUP_CACHE_DEFAULT_CLUSTER_SIZE);
+    qemu_opts_del(opts);
+
+    if (!is_power_of_2(s->cluster_size) ||
+        s->cluster_size < DEDUP_CACHE_MIN_CLUSTER_SIZE ||
+        s->cluster_size > DEDUP_CACHE_MAX_CLUSTER_SIZE) {
+        error_setg(errp, "cluster-size must be a power of two between %d "
+                   "and %d", DEDUP_CACHE_MIN_CLUSTER_SIZE,
+                   DEDUP_CACHE_MAX_CLUSTER_SIZE);
+        return -EINVAL;
+    }
+
+    bs->file = bdrv_open_child(NULL, options, "file", bs, &child_of_bds,
+                               BDRV_CHILD_FILTERED | BDRV_CHILD_PRIMARY,
+                               false, errp);
+    if (!bs->file) {
+        return -EINVAL;
+    }
+
+    bs->supported_write_flags = BDRV_REQ_WRITE_UNCHANGED |
+        (BDRV_REQ_FUA & bs->file->bs->supported_write_flags);
+
+    bs->supported_zero_flags = BDRV_REQ_WRITE_UNCHANGED |
+        ((BDRV_REQ_FUA | BDRV_REQ_MAY_UNMAP | BDRV_REQ_NO_FALLBACK) &
+            bs->file->bs->supported_zero_flags);
+
+    /*
+     * Nodes share cached clusters if their children show the same data, i.e.
+     * have the same driver and file name (which includes any options that
+     * change the content, such as an overridden backing file)
+     */
+    bdrv_refresh_filename(bs->file->bs);
+    key = g_strdup_printf("%s:%" PRIu64 ":%s",
+                          bs->file->bs->drv->format_name, s->cluster_size,
+                          bs->file->bs->filename);
+
+    qemu_mutex_lock(&dedup_cache.lock);
+    s->image = dedup_image_get(key);
+    QLIST_INSERT_HEAD(&dedup_cache.nodes, s, next);
+    dedup_cache_update_budget();
+    qemu_mutex_unlock(&dedup_cache.lock);
+
+    trace_dedup_cache_open(bs, key, s->cache_size, s->cluster_size);
+    g_free(key);
+    return 0;
+}
+
+static void dedup_cache_close(BlockDriverState *bs)
+{
+    BDRVDedupCacheState *s = bs->opaque;
+
+    qemu_mutex_lock(&dedup_cache.lock);
+    QLIST_REMOVE(s, next);
+    dedup_image_put(s->image);
+    dedup_cache_update_budget();
+    qemu_mutex_unlock(&dedup_cache.lock);
+}
+
+#define PERM_PASSTHROUGH (BLK_PERM_CONSISTENT_READ \
+                          | BLK_PERM_WRITE \
+                          | BLK_PERM_RESIZE)
+#define PERM_UNCHANGED (BLK_PERM_ALL & ~PERM_PASSTHROUGH)
+
+static void dedup_cache_child_perm(BlockDriverState *bs, BdrvChild *c,
+                                   BdrvChildRole role,
+                                   BlockReopenQueue *reopen_queue,
+                                   uint64_t perm, uint64_t shared,
+                                   uint64_t *nperm, uint64_t *nshared)
+{
+    *nperm = perm & PERM_PASSTHROUGH;
+    *nshared = (shared & PERM_PASSTHROUGH) | PERM_UNCHANGED;
+
+    /* Writes that bypass the filter would make the cache stale */
+    *nshared &= ~(BLK_PERM_WRITE | BLK_PERM_WRITE_UNCHANGED |
+                  BLK_PERM_RESIZE);
+}
+
+static int64_t dedup_cache_getlength(BlockDriverState *bs)
+{
+    return bdrv_getlength(bs->file->bs);
+}
+
+static int coroutine_fn dedup_cache_co_preadv_part(BlockDriverState *bs,
+                                                   uint64_t offset,
+                                                   uint64_t bytes,
+                                                   QEMUIOVector *qiov,
+                                                   size_t qiov_offset,
+                                                   int flags)
+{
+    BDRVDedupCacheState *s = bs->opaque;
+
+    if (flags) {
+        return bdrv_co_preadv_part(bs->file, offset, bytes, qiov, qiov_offset,
+                                   flags);
+    }
+
+    while (bytes) {
+        uint64_t cluster = offset / s->cluster_size;
+        size_t offset_in_cluster = offset % s->cluster_size;
+        size_t n = MIN(bytes, s->cluster_size - offset_in_cluster);
+        uint64_t write_gen;
+        void *data;
+        int ret;
+
+        if (dedup_cache_read(s, cluster, offset_in_cluster, n, qiov,
+                             qiov_offset)) {
+            s->stats.hits++;
+            goto next;
+        }
+        s->stats.misses++;
+
+        /*
+         * Read the whole cluster.  Reads beyond the end of the child return
+         * zeroes, which are never passed on because guest requests end at
+         * the end of the node.
+         */
+        qemu_mutex_lock(&dedup_cache.lock);
+        write_gen = s->image->write_gen;
+        qemu_mutex_unlock(&dedup_cache.lock);
+
+        data = g_try_malloc(s->cluster_size);
+        if (!data) {
+            ret = bdrv_co_preadv_part(bs->file, offset, n, qiov, qiov_offset,
+                                      0);
+            if (ret < 0) {
+                return ret;
+            }
+            goto next;
+        }
+
+        ret = bdrv_co_pread(bs->file, cluster * s->cluster_size,
+                            s->cluster_size, data, 0);
+        if (ret < 0) {
+            g_free(data);
+            return ret;
+        }
+        qemu_iovec_from_buf(qiov, qiov_offset, data + offset_in_cluster, n);
+        dedup_cache_insert(s, cluster, data, write_gen);
+
+next:
+        offset += n;
+        qiov_offset += n;
+        bytes -= n;
+    }
+
+    return 0;
+}
+
+/*
+ * The cache is invalidated both before and after modifying requests.  The
+ * first invalidation makes concurrent cache misses discard what they read,
+ * the second one drops anything that was read while the request was running.
+ */
+
+static int coroutine_fn dedup_cache_co_pwritev_part(BlockDriverState *bs,
+                                                    uint64_t offset,
+                                                    uint64_t bytes,
+                                                    QEMUIOVector *qiov,
+                                                    size_t qiov_offset,
+                                                    int flags)
+{
+    int ret;
+
+    dedup_cache_invalidate(bs, offset, bytes);
+    ret = bdrv_co_pwritev_part(bs->file, offset, bytes, qiov, qiov_offset,
+                               flags);
+    dedup_cache_invalidate(bs, offset, bytes);
+    return ret;
+}
+
+static int coroutine_fn dedup_cache_co_pwrite_zeroes(BlockDriverState *bs,
+                                                     int64_t offset, int bytes,
+                                                     BdrvRequestFlags flags)
+{
+    int ret;
+
+    dedup_cache_invalidate(bs, offset, bytes);
+    ret = bdrv_co_pwrite_zeroes(bs->file, offset, bytes, flags);
+    dedup_cache_invalidate(bs, offset, bytes);
+    return ret;
+}
+
+static int coroutine_fn dedup_cache_co_pdiscard(BlockDriverState *bs,
+                                                int64_t offset, int bytes)
+{
+    int ret;
+
+    dedup_cache_invalidate(bs, offset, bytes);
+    ret = bdrv_co_pdiscard(bs->file, offset, bytes);
+    dedup_cache_invalidate(bs, offset, bytes);
+    return ret;
+}
+
+static int coroutine_fn dedup_cache_co_pwritev_compressed(BlockDriverState *bs,
+                                                          uint64_t offset,
+                                                          uint64_t bytes,
+                                                          QEMUIOVector *qiov)
+{
+    int ret;
+
+    dedup_cache_invalidate(bs, offset, bytes);
+    ret = bdrv_co_pwritev(bs->file, offset, bytes, qiov,
+                          BDRV_REQ_WRITE_COMPRESSED);
+    dedup_cache_invalidate(bs, offset, bytes);
+    return ret;
+}
+
+static int coroutine_fn dedup_cache_co_truncate(BlockDriverState *bs,
+                                                int64_t offset, bool exact,
+                                                PreallocMode prealloc,
+                                                BdrvRequestFlags flags,
+                                                Error **errp)
+{
+    int ret;
+
+    /* The cluster at the old end of the image changes, drop everything */
+    dedup_cache_invalidate_all(bs);
+    ret = bdrv_co_truncate(bs->file, offset, exact, prealloc, flags, errp);
+    dedup_cache_invalidate_all(bs);
+    return ret;
+}
+
+static BlockStatsSpecific *dedup_cache_get_specific_stats(BlockDriverState *bs)
+{
+    BlockStatsSpecific *stats = g_new(BlockStatsSpecific, 1);
+    BDRVDedupCacheState *s = bs->opaque;
+
+    stats->driver = BLOCKDEV_DRIVER_DEDUP_CACHE;
+
+    qemu_mutex_lock(&dedup_cache.lock);
+    stats->u.dedup_cache = (BlockStatsSpecificDedupCache) {
+        .hits = s->stats.hits,
+        .misses = s->stats.misses,
+        .cache_used = dedup_cache.used,
+        .cache_size = dedup_cache.budget,
+        .entries = dedup_cache.nb_entries,
+        .deduplicated = dedup_cache.deduplicated,
+        .evictions = dedup_cache.evictions,
+    };
+    qemu_mutex_unlock(&dedup_cache.lock);
+
+    return stats;
+}
+
+static void dedup_cache_eject(BlockDriverState *bs, bool eject_flag)
+{
+    bdrv_eject(bs->file->bs, eject_flag);
+}
+
+static void dedup_cache_lock_medium(BlockDriverState *bs, bool locked)
+{
+    bdrv_lock_medium(bs->file->bs, locked);
+}
+
+static const char *const dedup_cache_strong_runtime_opts[] = {
+    DEDUP_CACHE_OPT_CLUSTER_SIZE,
+
+    NULL
+};
+
+static BlockDriver bdrv_dedup_cache = {
+    .format_name                        = "dedup-cache",
+    .instance_size                      = sizeof(BDRVDedupCacheState),
+
+    .bdrv_open                          = dedup_cache_open,
+    .bdrv_close                         = dedup_cache_close,
+    .bdrv_child_perm                    = dedup_cache_child_perm,
+
+    .bdrv_getlength                     = dedup_cache_getlength,
+
+    .bdrv_co_preadv_part                = dedup_cache_co_preadv_part,
+    .bdrv_co_pwritev_part               = dedup_cache_co_pwritev_part,
+    .bdrv_co_pwrite_zeroes              = dedup_cache_co_pwrite_zeroes,
+    .bdrv_co_pdiscard                   = dedup_cache_co_pdiscard,
+    .bdrv_co_pwritev_compressed         = dedup_cache_co_pwritev_compressed,
+    .bdrv_co_truncate                   = dedup_cache_co_truncate,
+
+    .bdrv_get_specific_stats            = dedup_cache_get_specific_stats,
+
+    .bdrv_eject                         = dedup_cache_eject,
+    .bdrv_lock_medium                   = dedup_cache_lock_medium,
+
+    .has_variable_length                = true,
+    .is_filter                          = true,
+    .strong_runtime_opts                = dedup_cache_strong_runtime_opts,
+};
+
+static void bdrv_dedup_cache_init(void)
+{
+    qemu_mutex_init(&dedup_cache.lock);
+    QLIST_INIT(&dedup_cache.nodes);
+    dedup_cache.images = g_hash_table_new(g_str_hash, g_str_equal);
+    dedup_cache.entries = g_hash_table_new(g_direct_hash, g_direct_equal);
+    QTAILQ_INIT(&dedup_cache.cold);
+    dedup_cache.hot = g_tree_new(dedup_entry_cmp);
+
+    bdrv_register(&bdrv_dedup_cache);
+}
+
+block_init(bdrv_dedup_cache_init);
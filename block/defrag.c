@@ -0,0 +1,126 @@
+/*
+ * Image defragmentation
+ *
+ * Moves the data clusters of an image so that they are laid out in guest
+ * offset order in the image file, and releases the free space at the end of
+ * the image file afterwards.  The guest-visible content does not change, so
+ * the job can run while the guest is using the image.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "trace.h"
+#include "block/block_int.h"
+#include "block/blockjob_int.h"
+#include "qapi/error.h"
+#include "qemu/ratelimit.h"
+
+enum {
+    /*
+     * Guest range to defragment per iteration.  Guest requests to the range
+     * wait while it is processed, so keep it small.
+     */
+    DEFRAG_CHUNK = 1024 * 1024, /* in bytes */
+};
+
+typedef struct DefragBlockJob {
+    BlockJob common;
+    BlockDriverState *bs;
+} DefragBlockJob;
+
+static int coroutine_fn defrag_run(Job *job, Error **errp)
+{
+    DefragBlockJob *s = container_of(job, DefragBlockJob, common.job);
+    BlockDriverInfo bdi;
+    int64_t len, chunk;
+    int64_t offset;
+    uint64_t delay_ns = 0;
+
+    len = bdrv_getlength(s->bs);
+    if (len < 0) {
+        error_setg_errno(errp, -len, "Failed to get the image length");
+        return len;
+    }
+    job_progress_set_remaining(&s->common.job, len);
+
+    /* Chunks must cover whole clusters, which are a power of two in size */
+    chunk = DEFRAG_CHUNK;
+    if (bdrv_get_info(s->bs, &bdi) == 0 && bdi.cluster_size > chunk) {
+        chunk = bdi.cluster_size;
+    }
+
+    for (offset = 0; offset < len; offset += chunk) {
+        int64_t bytes = MIN(chunk, len - offset);
+        int64_t moved = 0;
+        int ret;
+
+        /* Note that even when no rate limit is applied we need to yield
+         * with no pending I/O here so that bdrv_drain_all() returns.
+         */
+        job_sleep_ns(&s->common.job, delay_ns);
+        if (job_is_cancelled(&s->common.job)) {
+            return 0;
+        }
+
+        ret = bdrv_co_defragment(s->bs, offset, bytes, &moved);
+        trace_defrag_one_iteration(s, offset, bytes, moved);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Failed to defragment the image");
+            return ret;
+        }
+
+        /* Publish progress */
+        job_progress_update(&s->common.job, bytes);
+        delay_ns = moved ? block_job_ratelimit_get_delay(&s->common, moved)
+                         : 0;
+    }
+
+    return bdrv_co_compact(s->bs, errp);
+}
+
+static const BlockJobDriver defrag_job_driver = {
+    .job_driver = {
+        .instance_size = sizeof(DefragBlockJob),
+        .job_type      = JOB_TYPE_DEFRAG,
+        .free          = block_job_free,
+        .run           = defrag_run,
+        .user_resume   = block_job_user_resume,
+    },
+};
+
+void defrag_start(const char *job_id, BlockDriverState *bs,
+                  int creation_flags, int64_t speed, Error **errp)
+{
+    DefragBlockJob *s;
+
+    if (!bs->drv || !bs->drv->bdrv_co_defragment) {
+        error_setg(errp, "Node '%s' does not support defragmentation",
+                   bdrv_get_device_or_node_name(bs));
+        return;
+    }
+
+    if (bdrv_is_read_only(bs)) {
+        error_setg(errp, "Node '%s' is read only",
+                   bdrv_get_device_or_node_name(bs));
+        return;
+    }
+
+    /*
+     * The image length is queried only at the job start, so don't allow
+     * resizing.  Everything else may go on while the job is running.
+     */
+    s = block_job_create(job_id, &defrag_job_driver, NULL, bs,
+                         BLK_PERM_CONSISTENT_READ | BLK_PERM_WRITE_UNCHANGED,
+                         BLK_PERM_ALL & ~BLK_PERM_RESIZE,
+                         speed, creation_flags, NULL, NULL, errp);
+    if (!s) {
+        return;
+    }
+
+    s->bs = bs;
+
+    trace_defrag_start(bs, s);
+    job_start(&s->common.job);
+}
@@ -19,6 +19,10 @@
 #define FUSE_USE_VERSION 31
 
 #include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "qemu/coroutine.h"
+#include "qemu/sockets.h"
+#include "qemu/units.h"
 #include "block/aio.h"
 #include "block/block.h"
 #include "block/export.h"
@@ -31,22 +35,93 @@
 #include <fuse.h>
 #include <fuse_lowlevel.h>
 
+#ifdef CONFIG_LINUX
+#include <sys/ioctl.h>
+#include "standard-headers/linux/fuse.h"
+#endif
+
 
 /* Prevent overly long bounce buffer allocations */
 #define FUSE_MAX_BOUNCE_BYTES (MIN(BDRV_REQUEST_MAX_BYTES, 64 * 1024 * 1024))
 
+/* Maximum number of /dev/fuse FDs an export reads requests from */
+#define FUSE_MAX_QUEUES 64
+
+/*
+ * Additional queues read whole requests into their own buffer, so they
+ * need a bound on max_write.  libfuse never goes above 1 MB either.
+ */
+#define FUSE_QUEUE_MAX_WRITE (1 * MiB)
+#define FUSE_QUEUE_BUF_SIZE (FUSE_QUEUE_MAX_WRITE + 4096)
+
+/* Pipe size for spliced read replies; the default pipe-max-size */
+#define FUSE_QUEUE_PIPE_SIZE (1 * MiB)
+
+/* Maximum number of pipes per queue, i.e. of spliced reads in flight */
+#define FUSE_QUEUE_MAX_PIPES 8
+
+
+typedef struct FuseExport FuseExport;
+
+typedef struct FuseSplicePipe {
+    int fds[2];
+    QSLIST_ENTRY(FuseSplicePipe) next;
+} FuseSplicePipe;
+
+/*
+ * Additional request queue of an export: A clone of the session's
+ * /dev/fuse FD.  The kernel expects the reply to a request on the FD it
+ * was read from, which libfuse cannot do for FDs other than its own, so
+ * requests on these queues are parsed and answered here.  Unlike on the
+ * libfuse queue, they are processed in coroutines, so that several can be
+ * in flight at once.
+ */
+typedef struct FuseQueue {
+    FuseExport *exp;
+    int fuse_fd;
+    bool fd_handler_set_up;
+
+    /*
+     * Buffer for the next request.  Write requests take it over (so their
+     * payload stays valid while they yield) and a new one is allocated.
+     */
+    void *request_buf;
 
-typedef struct FuseExport {
+    /*
+     * Read replies go through pipes, so that data can be spliced from the
+     * image file into /dev/fuse.  A reply must be in a pipe in full before
+     * it is spliced, so every spliced read takes a pipe of its own from
+     * @splice_pipes.  Up to FUSE_QUEUE_MAX_PIPES are created on demand;
+     * reads that find none free use a bounce buffer.  All pipes hold at
+     * least @splice_pipe_size bytes, which is 0 if splicing is not possible.
+     */
+    QSLIST_HEAD(, FuseSplicePipe) splice_pipes;
+    unsigned int nr_splice_pipes;
+    size_t splice_pipe_size;
+} FuseQueue;
+
+struct FuseExport {
     BlockExport common;
 
     struct fuse_session *fuse_session;
     struct fuse_buf fuse_buf;
     bool mounted, fd_handler_set_up;
 
+    /* Queues in addition to the one libfuse reads from */
+    FuseQueue *extra_queues;
+    unsigned int num_extra_queues;
+
     char *mountpoint;
     bool writable;
     bool growable;
-} FuseExport;
+
+    /*
+     * Serializes changes of the image size, including the check whether a
+     * request still needs to grow the image and, for non-growable
+     * exports, taking and dropping the RESIZE permission around it
+     */
+    CoMutex resize_lock;
+};
 
 static GHashTable *exports;
 static const struct fuse_lowlevel_ops fuse_ops;
@@ -60,6 +135,12 @@ static int setup_fuse_export(FuseExport *exp, const char *mountpoint,
                              Error **errp);
 static void read_from_fuse_export(void *opaque);
 
+static int setup_fuse_queues(FuseExport *exp, unsigned int num_queues,
+                             Error **errp);
+static void start_fuse_queues(FuseExport *exp);
+static void shutdown_fuse_queues(FuseExport *exp);
+static void free_fuse_queues(FuseExport *exp);
+
 static bool is_regular_file(const char *path, Error **errp);
 
 
@@ -69,10 +150,17 @@ static int fuse_export_create(BlockExport *blk_exp,
 {
     FuseExport *exp = container_of(blk_exp, FuseExport, common);
     BlockExportOptionsFuse *args = &blk_exp_args->u.fuse;
+    unsigned int num_queues = args->has_num_queues ? args->num_queues : 1;
     int ret;
 
     assert(blk_exp_args->type == BLOCK_EXPORT_TYPE_FUSE);
 
+    if (num_queues == 0 || num_queues > FUSE_MAX_QUEUES) {
+        error_setg(errp, "num-queues must be between 1 and %d",
+                   FUSE_MAX_QUEUES);
+        return -EINVAL;
+    }
+
     /* For growable exports, take the RESIZE permission */
     if (args->growable) {
         uint64_t blk_perm, blk_shared_perm;
@@ -117,12 +205,18 @@ static int fuse_export_create(BlockExport *blk_exp,
     exp->mountpoint = g_strdup(args->mountpoint);
     exp->writable = blk_exp_args->writable;
     exp->growable = args->growable;
+    qemu_co_mutex_init(&exp->resize_lock);
 
     ret = setup_fuse_export(exp, args->mountpoint, errp);
     if (ret < 0) {
         goto fail;
     }
 
+    ret = setup_fuse_queues(exp, num_queues, errp);
+    if (ret < 0) {
+        goto fail;
+    }
+
     return 0;
 
 fail:
@@ -221,6 +315,8 @@ static void fuse_export_shutdown(BlockExport *blk_exp)
 {
     FuseExport *exp = container_of(blk_exp, FuseExport, common);
 
+    shutdown_fuse_queues(exp);
+
     if (exp->fuse_session) {
         fuse_session_exit(exp->fuse_session);
 
@@ -253,6 +349,7 @@ static void fuse_export_delete(BlockExport *blk_exp)
         fuse_session_destroy(exp->fuse_session);
     }
 
+    free_fuse_queues(exp);
     free(exp->fuse_buf.mem);
     g_free(exp->mountpoint);
 }
@@ -285,6 +382,8 @@ static bool is_regular_file(const char *path, Error **errp)
  */
 static void fuse_init(void *userdata, struct fuse_conn_info *conn)
 {
+    FuseExport *exp = userdata;
+
     /*
      * MIN_NON_ZERO() would not be wrong here, but what we set here
      * must equal what has been passed to fuse_session_new().
@@ -295,6 +394,15 @@ static void fuse_init(void *userdata, struct fuse_conn_info *conn)
     conn->max_read = FUSE_MAX_BOUNCE_BYTES;
 
     conn->max_write = MIN_NON_ZERO(BDRV_REQUEST_MAX_BYTES, conn->max_write);
+    if (exp->num_extra_queues) {
+        conn->max_write = MIN(conn->max_write, FUSE_QUEUE_MAX_WRITE);
+    }
+
+    /*
+     * The INIT reply is sent once we return; the other queues must not
+     * see any request before that.
+     */
+    start_fuse_queues(exp);
 }
 
 /**
@@ -307,21 +415,18 @@ static void fuse_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
 }
 
 /**
- * Let clients get file attributes (i.e., stat() the file).
+ * Fill *statbuf with the attributes of the exported image.
  */
-static void fuse_getattr(fuse_req_t req, fuse_ino_t inode,
-                         struct fuse_file_info *fi)
+static int fuse_do_getattr(FuseExport *exp, fuse_ino_t inode,
+                           struct stat *statbuf)
 {
-    struct stat statbuf;
     int64_t length, allocated_blocks;
     time_t now = time(NULL);
-    FuseExport *exp = fuse_req_userdata(req);
     mode_t mode;
 
     length = blk_getlength(exp->common.blk);
     if (length < 0) {
-        fuse_reply_err(req, -length);
-        return;
+        return length;
     }
 
     allocated_blocks = bdrv_get_allocated_file_size(blk_bs(exp->common.blk));
@@ -336,7 +441,7 @@ static void fuse_getattr(fuse_req_t req, fuse_ino_t inode,
         mode |= S_IWUSR;
     }
 
-    statbuf = (struct stat) {
+    *statbuf = (struct stat) {
         .st_ino     = inode,
         .st_mode    = mode,
         .st_nlink   = 1,
@@ -350,20 +455,53 @@ static void fuse_getattr(fuse_req_t req, fuse_ino_t inode,
         .st_ctime   = now,
     };
 
+    return 0;
+}
+
+/**
+ * Let clients get file attributes (i.e., stat() the file).
+ */
+static void fuse_getattr(fuse_req_t req, fuse_ino_t inode,
+                         struct fuse_file_info *fi)
+{
+    struct stat statbuf;
+    FuseExport *exp = fuse_req_userdata(req);
+    int ret;
+
+    ret = fuse_do_getattr(exp, inode, &statbuf);
+    if (ret < 0) {
+        fuse_reply_err(req, -ret);
+        return;
+    }
+
     fuse_reply_attr(req, &statbuf, 1.);
 }
 
-static int fuse_do_truncate(const FuseExport *exp, int64_t size,
-                            bool req_zero_write, PreallocMode prealloc)
+static int coroutine_fn fuse_co_do_truncate(FuseExport *exp, int64_t size,
+                                            bool grow_only,
+                                            bool req_zero_write,
+                                            PreallocMode prealloc)
 {
     uint64_t blk_perm, blk_shared_perm;
     BdrvRequestFlags truncate_flags = 0;
-    int ret;
+    int64_t length;
+    int ret = 0;
 
     if (req_zero_write) {
         truncate_flags |= BDRV_REQ_ZERO_WRITE;
     }
 
+    qemu_co_mutex_lock(&exp->resize_lock);
+
+    /* Another request may have grown the image while we were waiting */
+    if (grow_only) {
+        length = blk_getlength(exp->common.blk);
+        if (length < 0 || length >= size) {
+            ret = MIN(length, 0);
+            goto out;
+        }
+    }
+
     /* Growable exports have a permanent RESIZE permission */
     if (!exp->growable) {
         blk_get_perm(exp->common.blk, &blk_perm, &blk_shared_perm);
@@ -371,7 +509,7 @@ static int fuse_do_truncate(const FuseExport *exp, int64_t size,
         ret = blk_set_perm(exp->common.blk, blk_perm | BLK_PERM_RESIZE,
                            blk_shared_perm, NULL);
         if (ret < 0) {
-            return ret;
+            goto out;
         }
     }
 
@@ -383,29 +521,86 @@ static int fuse_do_truncate(const FuseExport *exp, int64_t size,
         blk_set_perm(exp->common.blk, blk_perm, blk_shared_perm, &error_abort);
     }
 
+out:
+    qemu_co_mutex_unlock(&exp->resize_lock);
     return ret;
 }
 
+typedef struct FuseTruncateCo {
+    FuseExport *exp;
+    int64_t size;
+    bool grow_only;
+    bool req_zero_write;
+    PreallocMode prealloc;
+    int ret;
+} FuseTruncateCo;
+
+static void coroutine_fn fuse_co_truncate_entry(void *opaque)
+{
+    FuseTruncateCo *t = opaque;
+
+    t->ret = fuse_co_do_truncate(t->exp, t->size, t->grow_only,
+                                 t->req_zero_write, t->prealloc);
+    aio_wait_kick();
+}
+
 /**
- * Let clients set file attributes.  Only resizing is supported.
+ * Resize the exported image to @size.  With @grow_only, do nothing if it
+ * is at least that large already.  Requests from the libfuse queue are
+ * not processed in coroutines, so they run this in one to take
+ * @resize_lock.
  */
-static void fuse_setattr(fuse_req_t req, fuse_ino_t inode, struct stat *statbuf,
-                         int to_set, struct fuse_file_info *fi)
+static int fuse_do_truncate(FuseExport *exp, int64_t size, bool grow_only,
+                            bool req_zero_write, PreallocMode prealloc)
 {
-    FuseExport *exp = fuse_req_userdata(req);
-    int ret;
+    FuseTruncateCo t = {
+        .exp = exp,
+        .size = size,
+        .grow_only = grow_only,
+        .req_zero_write = req_zero_write,
+        .prealloc = prealloc,
+        .ret = -EINPROGRESS,
+    };
+    Coroutine *co;
 
+    if (qemu_in_coroutine()) {
+        return fuse_co_do_truncate(exp, size, grow_only, req_zero_write,
+                                   prealloc);
+    }
+
+    co = qemu_coroutine_create(fuse_co_truncate_entry, &t);
+    aio_co_enter(exp->common.ctx, co);
+    AIO_WAIT_WHILE(exp->common.ctx, t.ret == -EINPROGRESS);
+    return t.ret;
+}
+
+/**
+ * Apply the FUSE_SET_ATTR_* changes in @to_set.  Only resizing is
+ * supported.
+ */
+static int fuse_do_setattr(FuseExport *exp, int to_set, int64_t size)
+{
     if (!exp->writable) {
-        fuse_reply_err(req, EACCES);
-        return;
+        return -EACCES;
     }
 
     if (to_set & ~FUSE_SET_ATTR_SIZE) {
-        fuse_reply_err(req, ENOTSUP);
-        return;
+        return -ENOTSUP;
     }
 
-    ret = fuse_do_truncate(exp, statbuf->st_size, true, PREALLOC_MODE_OFF);
+    return fuse_do_truncate(exp, size, false, true, PREALLOC_MODE_OFF);
+}
+
+/**
+ * Let clients set file attributes.  Only resizing is supported.
+ */
+static void fuse_setattr(fuse_req_t req, fuse_ino_t inode, struct stat *statbuf,
+                         int to_set, struct fuse_file_info *fi)
+{
+    FuseExport *exp = fuse_req_userdata(req);
+    int ret;
+
+    ret = fuse_do_setattr(exp, to_set, statbuf->st_size);
     if (ret < 0) {
         fuse_reply_err(req, -ret);
         return;
@@ -423,6 +618,28 @@ static void fuse_open(fuse_req_t req, fuse_ino_t inode,
     fuse_reply_open(req, fi);
 }
 
+/**
+ * Clients will expect short reads at EOF, so we have to limit
+ * offset+size to the image length.
+ */
+static int fuse_clamp_read(FuseExport *exp, off_t offset, size_t *size)
+{
+    int64_t length;
+
+    length = blk_getlength(exp->common.blk);
+    if (length < 0) {
+        return length;
+    }
+
+    if (offset >= length) {
+        *size = 0;
+    } else if (offset + *size > length) {
+        *size = length - offset;
+    }
+
+    return 0;
+}
+
 /**
  * Handle client reads from the exported image.
  */
@@ -430,7 +647,6 @@ static void fuse_read(fuse_req_t req, fuse_ino_t inode,
                       size_t size, off_t offset, struct fuse_file_info *fi)
 {
     FuseExport *exp = fuse_req_userdata(req);
-    int64_t length;
     void *buf;
     int ret;
 
@@ -440,20 +656,12 @@ static void fuse_read(fuse_req_t req, fuse_ino_t inode,
         return;
     }
 
-    /**
-     * Clients will expect short reads at EOF, so we have to limit
-     * offset+size to the image length.
-     */
-    length = blk_getlength(exp->common.blk);
-    if (length < 0) {
-        fuse_reply_err(req, -length);
+    ret = fuse_clamp_read(exp, offset, &size);
+    if (ret < 0) {
+        fuse_reply_err(req, -ret);
         return;
     }
 
-    if (offset + size > length) {
-        size = length - offset;
-    }
-
     buf = qemu_try_blockalign(blk_bs(exp->common.blk), size);
     if (!buf) {
         fuse_reply_err(req, ENOMEM);
@@ -471,24 +679,23 @@ static void fuse_read(fuse_req_t req, fuse_ino_t inode,
 }
 
 /**
- * Handle client writes to the exported image.
+ * Write @buf to the exported image.  On success, *size is set to the
+ * number of bytes written, which is less at the EOF of non-growable
+ * exports.
  */
-static void fuse_write(fuse_req_t req, fuse_ino_t inode, const char *buf,
-                       size_t size, off_t offset, struct fuse_file_info *fi)
+static int fuse_do_write(FuseExport *exp, off_t offset, size_t *size,
+                         const void *buf)
 {
-    FuseExport *exp = fuse_req_userdata(req);
     int64_t length;
     int ret;
 
     /* Limited by max_write, should not happen */
-    if (size > BDRV_REQUEST_MAX_BYTES) {
-        fuse_reply_err(req, EINVAL);
-        return;
+    if (*size > BDRV_REQUEST_MAX_BYTES) {
+        return -EINVAL;
     }
 
     if (!exp->writable) {
-        fuse_reply_err(req, EACCES);
-        return;
+        return -EACCES;
     }
 
     /**
@@ -497,23 +704,35 @@ static void fuse_write(fuse_req_t req, fuse_ino_t inode, const char *buf,
      */
     length = blk_getlength(exp->common.blk);
     if (length < 0) {
-        fuse_reply_err(req, -length);
-        return;
+        return length;
     }
 
-    if (offset + size > length) {
+    if (offset + *size > length) {
         if (exp->growable) {
-            ret = fuse_do_truncate(exp, offset + size, true, PREALLOC_MODE_OFF);
+            ret = fuse_do_truncate(exp, offset + *size, true, true,
+                                   PREALLOC_MODE_OFF);
             if (ret < 0) {
-                fuse_reply_err(req, -ret);
-                return;
+                return ret;
             }
         } else {
-            size = length - offset;
+            *size = offset < length ? length - offset : 0;
         }
     }
 
-    ret = blk_pwrite(exp->common.blk, offset, buf, size, 0);
+    ret = blk_pwrite(exp->common.blk, offset, buf, *size, 0);
+    return ret < 0 ? ret : 0;
+}
+
+/**
+ * Handle client writes to the exported image.
+ */
+static void fuse_write(fuse_req_t req, fuse_ino_t inode, const char *buf,
+                       size_t size, off_t offset, struct fuse_file_info *fi)
+{
+    FuseExport *exp = fuse_req_userdata(req);
+    int ret;
+
+    ret = fuse_do_write(exp, offset, &size, buf);
     if (ret >= 0) {
         fuse_reply_write(req, size);
     } else {
@@ -522,25 +741,21 @@ static void fuse_write(fuse_req_t req, fuse_ino_t inode, const char *buf,
 }
 
 /**
- * Let clients perform various fallocate() operations.
+ * Perform an fallocate() operation on the exported image.
  */
-static void fuse_fallocate(fuse_req_t req, fuse_ino_t inode, int mode,
-                           off_t offset, off_t length,
-                           struct fuse_file_info *fi)
+static int fuse_do_fallocate(FuseExport *exp, int mode, off_t offset,
+                             off_t length)
 {
-    FuseExport *exp = fuse_req_userdata(req);
     int64_t blk_len;
     int ret;
 
     if (!exp->writable) {
-        fuse_reply_err(req, EACCES);
-        return;
+        return -EACCES;
     }
 
     blk_len = blk_getlength(exp->common.blk);
     if (blk_len < 0) {
-        fuse_reply_err(req, -blk_len);
-        return;
+        return blk_len;
     }
 
     if (mode & FALLOC_FL_KEEP_SIZE) {
@@ -549,8 +764,7 @@ static void fuse_fallocate(fuse_req_t req, fuse_ino_t inode, int mode,
 
     if (mode & FALLOC_FL_PUNCH_HOLE) {
         if (!(mode & FALLOC_FL_KEEP_SIZE)) {
-            fuse_reply_err(req, EINVAL);
-            return;
+            return -EINVAL;
         }
 
         do {
@@ -563,11 +777,10 @@ static void fuse_fallocate(fuse_req_t req, fuse_ino_t inode, int mode,
     } else if (mode & FALLOC_FL_ZERO_RANGE) {
         if (!(mode & FALLOC_FL_KEEP_SIZE) && offset + length > blk_len) {
             /* No need for zeroes, we are going to write them ourselves */
-            ret = fuse_do_truncate(exp, offset + length, false,
+            ret = fuse_do_truncate(exp, offset + length, true, false,
                                    PREALLOC_MODE_OFF);
             if (ret < 0) {
-                fuse_reply_err(req, -ret);
-                return;
+                return ret;
             }
         }
 
@@ -582,25 +795,38 @@ static void fuse_fallocate(fuse_req_t req, fuse_ino_t inode, int mode,
     } else if (!mode) {
         /* We can only fallocate at the EOF with a truncate */
         if (offset < blk_len) {
-            fuse_reply_err(req, EOPNOTSUPP);
-            return;
+            return -EOPNOTSUPP;
         }
 
         if (offset > blk_len) {
             /* No preallocation needed here */
-            ret = fuse_do_truncate(exp, offset, true, PREALLOC_MODE_OFF);
+            ret = fuse_do_truncate(exp, offset, false, true,
+                                   PREALLOC_MODE_OFF);
             if (ret < 0) {
-                fuse_reply_err(req, -ret);
-                return;
+                return ret;
             }
         }
 
-        ret = fuse_do_truncate(exp, offset + length, true,
+        ret = fuse_do_truncate(exp, offset + length, false, true,
                                PREALLOC_MODE_FALLOC);
     } else {
         ret = -EOPNOTSUPP;
     }
 
+    return ret < 0 ? ret : 0;
+}
+
+/**
+ * Let clients perform various fallocate() operations.
+ */
+static void fuse_fallocate(fuse_req_t req, fuse_ino_t inode, int mode,
+                           off_t offset, off_t length,
+                           struct fuse_file_info *fi)
+{
+    FuseExport *exp = fuse_req_userdata(req);
+    int ret;
+
+    ret = fuse_do_fallocate(exp, mode, offset, length);
     fuse_reply_err(req, ret < 0 ? -ret : 0);
 }
 
@@ -629,16 +855,13 @@ static void fuse_flush(fuse_req_t req, fuse_ino_t inode,
 
 #ifdef CONFIG_FUSE_LSEEK
 /**
- * Let clients inquire allocation status.
+ * Find the next hole or data area (according to @whence) from *offset on,
+ * and store its start in *offset.
  */
-static void fuse_lseek(fuse_req_t req, fuse_ino_t inode, off_t offset,
-                       int whence, struct fuse_file_info *fi)
+static int fuse_do_lseek(FuseExport *exp, off_t *offset, int whence)
 {
-    FuseExport *exp = fuse_req_userdata(req);
-
     if (whence != SEEK_HOLE && whence != SEEK_DATA) {
-        fuse_reply_err(req, EINVAL);
-        return;
+        return -EINVAL;
     }
 
     while (true) {
@@ -646,10 +869,9 @@ static void fuse_lseek(fuse_req_t req, fuse_ino_t inode, off_t offset,
         int ret;
 
         ret = bdrv_block_status_above(blk_bs(exp->common.blk), NULL,
-                                      offset, INT64_MAX, &pnum, NULL, NULL);
+                                      *offset, INT64_MAX, &pnum, NULL, NULL);
         if (ret < 0) {
-            fuse_reply_err(req, -ret);
-            return;
+            return ret;
         }
 
         if (!pnum && (ret & BDRV_BLOCK_EOF)) {
@@ -666,37 +888,48 @@ static void fuse_lseek(fuse_req_t req, fuse_ino_t inode, off_t offset,
 
             blk_len = blk_getlength(exp->common.blk);
             if (blk_len < 0) {
-                fuse_reply_err(req, -blk_len);
-                return;
+                return blk_len;
             }
 
-            if (offset > blk_len || whence == SEEK_DATA) {
-                fuse_reply_err(req, ENXIO);
-            } else {
-                fuse_reply_lseek(req, offset);
+            if (*offset > blk_len || whence == SEEK_DATA) {
+                return -ENXIO;
             }
-            return;
+            return 0;
         }
 
         if (ret & BDRV_BLOCK_DATA) {
             if (whence == SEEK_DATA) {
-                fuse_reply_lseek(req, offset);
-                return;
+                return 0;
             }
         } else {
             if (whence == SEEK_HOLE) {
-                fuse_reply_lseek(req, offset);
-                return;
+                return 0;
             }
         }
 
         /* Safety check against infinite loops */
         if (!pnum) {
-            fuse_reply_err(req, ENXIO);
-            return;
+            return -ENXIO;
         }
 
-        offset += pnum;
+        *offset += pnum;
+    }
+}
+
+/**
+ * Let clients inquire allocation status.
+ */
+static void fuse_lseek(fuse_req_t req, fuse_ino_t inode, off_t offset,
+                       int whence, struct fuse_file_info *fi)
+{
+    FuseExport *exp = fuse_req_userdata(req);
+    int ret;
+
+    ret = fuse_do_lseek(exp, &offset, whence);
+    if (ret < 0) {
+        fuse_reply_err(req, -ret);
+    } else {
+        fuse_reply_lseek(req, offset);
     }
 }
 #endif
@@ -717,6 +950,609 @@ static const struct fuse_lowlevel_ops fuse_ops = {
 #endif
 };
 
+#ifdef CONFIG_LINUX
+
+typedef struct FuseQueueRequest {
+    FuseQueue *queue;
+    size_t len;
+} FuseQueueRequest;
+
+static void read_from_fuse_queue(void *opaque);
+
+static void fuse_splice_pipe_free(FuseSplicePipe *p)
+{
+    close(p->fds[0]);
+    close(p->fds[1]);
+    g_free(p);
+}
+
+#ifdef CONFIG_SPLICE
+/**
+ * Create a pipe for spliced read replies and store its size in *@size.
+ * Returns NULL if that fails or if it is smaller than @min_size.
+ */
+static FuseSplicePipe *fuse_splice_pipe_new(size_t min_size, size_t *size)
+{
+    FuseSplicePipe *p = g_new0(FuseSplicePipe, 1);
+    int ret;
+
+    if (qemu_pipe(p->fds) < 0) {
+        g_free(p);
+        return NULL;
+    }
+    qemu_set_nonblock(p->fds[0]);
+    qemu_set_nonblock(p->fds[1]);
+
+    ret = fcntl(p->fds[1], F_SETPIPE_SZ, FUSE_QUEUE_PIPE_SIZE);
+    if (ret < 0) {
+        ret = fcntl(p->fds[1], F_GETPIPE_SZ);
+    }
+    if (ret <= 0 || ret < min_size) {
+        fuse_splice_pipe_free(p);
+        return NULL;
+    }
+
+    *size = ret;
+    return p;
+}
+#endif
+
+/**
+ * Create the first pipe for spliced read replies.  Splicing stays disabled
+ * if this fails.
+ */
+static void fuse_queue_setup_splice(FuseQueue *q)
+{
+#ifdef CONFIG_SPLICE
+    FuseSplicePipe *p = fuse_splice_pipe_new(0, &q->splice_pipe_size);
+
+    if (p) {
+        QSLIST_INSERT_HEAD(&q->splice_pipes, p, next);
+        q->nr_splice_pipes++;
+    }
+#endif
+}
+
+/**
+ * Create @num_queues - 1 additional queues by cloning the session FD.
+ * They start reading requests only once the session has been initialized
+ * (see start_fuse_queues()).
+ */
+static int setup_fuse_queues(FuseExport *exp, unsigned int num_queues,
+                             Error **errp)
+{
+    uint32_t session_fd = fuse_session_fd(exp->fuse_session);
+    unsigned int i;
+
+    if (num_queues == 1) {
+        return 0;
+    }
+
+    /*
+     * A request makes all FDs readable, but only one of them gets it, so
+     * the others must not block in read()
+     */
+    qemu_set_nonblock(session_fd);
+
+    exp->extra_queues = g_new0(FuseQueue, num_queues - 1);
+    for (i = 0; i < num_queues - 1; i++) {
+        FuseQueue *q = &exp->extra_queues[i];
+
+        *q = (FuseQueue) {
+            .exp = exp,
+            .fuse_fd = -1,
+        };
+        QSLIST_INIT(&q->splice_pipes);
+        exp->num_extra_queues++;
+
+        q->fuse_fd = qemu_open("/dev/fuse", O_RDWR, errp);
+        if (q->fuse_fd < 0) {
+            goto fail;
+        }
+
+        if (ioctl(q->fuse_fd, FUSE_DEV_IOC_CLONE, &session_fd) < 0) {
+            error_setg_errno(errp, errno, "Failed to clone FUSE session FD");
+            goto fail;
+        }
+        qemu_set_nonblock(q->fuse_fd);
+
+        fuse_queue_setup_splice(q);
+    }
+
+    return 0;
+
+fail:
+    fuse_export_shutdown(&exp->common);
+    return -EIO;
+}
+
+static void start_fuse_queues(FuseExport *exp)
+{
+    unsigned int i;
+
+    for (i = 0; i < exp->num_extra_queues; i++) {
+        FuseQueue *q = &exp->extra_queues[i];
+
+        if (!q->fd_handler_set_up) {
+            aio_set_fd_handler(exp->common.ctx, q->fuse_fd, true,
+                               read_from_fuse_queue, NULL, NULL, q);
+            q->fd_handler_set_up = true;
+        }
+    }
+}
+
+static void shutdown_fuse_queues(FuseExport *exp)
+{
+    unsigned int i;
+
+    for (i = 0; i < exp->num_extra_queues; i++) {
+        FuseQueue *q = &exp->extra_queues[i];
+
+        if (q->fd_handler_set_up) {
+            aio_set_fd_handler(exp->common.ctx, q->fuse_fd, true,
+                               NULL, NULL, NULL, NULL);
+            q->fd_handler_set_up = false;
+        }
+    }
+}
+
+static void free_fuse_queues(FuseExport *exp)
+{
+    unsigned int i;
+
+    for (i = 0; i < exp->num_extra_queues; i++) {
+        FuseQueue *q = &exp->extra_queues[i];
+
+        assert(!q->fd_handler_set_up);
+        if (q->fuse_fd >= 0) {
+            close(q->fuse_fd);
+        }
+        while (!QSLIST_EMPTY(&q->splice_pipes)) {
+            FuseSplicePipe *p = QSLIST_FIRST(&q->splice_pipes);
+
+            QSLIST_REMOVE_HEAD(&q->splice_pipes, next);
+            fuse_splice_pipe_free(p);
+        }
+        g_free(q->request_buf);
+    }
+
+    g_free(exp->extra_queues);
+    exp->extra_queues = NULL;
+    exp->num_extra_queues = 0;
+}
+
+/**
+ * Send a reply on @q.  @error is a negative errno value or 0; the payload
+ * in @data is only sent on success.
+ */
+static void fuse_queue_reply(FuseQueue *q, uint64_t unique, int error,
+                             const void *data, size_t len)
+{
+    struct fuse_out_header out = {
+        .len    = sizeof(out) + (error ? 0 : len),
+        .error  = error,
+        .unique = unique,
+    };
+    struct iovec iov[] = {
+        { .iov_base = &out, .iov_len = sizeof(out) },
+        { .iov_base = (void *)data, .iov_len = len },
+    };
+    ssize_t ret;
+
+    do {
+        ret = writev(q->fuse_fd, iov, error || !len ? 1 : 2);
+    } while (ret < 0 && errno == EINTR);
+
+    /*
+     * Nothing to be done on error; ENOENT just means that the request
+     * has been aborted in the meantime.
+     */
+}
+
+static void fuse_queue_reply_attr(FuseQueue *q, uint64_t unique,
+                                  uint64_t nodeid)
+{
+    struct fuse_attr_out out;
+    struct stat statbuf;
+    int ret;
+
+    ret = fuse_do_getattr(q->exp, nodeid, &statbuf);
+    if (ret < 0) {
+        fuse_queue_reply(q, unique, ret, NULL, 0);
+        return;
+    }
+
+    /* Same attribute timeout as the fuse_reply_attr() in fuse_getattr() */
+    out = (struct fuse_attr_out) {
+        .attr_valid = 1,
+        .attr = {
+            .ino        = statbuf.st_ino,
+            .size       = statbuf.st_size,
+            .blocks     = statbuf.st_blocks,
+            .atime      = statbuf.st_atime,
+            .mtime      = statbuf.st_mtime,
+            .ctime      = statbuf.st_ctime,
+            .mode       = statbuf.st_mode,
+            .nlink      = statbuf.st_nlink,
+            .uid        = statbuf.st_uid,
+            .gid        = statbuf.st_gid,
+            .blksize    = statbuf.st_blksize,
+        },
+    };
+    fuse_queue_reply(q, unique, 0, &out, sizeof(out));
+}
+
+#ifdef CONFIG_SPLICE
+/**
+ * Take a free pipe from @q, or create a new one if there are fewer than
+ * FUSE_QUEUE_MAX_PIPES.  Returns NULL if neither is possible.
+ */
+static FuseSplicePipe *fuse_queue_get_pipe(FuseQueue *q)
+{
+    FuseSplicePipe *p = QSLIST_FIRST(&q->splice_pipes);
+    size_t size;
+
+    if (p) {
+        QSLIST_REMOVE_HEAD(&q->splice_pipes, next);
+        return p;
+    }
+    if (q->nr_splice_pipes >= FUSE_QUEUE_MAX_PIPES) {
+        return NULL;
+    }
+
+    p = fuse_splice_pipe_new(q->splice_pipe_size, &size);
+    if (p) {
+        q->nr_splice_pipes++;
+    }
+    return p;
+}
+
+static void fuse_splice_pipe_drain(FuseSplicePipe *p)
+{
+    char buf[4096];
+
+    while (read(p->fds[0], buf, sizeof(buf)) > 0) {
+        /* Discard */
+    }
+}
+
+/**
+ * Reply to a read request by putting the header and then the image data
+ * into a pipe with blk_co_sendfile(), and splicing the whole reply into
+ * /dev/fuse from there.  Returns -ENOTSUP if the data must be read into a
+ * buffer instead, in which case no reply has been sent.
+ */
+static int coroutine_fn fuse_queue_co_splice_read(FuseQueue *q,
+                                                  uint64_t unique,
+                                                  uint64_t offset,
+                                                  size_t size)
+{
+    struct fuse_out_header out = {
+        .len    = sizeof(out) + size,
+        .unique = unique,
+    };
+    FuseSplicePipe *p = fuse_queue_get_pipe(q);
+    ssize_t ret;
+
+    if (!p) {
+        return -ENOTSUP;
+    }
+
+    /* The pipe is empty and large enough for the whole reply */
+    ret = write(p->fds[1], &out, sizeof(out));
+    if (ret != sizeof(out)) {
+        ret = -ENOTSUP;
+        goto out;
+    }
+
+    ret = blk_co_sendfile(q->exp->common.blk, offset, size, p->fds[1]);
+    if (ret < 0) {
+        goto out;
+    }
+    if (ret != size) {
+        /* The pipe has room for the whole reply, so this cannot happen */
+        ret = -EIO;
+        goto out;
+    }
+
+    ret = splice(p->fds[0], NULL, q->fuse_fd, NULL, out.len, SPLICE_F_MOVE);
+    ret = ret < 0 ? -errno : 0;
+
+out:
+    if (ret < 0) {
+        fuse_splice_pipe_drain(p);
+    }
+    QSLIST_INSERT_HEAD(&q->splice_pipes, p, next);
+    return ret;
+}
+#else
+static int coroutine_fn fuse_queue_co_splice_read(FuseQueue *q,
+                                                  uint64_t unique,
+                                                  uint64_t offset,
+                                                  size_t size)
+{
+    return -ENOTSUP;
+}
+#endif
+
+static void coroutine_fn fuse_queue_co_read(FuseQueue *q, uint64_t unique,
+                                            uint64_t offset, size_t size)
+{
+    FuseExport *exp = q->exp;
+    void *buf;
+    int ret;
+
+    /* Limited by max_read, should not happen */
+    if (size > FUSE_MAX_BOUNCE_BYTES) {
+        fuse_queue_reply(q, unique, -EINVAL, NULL, 0);
+        return;
+    }
+
+    ret = fuse_clamp_read(exp, offset, &size);
+    if (ret < 0) {
+        fuse_queue_reply(q, unique, ret, NULL, 0);
+        return;
+    }
+
+    if (size && sizeof(struct fuse_out_header) + size <= q->splice_pipe_size &&
+        blk_can_sendfile(exp->common.blk))
+    {
+        ret = fuse_queue_co_splice_read(q, unique, offset, size);
+        if (ret != -ENOTSUP) {
+            if (ret < 0) {
+                fuse_queue_reply(q, unique, ret, NULL, 0);
+            }
+            return;
+        }
+    }
+
+    buf = qemu_try_blockalign(blk_bs(exp->common.blk), size);
+    if (!buf) {
+        fuse_queue_reply(q, unique, -ENOMEM, NULL, 0);
+        return;
+    }
+
+    ret = blk_pread(exp->common.blk, offset, buf, size);
+    fuse_queue_reply(q, unique, MIN(ret, 0), buf, size);
+
+    qemu_vfree(buf);
+}
+
+/**
+ * Process a single request read from @q.  Only write requests may access
+ * the request buffer after the first yield, so they take it over.
+ */
+static void coroutine_fn fuse_queue_co_process(void *opaque)
+{
+    FuseQueueRequest *req = opaque;
+    FuseQueue *q = req->queue;
+    FuseExport *exp = q->exp;
+    char *buf = q->request_buf;
+    size_t len = req->len;
+    struct fuse_in_header in;
+    union {
+        struct fuse_setattr_in setattr;
+        struct fuse_read_in read;
+        struct fuse_write_in write;
+        struct fuse_fallocate_in fallocate;
+        struct fuse_lseek_in lseek;
+    } arg;
+    size_t arg_size;
+    int ret;
+
+    memcpy(&in, buf, sizeof(in));
+
+    switch (in.opcode) {
+    case FUSE_SETATTR:
+        arg_size = sizeof(arg.setattr);
+        break;
+    case FUSE_READ:
+        arg_size = sizeof(arg.read);
+        break;
+    case FUSE_WRITE:
+        arg_size = sizeof(arg.write);
+        break;
+    case FUSE_FALLOCATE:
+        arg_size = sizeof(arg.fallocate);
+        break;
+    case FUSE_LSEEK:
+        arg_size = sizeof(arg.lseek);
+        break;
+    default:
+        arg_size = 0;
+        break;
+    }
+
+    if (len < sizeof(in) + arg_size) {
+        fuse_queue_reply(q, in.unique, -EINVAL, NULL, 0);
+        buf = NULL;
+        goto out;
+    }
+    memcpy(&arg, buf + sizeof(in), arg_size);
+
+    if (in.opcode == FUSE_WRITE) {
+        q->request_buf = NULL;
+    } else {
+        buf = NULL;
+    }
+
+    switch (in.opcode) {
+    case FUSE_LOOKUP:
+        fuse_queue_reply(q, in.unique, -ENOENT, NULL, 0);
+        break;
+
+    case FUSE_GETATTR:
+        fuse_queue_reply_attr(q, in.unique, in.nodeid);
+        break;
+
+    case FUSE_SETATTR: {
+        /*
+         * Only the flags that libfuse passes on to fuse_setattr(); their
+         * FUSE_SET_ATTR_* values are the same
+         */
+        int to_set = arg.setattr.valid &
+            (FATTR_MODE | FATTR_UID | FATTR_GID | FATTR_SIZE | FATTR_ATIME |
+             FATTR_MTIME | FATTR_ATIME_NOW | FATTR_MTIME_NOW | FATTR_CTIME);
+
+        ret = fuse_do_setattr(exp, to_set, arg.setattr.size);
+        if (ret < 0) {
+            fuse_queue_reply(q, in.unique, ret, NULL, 0);
+        } else {
+            fuse_queue_reply_attr(q, in.unique, in.nodeid);
+        }
+        break;
+    }
+
+    case FUSE_OPEN: {
+        struct fuse_open_out out = { 0 };
+
+        fuse_queue_reply(q, in.unique, 0, &out, sizeof(out));
+        break;
+    }
+
+    case FUSE_READ:
+        fuse_queue_co_read(q, in.unique, arg.read.offset, arg.read.size);
+        break;
+
+    case FUSE_WRITE: {
+        struct fuse_write_out out = { 0 };
+        size_t size = arg.write.size;
+
+        if (size > len - sizeof(in) - sizeof(arg.write)) {
+            fuse_queue_reply(q, in.unique, -EINVAL, NULL, 0);
+            break;
+        }
+
+        ret = fuse_do_write(exp, arg.write.offset, &size,
+                            buf + sizeof(in) + sizeof(arg.write));
+        out.size = size;
+        fuse_queue_reply(q, in.unique, ret, &out, sizeof(out));
+        break;
+    }
+
+    case FUSE_FALLOCATE:
+        ret = fuse_do_fallocate(exp, arg.fallocate.mode, arg.fallocate.offset,
+                                arg.fallocate.length);
+        fuse_queue_reply(q, in.unique, ret, NULL, 0);
+        break;
+
+    case FUSE_FLUSH:
+    case FUSE_FSYNC:
+        ret = blk_flush(exp->common.blk);
+        fuse_queue_reply(q, in.unique, MIN(ret, 0), NULL, 0);
+        break;
+
+#ifdef CONFIG_FUSE_LSEEK
+    case FUSE_LSEEK: {
+        struct fuse_lseek_out out;
+        off_t offset = arg.lseek.offset;
+
+        ret = fuse_do_lseek(exp, &offset, arg.lseek.whence);
+        out.offset = offset;
+        fuse_queue_reply(q, in.unique, ret, &out, sizeof(out));
+        break;
+    }
+#endif
+
+    case FUSE_STATFS: {
+        /* What libfuse replies without a statfs handler */
+        struct fuse_statfs_out out = {
+            .st = {
+                .bsize      = 512,
+                .namelen    = 255,
+            },
+        };
+
+        fuse_queue_reply(q, in.unique, 0, &out, sizeof(out));
+        break;
+    }
+
+    case FUSE_RELEASE:
+    case FUSE_DESTROY:
+        fuse_queue_reply(q, in.unique, 0, NULL, 0);
+        break;
+
+    case FUSE_FORGET:
+    case FUSE_BATCH_FORGET:
+    case FUSE_INTERRUPT:
+        /* No reply */
+        break;
+
+    default:
+        fuse_queue_reply(q, in.unique, -ENOSYS, NULL, 0);
+        break;
+    }
+
+out:
+    g_free(buf);
+    blk_exp_unref(&exp->common);
+}
+
+/**
+ * Callback to be invoked when a queue FD can be read from.
+ */
+static void read_from_fuse_queue(void *opaque)
+{
+    FuseQueue *q = opaque;
+    FuseQueueRequest req = { .queue = q };
+    Coroutine *co;
+    ssize_t ret;
+
+    if (!q->request_buf) {
+        q->request_buf = g_malloc(FUSE_QUEUE_BUF_SIZE);
+    }
+
+    do {
+        ret = read(q->fuse_fd, q->request_buf, FUSE_QUEUE_BUF_SIZE);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret < 0 && errno == ENODEV) {
+        /* Unmounted; the FD would stay readable forever */
+        aio_set_fd_handler(q->exp->common.ctx, q->fuse_fd, true,
+                           NULL, NULL, NULL, NULL);
+        q->fd_handler_set_up = false;
+        return;
+    }
+    if (ret < (ssize_t)sizeof(struct fuse_in_header)) {
+        /* Most likely EAGAIN, because another queue got the request */
+        return;
+    }
+    req.len = ret;
+
+    /* Dropped by fuse_queue_co_process() */
+    blk_exp_ref(&q->exp->common);
+
+    co = qemu_coroutine_create(fuse_queue_co_process, &req);
+    qemu_coroutine_enter(co);
+}
+
+#else /* !CONFIG_LINUX */
+
+static int setup_fuse_queues(FuseExport *exp, unsigned int num_queues,
+                             Error **errp)
+{
+    if (num_queues > 1) {
+        error_setg(errp, "num-queues > 1 is only supported on Linux");
+        fuse_export_shutdown(&exp->common);
+        return -ENOTSUP;
+    }
+    return 0;
+}
+
+static void start_fuse_queues(FuseExport *exp)
+{
+}
+
+static void shutdown_fuse_queues(FuseExport *exp)
+{
+}
+
+static void free_fuse_queues(FuseExport *exp)
+{
+}
+
+#endif /* CONFIG_LINUX */
+
 const BlockExportDriver blk_exp_fuse = {
     .type               = BLOCK_EXPORT_TYPE_FUSE,
     .instance_size      = sizeof(FuseExport),
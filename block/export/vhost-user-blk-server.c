@@ -18,6 +18,7 @@
 #include "qapi/error.h"
 #include "qom/object_interfaces.h"
 #include "sysemu/block-backend.h"
+#include "sysemu/iothread.h"
 #include "util/block-helpers.h"
 
 /*
@@ -44,6 +45,7 @@ typedef struct VuBlkReq {
     struct virtio_blk_outhdr out;
     VuServer *server;
     struct VuVirtq *vq;
+    AioContext *queue_ctx; /* fixed AioContext of the virtqueue, or NULL */
 } VuBlkReq;
 
 /* vhost user block device */
@@ -54,17 +56,28 @@ typedef struct {
     QIOChannelSocket *sioc;
     struct virtio_blk_config blkcfg;
     bool writable;
+
+    /* Referenced iothreads from the queue-iothreads option */
+    IOThread **queue_iothreads;
+    int num_queue_iothreads;
 } VuBlkExport;
 
 static void vu_blk_req_complete(VuBlkReq *req)
 {
-    VuDev *vu_dev = &req->server->vu_dev;
+    VuServer *server = req->server;
+    VuDev *vu_dev = &server->vu_dev;
+
+    /* Kicks of other virtqueues may be handled in parallel */
+    qemu_rec_mutex_lock(&server->vu_lock);
 
     /* IO size with 1 extra status byte */
     vu_queue_push(vu_dev, req->vq, &req->elem, req->size + 1);
     vu_queue_notify(vu_dev, req->vq);
 
+    qemu_rec_mutex_unlock(&server->vu_lock);
+
     free(req);
+    vhost_user_server_dec_in_flight(server);
 }
 
 static bool vu_blk_sect_range_ok(VuBlkExport *vexp, uint64_t sector,
@@ -205,6 +218,30 @@ static void coroutine_fn vu_blk_virtio_process_req(void *opaque)
               - sizeof(struct virtio_blk_inhdr);
     iov_discard_back(in_iov, &in_num, sizeof(struct virtio_blk_inhdr));
 
+    /*
+     * The virtqueue may be processed in a different AioContext than the one
+     * of the exported node.  vu_blk_process_vq() has taken an in-flight
+     * reference, so no drain can start moving the node before we get
+     * there.  One that started earlier may still be doing so, though, and
+     * holds the old AioContext while it does, so check again once we hold
+     * the one we are in.
+     */
+    if (req->queue_ctx) {
+        AioContext *ctx;
+
+        for (;;) {
+            ctx = blk_get_aio_context(blk);
+            aio_co_reschedule_self(ctx);
+            aio_context_acquire(ctx);
+            if (blk_get_aio_context(blk) == ctx) {
+                break;
+            }
+            aio_context_release(ctx);
+        }
+        blk_dec_in_flight(blk);
+        aio_context_release(ctx);
+    }
+
     type = le32_to_cpu(req->out.type);
     switch (type & ~VIRTIO_BLK_T_BARRIER) {
     case VIRTIO_BLK_T_IN:
@@ -278,17 +315,27 @@ static void coroutine_fn vu_blk_virtio_process_req(void *opaque)
         break;
     }
 
+    if (req->queue_ctx && qemu_get_current_aio_context() != req->queue_ctx) {
+        aio_co_reschedule_self(req->queue_ctx);
+    }
+
     vu_blk_req_complete(req);
     return;
 
 err:
+    if (req->queue_ctx) {
+        blk_dec_in_flight(blk);
+    }
     free(req);
+    vhost_user_server_dec_in_flight(server);
 }
 
 static void vu_blk_process_vq(VuDev *vu_dev, int idx)
 {
     VuServer *server = container_of(vu_dev, VuServer, vu_dev);
+    VuBlkExport *vexp = container_of(server, VuBlkExport, vu_server);
     VuVirtq *vq = vu_get_queue(vu_dev, idx);
+    AioContext *queue_ctx = server->queue_ctx ? server->queue_ctx[idx] : NULL;
 
     while (1) {
         VuBlkReq *req;
@@ -300,6 +347,18 @@ static void vu_blk_process_vq(VuDev *vu_dev, int idx)
 
         req->server = server;
         req->vq = vq;
+        req->queue_ctx = queue_ctx;
+
+        /* Dropped when the request is completed */
+        vhost_user_server_inc_in_flight(server);
+
+        /*
+         * Dropped once the request has reached the node's AioContext.  Taken
+         * before looking at that AioContext, so that it can't change unseen.
+         */
+        if (queue_ctx) {
+            blk_inc_in_flight(vexp->export.blk);
+        }
 
         Coroutine *co =
             qemu_coroutine_create(vu_blk_virtio_process_req, req);
@@ -460,6 +519,18 @@ static void vu_blk_exp_request_shutdown(BlockExport *exp)
     vhost_user_server_stop(&vexp->vu_server);
 }
 
+static void vu_blk_exp_put_queue_iothreads(VuBlkExport *vexp)
+{
+    int i;
+
+    for (i = 0; i < vexp->num_queue_iothreads; i++) {
+        object_unref(OBJECT(vexp->queue_iothreads[i]));
+    }
+    g_free(vexp->queue_iothreads);
+    vexp->queue_iothreads = NULL;
+    vexp->num_queue_iothreads = 0;
+}
+
 static int vu_blk_exp_create(BlockExport *exp, BlockExportOptions *opts,
                              Error **errp)
 {
@@ -468,6 +539,7 @@ static int vu_blk_exp_create(BlockExport *exp, BlockExportOptions *opts,
     Error *local_err = NULL;
     uint64_t logical_block_size;
     uint16_t num_queues = VHOST_USER_BLK_NUM_QUEUES_DEFAULT;
+    g_autofree AioContext **queue_ctx = NULL;
 
     vexp->writable = opts->writable;
     vexp->blkcfg.wce = 0;
@@ -494,6 +566,38 @@ static int vu_blk_exp_create(BlockExport *exp, BlockExportOptions *opts,
         return -EINVAL;
     }
 
+    if (vu_opts->has_queue_iothreads) {
+        strList *e;
+        int i;
+
+        if (!vu_opts->queue_iothreads) {
+            error_setg(errp, "queue-iothreads must not be empty");
+            return -EINVAL;
+        }
+
+        for (e = vu_opts->queue_iothreads; e; e = e->next) {
+            IOThread *iothread = iothread_by_id(e->value);
+
+            if (!iothread) {
+                error_setg(errp, "iothread \"%s\" not found", e->value);
+                vu_blk_exp_put_queue_iothreads(vexp);
+                return -EINVAL;
+            }
+
+            vexp->queue_iothreads = g_renew(IOThread *, vexp->queue_iothreads,
+                                            vexp->num_queue_iothreads + 1);
+            vexp->queue_iothreads[vexp->num_queue_iothreads++] = iothread;
+            object_ref(OBJECT(iothread));
+        }
+
+        queue_ctx = g_new(AioContext *, num_queues);
+        for (i = 0; i < num_queues; i++) {
+            IOThread *iothread =
+                vexp->queue_iothreads[i % vexp->num_queue_iothreads];
+            queue_ctx[i] = iothread_get_aio_context(iothread);
+        }
+    }
+
     vu_blk_initialize_config(blk_bs(exp->blk), &vexp->blkcfg,
                              logical_block_size, num_queues);
 
@@ -501,9 +605,10 @@ static int vu_blk_exp_create(BlockExport *exp, BlockExportOptions *opts,
                                  vexp);
 
     if (!vhost_user_server_start(&vexp->vu_server, vu_opts->addr, exp->ctx,
-                                 num_queues, &vu_blk_iface, errp)) {
+                                 num_queues, queue_ctx, &vu_blk_iface, errp)) {
         blk_remove_aio_context_notifier(exp->blk, blk_aio_attached,
                                         blk_aio_detach, vexp);
+        vu_blk_exp_put_queue_iothreads(vexp);
         return -EADDRNOTAVAIL;
     }
 
@@ -516,6 +621,7 @@ static void vu_blk_exp_delete(BlockExport *exp)
 
     blk_remove_aio_context_notifier(exp->blk, blk_aio_attached, blk_aio_detach,
                                     vexp);
+    vu_blk_exp_put_queue_iothreads(vexp);
 }
 
 const BlockExportDriver blk_exp_vhost_user_blk = {
@@ -79,6 +79,9 @@
 #if defined(CONFIG_FALLOCATE_PUNCH_HOLE) || defined(CONFIG_FALLOCATE_ZERO_RANGE)
 #include <linux/falloc.h>
 #endif
+#ifdef CONFIG_SENDFILE
+#include <sys/sendfile.h>
+#endif
 #if defined (__FreeBSD__) || defined(__FreeBSD_kernel__)
 #include <sys/disk.h>
 #include <sys/cdio.h>
@@ -165,6 +168,17 @@ typedef struct BDRVRawState {
     bool needs_alignment;
     bool drop_cache;
     bool check_cache_dropped;
+#ifdef CONFIG_LINUX_IO_URING
+    /* LURING_SETUP_* flags selecting the AioContext's ring */
+    int luring_flags;
+    /* io-uring-fixed=on: fixed file slot of s->fd, or -1 */
+    bool use_io_uring_fixed;
+    int luring_fixed_fd;
+    /* Buffers registered through bdrv_register_buf(), as struct iovec */
+    GArray *luring_bufs;
+    /* Whether guest RAM is registered with the ring */
+    bool luring_guest_ram;
+#endif
     struct {
         uint64_t discard_nb_ok;
         uint64_t discard_nb_failed;
@@ -209,6 +223,9 @@ typedef struct RawPosixAIOData {
             PreallocMode prealloc;
             Error **errp;
         } truncate;
+        struct {
+            int out_fd;
+        } sendfile;
     };
 } RawPosixAIOData;
 
@@ -541,12 +558,77 @@ static QemuOptsList raw_runtime_opts = {
             .type = QEMU_OPT_BOOL,
             .help = "check that page cache was dropped on live migration (default: off)"
         },
+        {
+            .name = "io-uring-fixed",
+            .type = QEMU_OPT_BOOL,
+            .help = "register the file descriptor and I/O buffers with "
+                    "io_uring (default: off)",
+        },
+        {
+            .name = "io-uring-sqpoll",
+            .type = QEMU_OPT_BOOL,
+            .help = "submit io_uring requests through a kernel polling "
+                    "thread (default: off)",
+        },
+        {
+            .name = "io-uring-iopoll",
+            .type = QEMU_OPT_BOOL,
+            .help = "busy-poll for io_uring completions, requires "
+                    "cache.direct=on (default: off)",
+        },
         { /* end of list */ }
     },
 };
 
 static const char *const mutable_opts[] = { "x-check-cache-dropped", NULL };
 
+#ifdef CONFIG_LINUX_IO_URING
+static void raw_luring_register(BlockDriverState *bs, AioContext *ctx)
+{
+    BDRVRawState *s = bs->opaque;
+    LuringState *aio;
+    unsigned int i;
+
+    if (!s->use_linux_io_uring || !s->use_io_uring_fixed) {
+        return;
+    }
+
+    aio = aio_get_linux_io_uring(ctx, s->luring_flags);
+    s->luring_fixed_fd = luring_register_fd(aio, s->fd);
+    /* Before any other buffer, so that the ring can share guest RAM */
+    s->luring_guest_ram = luring_register_guest_ram(aio);
+    for (i = 0; i < s->luring_bufs->len; i++) {
+        struct iovec *iov = &g_array_index(s->luring_bufs, struct iovec, i);
+        luring_register_buf(aio, iov->iov_base, iov->iov_len);
+    }
+}
+
+static void raw_luring_unregister(BlockDriverState *bs, AioContext *ctx)
+{
+    BDRVRawState *s = bs->opaque;
+    LuringState *aio;
+    unsigned int i;
+
+    if (!s->use_linux_io_uring || !s->use_io_uring_fixed) {
+        return;
+    }
+
+    aio = aio_get_linux_io_uring(ctx, s->luring_flags);
+    if (s->luring_fixed_fd >= 0) {
+        luring_unregister_fd(aio, s->luring_fixed_fd);
+        s->luring_fixed_fd = -1;
+    }
+    for (i = 0; i < s->luring_bufs->len; i++) {
+        struct iovec *iov = &g_array_index(s->luring_bufs, struct iovec, i);
+        luring_unregister_buf(aio, iov->iov_base, iov->iov_len);
+    }
+    if (s->luring_guest_ram) {
+        luring_unregister_guest_ram(aio);
+        s->luring_guest_ram = false;
+    }
+}
+#endif
+
 static int raw_open_common(BlockDriverState *bs, QDict *options,
                            int bdrv_flags, int open_flags,
                            bool device, Error **errp)
@@ -596,6 +678,16 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
     s->use_linux_aio = (aio == BLOCKDEV_AIO_OPTIONS_NATIVE);
 #ifdef CONFIG_LINUX_IO_URING
     s->use_linux_io_uring = (aio == BLOCKDEV_AIO_OPTIONS_IO_URING);
+    s->use_io_uring_fixed = qemu_opt_get_bool(opts, "io-uring-fixed", false);
+    s->luring_flags = 0;
+    if (qemu_opt_get_bool(opts, "io-uring-sqpoll", false)) {
+        s->luring_flags |= LURING_SETUP_SQPOLL;
+    }
+    if (qemu_opt_get_bool(opts, "io-uring-iopoll", false)) {
+        s->luring_flags |= LURING_SETUP_IOPOLL;
+    }
+    s->luring_fixed_fd = -1;
+    s->luring_bufs = g_array_new(false, false, sizeof(struct iovec));
 #endif
 
     locking = qapi_enum_parse(&OnOffAuto_lookup,
@@ -692,10 +784,26 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
 
 #ifdef CONFIG_LINUX_IO_URING
     if (s->use_linux_io_uring) {
-        if (!aio_setup_linux_io_uring(bdrv_get_aio_context(bs), errp)) {
+        /* Polled completions are only supported for O_DIRECT */
+        if ((s->luring_flags & LURING_SETUP_IOPOLL) &&
+            !(s->open_flags & O_DIRECT)) {
+            error_setg(errp, "io-uring-iopoll=on was specified, but it "
+                             "requires cache.direct=on, which was not "
+                             "specified.");
+            ret = -EINVAL;
+            goto fail;
+        }
+        if (!aio_setup_linux_io_uring(bdrv_get_aio_context(bs),
+                                      s->luring_flags, errp)) {
             error_prepend(errp, "Unable to use io_uring: ");
             goto fail;
         }
+        raw_luring_register(bs, bdrv_get_aio_context(bs));
+    } else if (s->use_io_uring_fixed || s->luring_flags) {
+        error_setg(errp, "io-uring-fixed, io-uring-sqpoll and io-uring-iopoll "
+                         "require aio=io_uring");
+        ret = -EINVAL;
+        goto fail;
     }
 #else
     if (s->use_linux_io_uring) {
@@ -704,6 +812,14 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
         ret = -EINVAL;
         goto fail;
     }
+    if (qemu_opt_get_bool(opts, "io-uring-fixed", false) ||
+        qemu_opt_get_bool(opts, "io-uring-sqpoll", false) ||
+        qemu_opt_get_bool(opts, "io-uring-iopoll", false)) {
+        error_setg(errp, "io-uring-fixed, io-uring-sqpoll and io-uring-iopoll "
+                         "are not supported in this build.");
+        ret = -EINVAL;
+        goto fail;
+    }
 #endif /* !defined(CONFIG_LINUX_IO_URING) */
 
     s->has_discard = true;
@@ -786,6 +902,15 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
     }
     ret = 0;
 fail:
+#ifdef CONFIG_LINUX_IO_URING
+    if (ret < 0 && s->luring_bufs) {
+        if (s->luring_fixed_fd >= 0 || s->luring_guest_ram) {
+            raw_luring_unregister(bs, bdrv_get_aio_context(bs));
+        }
+        g_array_free(s->luring_bufs, true);
+        s->luring_bufs = NULL;
+    }
+#endif
     if (ret < 0 && s->fd != -1) {
         qemu_close(s->fd);
     }
@@ -1114,6 +1239,16 @@ static int raw_reopen_prepare(BDRVReopenState *state,
         goto out;
     }
 
+#ifdef CONFIG_LINUX_IO_URING
+    /* The ring stays polled, which only works for O_DIRECT */
+    if (s->use_linux_io_uring && (s->luring_flags & LURING_SETUP_IOPOLL) &&
+        !(rs->open_flags & O_DIRECT)) {
+        error_setg(errp, "io-uring-iopoll=on requires cache.direct=on");
+        ret = -EINVAL;
+        goto out_fd;
+    }
+#endif
+
     /* Fail already reopen_prepare() if we can't get a working O_DIRECT
      * alignment with the new fd. */
     if (rs->fd != -1) {
@@ -1146,6 +1281,15 @@ static void raw_reopen_commit(BDRVReopenState *state)
     s->check_cache_dropped = rs->check_cache_dropped;
     s->open_flags = rs->open_flags;
 
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->luring_fixed_fd >= 0) {
+        LuringState *aio = aio_get_linux_io_uring(
+            bdrv_get_aio_context(state->bs), s->luring_flags);
+        luring_unregister_fd(aio, s->luring_fixed_fd);
+        s->luring_fixed_fd = luring_register_fd(aio, rs->fd);
+    }
+#endif
+
     qemu_close(s->fd);
     s->fd = rs->fd;
 
@@ -1848,6 +1992,69 @@ static int allocate_first_block(int fd, size_t max_size)
     return ret;
 }
 
+#ifdef CONFIG_SENDFILE
+/*
+ * Send as much as @out_fd takes without blocking.  Waiting for @out_fd to
+ * become writable is left to the caller, which can do it in a coroutine
+ * instead of tying up a worker thread, and without an in-flight request.
+ */
+static int handle_aiocb_sendfile(void *opaque)
+{
+    RawPosixAIOData *aiocb = opaque;
+    int out_fd = aiocb->sendfile.out_fd;
+    uint64_t bytes = aiocb->aio_nbytes;
+    off_t offset = aiocb->aio_offset;
+    bool eof = false;
+
+    while (bytes) {
+        static const uint8_t zeroes[4096];
+        ssize_t len;
+
+        if (!eof) {
+            len = sendfile(out_fd, aiocb->aio_fildes, &offset,
+                           MIN(bytes, SIZE_MAX >> 1));
+            trace_file_sendfile(aiocb->bs, aiocb->aio_fildes, out_fd, offset,
+                                bytes, len);
+            if (len == 0) {
+                /* Beyond EOF, read as zeroes like handle_aiocb_rw() does */
+                eof = true;
+                continue;
+            }
+        } else {
+            len = write(out_fd, zeroes, MIN(bytes, sizeof(zeroes)));
+        }
+
+        if (len < 0) {
+            switch (errno) {
+            case EINTR:
+                continue;
+            case EAGAIN:
+                goto out;
+            case ENOSYS:
+            case EINVAL:
+                /*
+                 * Only possible before any data was sent, since the file
+                 * and @out_fd do not change between iterations.
+                 */
+                if (!eof && bytes == aiocb->aio_nbytes) {
+                    return -ENOTSUP;
+                }
+                return -EIO;
+            default:
+                return -errno;
+            }
+        }
+        bytes -= len;
+    }
+
+out:
+    if (bytes == aiocb->aio_nbytes) {
+        return -EAGAIN;
+    }
+    return aiocb->aio_nbytes - bytes;
+}
+#endif
+
 static int handle_aiocb_truncate(void *opaque)
 {
     RawPosixAIOData *aiocb = opaque;
@@ -2010,7 +2217,8 @@ static int coroutine_fn raw_co_prw(BlockDriverState *bs, uint64_t offset,
         type |= QEMU_AIO_MISALIGNED;
 #ifdef CONFIG_LINUX_IO_URING
     } else if (s->use_linux_io_uring) {
-        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
+        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs),
+                                                  s->luring_flags);
         assert(qiov->size == bytes);
         return luring_co_submit(bs, aio, s->fd, offset, qiov, type);
 #endif
@@ -2064,7 +2272,8 @@ static void raw_aio_plug(BlockDriverState *bs)
 #endif
 #ifdef CONFIG_LINUX_IO_URING
     if (s->use_linux_io_uring) {
-        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
+        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs),
+                                                  s->luring_flags);
         luring_io_plug(bs, aio);
     }
 #endif
@@ -2081,7 +2290,8 @@ static void raw_aio_unplug(BlockDriverState *bs)
 #endif
 #ifdef CONFIG_LINUX_IO_URING
     if (s->use_linux_io_uring) {
-        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
+        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs),
+                                                  s->luring_flags);
         luring_io_unplug(bs, aio);
     }
 #endif
@@ -2105,8 +2315,10 @@ static int raw_co_flush_to_disk(BlockDriverState *bs)
     };
 
 #ifdef CONFIG_LINUX_IO_URING
-    if (s->use_linux_io_uring) {
-        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
+    /* Polled rings reject fsync, so flushes go to the thread pool */
+    if (s->use_linux_io_uring && !(s->luring_flags & LURING_SETUP_IOPOLL)) {
+        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs),
+                                                  s->luring_flags);
         return luring_co_submit(bs, aio, s->fd, 0, NULL, QEMU_AIO_FLUSH);
     }
 #endif
@@ -2130,19 +2342,78 @@ static void raw_aio_attach_aio_context(BlockDriverState *bs,
 #ifdef CONFIG_LINUX_IO_URING
     if (s->use_linux_io_uring) {
         Error *local_err = NULL;
-        if (!aio_setup_linux_io_uring(new_context, &local_err)) {
+        if (!aio_setup_linux_io_uring(new_context, s->luring_flags,
+                                      &local_err)) {
             error_reportf_err(local_err, "Unable to use linux io_uring, "
                                          "falling back to thread pool: ");
             s->use_linux_io_uring = false;
         }
+        raw_luring_register(bs, new_context);
     }
 #endif
 }
 
+static void raw_aio_detach_aio_context(BlockDriverState *bs)
+{
+#ifdef CONFIG_LINUX_IO_URING
+    raw_luring_unregister(bs, bdrv_get_aio_context(bs));
+#endif
+}
+
+#ifdef CONFIG_LINUX_IO_URING
+static void raw_register_buf(BlockDriverState *bs, void *host, size_t size)
+{
+    BDRVRawState *s = bs->opaque;
+    struct iovec iov = {
+        .iov_base = host,
+        .iov_len = size,
+    };
+
+    if (!s->use_linux_io_uring || !s->use_io_uring_fixed) {
+        return;
+    }
+
+    g_array_append_val(s->luring_bufs, iov);
+    luring_register_buf(aio_get_linux_io_uring(bdrv_get_aio_context(bs),
+                                               s->luring_flags),
+                        host, size);
+}
+
+static void raw_unregister_buf(BlockDriverState *bs, void *host)
+{
+    BDRVRawState *s = bs->opaque;
+    unsigned int i;
+
+    if (!s->use_linux_io_uring || !s->use_io_uring_fixed) {
+        return;
+    }
+
+    for (i = 0; i < s->luring_bufs->len; i++) {
+        struct iovec iov = g_array_index(s->luring_bufs, struct iovec, i);
+
+        if (iov.iov_base == host) {
+            g_array_remove_index(s->luring_bufs, i);
+            luring_unregister_buf(
+                aio_get_linux_io_uring(bdrv_get_aio_context(bs),
+                                       s->luring_flags), host, iov.iov_len);
+            return;
+        }
+    }
+}
+#endif
+
 static void raw_close(BlockDriverState *bs)
 {
     BDRVRawState *s = bs->opaque;
 
+#ifdef CONFIG_LINUX_IO_URING
+    raw_luring_unregister(bs, bdrv_get_aio_context(bs));
+    if (s->luring_bufs) {
+        g_array_free(s->luring_bufs, true);
+        s->luring_bufs = NULL;
+    }
+#endif
+
     if (s->fd >= 0) {
         qemu_close(s->fd);
         s->fd = -1;
@@ -3218,6 +3489,40 @@ static int coroutine_fn raw_co_copy_range_to(BlockDriverState *bs,
     return raw_thread_pool_submit(bs, handle_aiocb_copy_range, &acb);
 }
 
+#ifdef CONFIG_SENDFILE
+static bool raw_can_sendfile(BlockDriverState *bs)
+{
+    BDRVRawState *s = bs->opaque;
+
+    /* O_DIRECT would need aligned requests even for sendfile() */
+    return !(s->open_flags & O_DIRECT);
+}
+
+static int coroutine_fn raw_co_sendfile(BlockDriverState *bs, uint64_t offset,
+                                        uint64_t bytes, int out_fd)
+{
+    BDRVRawState *s = bs->opaque;
+    RawPosixAIOData acb;
+
+    if (fd_open(bs) < 0) {
+        return -EIO;
+    }
+
+    acb = (RawPosixAIOData) {
+        .bs             = bs,
+        .aio_type       = QEMU_AIO_SENDFILE,
+        .aio_fildes     = s->fd,
+        .aio_offset     = offset,
+        .aio_nbytes     = bytes,
+        .sendfile       = {
+            .out_fd         = out_fd,
+        },
+    };
+
+    return raw_thread_pool_submit(bs, handle_aiocb_sendfile, &acb);
+}
+#endif
+
 BlockDriver bdrv_file = {
     .format_name = "file",
     .protocol_name = "file",
@@ -3244,10 +3549,19 @@ BlockDriver bdrv_file = {
     .bdrv_co_pdiscard       = raw_co_pdiscard,
     .bdrv_co_copy_range_from = raw_co_copy_range_from,
     .bdrv_co_copy_range_to  = raw_co_copy_range_to,
+#ifdef CONFIG_SENDFILE
+    .bdrv_can_sendfile = raw_can_sendfile,
+    .bdrv_co_sendfile = raw_co_sendfile,
+#endif
     .bdrv_refresh_limits = raw_refresh_limits,
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
     .bdrv_attach_aio_context = raw_aio_attach_aio_context,
+    .bdrv_detach_aio_context = raw_aio_detach_aio_context,
+#ifdef CONFIG_LINUX_IO_URING
+    .bdrv_register_buf      = raw_register_buf,
+    .bdrv_unregister_buf    = raw_unregister_buf,
+#endif
 
     .bdrv_co_truncate = raw_co_truncate,
     .bdrv_getlength = raw_getlength,
@@ -3622,6 +3936,11 @@ static BlockDriver bdrv_host_device = {
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
     .bdrv_attach_aio_context = raw_aio_attach_aio_context,
+    .bdrv_detach_aio_context = raw_aio_detach_aio_context,
+#ifdef CONFIG_LINUX_IO_URING
+    .bdrv_register_buf      = raw_register_buf,
+    .bdrv_unregister_buf    = raw_unregister_buf,
+#endif
 
     .bdrv_co_truncate       = raw_co_truncate,
     .bdrv_getlength	= raw_getlength,
@@ -3746,6 +4065,11 @@ static BlockDriver bdrv_host_cdrom = {
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
     .bdrv_attach_aio_context = raw_aio_attach_aio_context,
+    .bdrv_detach_aio_context = raw_aio_detach_aio_context,
+#ifdef CONFIG_LINUX_IO_URING
+    .bdrv_register_buf      = raw_register_buf,
+    .bdrv_unregister_buf    = raw_unregister_buf,
+#endif
 
     .bdrv_co_truncate    = raw_co_truncate,
     .bdrv_getlength      = raw_getlength,
@@ -3876,6 +4200,11 @@ static BlockDriver bdrv_host_cdrom = {
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
     .bdrv_attach_aio_context = raw_aio_attach_aio_context,
+    .bdrv_detach_aio_context = raw_aio_detach_aio_context,
+#ifdef CONFIG_LINUX_IO_URING
+    .bdrv_register_buf      = raw_register_buf,
+    .bdrv_unregister_buf    = raw_unregister_buf,
+#endif
 
     .bdrv_co_truncate    = raw_co_truncate,
     .bdrv_getlength      = raw_getlength,
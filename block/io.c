@@ -1774,6 +1774,7 @@ int coroutine_fn bdrv_co_preadv_part(BdrvChild *child,
     BlockDriverState *bs = child->bs;
     BdrvTrackedRequest req;
     BdrvRequestPadding pad;
+    int64_t start_ns, acct_bytes = bytes;
     int ret;
 
     trace_bdrv_co_preadv_part(bs, offset, bytes, flags);
@@ -1799,6 +1800,7 @@ int coroutine_fn bdrv_co_preadv_part(BdrvChild *child,
         return 0;
     }
 
+    start_ns = block_node_stats_start();
     bdrv_inc_in_flight(bs);
 
     /* Don't do copy-on-read if we read data before write operation */
@@ -1821,6 +1823,8 @@ int coroutine_fn bdrv_co_preadv_part(BdrvChild *child,
 
     bdrv_padding_destroy(&pad);
 
+    block_node_stats_done(&bs->node_stats, BLOCK_ACCT_READ, acct_bytes,
+                          start_ns, ret);
     return ret;
 }
 
@@ -2201,6 +2205,7 @@ int coroutine_fn bdrv_co_pwritev_part(BdrvChild *child,
     BdrvTrackedRequest req;
     uint64_t align = bs->bl.request_alignment;
     BdrvRequestPadding pad;
+    int64_t start_ns, acct_bytes = bytes;
     int ret;
     bool padded = false;
 
@@ -2234,6 +2239,8 @@ int coroutine_fn bdrv_co_pwritev_part(BdrvChild *child,
         return 0;
     }
 
+    start_ns = block_node_stats_start();
+
     if (!(flags & BDRV_REQ_ZERO_WRITE)) {
         /*
          * Pad request for following read-modify-write cycle.
@@ -2276,6 +2283,8 @@ out:
     tracked_request_end(&req);
     bdrv_dec_in_flight(bs);
 
+    block_node_stats_done(&bs->node_stats, BLOCK_ACCT_WRITE, acct_bytes,
+                          start_ns, ret);
     return ret;
 }
 
@@ -2821,6 +2830,7 @@ int coroutine_fn bdrv_co_flush(BlockDriverState *bs)
     BdrvChild *primary_child = bdrv_primary_child(bs);
     BdrvChild *child;
     int current_gen;
+    int64_t start_ns;
     int ret = 0;
 
     bdrv_inc_in_flight(bs);
@@ -2830,6 +2840,8 @@ int coroutine_fn bdrv_co_flush(BlockDriverState *bs)
         goto early_exit;
     }
 
+    start_ns = block_node_stats_start();
+
     qemu_co_mutex_lock(&bs->reqs_lock);
     current_gen = qatomic_read(&bs->write_gen);
 
@@ -2934,6 +2946,8 @@ out:
     qemu_co_queue_next(&bs->flush_queue);
     qemu_co_mutex_unlock(&bs->reqs_lock);
 
+    block_node_stats_done(&bs->node_stats, BLOCK_ACCT_FLUSH, 0, start_ns, ret);
+
 early_exit:
     bdrv_dec_in_flight(bs);
     return ret;
@@ -2945,6 +2959,7 @@ int coroutine_fn bdrv_co_pdiscard(BdrvChild *child, int64_t offset,
     BdrvTrackedRequest req;
     int max_pdiscard, ret;
     int head, tail, align;
+    int64_t start_ns;
     BlockDriverState *bs = child->bs;
 
     if (!bs || !bs->drv || !bdrv_is_inserted(bs)) {
@@ -2979,6 +2994,7 @@ int coroutine_fn bdrv_co_pdiscard(BdrvChild *child, int64_t offset,
     head = offset % align;
     tail = (offset + bytes) % align;
 
+    start_ns = block_node_stats_start();
     bdrv_inc_in_flight(bs);
     tracked_request_begin(&req, bs, offset, bytes, BDRV_TRACKED_DISCARD);
 
@@ -3051,6 +3067,66 @@ out:
     bdrv_co_write_req_finish(child, req.offset, req.bytes, &req, ret);
     tracked_request_end(&req);
     bdrv_dec_in_flight(bs);
+
+    block_node_stats_done(&bs->node_stats, BLOCK_ACCT_UNMAP, req.bytes,
+                          start_ns, ret);
+    return ret;
+}
+
+int coroutine_fn bdrv_co_defragment(BlockDriverState *bs, int64_t offset,
+                                    int64_t bytes, int64_t *moved)
+{
+    BdrvTrackedRequest req;
+    int ret;
+
+    if (!bs || !bs->drv || !bdrv_is_inserted(bs)) {
+        return -ENOMEDIUM;
+    }
+    if (!bs->drv->bdrv_co_defragment) {
+        return -ENOTSUP;
+    }
+    if (bdrv_is_read_only(bs)) {
+        return -EPERM;
+    }
+
+    ret = bdrv_check_request(offset, bytes, NULL);
+    if (ret < 0) {
+        return ret;
+    }
+
+    bdrv_inc_in_flight(bs);
+    tracked_request_begin(&req, bs, offset, bytes, BDRV_TRACKED_WRITE);
+
+    /*
+     * The guest-visible data does not change, so there is no need for
+     * bdrv_co_write_req_prepare(), but no guest request may access the
+     * clusters while they are being moved.
+     */
+    bdrv_make_request_serialising(&req, bdrv_get_cluster_size(bs));
+
+    ret = bs->drv->bdrv_co_defragment(bs, req.overlap_offset,
+                                      req.overlap_bytes, moved);
+
+    tracked_request_end(&req);
+    bdrv_dec_in_flight(bs);
+    return ret;
+}
+
+int coroutine_fn bdrv_co_compact(BlockDriverState *bs, Error **errp)
+{
+    int ret;
+
+    if (!bs || !bs->drv || !bdrv_is_inserted(bs)) {
+        error_setg(errp, "No medium inserted");
+        return -ENOMEDIUM;
+    }
+    if (!bs->drv->bdrv_co_compact) {
+        return 0;
+    }
+
+    bdrv_inc_in_flight(bs);
+    ret = bs->drv->bdrv_co_compact(bs, errp);
+    bdrv_dec_in_flight(bs);
     return ret;
 }
 
@@ -3276,6 +3352,48 @@ static int coroutine_fn bdrv_co_copy_range_internal(
     return ret;
 }
 
+bool bdrv_can_sendfile(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+
+    if (!drv || !drv->bdrv_co_sendfile || bs->encrypted ||
+        qatomic_read(&bs->copy_on_read)) {
+        return false;
+    }
+
+    return !drv->bdrv_can_sendfile || drv->bdrv_can_sendfile(bs);
+}
+
+int coroutine_fn bdrv_co_sendfile(BdrvChild *child, int64_t offset,
+                                  int64_t bytes, int out_fd)
+{
+    BlockDriverState *bs = child ? child->bs : NULL;
+    BdrvTrackedRequest req;
+    int ret;
+
+    if (!bs || !bdrv_is_inserted(bs)) {
+        return -ENOMEDIUM;
+    }
+    ret = bdrv_check_request32(offset, bytes, NULL, 0);
+    if (ret) {
+        return ret;
+    }
+    if (!bdrv_can_sendfile(bs)) {
+        return -ENOTSUP;
+    }
+
+    bdrv_inc_in_flight(bs);
+    tracked_request_begin(&req, bs, offset, bytes, BDRV_TRACKED_READ);
+    bdrv_wait_serialising_requests(&req);
+
+    ret = bs->drv->bdrv_co_sendfile(bs, offset, bytes, out_fd);
+
+    tracked_request_end(&req);
+    bdrv_dec_in_flight(bs);
+
+    return ret;
+}
+
 /* Copy range from @src to @dst.
  *
  * See the comment of bdrv_co_copy_range for the parameter and return value
@@ -16,12 +16,30 @@
 #include "block/block.h"
 #include "block/raw-aio.h"
 #include "qemu/coroutine.h"
+#include "qemu/units.h"
+#include "qemu/bitmap.h"
 #include "qapi/error.h"
+#include "exec/cpu-common.h"
+#include "exec/memory.h"
+#include "exec/ramlist.h"
 #include "trace.h"
 
 /* io_uring ring size */
 #define MAX_ENTRIES 128
 
+/* Size of the sparse fixed file table, see luring_register_fd() */
+#define MAX_FIXED_FILES 64
+
+/* Size of the sparse registered buffer table, see luring_register_buf() */
+#define MAX_FIXED_BUFS 1024
+
+/* The kernel limits each registered buffer to this size */
+#define MAX_FIXED_BUF_SIZE (1 * GiB)
+
+/* Interval for reaping completions of a polled ring when idle, see below */
+#define IOPOLL_MIN_NS (10 * SCALE_US)
+#define IOPOLL_MAX_NS (1 * SCALE_MS)
+
 typedef struct LuringAIOCB {
     Coroutine *co;
     struct io_uring_sqe sqeq;
@@ -51,13 +69,62 @@ typedef struct LuringState {
 
     struct io_uring ring;
 
+    /* LURING_SETUP_* flags the ring was created with */
+    int flags;
+
     /* io queue for submit at batch.  Protected by AioContext lock. */
     LuringQueue io_q;
 
     /* I/O completion processing.  Only runs in I/O thread.  */
     QEMUBH *completion_bh;
+
+    /*
+     * Completions of a polled ring never wake up the ring fd.  The poll
+     * handler reaps them while aio_poll() busy-polls; once it blocks, this
+     * timer does, backing off from IOPOLL_MIN_NS to IOPOLL_MAX_NS while
+     * nothing completes.  Only with LURING_SETUP_IOPOLL.
+     */
+    QEMUTimer *iopoll_timer;
+    int64_t iopoll_interval_ns;
+
+    /*
+     * Fixed file table.  Slots that are not in use hold -1.  NULL if the
+     * table has not been set up yet or the kernel refused to register it.
+     */
+    int *fixed_fds;
+    bool fixed_fds_unsupported;
+
+    /*
+     * Registered buffer table, indexed by buf_index.  Slots that are not in
+     * use have a NULL iov_base.  NULL if the table has not been set up yet
+     * or the kernel refused to register it.  Only requests with a single
+     * iovec that falls entirely within one of these buffers are submitted
+     * as IORING_OP_READ_FIXED/WRITE_FIXED.
+     *
+     * Buffers never overlap.  fixed_bufs_sorted lists the nr_fixed_bufs
+     * slots in use by ascending address, see luring_find_fixed_buf().
+     * fixed_bufs_ram marks the slots that hold guest RAM.
+     */
+    struct iovec *fixed_bufs;
+    int *fixed_bufs_sorted;
+    unsigned int nr_fixed_bufs;
+    unsigned long *fixed_bufs_ram;
+    bool fixed_bufs_unsupported;
+
+    /* Guest RAM is registered while guest_ram_users > 0 */
+    unsigned int guest_ram_users;
+    QLIST_ENTRY(LuringState) guest_ram_next;
 } LuringState;
 
+/*
+ * Rings that have guest RAM registered.  They share one RAMBlockNotifier,
+ * and discarding guest RAM is disabled while the list is not empty.
+ * Protected by the BQL.
+ */
+static QLIST_HEAD(, LuringState) guest_ram_rings =
+    QLIST_HEAD_INITIALIZER(guest_ram_rings);
+static RAMBlockNotifier guest_ram_notifier;
+
 /**
  * luring_resubmit:
  *
@@ -70,6 +137,32 @@ static void luring_resubmit(LuringState *s, LuringAIOCB *luringcb)
     s->io_q.in_queue++;
 }
 
+/**
+ * luring_unfix_buf:
+ *
+ * Turn a fixed buffer request back into a vectored one.  Needed when the
+ * buffer table changes while the request still waits in submit_queue, and for
+ * resubmitting short reads.
+ */
+static void luring_unfix_buf(LuringAIOCB *luringcb)
+{
+    struct io_uring_sqe *sqe = &luringcb->sqeq;
+
+    switch (sqe->opcode) {
+    case IORING_OP_READ_FIXED:
+        sqe->opcode = IORING_OP_READV;
+        break;
+    case IORING_OP_WRITE_FIXED:
+        sqe->opcode = IORING_OP_WRITEV;
+        break;
+    default:
+        return;
+    }
+    sqe->addr = (__u64)(uintptr_t)luringcb->qiov->iov;
+    sqe->len = luringcb->qiov->niov;
+    sqe->buf_index = 0;
+}
+
 /**
  * luring_resubmit_short_read:
  *
@@ -103,6 +196,7 @@ static void luring_resubmit_short_read(LuringState *s, LuringAIOCB *luringcb,
                       remaining);
 
     /* Update sqe */
+    luring_unfix_buf(luringcb);
     luringcb->sqeq.off = nread;
     luringcb->sqeq.addr = (__u64)(uintptr_t)luringcb->resubmit_qiov.iov;
     luringcb->sqeq.len = luringcb->resubmit_qiov.niov;
@@ -127,6 +221,7 @@ static void luring_process_completions(LuringState *s)
 {
     struct io_uring_cqe *cqes;
     int total_bytes;
+    bool progress = false;
     /*
      * Request completion callbacks can run the nested event loop.
      * Schedule ourselves so the nested event loop will "see" remaining
@@ -156,6 +251,7 @@ static void luring_process_completions(LuringState *s)
         ret = cqes->res;
         io_uring_cqe_seen(&s->ring, cqes);
         cqes = NULL;
+        progress = true;
 
         /* Change counters one-by-one because we can be nested. */
         s->io_q.in_flight--;
@@ -204,7 +300,20 @@ end:
             aio_co_wake(luringcb->co);
         }
     }
+
     qemu_bh_cancel(s->completion_bh);
+
+    if (s->iopoll_timer && s->io_q.in_flight) {
+        if (progress) {
+            s->iopoll_interval_ns = IOPOLL_MIN_NS;
+        } else {
+            s->iopoll_interval_ns = MIN(s->iopoll_interval_ns * 2,
+                                        IOPOLL_MAX_NS);
+        }
+        timer_mod(s->iopoll_timer,
+                  qemu_clock_get_ns(QEMU_CLOCK_REALTIME) +
+                  s->iopoll_interval_ns);
+    }
 }
 
 static int ioq_submit(LuringState *s)
@@ -251,9 +360,24 @@ static int ioq_submit(LuringState *s)
     return ret;
 }
 
+/*
+ * With IORING_SETUP_IOPOLL, completions are only reaped from the device when
+ * someone enters the kernel with IORING_ENTER_GETEVENTS.  The SQPOLL thread
+ * does that for us, otherwise io_uring_submit() with an empty SQ does it.
+ */
+static void luring_reap_iopoll(LuringState *s)
+{
+    if ((s->flags & LURING_SETUP_IOPOLL) &&
+        !(s->flags & LURING_SETUP_SQPOLL) &&
+        s->io_q.in_flight) {
+        io_uring_submit(&s->ring);
+    }
+}
+
 static void luring_process_completions_and_submit(LuringState *s)
 {
     aio_context_acquire(s->aio_context);
+    luring_reap_iopoll(s);
     luring_process_completions(s);
 
     if (!s->io_q.plugged && s->io_q.in_queue > 0) {
@@ -274,10 +398,17 @@ static void qemu_luring_completion_cb(void *opaque)
     luring_process_completions_and_submit(s);
 }
 
+static void qemu_luring_iopoll_timer_cb(void *opaque)
+{
+    LuringState *s = opaque;
+    luring_process_completions_and_submit(s);
+}
+
 static bool qemu_luring_poll_cb(void *opaque)
 {
     LuringState *s = opaque;
 
+    luring_reap_iopoll(s);
     if (io_uring_cq_ready(&s->ring)) {
         luring_process_completions_and_submit(s);
         return true;
@@ -312,6 +443,499 @@ void luring_io_unplug(BlockDriverState *bs, LuringState *s)
     }
 }
 
+/**
+ * luring_find_fixed_fd:
+ *
+ * Returns the fixed file table slot of @fd, or -1 if @fd is not registered.
+ */
+static int luring_find_fixed_fd(LuringState *s, int fd)
+{
+    int i;
+
+    if (!s->fixed_fds) {
+        return -1;
+    }
+    for (i = 0; i < MAX_FIXED_FILES; i++) {
+        if (s->fixed_fds[i] == fd) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Returns the position in fixed_bufs_sorted of the last buffer that starts
+ * at or before @addr, or -1 if there is none.
+ */
+static int luring_bsearch_fixed_buf(LuringState *s, uintptr_t addr)
+{
+    int lo = 0, hi = s->nr_fixed_bufs;
+
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        int slot = s->fixed_bufs_sorted[mid];
+
+        if ((uintptr_t)s->fixed_bufs[slot].iov_base <= addr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo - 1;
+}
+
+/**
+ * luring_find_fixed_buf:
+ *
+ * Returns the index of the registered buffer that contains @iov, or -1 if
+ * there is none.
+ */
+static int luring_find_fixed_buf(LuringState *s, const struct iovec *iov)
+{
+    uintptr_t start = (uintptr_t)iov->iov_base;
+    int pos = luring_bsearch_fixed_buf(s, start);
+    struct iovec *buf;
+    int slot;
+
+    if (pos < 0) {
+        return -1;
+    }
+
+    slot = s->fixed_bufs_sorted[pos];
+    buf = &s->fixed_bufs[slot];
+    if (start - (uintptr_t)buf->iov_base + iov->iov_len <= buf->iov_len) {
+        return slot;
+    }
+    return -1;
+}
+
+/**
+ * luring_register_fd:
+ * @s: AIO state
+ * @fd: file descriptor
+ *
+ * Add @fd to the fixed file table of the ring, which saves the kernel the
+ * file table lookup and reference counting on every request.  Requests on
+ * @fd pick up the fixed slot automatically.
+ *
+ * Returns the slot on success, or -1 if @fd cannot be registered (e.g.
+ * because the kernel does not support sparse file tables or the table is
+ * full).  Requests on @fd keep working in the latter case.
+ */
+int luring_register_fd(LuringState *s, int fd)
+{
+    int i, ret;
+
+    if (!s->fixed_fds) {
+        if (s->fixed_fds_unsupported) {
+            return -1;
+        }
+        s->fixed_fds = g_new(int, MAX_FIXED_FILES);
+        for (i = 0; i < MAX_FIXED_FILES; i++) {
+            s->fixed_fds[i] = -1;
+        }
+        ret = io_uring_register_files(&s->ring, s->fixed_fds, MAX_FIXED_FILES);
+        if (ret < 0) {
+            trace_luring_register_fd(s, fd, ret);
+            g_free(s->fixed_fds);
+            s->fixed_fds = NULL;
+            s->fixed_fds_unsupported = true;
+            return -1;
+        }
+    }
+
+    i = luring_find_fixed_fd(s, -1);
+    if (i < 0) {
+        trace_luring_register_fd(s, fd, -ENFILE);
+        return -1;
+    }
+
+    ret = io_uring_register_files_update(&s->ring, i, &fd, 1);
+    trace_luring_register_fd(s, fd, ret < 0 ? ret : i);
+    if (ret < 0) {
+        return -1;
+    }
+    s->fixed_fds[i] = fd;
+    return i;
+}
+
+/**
+ * luring_unregister_fd:
+ * @s: AIO state
+ * @slot: slot returned by luring_register_fd()
+ *
+ * Remove a file descriptor from the fixed file table.  Must be called before
+ * the file descriptor is closed and while no requests on it are pending.
+ */
+void luring_unregister_fd(LuringState *s, int slot)
+{
+    int fd = -1;
+
+    assert(s->fixed_fds && slot >= 0 && slot < MAX_FIXED_FILES);
+    trace_luring_unregister_fd(s, s->fixed_fds[slot], slot);
+
+    io_uring_register_files_update(&s->ring, slot, &fd, 1);
+    s->fixed_fds[slot] = -1;
+}
+
+static void luring_alloc_fixed_bufs(LuringState *s)
+{
+    s->fixed_bufs = g_new0(struct iovec, MAX_FIXED_BUFS);
+    s->fixed_bufs_sorted = g_new(int, MAX_FIXED_BUFS);
+    s->nr_fixed_bufs = 0;
+    s->fixed_bufs_ram = bitmap_new(MAX_FIXED_BUFS);
+}
+
+static void luring_free_fixed_bufs(LuringState *s)
+{
+    g_free(s->fixed_bufs);
+    g_free(s->fixed_bufs_sorted);
+    g_free(s->fixed_bufs_ram);
+    s->fixed_bufs = NULL;
+    s->fixed_bufs_sorted = NULL;
+    s->fixed_bufs_ram = NULL;
+}
+
+/*
+ * Set up an empty buffer table, so that buffers can be added and removed one
+ * slot at a time later.  Empty slots need Linux 5.13, as does updating them.
+ */
+static bool luring_setup_fixed_bufs(LuringState *s)
+{
+#ifdef CONFIG_LINUX_IO_URING_BUFFERS_UPDATE
+    int ret;
+
+    if (s->fixed_bufs) {
+        return true;
+    }
+    if (s->fixed_bufs_unsupported) {
+        return false;
+    }
+
+    luring_alloc_fixed_bufs(s);
+    ret = io_uring_register_buffers(&s->ring, s->fixed_bufs, MAX_FIXED_BUFS);
+    trace_luring_setup_fixed_bufs(s, ret);
+    if (ret < 0) {
+        luring_free_fixed_bufs(s);
+        s->fixed_bufs_unsupported = true;
+        return false;
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+/* Point buffer table slot @slot to @iov, or empty it if iov_base is NULL */
+static int luring_update_fixed_buf(LuringState *s, int slot,
+                                   const struct iovec *iov, bool guest_ram)
+{
+#ifdef CONFIG_LINUX_IO_URING_BUFFERS_UPDATE
+    int *sorted = s->fixed_bufs_sorted;
+    __u64 tag = 0;
+    int pos, ret;
+
+    ret = io_uring_register_buffers_update_tag(&s->ring, slot, iov, &tag, 1);
+    trace_luring_update_fixed_buf(s, slot, iov->iov_base, iov->iov_len, ret);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (s->fixed_bufs[slot].iov_base) {
+        pos = luring_bsearch_fixed_buf(s,
+                                       (uintptr_t)s->fixed_bufs[slot].iov_base);
+        assert(pos >= 0 && sorted[pos] == slot);
+        memmove(&sorted[pos], &sorted[pos + 1],
+                (s->nr_fixed_bufs - pos - 1) * sizeof(*sorted));
+        s->nr_fixed_bufs--;
+    }
+
+    if (iov->iov_base) {
+        pos = luring_bsearch_fixed_buf(s, (uintptr_t)iov->iov_base) + 1;
+        memmove(&sorted[pos + 1], &sorted[pos],
+                (s->nr_fixed_bufs - pos) * sizeof(*sorted));
+        sorted[pos] = slot;
+        s->nr_fixed_bufs++;
+    }
+
+    s->fixed_bufs[slot] = *iov;
+    if (guest_ram) {
+        set_bit(slot, s->fixed_bufs_ram);
+    } else {
+        clear_bit(slot, s->fixed_bufs_ram);
+    }
+    return 0;
+#else
+    g_assert_not_reached();
+#endif
+}
+
+/*
+ * Requests still waiting in submit_queue must not use a slot that is about
+ * to change.  Requests the kernel has already taken keep the old buffer.
+ */
+static void luring_unfix_queued(LuringState *s, int slot)
+{
+    LuringAIOCB *luringcb;
+
+    QSIMPLEQ_FOREACH(luringcb, &s->io_q.submit_queue, next) {
+        if ((luringcb->sqeq.opcode == IORING_OP_READ_FIXED ||
+             luringcb->sqeq.opcode == IORING_OP_WRITE_FIXED) &&
+            luringcb->sqeq.buf_index == slot) {
+            luring_unfix_buf(luringcb);
+        }
+    }
+}
+
+static int luring_find_free_buf_slot(LuringState *s)
+{
+    int i;
+
+    for (i = 0; i < MAX_FIXED_BUFS; i++) {
+        if (!s->fixed_bufs[i].iov_base) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void luring_add_buf(LuringState *s, void *host, size_t size,
+                           bool guest_ram)
+{
+    if (!luring_setup_fixed_bufs(s)) {
+        return;
+    }
+
+    while (size) {
+        struct iovec iov = {
+            .iov_base = host,
+            .iov_len = MIN(size, MAX_FIXED_BUF_SIZE),
+        };
+        int slot = luring_find_free_buf_slot(s);
+
+        if (slot < 0 || luring_update_fixed_buf(s, slot, &iov, guest_ram) < 0) {
+            return;
+        }
+        host += iov.iov_len;
+        size -= iov.iov_len;
+    }
+}
+
+/**
+ * luring_register_buf:
+ * @s: AIO state
+ * @host: start of the buffer
+ * @size: size of the buffer
+ *
+ * Pin @host in the kernel so that requests whose data lies within it can be
+ * submitted without mapping the user pages for each request.  Large buffers
+ * take several slots of the buffer table.  If registration fails (e.g.
+ * because of RLIMIT_MEMLOCK), requests use the normal vectored path.
+ */
+void luring_register_buf(LuringState *s, void *host, size_t size)
+{
+    luring_add_buf(s, host, size, false);
+}
+
+/**
+ * luring_unregister_buf:
+ * @s: AIO state
+ * @host: start of a buffer passed to luring_register_buf()
+ * @size: size of the buffer passed to luring_register_buf()
+ */
+void luring_unregister_buf(LuringState *s, void *host, size_t size)
+{
+    const struct iovec empty = { .iov_base = NULL };
+
+    if (!s->fixed_bufs) {
+        return;
+    }
+
+    while (size) {
+        size_t len = MIN(size, MAX_FIXED_BUF_SIZE);
+        int pos = luring_bsearch_fixed_buf(s, (uintptr_t)host);
+        int slot = pos < 0 ? -1 : s->fixed_bufs_sorted[pos];
+
+        if (slot < 0 || s->fixed_bufs[slot].iov_base != host ||
+            s->fixed_bufs[slot].iov_len != len) {
+            /* Registration failed at this point */
+            return;
+        }
+
+        luring_unfix_queued(s, slot);
+        luring_update_fixed_buf(s, slot, &empty, false);
+        host += len;
+        size -= len;
+    }
+}
+
+static void luring_ram_block_added(RAMBlockNotifier *n, void *host,
+                                   size_t size)
+{
+    LuringState *s;
+
+    QLIST_FOREACH(s, &guest_ram_rings, guest_ram_next) {
+        aio_context_acquire(s->aio_context);
+        luring_add_buf(s, host, size, true);
+        aio_context_release(s->aio_context);
+    }
+}
+
+static void luring_ram_block_removed(RAMBlockNotifier *n, void *host,
+                                     size_t size)
+{
+    LuringState *s;
+
+    if (!host) {
+        return;
+    }
+    QLIST_FOREACH(s, &guest_ram_rings, guest_ram_next) {
+        aio_context_acquire(s->aio_context);
+        luring_unregister_buf(s, host, size);
+        aio_context_release(s->aio_context);
+    }
+}
+
+static int luring_register_ramblock(RAMBlock *rb, void *opaque)
+{
+    void *host = qemu_ram_get_host_addr(rb);
+
+    if (host) {
+        luring_add_buf(opaque, host, qemu_ram_get_used_length(rb), true);
+    }
+    return 0;
+}
+
+static int luring_unregister_ramblock(RAMBlock *rb, void *opaque)
+{
+    void *host = qemu_ram_get_host_addr(rb);
+
+    if (host) {
+        luring_unregister_buf(opaque, host, qemu_ram_get_used_length(rb));
+    }
+    return 0;
+}
+
+/*
+ * Share the guest RAM that @src has pinned instead of pinning it again.
+ * Cloning the buffer table needs Linux 6.12 and a ring that has no buffer
+ * table yet.
+ */
+static bool luring_clone_guest_ram(LuringState *s, LuringState *src)
+{
+#ifdef CONFIG_LINUX_IO_URING_CLONE_BUFFERS
+    const struct iovec empty = { .iov_base = NULL };
+    int i, ret;
+
+    if (s->fixed_bufs || s->fixed_bufs_unsupported) {
+        return false;
+    }
+
+    aio_context_acquire(src->aio_context);
+    ret = io_uring_clone_buffers(&s->ring, &src->ring);
+    trace_luring_clone_guest_ram(s, src, ret);
+    if (ret == 0) {
+        luring_alloc_fixed_bufs(s);
+        memcpy(s->fixed_bufs, src->fixed_bufs,
+               MAX_FIXED_BUFS * sizeof(*s->fixed_bufs));
+        memcpy(s->fixed_bufs_sorted, src->fixed_bufs_sorted,
+               src->nr_fixed_bufs * sizeof(*s->fixed_bufs_sorted));
+        s->nr_fixed_bufs = src->nr_fixed_bufs;
+        bitmap_copy(s->fixed_bufs_ram, src->fixed_bufs_ram, MAX_FIXED_BUFS);
+    }
+    aio_context_release(src->aio_context);
+    if (ret < 0) {
+        return false;
+    }
+
+    /* Only guest RAM is shared, drop the other buffers of @src */
+    for (i = 0; i < MAX_FIXED_BUFS; i++) {
+        if (s->fixed_bufs[i].iov_base && !test_bit(i, s->fixed_bufs_ram)) {
+            luring_update_fixed_buf(s, i, &empty, false);
+        }
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+/**
+ * luring_register_guest_ram:
+ * @s: AIO state
+ *
+ * Register all guest RAM, and RAM that is added later, as buffers, so that
+ * guest requests can use IORING_OP_READ_FIXED/WRITE_FIXED.  Calls nest, the
+ * RAM stays registered until luring_unregister_guest_ram() has been called
+ * as often.  Must be called from the main loop with the BQL held.
+ *
+ * Registered buffers keep the pages that were mapped at registration time,
+ * so discarding guest RAM (e.g. by virtio-balloon) is disabled while any
+ * ring has guest RAM registered.  Where the kernel supports it, rings share
+ * the guest RAM buffers of the first ring instead of pinning it again.
+ *
+ * Returns false if guest RAM is not registered, e.g. because a device that
+ * relies on discarding guest RAM (such as virtio-mem) is in use.  Requests
+ * then use the normal vectored path.
+ */
+bool luring_register_guest_ram(LuringState *s)
+{
+    LuringState *src = QLIST_FIRST(&guest_ram_rings);
+    bool cloned = false;
+    int ret;
+
+    if (s->guest_ram_users) {
+        s->guest_ram_users++;
+        return true;
+    }
+
+    if (src) {
+        cloned = luring_clone_guest_ram(s, src);
+    }
+    if (!cloned && !luring_setup_fixed_bufs(s)) {
+        return false;
+    }
+
+    if (!src) {
+        ret = ram_block_discard_disable(true);
+        trace_luring_register_guest_ram(s, ret);
+        if (ret < 0) {
+            return false;
+        }
+        guest_ram_notifier.ram_block_added = luring_ram_block_added;
+        guest_ram_notifier.ram_block_removed = luring_ram_block_removed;
+        ram_block_notifier_add(&guest_ram_notifier);
+    }
+
+    s->guest_ram_users = 1;
+    QLIST_INSERT_HEAD(&guest_ram_rings, s, guest_ram_next);
+    if (!cloned) {
+        qemu_ram_foreach_block(luring_register_ramblock, s);
+    }
+    return true;
+}
+
+/**
+ * luring_unregister_guest_ram:
+ * @s: AIO state
+ *
+ * Undo a successful luring_register_guest_ram().
+ */
+void luring_unregister_guest_ram(LuringState *s)
+{
+    assert(s->guest_ram_users > 0);
+    if (--s->guest_ram_users) {
+        return;
+    }
+
+    QLIST_REMOVE(s, guest_ram_next);
+    qemu_ram_foreach_block(luring_unregister_ramblock, s);
+    if (QLIST_EMPTY(&guest_ram_rings)) {
+        ram_block_notifier_remove(&guest_ram_notifier);
+        ram_block_discard_disable(false);
+    }
+}
+
 /**
  * luring_do_submit:
  * @fd: file descriptor for I/O
@@ -328,13 +952,37 @@ static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
 {
     int ret;
     struct io_uring_sqe *sqes = &luringcb->sqeq;
+    int fixed_fd = luring_find_fixed_fd(s, fd);
+    int buf_index = -1;
+
+    if (fixed_fd >= 0) {
+        fd = fixed_fd;
+    }
+    if (luringcb->qiov && luringcb->qiov->niov == 1 && s->fixed_bufs) {
+        buf_index = luring_find_fixed_buf(s, luringcb->qiov->iov);
+        if (buf_index >= 0) {
+            trace_luring_do_submit_fixed(s, luringcb, buf_index);
+        }
+    }
 
     switch (type) {
     case QEMU_AIO_WRITE:
+        if (buf_index >= 0) {
+            io_uring_prep_write_fixed(sqes, fd, luringcb->qiov->iov->iov_base,
+                                      luringcb->qiov->iov->iov_len, offset,
+                                      buf_index);
+            break;
+        }
         io_uring_prep_writev(sqes, fd, luringcb->qiov->iov,
                              luringcb->qiov->niov, offset);
         break;
     case QEMU_AIO_READ:
+        if (buf_index >= 0) {
+            io_uring_prep_read_fixed(sqes, fd, luringcb->qiov->iov->iov_base,
+                                     luringcb->qiov->iov->iov_len, offset,
+                                     buf_index);
+            break;
+        }
         io_uring_prep_readv(sqes, fd, luringcb->qiov->iov,
                             luringcb->qiov->niov, offset);
         break;
@@ -346,6 +994,9 @@ static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
                         __func__, type);
         abort();
     }
+    if (fixed_fd >= 0) {
+        io_uring_sqe_set_flags(sqes, IOSQE_FIXED_FILE);
+    }
     io_uring_sqe_set_data(sqes, luringcb);
 
     QSIMPLEQ_INSERT_TAIL(&s->io_q.submit_queue, luringcb, next);
@@ -391,6 +1042,10 @@ void luring_detach_aio_context(LuringState *s, AioContext *old_context)
     aio_set_fd_handler(old_context, s->ring.ring_fd, false, NULL, NULL, NULL,
                        s);
     qemu_bh_delete(s->completion_bh);
+    if (s->iopoll_timer) {
+        timer_free(s->iopoll_timer);
+        s->iopoll_timer = NULL;
+    }
     s->aio_context = NULL;
 }
 
@@ -398,24 +1053,39 @@ void luring_attach_aio_context(LuringState *s, AioContext *new_context)
 {
     s->aio_context = new_context;
     s->completion_bh = aio_bh_new(new_context, qemu_luring_completion_bh, s);
+    if (s->flags & LURING_SETUP_IOPOLL) {
+        s->iopoll_timer = aio_timer_new(new_context, QEMU_CLOCK_REALTIME,
+                                        SCALE_NS, qemu_luring_iopoll_timer_cb,
+                                        s);
+        s->iopoll_interval_ns = IOPOLL_MIN_NS;
+    }
     aio_set_fd_handler(s->aio_context, s->ring.ring_fd, false,
                        qemu_luring_completion_cb, NULL, qemu_luring_poll_cb, s);
 }
 
-LuringState *luring_init(Error **errp)
+LuringState *luring_init(int flags, Error **errp)
 {
     int rc;
     LuringState *s = g_new0(LuringState, 1);
     struct io_uring *ring = &s->ring;
+    unsigned int setup_flags = 0;
 
     trace_luring_init_state(s, sizeof(*s));
 
-    rc = io_uring_queue_init(MAX_ENTRIES, ring, 0);
+    if (flags & LURING_SETUP_SQPOLL) {
+        setup_flags |= IORING_SETUP_SQPOLL;
+    }
+    if (flags & LURING_SETUP_IOPOLL) {
+        setup_flags |= IORING_SETUP_IOPOLL;
+    }
+
+    rc = io_uring_queue_init(MAX_ENTRIES, ring, setup_flags);
     if (rc < 0) {
-        error_setg_errno(errp, errno, "failed to init linux io_uring ring");
+        error_setg_errno(errp, -rc, "failed to init linux io_uring ring");
         g_free(s);
         return NULL;
     }
+    s->flags = flags;
 
     ioq_init(&s->io_q);
     return s;
@@ -424,6 +1094,9 @@ LuringState *luring_init(Error **errp)
 
 void luring_cleanup(LuringState *s)
 {
+    assert(!s->guest_ram_users);
+    luring_free_fixed_bufs(s);
+    g_free(s->fixed_fds);
     io_uring_queue_exit(&s->ring);
     trace_luring_cleanup_state(s);
     g_free(s);
@@ -13,6 +13,7 @@
 
 #include "qemu/osdep.h"
 #include "qemu/cutils.h"
+#include "qemu/units.h"
 #include "qemu/coroutine.h"
 #include "qemu/range.h"
 #include "trace.h"
@@ -27,6 +28,9 @@
 #define MAX_IN_FLIGHT 16
 #define MAX_IO_BYTES (1 << 20) /* 1 Mb */
 #define DEFAULT_MIRROR_BUF_SIZE (MAX_IN_FLIGHT * MAX_IO_BYTES)
+/* Clean areas up to this size between dirty ones are copied along with them */
+#define MAX_COALESCE_GAP (256 * KiB)
+#define MIRROR_STREAM_RATE_WINDOW_NS 1000000000LL
 
 /* The mirroring buffer is a list of granularity-sized chunks.
  * Free chunks are organized in a list.
@@ -37,9 +41,30 @@ typedef struct MirrorBuffer {
 
 typedef struct MirrorOp MirrorOp;
 
+/*
+ * A way to write to the target.  Besides the target itself, there may be
+ * more nodes that access the same image, e.g. several NBD connections to
+ * the same export.  Writes are distributed over them to use them in
+ * parallel.
+ */
+typedef struct MirrorStream {
+    BlockBackend *blk;
+    int in_flight;
+    int64_t bytes_in_flight;
+
+    /* Statistics for query-block-jobs; only data writes are counted */
+    uint64_t bytes;
+    int64_t window_start_ns;
+    uint64_t window_bytes;
+    uint64_t rate;
+} MirrorStream;
+
 typedef struct MirrorBlockJob {
     BlockJob common;
     BlockBackend *target;
+    /* streams[0].blk is @target */
+    MirrorStream *streams;
+    int nb_streams;
     BlockDriverState *mirror_top_bs;
     BlockDriverState *base;
     BlockDriverState *base_overlay;
@@ -63,6 +88,9 @@ typedef struct MirrorBlockJob {
     bool should_complete;
     int64_t granularity;
     size_t buf_size;
+    int max_in_flight;
+    /* Number of clean chunks that may be copied to merge dirty areas */
+    int max_gap_chunks;
     int64_t bdev_length;
     unsigned long *cow_bitmap;
     BdrvDirtyBitmap *dirty_bitmap;
@@ -116,6 +144,46 @@ typedef enum MirrorMethod {
     MIRROR_METHOD_DISCARD,
 } MirrorMethod;
 
+/* Pick the stream with the least data in flight for a write */
+static MirrorStream *mirror_stream_begin(MirrorBlockJob *s, uint64_t bytes)
+{
+    MirrorStream *stream = &s->streams[0];
+    int i;
+
+    for (i = 1; i < s->nb_streams; i++) {
+        if (s->streams[i].bytes_in_flight < stream->bytes_in_flight) {
+            stream = &s->streams[i];
+        }
+    }
+
+    stream->in_flight++;
+    stream->bytes_in_flight += bytes;
+    return stream;
+}
+
+static void mirror_stream_end(MirrorStream *stream, uint64_t bytes,
+                              bool is_data, int ret)
+{
+    int64_t now;
+
+    stream->in_flight--;
+    stream->bytes_in_flight -= bytes;
+
+    if (ret < 0 || !is_data) {
+        return;
+    }
+
+    now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    stream->bytes += bytes;
+    stream->window_bytes += bytes;
+    if (now - stream->window_start_ns >= MIRROR_STREAM_RATE_WINDOW_NS) {
+        stream->rate = muldiv64(stream->window_bytes, NANOSECONDS_PER_SECOND,
+                                now - stream->window_start_ns);
+        stream->window_start_ns = now;
+        stream->window_bytes = 0;
+    }
+}
+
 static BlockErrorAction mirror_error_action(MirrorBlockJob *s, bool read,
                                             int error)
 {
@@ -222,6 +290,7 @@ static void coroutine_fn mirror_write_complete(MirrorOp *op, int ret)
 static void coroutine_fn mirror_read_complete(MirrorOp *op, int ret)
 {
     MirrorBlockJob *s = op->s;
+    MirrorStream *stream;
 
     if (ret < 0) {
         BlockErrorAction action;
@@ -236,7 +305,9 @@ static void coroutine_fn mirror_read_complete(MirrorOp *op, int ret)
         return;
     }
 
-    ret = blk_co_pwritev(s->target, op->offset, op->qiov.size, &op->qiov, 0);
+    stream = mirror_stream_begin(s, op->qiov.size);
+    ret = blk_co_pwritev(stream->blk, op->offset, op->qiov.size, &op->qiov, 0);
+    mirror_stream_end(stream, op->qiov.size, true, ret);
     mirror_write_complete(op, ret);
 }
 
@@ -382,6 +453,7 @@ static void coroutine_fn mirror_co_read(void *opaque)
 static void coroutine_fn mirror_co_zero(void *opaque)
 {
     MirrorOp *op = opaque;
+    MirrorStream *stream;
     int ret;
 
     op->s->in_flight++;
@@ -389,14 +461,17 @@ static void coroutine_fn mirror_co_zero(void *opaque)
     *op->bytes_handled = op->bytes;
     op->is_in_flight = true;
 
-    ret = blk_co_pwrite_zeroes(op->s->target, op->offset, op->bytes,
+    stream = mirror_stream_begin(op->s, op->bytes);
+    ret = blk_co_pwrite_zeroes(stream->blk, op->offset, op->bytes,
                                op->s->unmap ? BDRV_REQ_MAY_UNMAP : 0);
+    mirror_stream_end(stream, op->bytes, false, ret);
     mirror_write_complete(op, ret);
 }
 
 static void coroutine_fn mirror_co_discard(void *opaque)
 {
     MirrorOp *op = opaque;
+    MirrorStream *stream;
     int ret;
 
     op->s->in_flight++;
@@ -404,7 +479,9 @@ static void coroutine_fn mirror_co_discard(void *opaque)
     *op->bytes_handled = op->bytes;
     op->is_in_flight = true;
 
-    ret = blk_co_pdiscard(op->s->target, op->offset, op->bytes);
+    stream = mirror_stream_begin(op->s, op->bytes);
+    ret = blk_co_pdiscard(stream->blk, op->offset, op->bytes);
+    mirror_stream_end(stream, op->bytes, false, ret);
     mirror_write_complete(op, ret);
 }
 
@@ -454,6 +531,32 @@ static unsigned mirror_perform(MirrorBlockJob *s, int64_t offset,
     return bytes_handled;
 }
 
+/*
+ * Returns the number of clean chunks starting at @offset if they are followed
+ * by a dirty chunk, at most @max_chunks and s->max_gap_chunks, and none of
+ * them is in flight.  Otherwise returns 0.  Called with the dirty bitmap
+ * locked.
+ */
+static int mirror_gap_chunks(MirrorBlockJob *s, int64_t offset, int max_chunks)
+{
+    int i;
+
+    max_chunks = MIN(max_chunks, s->max_gap_chunks);
+    for (i = 0; i < max_chunks; i++) {
+        int64_t gap_offset = offset + i * s->granularity;
+
+        if (gap_offset >= s->bdev_length ||
+            test_bit(gap_offset / s->granularity, s->in_flight_bitmap)) {
+            return 0;
+        }
+        if (bdrv_dirty_bitmap_get_locked(s->dirty_bitmap, gap_offset)) {
+            return i;
+        }
+    }
+
+    return 0;
+}
+
 static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
 {
     BlockDriverState *source = s->mirror_top_bs->backing->bs;
@@ -463,7 +566,7 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
     /* At least the first dirty chunk is mirrored in one iteration. */
     int nb_chunks = 1;
     bool write_zeroes_ok = bdrv_can_write_zeroes_with_unmap(blk_bs(s->target));
-    int max_io_bytes = MAX(s->buf_size / MAX_IN_FLIGHT, MAX_IO_BYTES);
+    int max_io_bytes = MAX(s->buf_size / s->max_in_flight, MAX_IO_BYTES);
 
     bdrv_dirty_bitmap_lock(s->dirty_bitmap);
     offset = bdrv_dirty_iter_next(s->dbi);
@@ -480,16 +583,26 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
     job_pause_point(&s->common.job);
 
     /* Find the number of consective dirty chunks following the first dirty
-     * one, and wait for in flight requests in them. */
+     * one, and wait for in flight requests in them.  Short clean gaps are
+     * included if that allows merging with the next dirty area. */
     bdrv_dirty_bitmap_lock(s->dirty_bitmap);
     while (nb_chunks * s->granularity < s->buf_size) {
         int64_t next_dirty;
         int64_t next_offset = offset + nb_chunks * s->granularity;
         int64_t next_chunk = next_offset / s->granularity;
-        if (next_offset >= s->bdev_length ||
-            !bdrv_dirty_bitmap_get_locked(s->dirty_bitmap, next_offset)) {
+        if (next_offset >= s->bdev_length) {
             break;
         }
+        if (!bdrv_dirty_bitmap_get_locked(s->dirty_bitmap, next_offset)) {
+            int gap = mirror_gap_chunks(s, next_offset,
+                                        s->buf_size / s->granularity -
+                                        nb_chunks - 1);
+            if (!gap) {
+                break;
+            }
+            nb_chunks += gap;
+            continue;
+        }
         if (test_bit(next_chunk, s->in_flight_bitmap)) {
             break;
         }
@@ -560,7 +673,7 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
             }
         }
 
-        while (s->in_flight >= MAX_IN_FLIGHT) {
+        while (s->in_flight >= s->max_in_flight) {
             trace_mirror_yield_in_flight(s, offset, s->in_flight);
             mirror_wait_for_free_in_flight_slot(s);
         }
@@ -637,6 +750,7 @@ static int mirror_exit_common(Job *job)
     Error *local_err = NULL;
     bool abort = job->ret < 0;
     int ret = 0;
+    int i;
 
     if (s->prepared) {
         return 0;
@@ -667,6 +781,12 @@ static int mirror_exit_common(Job *job)
      */
     blk_unref(s->target);
     s->target = NULL;
+    for (i = 1; i < s->nb_streams; i++) {
+        blk_unref(s->streams[i].blk);
+    }
+    g_free(s->streams);
+    s->streams = NULL;
+    s->nb_streams = 0;
 
     /* We don't access the source any more. Dropping any WRITE/RESIZE is
      * required before it could become a backing file of target_bs. Not having
@@ -812,7 +932,7 @@ static int coroutine_fn mirror_dirty_init(MirrorBlockJob *s)
                 return 0;
             }
 
-            if (s->in_flight >= MAX_IN_FLIGHT) {
+            if (s->in_flight >= s->max_in_flight) {
                 trace_mirror_yield(s, UINT64_MAX, s->buf_free_count,
                                    s->in_flight);
                 mirror_wait_for_free_in_flight_slot(s);
@@ -859,7 +979,12 @@ static int coroutine_fn mirror_dirty_init(MirrorBlockJob *s)
  */
 static int mirror_flush(MirrorBlockJob *s)
 {
-    int ret = blk_flush(s->target);
+    int ret = 0;
+    int i;
+
+    for (i = 0; i < s->nb_streams && ret >= 0; i++) {
+        ret = blk_flush(s->streams[i].blk);
+    }
     if (ret < 0) {
         if (mirror_error_action(s, false, -ret) == BLOCK_ERROR_ACTION_REPORT) {
             s->ret = ret;
@@ -880,6 +1005,7 @@ static int coroutine_fn mirror_run(Job *job, Error **errp)
     char backing_filename[2]; /* we only need 2 characters because we are only
                                  checking for a NULL string */
     int ret = 0;
+    int i;
 
     if (job_is_cancelled(&s->common.job)) {
         goto immediate_exit;
@@ -913,6 +1039,24 @@ static int coroutine_fn mirror_run(Job *job, Error **errp)
         goto immediate_exit;
     }
 
+    for (i = 1; i < s->nb_streams; i++) {
+        int64_t stream_length = blk_getlength(s->streams[i].blk);
+
+        if (stream_length < 0) {
+            ret = stream_length;
+            goto immediate_exit;
+        }
+        if (stream_length != target_length) {
+            error_setg(errp, "Extra target '%s' and target image have "
+                       "different sizes",
+                       bdrv_get_node_name(blk_bs(s->streams[i].blk)));
+            ret = -EINVAL;
+            goto immediate_exit;
+        }
+        s->streams[i].window_start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    }
+    s->streams[0].window_start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
     if (s->bdev_length == 0) {
         /* Transition to the READY state and wait for complete. */
         job_transition_to_ready(&s->common.job);
@@ -945,6 +1089,18 @@ static int coroutine_fn mirror_run(Job *job, Error **errp)
         s->cow_bitmap = bitmap_new(length);
     }
     s->max_iov = MIN(bs->bl.max_iov, target_bs->bl.max_iov);
+    for (i = 1; i < s->nb_streams; i++) {
+        s->max_iov = MIN(s->max_iov, blk_bs(s->streams[i].blk)->bl.max_iov);
+    }
+
+    /*
+     * Copying clean areas to merge requests is only harmless if the whole
+     * image is mirrored.  With a backing file on the target, or if the
+     * target must do COW, this would allocate more than necessary.
+     */
+    if (!s->is_none_mode && !s->base && !s->cow_bitmap) {
+        s->max_gap_chunks = MAX_COALESCE_GAP / s->granularity;
+    }
 
     s->buf = qemu_try_blockalign(bs, s->buf_size);
     if (s->buf == NULL) {
@@ -995,7 +1151,7 @@ static int coroutine_fn mirror_run(Job *job, Error **errp)
         delta = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - s->last_pause_ns;
         if (delta < BLOCK_JOB_SLICE_TIME &&
             s->common.iostatus == BLOCK_DEVICE_IO_STATUS_OK) {
-            if (s->in_flight >= MAX_IN_FLIGHT || s->buf_free_count == 0 ||
+            if (s->in_flight >= s->max_in_flight || s->buf_free_count == 0 ||
                 (cnt == 0 && s->in_flight > 0)) {
                 trace_mirror_yield(s, cnt, s->buf_free_count, s->in_flight);
                 mirror_wait_for_free_in_flight_slot(s);
@@ -1182,9 +1338,38 @@ static bool mirror_drained_poll(BlockJob *job)
 static void mirror_cancel(Job *job)
 {
     MirrorBlockJob *s = container_of(job, MirrorBlockJob, common.job);
-    BlockDriverState *target = blk_bs(s->target);
+    int i;
+
+    for (i = 0; i < s->nb_streams; i++) {
+        bdrv_cancel_in_flight(blk_bs(s->streams[i].blk));
+    }
+}
+
+static void mirror_query(BlockJob *job, BlockJobInfo *info)
+{
+    MirrorBlockJob *s = container_of(job, MirrorBlockJob, common);
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    BlockJobStreamInfoList **tail = &info->streams;
+    int i;
+
+    /* Keep the output of single-target jobs unchanged */
+    if (s->nb_streams < 2) {
+        return;
+    }
+
+    info->has_streams = true;
+    for (i = 0; i < s->nb_streams; i++) {
+        MirrorStream *stream = &s->streams[i];
+        BlockJobStreamInfo *value = g_new0(BlockJobStreamInfo, 1);
+        bool idle = now - stream->window_start_ns >
+                    2 * MIRROR_STREAM_RATE_WINDOW_NS;
 
-    bdrv_cancel_in_flight(target);
+        value->node_name = g_strdup(bdrv_get_node_name(blk_bs(stream->blk)));
+        value->bytes = stream->bytes;
+        value->in_flight = stream->in_flight;
+        value->throughput = idle ? 0 : stream->rate;
+        QAPI_LIST_APPEND(tail, value);
+    }
 }
 
 static const BlockJobDriver mirror_job_driver = {
@@ -1201,6 +1386,7 @@ static const BlockJobDriver mirror_job_driver = {
         .cancel                 = mirror_cancel,
     },
     .drained_poll           = mirror_drained_poll,
+    .query                  = mirror_query,
 };
 
 static const BlockJobDriver commit_active_job_driver = {
@@ -1226,6 +1412,7 @@ do_sync_target_write(MirrorBlockJob *job, MirrorMethod method,
     int ret;
     size_t qiov_offset = 0;
     int64_t bitmap_offset, bitmap_end;
+    MirrorStream *stream;
 
     if (!QEMU_IS_ALIGNED(offset, job->granularity) &&
         bdrv_dirty_bitmap_get(job->dirty_bitmap, offset))
@@ -1281,25 +1468,27 @@ do_sync_target_write(MirrorBlockJob *job, MirrorMethod method,
 
     job_progress_increase_remaining(&job->common.job, bytes);
 
+    stream = mirror_stream_begin(job, bytes);
     switch (method) {
     case MIRROR_METHOD_COPY:
-        ret = blk_co_pwritev_part(job->target, offset, bytes,
+        ret = blk_co_pwritev_part(stream->blk, offset, bytes,
                                   qiov, qiov_offset, flags);
         break;
 
     case MIRROR_METHOD_ZERO:
         assert(!qiov);
-        ret = blk_co_pwrite_zeroes(job->target, offset, bytes, flags);
+        ret = blk_co_pwrite_zeroes(stream->blk, offset, bytes, flags);
         break;
 
     case MIRROR_METHOD_DISCARD:
         assert(!qiov);
-        ret = blk_co_pdiscard(job->target, offset, bytes);
+        ret = blk_co_pdiscard(stream->blk, offset, bytes);
         break;
 
     default:
         abort();
     }
+    mirror_stream_end(stream, bytes, method == MIRROR_METHOD_COPY, ret);
 
     if (ret >= 0) {
         job_progress_update(&job->common.job, bytes);
@@ -1549,6 +1738,8 @@ static BlockDriver bdrv_mirror_top = {
 static BlockJob *mirror_start_job(
                              const char *job_id, BlockDriverState *bs,
                              int creation_flags, BlockDriverState *target,
+                             BlockDriverState **extra_targets,
+                             int nb_extra_targets,
                              const char *replaces, int64_t speed,
                              uint32_t granularity, int64_t buf_size,
                              BlockMirrorBackingMode backing_mode,
@@ -1570,6 +1761,7 @@ static BlockJob *mirror_start_job(
     bool target_is_backing;
     uint64_t target_perms, target_shared_perms;
     int ret;
+    int i;
 
     if (granularity == 0) {
         granularity = bdrv_get_default_bitmap_granularity(target);
@@ -1583,7 +1775,7 @@ static BlockJob *mirror_start_job(
     }
 
     if (buf_size == 0) {
-        buf_size = DEFAULT_MIRROR_BUF_SIZE;
+        buf_size = DEFAULT_MIRROR_BUF_SIZE * (1 + nb_extra_targets);
     }
 
     if (bdrv_skip_filters(bs) == bdrv_skip_filters(target)) {
@@ -1591,6 +1783,29 @@ static BlockJob *mirror_start_job(
         return NULL;
     }
 
+    for (i = 0; i < nb_extra_targets; i++) {
+        BlockDriverState *extra = bdrv_skip_filters(extra_targets[i]);
+        int j;
+
+        if (extra == bdrv_skip_filters(target)) {
+            error_setg(errp, "Extra target '%s' is the target itself",
+                       bdrv_get_node_name(extra_targets[i]));
+            return NULL;
+        }
+        if (bdrv_chain_contains(bs, extra)) {
+            error_setg(errp, "Extra target '%s' is in the source's backing "
+                       "chain", bdrv_get_node_name(extra_targets[i]));
+            return NULL;
+        }
+        for (j = 0; j < i; j++) {
+            if (extra == bdrv_skip_filters(extra_targets[j])) {
+                error_setg(errp, "Extra target '%s' is given more than once",
+                           bdrv_get_node_name(extra_targets[i]));
+                return NULL;
+            }
+        }
+    }
+
     /* In the case of active commit, add dummy driver to provide consistent
      * reads on the top, while disabling it in the intermediate nodes, and make
      * the backing chain writable. */
@@ -1709,6 +1924,34 @@ static BlockJob *mirror_start_job(
     blk_set_allow_aio_context_change(s->target, true);
     blk_set_disable_request_queuing(s->target, true);
 
+    s->streams = g_new0(MirrorStream, 1 + nb_extra_targets);
+    s->streams[0].blk = s->target;
+    s->nb_streams = 1;
+    for (i = 0; i < nb_extra_targets; i++) {
+        BlockBackend *blk;
+
+        if (target_is_backing) {
+            error_setg(errp, "Extra targets are not supported for commit");
+            goto fail;
+        }
+
+        blk = blk_new(s->common.job.aio_context,
+                      target_perms, target_shared_perms);
+        ret = blk_insert_bs(blk, extra_targets[i], errp);
+        if (ret < 0) {
+            blk_unref(blk);
+            goto fail;
+        }
+        if (is_mirror) {
+            /* See above */
+            blk_set_force_allow_inactivate(blk);
+        }
+        blk_set_allow_aio_context_change(blk, true);
+        blk_set_disable_request_queuing(blk, true);
+        s->streams[s->nb_streams++].blk = blk;
+    }
+    s->max_in_flight = MAX_IN_FLIGHT * s->nb_streams;
+
     s->replaces = g_strdup(replaces);
     s->on_source_error = on_source_error;
     s->on_target_error = on_target_error;
@@ -1744,6 +1987,10 @@ static BlockJob *mirror_start_job(
     /* Required permissions are already taken with blk_new() */
     block_job_add_bdrv(&s->common, "target", target, 0, BLK_PERM_ALL,
                        &error_abort);
+    for (i = 0; i < nb_extra_targets; i++) {
+        block_job_add_bdrv(&s->common, "extra target", extra_targets[i], 0,
+                           BLK_PERM_ALL, &error_abort);
+    }
 
     /* In commit_active_start() all intermediate nodes disappear, so
      * any jobs in them must be blocked */
@@ -1806,6 +2053,10 @@ fail:
 
         g_free(s->replaces);
         blk_unref(s->target);
+        for (i = 1; i < s->nb_streams; i++) {
+            blk_unref(s->streams[i].blk);
+        }
+        g_free(s->streams);
         bs_opaque->job = NULL;
         if (s->dirty_bitmap) {
             bdrv_release_dirty_bitmap(s->dirty_bitmap);
@@ -1824,7 +2075,9 @@ fail:
 }
 
 void mirror_start(const char *job_id, BlockDriverState *bs,
-                  BlockDriverState *target, const char *replaces,
+                  BlockDriverState *target,
+                  BlockDriverState **extra_targets, int nb_extra_targets,
+                  const char *replaces,
                   int creation_flags, int64_t speed,
                   uint32_t granularity, int64_t buf_size,
                   MirrorSyncMode mode, BlockMirrorBackingMode backing_mode,
@@ -1845,7 +2098,8 @@ void mirror_start(const char *job_id, BlockDriverState *bs,
     }
     is_none_mode = mode == MIRROR_SYNC_MODE_NONE;
     base = mode == MIRROR_SYNC_MODE_TOP ? bdrv_backing_chain_next(bs) : NULL;
-    mirror_start_job(job_id, bs, creation_flags, target, replaces,
+    mirror_start_job(job_id, bs, creation_flags, target,
+                     extra_targets, nb_extra_targets, replaces,
                      speed, granularity, buf_size, backing_mode, zero_target,
                      on_source_error, on_target_error, unmap, NULL, NULL,
                      &mirror_job_driver, is_none_mode, base, false,
@@ -1872,7 +2126,8 @@ BlockJob *commit_active_start(const char *job_id, BlockDriverState *bs,
     }
 
     ret = mirror_start_job(
-                     job_id, bs, creation_flags, base, NULL, speed, 0, 0,
+                     job_id, bs, creation_flags, base, NULL, 0, NULL,
+                     speed, 0, 0,
                      MIRROR_LEAVE_BACKING_CHAIN, false,
                      on_error, on_error, true, cb, opaque,
                      &commit_active_job_driver, false, base, auto_complete,
@@ -667,6 +667,96 @@ BlockStatsList *qmp_query_blockstats(bool has_query_nodes,
     return head;
 }
 
+static BlockLatencyHistogramInfo *bdrv_node_stats_histogram(Stat64 *buckets,
+                                                            int shift,
+                                                            int nbuckets)
+{
+    BlockLatencyHistogramInfo *info = g_new0(BlockLatencyHistogramInfo, 1);
+    uint64List **boundaries = &info->boundaries;
+    uint64List **bins = &info->bins;
+    int i;
+
+    for (i = 0; i < nbuckets; i++) {
+        if (i) {
+            QAPI_LIST_APPEND(boundaries,
+                             block_node_stats_bucket_start(shift, i));
+        }
+        QAPI_LIST_APPEND(bins, stat64_get(&buckets[i]));
+    }
+
+    return info;
+}
+
+static BlockNodeOpStatsInfo *bdrv_query_node_op_stats(BlockDriverState *bs,
+                                                      enum BlockAcctType type)
+{
+    BlockNodeOpStats *s = &bs->node_stats.op[type];
+    BlockNodeOpStatsInfo *info = g_new0(BlockNodeOpStatsInfo, 1);
+
+    *info = (BlockNodeOpStatsInfo) {
+        .operations         = stat64_get(&s->ops),
+        .failed_operations  = stat64_get(&s->failed_ops),
+        .bytes              = stat64_get(&s->bytes),
+        .total_time_ns      = stat64_get(&s->total_time_ns),
+        .latency_histogram  =
+            bdrv_node_stats_histogram(s->latency, BLOCK_NODE_LATENCY_SHIFT,
+                                      BLOCK_NODE_LATENCY_BUCKETS),
+    };
+
+    if (type != BLOCK_ACCT_FLUSH) {
+        info->has_size_histogram = true;
+        info->size_histogram =
+            bdrv_node_stats_histogram(s->size, BLOCK_NODE_SIZE_SHIFT,
+                                      BLOCK_NODE_SIZE_BUCKETS);
+    }
+
+    return info;
+}
+
+static BlockNodeStatsInfo *bdrv_query_node_stats(BlockDriverState *bs,
+                                                 bool reset)
+{
+    BlockNodeStatsInfo *info = g_new0(BlockNodeStatsInfo, 1);
+
+    info->node_name = g_strdup(bdrv_get_node_name(bs));
+    info->driver = g_strdup(bs->drv ? bs->drv->format_name : "");
+    info->read = bdrv_query_node_op_stats(bs, BLOCK_ACCT_READ);
+    info->write = bdrv_query_node_op_stats(bs, BLOCK_ACCT_WRITE);
+    info->flush = bdrv_query_node_op_stats(bs, BLOCK_ACCT_FLUSH);
+    info->discard = bdrv_query_node_op_stats(bs, BLOCK_ACCT_UNMAP);
+
+    if (reset) {
+        block_node_stats_clear(&bs->node_stats);
+    }
+
+    return info;
+}
+
+BlockNodeStatsInfoList *qmp_query_block_node_stats(bool has_node_name,
+                                                   const char *node_name,
+                                                   bool has_reset, bool reset,
+                                                   Error **errp)
+{
+    BlockNodeStatsInfoList *head = NULL, **tail = &head;
+    BlockDriverState *bs;
+
+    if (has_node_name) {
+        bs = bdrv_find_node(node_name);
+        if (!bs) {
+            error_setg(errp, "Cannot find node %s", node_name);
+            return NULL;
+        }
+        QAPI_LIST_APPEND(tail, bdrv_query_node_stats(bs, reset));
+        return head;
+    }
+
+    for (bs = bdrv_next_node(NULL); bs; bs = bdrv_next_node(bs)) {
+        QAPI_LIST_APPEND(tail, bdrv_query_node_stats(bs, reset));
+    }
+
+    return head;
+}
+
 void bdrv_snapshot_dump(QEMUSnapshotInfo *sn)
 {
     char date_buf[128], clock_buf[128];
@@ -23,18 +23,33 @@
  */
 
 #include "qemu/osdep.h"
+#include "qemu/qht.h"
+#include "qemu/rcu.h"
+#include "qemu/xxhash.h"
 #include "qcow2.h"
 #include "trace.h"
 
+/*
+ * Every cached table is also indexed in a QHT keyed by its offset, so that
+ * hits do not need to scan the whole cache and so that lookups can be done
+ * under RCU without holding s->lock (see qcow2_cache_peek()).
+ *
+ * The sequence lock of an entry is odd for as long as the entry is in use
+ * (ref > 0) or being refilled, i.e. whenever its offset or its contents may
+ * change.  Writers are serialized by s->lock; lock-free readers retry or
+ * give up when they observe a sequence change.
+ */
 typedef struct Qcow2CachedTable {
-    int64_t  offset;
-    uint64_t lru_counter;
-    int      ref;
-    bool     dirty;
+    int64_t     offset;
+    uint64_t    lru_counter;
+    int         ref;
+    bool        dirty;
+    QemuSeqLock seqlock;
 } Qcow2CachedTable;
 
 struct Qcow2Cache {
     Qcow2CachedTable       *entries;
+    struct qht              ht;
     struct Qcow2Cache      *depends;
     int                     size;
     int                     table_size;
@@ -57,6 +72,52 @@ static inline int qcow2_cache_get_table_idx(Qcow2Cache *c, void *table)
     return idx;
 }
 
+static inline uint32_t qcow2_cache_hash(uint64_t offset)
+{
+    return qemu_xxhash2(offset);
+}
+
+static bool qcow2_cache_entry_cmp(const void *a, const void *b)
+{
+    const Qcow2CachedTable *ta = a;
+    const Qcow2CachedTable *tb = b;
+
+    return ta->offset == tb->offset;
+}
+
+static bool qcow2_cache_lookup_cmp(const void *obj, const void *userp)
+{
+    const Qcow2CachedTable *t = obj;
+    const uint64_t *offset = userp;
+
+    return t->offset == *offset;
+}
+
+static Qcow2CachedTable *qcow2_cache_lookup(Qcow2Cache *c, uint64_t offset)
+{
+    return qht_lookup_custom(&c->ht, &offset, qcow2_cache_hash(offset),
+                             qcow2_cache_lookup_cmp);
+}
+
+/*
+ * Drop entry @i from the cache.  The caller must not hold a reference to
+ * it; the memory of the table itself is not released here.
+ */
+static void qcow2_cache_entry_reset(Qcow2Cache *c, int i)
+{
+    Qcow2CachedTable *t = &c->entries[i];
+
+    assert(t->ref == 0);
+    if (t->offset) {
+        qht_remove(&c->ht, t, qcow2_cache_hash(t->offset));
+    }
+
+    seqlock_write_begin(&t->seqlock);
+    t->offset = 0;
+    t->lru_counter = 0;
+    seqlock_write_end(&t->seqlock);
+}
+
 static inline const char *qcow2_cache_get_name(BDRVQcow2State *s, Qcow2Cache *c)
 {
     if (c == s->refcount_block_cache) {
@@ -104,8 +165,7 @@ void qcow2_cache_clean_unused(Qcow2Cache *c)
 
         /* And count how many we can clean in a row */
         while (i < c->size && can_clean_entry(c, i)) {
-            c->entries[i].offset = 0;
-            c->entries[i].lru_counter = 0;
+            qcow2_cache_entry_reset(c, i);
             i++;
             to_clean++;
         }
@@ -140,9 +200,11 @@ Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
         qemu_vfree(c->table_array);
         g_free(c->entries);
         g_free(c);
-        c = NULL;
+        return NULL;
     }
 
+    qht_init(&c->ht, qcow2_cache_entry_cmp, num_tables, QHT_MODE_AUTO_RESIZE);
+
     return c;
 }
 
@@ -154,6 +216,7 @@ int qcow2_cache_destroy(Qcow2Cache *c)
         assert(c->entries[i].ref == 0);
     }
 
+    qht_destroy(&c->ht);
     qemu_vfree(c->table_array);
     g_free(c->entries);
     g_free(c);
@@ -304,9 +367,7 @@ int qcow2_cache_empty(BlockDriverState *bs, Qcow2Cache *c)
     }
 
     for (i = 0; i < c->size; i++) {
-        assert(c->entries[i].ref == 0);
-        c->entries[i].offset = 0;
-        c->entries[i].lru_counter = 0;
+        qcow2_cache_entry_reset(c, i);
     }
 
     qcow2_cache_table_release(c, 0, c->size);
@@ -320,9 +381,9 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
     uint64_t offset, void **table, bool read_from_disk)
 {
     BDRVQcow2State *s = bs->opaque;
+    Qcow2CachedTable *t;
     int i;
     int ret;
-    int lookup_index;
     uint64_t min_lru_counter = UINT64_MAX;
     int min_lru_index = -1;
 
@@ -339,20 +400,21 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
     }
 
     /* Check if the table is already cached */
-    i = lookup_index = (offset / c->table_size * 4) % c->size;
-    do {
-        const Qcow2CachedTable *t = &c->entries[i];
-        if (t->offset == offset) {
-            goto found;
-        }
+    WITH_RCU_READ_LOCK_GUARD() {
+        t = qcow2_cache_lookup(c, offset);
+    }
+    if (t) {
+        i = t - c->entries;
+        goto found;
+    }
+
+    for (i = 0; i < c->size; i++) {
+        t = &c->entries[i];
         if (t->ref == 0 && t->lru_counter < min_lru_counter) {
             min_lru_counter = t->lru_counter;
             min_lru_index = i;
         }
-        if (++i == c->size) {
-            i = 0;
-        }
-    } while (i != lookup_index);
+    }
 
     if (min_lru_index == -1) {
         /* This can't happen in current synchronous code, but leave the check
@@ -372,7 +434,11 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
 
     trace_qcow2_cache_get_read(qemu_coroutine_self(),
                                c == s->l2_table_cache, i);
-    c->entries[i].offset = 0;
+    t = &c->entries[i];
+    qcow2_cache_entry_reset(c, i);
+
+    /* Keep lock-free readers away while the table is refilled */
+    seqlock_write_begin(&t->seqlock);
     if (read_from_disk) {
         if (c == s->l2_table_cache) {
             BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
@@ -382,15 +448,24 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
                          qcow2_cache_get_table_addr(c, i),
                          c->table_size);
         if (ret < 0) {
+            seqlock_write_end(&t->seqlock);
             return ret;
         }
     }
 
-    c->entries[i].offset = offset;
+    t->offset = offset;
+    if (!qht_insert(&c->ht, t, qcow2_cache_hash(offset), NULL)) {
+        abort();
+    }
+    t->ref = 1;
+    goto done;
 
     /* And return the right table */
 found:
-    c->entries[i].ref++;
+    if (c->entries[i].ref++ == 0) {
+        seqlock_write_begin(&c->entries[i].seqlock);
+    }
+done:
     *table = qcow2_cache_get_table_addr(c, i);
 
     trace_qcow2_cache_get_done(qemu_coroutine_self(),
@@ -420,6 +495,7 @@ void qcow2_cache_put(Qcow2Cache *c, void **table)
 
     if (c->entries[i].ref == 0) {
         c->entries[i].lru_counter = ++c->lru_counter;
+        seqlock_write_end(&c->entries[i].seqlock);
     }
 
     assert(c->entries[i].ref >= 0);
@@ -434,24 +510,54 @@ void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table)
 
 void *qcow2_cache_is_table_offset(Qcow2Cache *c, uint64_t offset)
 {
+    Qcow2CachedTable *t;
+
+    WITH_RCU_READ_LOCK_GUARD() {
+        t = qcow2_cache_lookup(c, offset);
+    }
+    return t ? qcow2_cache_get_table_addr(c, t - c->entries) : NULL;
+}
+
+/*
+ * Copy @len bytes at @pos from the table at @offset into @buf, without
+ * taking s->lock and without touching the LRU state.  This only succeeds
+ * if the table is cached and nobody holds a reference to it, so that its
+ * contents are known to be consistent with the metadata on disk.
+ *
+ * Returns true on success, false if the caller must fall back to
+ * qcow2_cache_get() under s->lock.
+ */
+bool qcow2_cache_peek(Qcow2Cache *c, uint64_t offset, size_t pos,
+                      void *buf, size_t len)
+{
+    Qcow2CachedTable *t;
+    unsigned seq;
     int i;
 
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].offset == offset) {
-            return qcow2_cache_get_table_addr(c, i);
-        }
+    assert(pos + len <= c->table_size);
+
+    RCU_READ_LOCK_GUARD();
+
+    t = qcow2_cache_lookup(c, offset);
+    if (!t) {
+        return false;
+    }
+
+    i = t - c->entries;
+    seq = seqlock_read_begin(&t->seqlock);
+    if (t->offset != offset) {
+        return false;
     }
-    return NULL;
+    memcpy(buf, (uint8_t *) qcow2_cache_get_table_addr(c, i) + pos, len);
+
+    return !seqlock_read_retry(&t->seqlock, seq);
 }
 
 void qcow2_cache_discard(Qcow2Cache *c, void *table)
 {
     int i = qcow2_cache_get_table_idx(c, table);
 
-    assert(c->entries[i].ref == 0);
-
-    c->entries[i].offset = 0;
-    c->entries[i].lru_counter = 0;
+    qcow2_cache_entry_reset(c, i);
     c->entries[i].dirty = false;
 
     qcow2_cache_table_release(c, i, 1);
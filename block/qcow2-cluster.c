@@ -728,6 +728,79 @@ fail:
     return ret;
 }
 
+/*
+ * try_get_host_offset
+ *
+ * Lock-free fast path of qcow2_get_host_offset() for requests that are
+ * contained in a single allocated, uncompressed cluster whose L2 slice is
+ * already in the cache and not in use by any other request.  s->lock need
+ * not be held, but the caller must run in the AioContext of @bs.  Larger
+ * requests are left to qcow2_get_host_offset() so that contiguous clusters
+ * are still merged.
+ *
+ * On success, *host_offset is set and the subcluster type is
+ * QCOW2_SUBCLUSTER_NORMAL.
+ *
+ * Returns true on success, false if the caller has to fall back to
+ * qcow2_get_host_offset() (which also takes care of reporting corruption).
+ */
+bool qcow2_try_get_host_offset(BlockDriverState *bs, uint64_t offset,
+                               unsigned int *bytes, uint64_t *host_offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t l1_index, l2_offset, l2_entry, host_cluster_offset;
+    unsigned int l2_index, offset_in_cluster;
+    int start_of_slice;
+
+    /* Subclusters need the L2 bitmap, too; keep them on the slow path */
+    if (has_subclusters(s)) {
+        return false;
+    }
+
+    offset_in_cluster = offset_into_cluster(s, offset);
+    if ((uint64_t) offset_in_cluster + *bytes > s->cluster_size) {
+        return false;
+    }
+
+    l1_index = offset_to_l1_index(s, offset);
+    if (l1_index >= s->l1_size) {
+        return false;
+    }
+
+    l2_offset = s->l1_table[l1_index] & L1E_OFFSET_MASK;
+    if (!l2_offset || offset_into_cluster(s, l2_offset)) {
+        return false;
+    }
+
+    start_of_slice = l2_entry_size(s) *
+        (offset_to_l2_index(s, offset) - offset_to_l2_slice_index(s, offset));
+    l2_index = offset_to_l2_slice_index(s, offset);
+    if (!qcow2_cache_peek(s->l2_table_cache, l2_offset + start_of_slice,
+                          l2_index * l2_entry_size(s),
+                          &l2_entry, sizeof(l2_entry)))
+    {
+        return false;
+    }
+    l2_entry = be64_to_cpu(l2_entry);
+
+    if (qcow2_get_cluster_type(bs, l2_entry) != QCOW2_CLUSTER_NORMAL) {
+        return false;
+    }
+
+    host_cluster_offset = l2_entry & L2E_OFFSET_MASK;
+    if (offset_into_cluster(s, host_cluster_offset) ||
+        (has_data_file(bs) &&
+         host_cluster_offset != offset - offset_in_cluster))
+    {
+        return false;
+    }
+
+    *host_offset = host_cluster_offset + offset_in_cluster;
+    trace_qcow2_get_host_offset_lockless(qemu_coroutine_self(), offset,
+                                         *host_offset);
+    return true;
+}
+
 /*
  * get_cluster_table
  *
@@ -1581,7 +1654,9 @@ static int do_alloc_cluster_offset(BlockDriverState *bs, uint64_t guest_offset,
 
     /* Allocate new clusters */
     trace_qcow2_cluster_alloc_phys(qemu_coroutine_self());
-    if (*host_offset == INV_OFFSET) {
+    if (s->cluster_pool_size) {
+        return qcow2_cluster_pool_alloc(bs, host_offset, nb_clusters);
+    } else if (*host_offset == INV_OFFSET) {
         int64_t cluster_offset =
             qcow2_alloc_clusters(bs, *nb_clusters * s->cluster_size);
         if (cluster_offset < 0) {
@@ -2157,6 +2232,338 @@ fail:
     return ret;
 }
 
+typedef struct Qcow2DefragMove {
+    int l2_index;
+    uint64_t old_offset;
+    uint64_t new_offset;
+} Qcow2DefragMove;
+
+static bool defrag_is_moved(Qcow2DefragMove *moves, int nb_moves,
+                            uint64_t host_offset)
+{
+    int i;
+
+    for (i = 0; i < nb_moves; i++) {
+        if (moves[i].old_offset == host_offset) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Picks and allocates a new host cluster for the data cluster at
+ * @host_offset.  @prev_offset is the host cluster of the preceding guest
+ * cluster, or 0 if there is none.  The cluster right after it is preferred,
+ * so that sequential guest data is sequential in the image file.  Otherwise
+ * the lowest free cluster below @host_offset is taken, so that the end of the
+ * file can be released.
+ *
+ * Returns the offset of the new cluster, 0 if the cluster should stay where
+ * it is, or -errno.
+ */
+static int64_t defrag_alloc_cluster(BlockDriverState *bs, uint64_t prev_offset,
+                                    uint64_t host_offset, int64_t file_size)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int64_t ret;
+
+    if (prev_offset) {
+        uint64_t next_offset = prev_offset + s->cluster_size;
+
+        if (next_offset == host_offset) {
+            return 0;
+        }
+
+        if (next_offset + s->cluster_size <= file_size) {
+            ret = qcow2_alloc_clusters_at(bs, next_offset, 1);
+            if (ret < 0) {
+                return ret;
+            } else if (ret == 1) {
+                return next_offset;
+            }
+        }
+    }
+
+    return qcow2_alloc_cluster_below(bs, host_offset);
+}
+
+/*
+ * This moves the data clusters of up to @nb_clusters guest clusters starting
+ * at @offset, but never beyond the end of the L2 slice, and stops early when
+ * the next cluster should go where a cluster moved in this call used to be.
+ * *prev_offset is the host cluster of the guest cluster before @offset on
+ * entry, and is updated for the next call.
+ *
+ * The new clusters are allocated with s->lock held, but the lock is dropped
+ * while the data is copied and flushed.  It is retaken to point the L2 slice
+ * to the new clusters, which is flushed before the old clusters are freed.
+ * A crash at any point therefore leaves the data intact, at worst with
+ * leaked clusters.
+ *
+ * Returns the number of clusters processed, or -errno.
+ */
+static int coroutine_fn defrag_in_l2_slice(BlockDriverState *bs,
+                                           uint64_t offset,
+                                           uint64_t nb_clusters,
+                                           uint64_t *prev_offset,
+                                           int64_t file_size, void *buf,
+                                           int64_t *moved)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int l1_index = offset_to_l1_index(s, offset);
+    int l2_index = offset_to_l2_slice_index(s, offset);
+    g_autofree Qcow2DefragMove *moves = NULL;
+    uint64_t *l2_slice = NULL;
+    uint64_t l2_offset;
+    int i, nb_moves = 0, nb_done = 0;
+    int ret;
+
+    /* Limit nb_clusters to one L2 slice */
+    nb_clusters = MIN(nb_clusters, s->l2_slice_size - l2_index);
+    assert(nb_clusters <= INT_MAX);
+
+    /* Tables that are shared with snapshots only point to shared clusters */
+    if (l1_index >= s->l1_size ||
+        !(s->l1_table[l1_index] & QCOW_OFLAG_COPIED))
+    {
+        *prev_offset = 0;
+        return nb_clusters;
+    }
+
+    l2_offset = s->l1_table[l1_index] & L1E_OFFSET_MASK;
+    ret = l2_load(bs, offset, l2_offset, &l2_slice);
+    if (ret < 0) {
+        return ret;
+    }
+
+    moves = g_new(Qcow2DefragMove, nb_clusters);
+
+    for (i = 0; i < nb_clusters; i++) {
+        uint64_t l2_entry = get_l2_entry(s, l2_slice, l2_index + i);
+        uint64_t host_offset = l2_entry & L2E_OFFSET_MASK;
+        int64_t new_offset;
+
+        switch (qcow2_get_cluster_type(bs, l2_entry)) {
+        case QCOW2_CLUSTER_NORMAL:
+            if (l2_entry & QCOW_OFLAG_COPIED) {
+                break;
+            }
+            /* Shared with a snapshot, leave it there */
+            *prev_offset = host_offset;
+            continue;
+        case QCOW2_CLUSTER_ZERO_ALLOC:
+            *prev_offset = host_offset;
+            continue;
+        default:
+            *prev_offset = 0;
+            continue;
+        }
+
+        /*
+         * The preferred cluster is only freed once this batch is done.  Stop
+         * here so that the next call can use it.
+         */
+        if (*prev_offset &&
+            defrag_is_moved(moves, nb_moves, *prev_offset + s->cluster_size))
+        {
+            nb_clusters = i;
+            break;
+        }
+
+        new_offset = defrag_alloc_cluster(bs, *prev_offset, host_offset,
+                                          file_size);
+        if (new_offset < 0) {
+            ret = new_offset;
+            goto fail;
+        } else if (new_offset == 0) {
+            *prev_offset = host_offset;
+            continue;
+        }
+
+        moves[nb_moves++] = (Qcow2DefragMove) {
+            .l2_index   = l2_index + i,
+            .old_offset = host_offset,
+            .new_offset = new_offset,
+        };
+        *prev_offset = new_offset;
+
+        ret = qcow2_pre_write_overlap_check(bs, 0, new_offset,
+                                            s->cluster_size, true);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+    qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
+
+    if (!nb_moves) {
+        return nb_clusters;
+    }
+
+    /*
+     * The caller keeps guest requests out of the range, and nothing refers
+     * to the new clusters yet, so their data is written without s->lock
+     */
+    qemu_co_mutex_unlock(&s->lock);
+
+    for (i = 0; i < nb_moves; i++) {
+        trace_qcow2_defrag_move(bs, moves[i].old_offset, moves[i].new_offset);
+
+        ret = bdrv_co_pread(s->data_file, moves[i].old_offset,
+                            s->cluster_size, buf, 0);
+        if (ret < 0) {
+            break;
+        }
+
+        ret = bdrv_co_pwrite(s->data_file, moves[i].new_offset,
+                             s->cluster_size, buf, 0);
+        if (ret < 0) {
+            break;
+        }
+    }
+    if (ret >= 0) {
+        ret = bdrv_co_flush(s->data_file->bs);
+    }
+
+    qemu_co_mutex_lock(&s->lock);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    /*
+     * A snapshot may have been taken meanwhile, and then the old clusters
+     * must stay where they are
+     */
+    if (l1_index >= s->l1_size ||
+        !(s->l1_table[l1_index] & QCOW_OFLAG_COPIED))
+    {
+        ret = 0;
+        goto fail;
+    }
+
+    l2_offset = s->l1_table[l1_index] & L1E_OFFSET_MASK;
+    ret = l2_load(bs, offset, l2_offset, &l2_slice);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    /* The refcounts of the new clusters must be on disk before the L2 slice */
+    if (qcow2_need_accurate_refcounts(s)) {
+        qcow2_cache_set_dependency(bs, s->l2_table_cache,
+                                   s->refcount_block_cache);
+    }
+    qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_slice);
+    for (i = 0; i < nb_moves; i++) {
+        uint64_t l2_entry = get_l2_entry(s, l2_slice, moves[i].l2_index);
+
+        if ((l2_entry & L2E_OFFSET_MASK) != moves[i].old_offset ||
+            !(l2_entry & QCOW_OFLAG_COPIED))
+        {
+            qcow2_free_clusters(bs, moves[i].new_offset, s->cluster_size,
+                                QCOW2_DISCARD_NEVER);
+            moves[i].old_offset = 0;
+            continue;
+        }
+
+        set_l2_entry(s, l2_slice, moves[i].l2_index,
+                     (l2_entry & ~L2E_OFFSET_MASK) | moves[i].new_offset);
+        nb_done++;
+    }
+    qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
+
+    ret = qcow2_cache_flush(bs, s->l2_table_cache);
+    if (ret < 0) {
+        /* The old clusters may still be referenced on disk, leak them */
+        return ret;
+    }
+
+    for (i = 0; i < nb_moves; i++) {
+        if (moves[i].old_offset) {
+            qcow2_free_clusters(bs, moves[i].old_offset, s->cluster_size,
+                                QCOW2_DISCARD_OTHER);
+        }
+    }
+    *moved += nb_done * s->cluster_size;
+
+    return nb_clusters;
+
+fail:
+    if (l2_slice) {
+        qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
+    }
+    for (i = 0; i < nb_moves; i++) {
+        qcow2_free_clusters(bs, moves[i].new_offset, s->cluster_size,
+                            QCOW2_DISCARD_NEVER);
+    }
+    *prev_offset = 0;
+    return ret < 0 ? ret : nb_clusters;
+}
+
+/*
+ * Moves the data clusters of the guest range [@offset, @offset + @bytes) to
+ * host clusters that continue the preceding guest data, or that are lower in
+ * the image file.  Compressed clusters and clusters that are shared with
+ * snapshots stay where they are.
+ *
+ * The caller must hold s->lock and make sure that no guest request accesses
+ * the range.  The lock is dropped while data is copied.  @moved is increased
+ * by the number of bytes that were moved.
+ */
+int coroutine_fn qcow2_cluster_defragment(BlockDriverState *bs,
+                                          uint64_t offset, uint64_t bytes,
+                                          int64_t *moved)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t nb_clusters = size_to_clusters(s, bytes);
+    uint64_t prev_offset = 0;
+    void *buf;
+    int64_t file_size;
+    int64_t ret;
+
+    assert(QEMU_IS_ALIGNED(offset, s->cluster_size));
+    assert(!has_data_file(bs) && !bs->encrypted);
+
+    file_size = bdrv_getlength(s->data_file->bs);
+    if (file_size < 0) {
+        return file_size;
+    }
+
+    if (offset) {
+        unsigned int cur_bytes = s->cluster_size;
+        QCow2SubclusterType type;
+
+        ret = qcow2_get_host_offset(bs, offset - s->cluster_size, &cur_bytes,
+                                    &prev_offset, &type);
+        if (ret < 0) {
+            return ret;
+        }
+        if (type == QCOW2_SUBCLUSTER_COMPRESSED) {
+            prev_offset = 0;
+        }
+    }
+
+    buf = qemu_try_blockalign(s->data_file->bs, s->cluster_size);
+    if (!buf) {
+        return -ENOMEM;
+    }
+
+    while (nb_clusters > 0) {
+        ret = defrag_in_l2_slice(bs, offset, nb_clusters, &prev_offset,
+                                 file_size, buf, moved);
+        if (ret < 0) {
+            goto out;
+        }
+
+        nb_clusters -= ret;
+        offset += ret * s->cluster_size;
+    }
+
+    ret = 0;
+out:
+    qemu_vfree(buf);
+    return ret;
+}
+
 /*
  * Expands all zero clusters in a specific L1 table (or deallocates them, for
  * non-backed non-pre-allocated zero clusters).
@@ -1063,6 +1063,154 @@ int64_t qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offset,
     return i;
 }
 
+/*
+ * Allocates the lowest free cluster below @limit, starting the search at
+ * s->free_cluster_index.  The caller must hold s->lock.
+ *
+ * Returns the offset of the cluster, 0 if all clusters below @limit are in
+ * use, or -errno.
+ */
+int64_t qcow2_alloc_cluster_below(BlockDriverState *bs, uint64_t limit)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t cluster_index, refcount;
+    int64_t ret;
+
+    for (cluster_index = s->free_cluster_index;
+         cluster_index < (limit >> s->cluster_bits);
+         cluster_index++)
+    {
+        ret = qcow2_get_refcount(bs, cluster_index, &refcount);
+        if (ret < 0) {
+            return ret;
+        }
+        if (refcount == 0) {
+            ret = qcow2_alloc_clusters_at(bs, cluster_index << s->cluster_bits,
+                                          1);
+            if (ret < 0) {
+                return ret;
+            }
+            assert(ret == 1);
+            s->free_cluster_index = cluster_index + 1;
+            return cluster_index << s->cluster_bits;
+        }
+    }
+
+    /* Everything up to here is in use, don't scan it again */
+    s->free_cluster_index = MAX(s->free_cluster_index, cluster_index);
+    return 0;
+}
+
+static int qcow2_cluster_pool_refill(BlockDriverState *bs,
+                                     uint64_t min_clusters)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t nb_clusters = MAX(min_clusters, s->cluster_pool_size);
+    int64_t offset;
+
+    assert(s->cluster_pool_nb_clusters == 0);
+
+    offset = qcow2_alloc_clusters(bs, nb_clusters << s->cluster_bits);
+    if (offset < 0) {
+        return offset;
+    }
+
+    trace_qcow2_cluster_pool_refill(bs, offset, nb_clusters);
+    s->cluster_pool_offset = offset;
+    s->cluster_pool_nb_clusters = nb_clusters;
+    return 0;
+}
+
+static void coroutine_fn qcow2_cluster_pool_refill_entry(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+    BDRVQcow2State *s = bs->opaque;
+
+    qemu_co_mutex_lock(&s->lock);
+    if (s->cluster_pool_size && !s->cluster_pool_nb_clusters &&
+        !(bs->open_flags & BDRV_O_INACTIVE))
+    {
+        /* Errors are not fatal here, the next allocation refills inline */
+        qcow2_cluster_pool_refill(bs, 0);
+    }
+    s->cluster_pool_refill_pending = false;
+    qemu_co_mutex_unlock(&s->lock);
+
+    bdrv_dec_in_flight(bs);
+}
+
+/*
+ * Hands out up to *nb_clusters host clusters from the cluster pool and
+ * stores the offset of the first one in *host_offset.  If *host_offset is
+ * not INV_OFFSET on entry, clusters are only taken if the pool continues
+ * exactly at that offset; otherwise *nb_clusters is set to 0.
+ *
+ * An empty pool is refilled inline; once a request drains it, a refill is
+ * scheduled in the background so that the next allocating write finds
+ * clusters ready.  The caller must hold s->lock.
+ *
+ * Returns 0 on success and -errno on error.
+ */
+int qcow2_cluster_pool_alloc(BlockDriverState *bs, uint64_t *host_offset,
+                             uint64_t *nb_clusters)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t n;
+    int ret;
+
+    if (*host_offset != INV_OFFSET) {
+        if (!s->cluster_pool_nb_clusters ||
+            s->cluster_pool_offset != *host_offset)
+        {
+            *nb_clusters = 0;
+            return 0;
+        }
+    } else if (!s->cluster_pool_nb_clusters) {
+        BLKDBG_EVENT(bs->file, BLKDBG_CLUSTER_ALLOC);
+        ret = qcow2_cluster_pool_refill(bs, *nb_clusters);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    n = MIN(*nb_clusters, s->cluster_pool_nb_clusters);
+    *host_offset = s->cluster_pool_offset;
+    *nb_clusters = n;
+    s->cluster_pool_offset += n << s->cluster_bits;
+    s->cluster_pool_nb_clusters -= n;
+
+    if (!s->cluster_pool_nb_clusters && !s->cluster_pool_refill_pending) {
+        Coroutine *co = qemu_coroutine_create(qcow2_cluster_pool_refill_entry,
+                                              bs);
+        s->cluster_pool_refill_pending = true;
+        bdrv_inc_in_flight(bs);
+        aio_co_schedule(bdrv_get_aio_context(bs), co);
+    }
+
+    return 0;
+}
+
+/*
+ * Returns the clusters that are still reserved in the cluster pool to the
+ * free space.  Must be called before anything that walks or rebuilds the
+ * refcount structures, or the reserved clusters would look like leaks.
+ */
+void qcow2_cluster_pool_release(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (!s->cluster_pool_nb_clusters) {
+        return;
+    }
+
+    trace_qcow2_cluster_pool_release(bs, s->cluster_pool_offset,
+                                     s->cluster_pool_nb_clusters);
+    qcow2_free_clusters(bs, s->cluster_pool_offset,
+                        s->cluster_pool_nb_clusters << s->cluster_bits,
+                        QCOW2_DISCARD_NEVER);
+    s->cluster_pool_nb_clusters = 0;
+}
+
 /* only used to allocate compressed sectors. We try to allocate
    contiguous sectors. size must be <= cluster_size */
 int64_t qcow2_alloc_bytes(BlockDriverState *bs, int size)
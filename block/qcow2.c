@@ -611,6 +611,9 @@ static int coroutine_fn qcow2_co_check_locked(BlockDriverState *bs,
 
     memset(result, 0, sizeof(*result));
 
+    /* Clusters reserved in the pool are not referenced by anything yet */
+    qcow2_cluster_pool_release(bs);
+
     ret = qcow2_check_read_snapshot_table(bs, &snapshot_res, fix);
     if (ret < 0) {
         qcow2_add_check_result(result, &snapshot_res, false);
@@ -697,6 +700,7 @@ static const char *const mutable_opts[] = {
     QCOW2_OPT_L2_CACHE_ENTRY_SIZE,
     QCOW2_OPT_REFCOUNT_CACHE_SIZE,
     QCOW2_OPT_CACHE_CLEAN_INTERVAL,
+    QCOW2_OPT_CLUSTER_POOL_SIZE,
     NULL
 };
 
@@ -808,6 +812,12 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_NUMBER,
             .help = "Clean unused cache entries after this time (in seconds)",
         },
+        {
+            .name = QCOW2_OPT_CLUSTER_POOL_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Size of the run of host clusters reserved ahead of "
+                    "allocating writes (0 disables the pool)",
+        },
         BLOCK_CRYPTO_OPT_DEF_KEY_SECRET("encrypt.",
             "ID of secret providing qcow2 AES key or LUKS passphrase"),
         { /* end of list */ }
@@ -966,6 +976,7 @@ typedef struct Qcow2ReopenState {
     int overlap_check;
     bool discard_passthrough[QCOW2_DISCARD_MAX];
     uint64_t cache_clean_interval;
+    uint64_t cluster_pool_size;
     QCryptoBlockOpenOptions *crypto_opts; /* Disk encryption runtime options */
 } Qcow2ReopenState;
 
@@ -1023,6 +1034,9 @@ static int qcow2_update_options_prepare(BlockDriverState *bs,
         goto fail;
     }
 
+    /* Return reserved clusters before the caches are flushed and replaced */
+    qcow2_cluster_pool_release(bs);
+
     /* alloc new L2 table/refcount block cache, flush old one */
     if (s->l2_table_cache) {
         ret = qcow2_cache_flush(bs, s->l2_table_cache);
@@ -1070,6 +1084,16 @@ static int qcow2_update_options_prepare(BlockDriverState *bs,
         goto fail;
     }
 
+    /* Cluster pool size, converted to clusters */
+    r->cluster_pool_size =
+        qemu_opt_get_size(opts, QCOW2_OPT_CLUSTER_POOL_SIZE, 0);
+    if (r->cluster_pool_size > QCOW2_MAX_CLUSTER_POOL_SIZE) {
+        error_setg(errp, "Cluster pool size too big");
+        ret = -EINVAL;
+        goto fail;
+    }
+    r->cluster_pool_size = DIV_ROUND_UP(r->cluster_pool_size, s->cluster_size);
+
     /* lazy-refcounts; flush if going from enabled to disabled */
     r->use_lazy_refcounts = qemu_opt_get_bool(opts, QCOW2_OPT_LAZY_REFCOUNTS,
         (s->compatible_features & QCOW2_COMPAT_LAZY_REFCOUNTS));
@@ -1220,6 +1244,8 @@ static void qcow2_update_options_commit(BlockDriverState *bs,
         cache_clean_timer_init(bs, bdrv_get_aio_context(bs));
     }
 
+    s->cluster_pool_size = r->cluster_pool_size;
+
     qapi_free_QCryptoBlockOpenOptions(s->crypto_opts);
     s->crypto_opts = r->crypto_opts;
 }
@@ -1831,6 +1857,14 @@ static int coroutine_fn qcow2_do_open(BlockDriverState *bs, QDict *options,
 #endif
 
     qemu_co_queue_init(&s->thread_task_queue);
+    qemu_co_queue_init(&s->compress_seq_queue);
+
+    /*
+     * Compression is CPU bound, so let it use all host CPUs.  Encryption
+     * is limited by the number of ciphers set up in qcrypto_block_open().
+     */
+    s->max_threads = s->crypto ? QCOW2_MAX_THREADS :
+                     MAX(QCOW2_MAX_THREADS, g_get_num_processors());
 
     return ret;
 
@@ -2298,12 +2332,16 @@ static coroutine_fn int qcow2_co_preadv_part(BlockDriverState *bs,
                             QCOW_MAX_CRYPT_CLUSTERS * s->cluster_size);
         }
 
-        qemu_co_mutex_lock(&s->lock);
-        ret = qcow2_get_host_offset(bs, offset, &cur_bytes,
-                                    &host_offset, &type);
-        qemu_co_mutex_unlock(&s->lock);
-        if (ret < 0) {
-            goto out;
+        if (qcow2_try_get_host_offset(bs, offset, &cur_bytes, &host_offset)) {
+            type = QCOW2_SUBCLUSTER_NORMAL;
+        } else {
+            qemu_co_mutex_lock(&s->lock);
+            ret = qcow2_get_host_offset(bs, offset, &cur_bytes,
+                                        &host_offset, &type);
+            qemu_co_mutex_unlock(&s->lock);
+            if (ret < 0) {
+                goto out;
+            }
         }
 
         if (type == QCOW2_SUBCLUSTER_ZERO_PLAIN ||
@@ -2652,6 +2690,8 @@ static int qcow2_inactivate(BlockDriverState *bs)
     int ret, result = 0;
     Error *local_err = NULL;
 
+    qcow2_cluster_pool_release(bs);
+
     qcow2_store_persistent_dirty_bitmaps(bs, true, &local_err);
     if (local_err != NULL) {
         result = -EINVAL;
@@ -3975,6 +4015,68 @@ static coroutine_fn int qcow2_co_pdiscard(BlockDriverState *bs,
     return ret;
 }
 
+static int coroutine_fn qcow2_co_defragment(BlockDriverState *bs,
+                                            int64_t offset, int64_t bytes,
+                                            int64_t *moved)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int64_t end = offset + bytes;
+    int ret;
+
+    /* Data clusters in an external data file map 1:1 to guest offsets */
+    if (has_data_file(bs) || bs->encrypted) {
+        return -ENOTSUP;
+    }
+
+    /* The generic layer serialises the whole clusters around the request */
+    offset = QEMU_ALIGN_DOWN(offset, s->cluster_size);
+
+    qemu_co_mutex_lock(&s->lock);
+    ret = qcow2_cluster_defragment(bs, offset, end - offset, moved);
+    qemu_co_mutex_unlock(&s->lock);
+    return ret;
+}
+
+static int coroutine_fn qcow2_co_compact(BlockDriverState *bs, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int64_t last_cluster, old_file_size;
+    int ret;
+
+    qemu_co_mutex_lock(&s->lock);
+
+    qcow2_cluster_pool_release(bs);
+
+    ret = qcow2_shrink_reftable(bs);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to discard unused refblocks");
+        goto out;
+    }
+
+    old_file_size = bdrv_getlength(bs->file->bs);
+    if (old_file_size < 0) {
+        error_setg_errno(errp, -old_file_size,
+                         "Failed to inquire current file length");
+        ret = old_file_size;
+        goto out;
+    }
+    last_cluster = qcow2_get_last_cluster(bs, old_file_size);
+    if (last_cluster < 0) {
+        error_setg_errno(errp, -last_cluster,
+                         "Failed to find the last cluster");
+        ret = last_cluster;
+        goto out;
+    }
+    if ((last_cluster + 1) * s->cluster_size < old_file_size) {
+        ret = bdrv_co_truncate(bs->file, (last_cluster + 1) * s->cluster_size,
+                               false, PREALLOC_MODE_OFF, 0, errp);
+    }
+
+out:
+    qemu_co_mutex_unlock(&s->lock);
+    return ret;
+}
+
 static int coroutine_fn
 qcow2_co_copy_range_from(BlockDriverState *bs,
                          BdrvChild *src, uint64_t src_offset,
@@ -4152,6 +4254,8 @@ static int coroutine_fn qcow2_co_truncate(BlockDriverState *bs, int64_t offset,
 
     qemu_co_mutex_lock(&s->lock);
 
+    qcow2_cluster_pool_release(bs);
+
     /*
      * Even though we store snapshot size for all images, it was not
      * required until v3, so it is not safe to proceed for v2.
@@ -4490,6 +4594,13 @@ fail:
     return ret;
 }
 
+/* Called with s->lock held once a task is done allocating */
+static void qcow2_compress_seq_next(BDRVQcow2State *s)
+{
+    s->compress_seq_done++;
+    qemu_co_queue_restart_all(&s->compress_seq_queue);
+}
+
 static coroutine_fn int
 qcow2_co_pwritev_compressed_task(BlockDriverState *bs,
                                  uint64_t offset, uint64_t bytes,
@@ -4500,6 +4611,8 @@ qcow2_co_pwritev_compressed_task(BlockDriverState *bs,
     ssize_t out_len;
     uint8_t *buf, *out_buf;
     uint64_t cluster_offset;
+    /* Must be taken before the first yield, see compress_seq_queue */
+    uint64_t seq = s->compress_seq_next++;
 
     assert(bytes == s->cluster_size || (bytes < s->cluster_size &&
            (offset + bytes == bs->total_sectors << BDRV_SECTOR_BITS)));
@@ -4515,21 +4628,31 @@ qcow2_co_pwritev_compressed_task(BlockDriverState *bs,
 
     out_len = qcow2_co_compress(bs, out_buf, s->cluster_size - 1,
                                 buf, s->cluster_size);
+
+    qemu_co_mutex_lock(&s->lock);
+    while (s->compress_seq_done != seq) {
+        qemu_co_queue_wait(&s->compress_seq_queue, &s->lock);
+    }
+
     if (out_len == -ENOMEM) {
         /* could not compress: write normal cluster */
+        qcow2_compress_seq_next(s);
+        qemu_co_mutex_unlock(&s->lock);
         ret = qcow2_co_pwritev_part(bs, offset, bytes, qiov, qiov_offset, 0);
         if (ret < 0) {
             goto fail;
         }
         goto success;
     } else if (out_len < 0) {
+        qcow2_compress_seq_next(s);
+        qemu_co_mutex_unlock(&s->lock);
         ret = -EINVAL;
         goto fail;
     }
 
-    qemu_co_mutex_lock(&s->lock);
     ret = qcow2_alloc_compressed_cluster_offset(bs, offset, out_len,
                                                 &cluster_offset);
+    qcow2_compress_seq_next(s);
     if (ret < 0) {
         qemu_co_mutex_unlock(&s->lock);
         goto fail;
@@ -4835,6 +4958,8 @@ static int qcow2_make_empty(BlockDriverState *bs)
     int step = QEMU_ALIGN_DOWN(INT_MAX, s->cluster_size);
     int l1_clusters, ret = 0;
 
+    qcow2_cluster_pool_release(bs);
+
     l1_clusters = DIV_ROUND_UP(s->l1_size, s->cluster_size / L1E_SIZE);
 
     if (s->qcow_version >= 3 && !s->snapshots && !s->nb_bitmaps &&
@@ -5432,6 +5557,8 @@ static int qcow2_amend_options(BlockDriverState *bs, QemuOpts *opts,
     Qcow2AmendHelperCBInfo helper_cb_info;
     bool encryption_update = false;
 
+    qcow2_cluster_pool_release(bs);
+
     while (desc && desc->name) {
         if (!qemu_opt_find(opts, desc->name)) {
             /* only change explicitly defined options */
@@ -5899,6 +6026,8 @@ BlockDriver bdrv_qcow2 = {
 
     .bdrv_co_pwrite_zeroes  = qcow2_co_pwrite_zeroes,
     .bdrv_co_pdiscard       = qcow2_co_pdiscard,
+    .bdrv_co_defragment     = qcow2_co_defragment,
+    .bdrv_co_compact        = qcow2_co_compact,
     .bdrv_co_copy_range_from = qcow2_co_copy_range_from,
     .bdrv_co_copy_range_to  = qcow2_co_copy_range_to,
     .bdrv_co_truncate       = qcow2_co_truncate,
@@ -127,6 +127,9 @@
 #define DEFAULT_CACHE_CLEAN_INTERVAL 0
 #endif
 
+/* Upper bound for the cluster-pool-size runtime option */
+#define QCOW2_MAX_CLUSTER_POOL_SIZE (1 * GiB)
+
 #define DEFAULT_CLUSTER_SIZE 65536
 
 #define QCOW2_OPT_DATA_FILE "data-file"
@@ -150,6 +153,7 @@
 #define QCOW2_OPT_L2_CACHE_ENTRY_SIZE "l2-cache-entry-size"
 #define QCOW2_OPT_REFCOUNT_CACHE_SIZE "refcount-cache-size"
 #define QCOW2_OPT_CACHE_CLEAN_INTERVAL "cache-clean-interval"
+#define QCOW2_OPT_CLUSTER_POOL_SIZE "cluster-pool-size"
 
 typedef struct QCowHeader {
     uint32_t magic;
@@ -357,6 +361,17 @@ typedef struct BDRVQcow2State {
     uint64_t free_cluster_index;
     uint64_t free_byte_offset;
 
+    /*
+     * Run of host clusters that are already accounted for in the refcounts
+     * but not referenced by any L2 entry yet.  Data cluster allocations are
+     * served from here so that refcount updates happen once per run rather
+     * than once per allocating write.  Empty if cluster_pool_size is 0.
+     */
+    uint64_t cluster_pool_size; /* in clusters */
+    uint64_t cluster_pool_offset;
+    uint64_t cluster_pool_nb_clusters;
+    bool cluster_pool_refill_pending;
+
     CoMutex lock;
 
     Qcow2CryptoHeaderExtension crypto_header; /* QCow2 header extension */
@@ -408,6 +423,18 @@ typedef struct BDRVQcow2State {
 
     CoQueue thread_task_queue;
     int nb_threads;
+    int max_threads;
+
+    /*
+     * Compressed clusters are allocated in the order in which the write
+     * tasks were started, even though compression itself runs in parallel
+     * in the thread pool.  A task takes a ticket from compress_seq_next
+     * when it starts and waits for compress_seq_done to reach it before
+     * allocating.
+     */
+    uint64_t compress_seq_next;
+    uint64_t compress_seq_done;
+    CoQueue compress_seq_queue;
 
     BdrvChild *data_file;
 
@@ -861,8 +888,12 @@ int64_t qcow2_refcount_area(BlockDriverState *bs, uint64_t offset,
                             uint64_t new_refblock_offset);
 
 int64_t qcow2_alloc_clusters(BlockDriverState *bs, uint64_t size);
+int qcow2_cluster_pool_alloc(BlockDriverState *bs, uint64_t *host_offset,
+                             uint64_t *nb_clusters);
+void qcow2_cluster_pool_release(BlockDriverState *bs);
 int64_t qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offset,
                                 int64_t nb_clusters);
+int64_t qcow2_alloc_cluster_below(BlockDriverState *bs, uint64_t limit);
 int64_t qcow2_alloc_bytes(BlockDriverState *bs, int size);
 void qcow2_free_clusters(BlockDriverState *bs,
                           int64_t offset, int64_t size,
@@ -907,6 +938,8 @@ int qcow2_encrypt_sectors(BDRVQcow2State *s, int64_t sector_num,
 int qcow2_get_host_offset(BlockDriverState *bs, uint64_t offset,
                           unsigned int *bytes, uint64_t *host_offset,
                           QCow2SubclusterType *subcluster_type);
+bool qcow2_try_get_host_offset(BlockDriverState *bs, uint64_t offset,
+                               unsigned int *bytes, uint64_t *host_offset);
 int qcow2_alloc_host_offset(BlockDriverState *bs, uint64_t offset,
                             unsigned int *bytes, uint64_t *host_offset,
                             QCowL2Meta **m);
@@ -922,6 +955,9 @@ int qcow2_cluster_discard(BlockDriverState *bs, uint64_t offset,
                           bool full_discard);
 int qcow2_subcluster_zeroize(BlockDriverState *bs, uint64_t offset,
                              uint64_t bytes, int flags);
+int coroutine_fn qcow2_cluster_defragment(BlockDriverState *bs,
+                                          uint64_t offset, uint64_t bytes,
+                                          int64_t *moved);
 
 int qcow2_expand_zero_clusters(BlockDriverState *bs,
                                BlockDriverAmendStatusCB *status_cb,
@@ -972,6 +1008,8 @@ int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     void **table);
 void qcow2_cache_put(Qcow2Cache *c, void **table);
 void *qcow2_cache_is_table_offset(Qcow2Cache *c, uint64_t offset);
+bool qcow2_cache_peek(Qcow2Cache *c, uint64_t offset, size_t pos,
+                      void *buf, size_t len);
 void qcow2_cache_discard(Qcow2Cache *c, void *table);
 
 /* qcow2-bitmap.c functions */
@@ -0,0 +1,1326 @@
+/*
+ * Persistent read cache filter
+ *
+ * Images on network storage are often read much more than they are written,
+ * e.g. the base images of a chain.  This filter keeps the clusters that are
+ * read through it in a cache file, which is meant to be on fast local
+ * storage, and serves later reads of the same clusters from there.
+ *
+ * The cache file consists of a header, an index and the data area.  The data
+ * area has a fixed number of slots of one cluster each.  The index stores,
+ * for each slot, the image cluster that the slot holds plus one, or zero for
+ * an empty slot.  It is kept in memory and written back on flush.  Slots are
+ * replaced with the CLOCK algorithm, so clusters that are read repeatedly
+ * stay in the cache.
+ *
+ * The cache is write-through: writes always go to the child before they
+ * complete.  Cached clusters that a write covers completely are updated in
+ * the cache file, partially written clusters are dropped.
+ *
+ * The header is marked dirty before the on-disk index can stop describing
+ * the data area, i.e. before a slot with a cached cluster is overwritten and
+ * before the child is modified.  It is marked clean again when the index has
+ * been written back.  On open, the cache is discarded if the header is dirty
+ * or doesn't match the child, or if the index is inconsistent.
+ *
+ * To notice changes to the child that don't go through the filter, the header
+ * also records the modification and change times of the local file that
+ * stores the child, as they were when the header was marked clean.  Other
+ * changes, e.g. to backing files or to images on network storage, can't be
+ * detected, so a cache file must not be reused after such an image was
+ * modified elsewhere.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "block/block_int.h"
+#include "qapi/error.h"
+#include "qapi/qmp/qdict.h"
+#include "qemu/bitmap.h"
+#include "qemu/bswap.h"
+#include "qemu/crc32c.h"
+#include "qemu/cutils.h"
+#include "qemu/module.h"
+#include "qemu/option.h"
+#include "qemu/units.h"
+#include "trace.h"
+
+#define READ_CACHE_OPT_CACHE_SIZE       "cache-size"
+#define READ_CACHE_OPT_CLUSTER_SIZE     "cluster-size"
+
+#define READ_CACHE_DEFAULT_CACHE_SIZE       (1 * GiB)
+#define READ_CACHE_DEFAULT_CLUSTER_SIZE     (64 * KiB)
+#define READ_CACHE_MIN_CLUSTER_SIZE         (4 * KiB)
+#define READ_CACHE_MAX_CLUSTER_SIZE         (2 * MiB)
+
+#define READ_CACHE_MAGIC        (('Q' << 24) | ('R' << 16) | ('C' << 8) | 0xfb)
+#define READ_CACHE_VERSION      2
+
+/* The index may not describe the data area */
+#define READ_CACHE_FLAG_DIRTY   (1 << 0)
+
+/* The header and the image key fit in front of the index */
+#define READ_CACHE_INDEX_OFFSET \
+    ROUND_UP(sizeof(ReadCacheHeader) + PATH_MAX, READ_CACHE_PAGE_SIZE)
+
+/* The index is written back in pages of this size */
+#define READ_CACHE_PAGE_SIZE        4096
+#define READ_CACHE_PAGE_ENTRIES     (READ_CACHE_PAGE_SIZE / sizeof(uint64_t))
+
+/* All fields are big endian */
+typedef struct QEMU_PACKED ReadCacheHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t flags;
+    uint32_t cluster_bits;
+    uint64_t nb_slots;
+    uint64_t index_offset;
+    uint64_t data_offset;
+    uint64_t image_size;
+    uint64_t image_mtime;       /* in ns, 0 if the child isn't a local file */
+    uint64_t image_ctime;       /* in ns, 0 if the child isn't a local file */
+    uint32_t key_len;           /* length of the key following the header */
+    uint32_t crc;               /* crc32c of header and key with crc = 0 */
+} ReadCacheHeader;
+
+typedef enum ReadCacheSlotState {
+    READ_CACHE_SLOT_EMPTY,
+    READ_CACHE_SLOT_FILLING,    /* data is being written to the slot */
+    READ_CACHE_SLOT_VALID,
+} ReadCacheSlotState;
+
+typedef struct ReadCacheSlot {
+    uint64_t cluster;           /* key in BDRVReadCacheState.clusters */
+    uint32_t readers;
+    uint8_t state;
+    bool referenced;            /* CLOCK reference bit */
+
+    /*
+     * The cluster was invalidated while the slot was busy.  The slot is not
+     * in BDRVReadCacheState.clusters and becomes empty when it is idle.
+     */
+    bool stale;
+} ReadCacheSlot;
+
+typedef struct BDRVReadCacheState {
+    BdrvChild *cache_file;
+    uint64_t cache_size;
+    uint64_t cluster_size;
+    int cluster_bits;
+    char *key;                  /* identifies the child in the header */
+
+    uint64_t nb_slots;
+    uint64_t nb_index_pages;
+    uint64_t data_offset;
+
+    /* All of the following is NULL while the node is inactive */
+    ReadCacheSlot *slots;
+    uint64_t *index;            /* in on-disk format */
+    unsigned long *dirty_pages; /* index pages that need to be written */
+    GHashTable *clusters;       /* cluster -> non-stale, non-empty slot */
+    uint64_t clock_hand;
+    uint64_t nb_valid;
+
+    /* Serializes header and index writes */
+    CoMutex lock;
+    bool header_dirty;
+
+    /* Requests that change the cache file or the child */
+    unsigned unsafe_in_flight;
+
+    struct {
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t restored;
+        uint64_t evictions;
+        uint64_t io_errors;
+    } stats;
+} BDRVReadCacheState;
+
+typedef struct ReadCacheFill {
+    BlockDriverState *bs;
+    ReadCacheSlot *slot;
+    void *buf;
+    bool evicted;
+} ReadCacheFill;
+
+static uint64_t read_cache_slot_offset(BDRVReadCacheState *s,
+                                       ReadCacheSlot *slot)
+{
+    return s->data_offset + (slot - s->slots) * s->cluster_size;
+}
+
+static void read_cache_set_index(BDRVReadCacheState *s, ReadCacheSlot *slot,
+                                 uint64_t value)
+{
+    uint64_t i = slot - s->slots;
+    uint64_t entry = cpu_to_be64(value);
+
+    if (s->index[i] != entry) {
+        s->index[i] = entry;
+        set_bit(i / READ_CACHE_PAGE_ENTRIES, s->dirty_pages);
+    }
+}
+
+/* Returns the slot that holds or is being filled with @cluster */
+static ReadCacheSlot *read_cache_lookup(BDRVReadCacheState *s,
+                                        uint64_t cluster)
+{
+    return g_hash_table_lookup(s->clusters, &cluster);
+}
+
+/* Drop the cluster in @slot, which must be in s->clusters */
+static void read_cache_slot_invalidate(BDRVReadCacheState *s,
+                                       ReadCacheSlot *slot)
+{
+    g_hash_table_remove(s->clusters, &slot->cluster);
+    read_cache_set_index(s, slot, 0);
+
+    if (slot->state == READ_CACHE_SLOT_VALID) {
+        s->nb_valid--;
+    }
+    if (slot->readers || slot->state == READ_CACHE_SLOT_FILLING) {
+        slot->stale = true;
+    } else {
+        slot->state = READ_CACHE_SLOT_EMPTY;
+    }
+}
+
+static void read_cache_slot_put(BDRVReadCacheState *s, ReadCacheSlot *slot)
+{
+    if (--slot->readers == 0 && slot->stale) {
+        slot->stale = false;
+        slot->state = READ_CACHE_SLOT_EMPTY;
+    }
+}
+
+static void read_cache_invalidate(BlockDriverState *bs, uint64_t offset,
+                                  uint64_t bytes)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    uint64_t first, last, cluster;
+    ReadCacheSlot *slot;
+
+    if (!s->slots || !bytes) {
+        return;
+    }
+
+    first = offset >> s->cluster_bits;
+    last = (offset + bytes - 1) >> s->cluster_bits;
+
+    if (last - first >= g_hash_table_size(s->clusters)) {
+        GHashTableIter iter;
+        GSList *slots = NULL, *l;
+
+        g_hash_table_iter_init(&iter, s->clusters);
+        while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&slot)) {
+            if (slot->cluster >= first && slot->cluster <= last) {
+                slots = g_slist_prepend(slots, slot);
+            }
+        }
+        for (l = slots; l; l = l->next) {
+            read_cache_slot_invalidate(s, l->data);
+        }
+        g_slist_free(slots);
+    } else {
+        for (cluster = first; cluster <= last; cluster++) {
+            slot = read_cache_lookup(s, cluster);
+            if (slot) {
+                read_cache_slot_invalidate(s, slot);
+            }
+        }
+    }
+}
+
+static void read_cache_invalidate_all(BlockDriverState *bs)
+{
+    read_cache_invalidate(bs, 0, INT64_MAX);
+}
+
+/*
+ * Find a slot for a new cluster with CLOCK.  Sets *@evicted if a cached
+ * cluster was dropped for it.
+ */
+static ReadCacheSlot *read_cache_get_free_slot(BlockDriverState *bs,
+                                               bool *evicted)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    ReadCacheSlot *slot;
+    uint64_t i;
+
+    *evicted = false;
+
+    for (i = 0; i < 2 * s->nb_slots; i++) {
+        slot = &s->slots[s->clock_hand];
+        s->clock_hand = (s->clock_hand + 1) % s->nb_slots;
+
+        if (slot->state == READ_CACHE_SLOT_EMPTY) {
+            return slot;
+        }
+        if (slot->state != READ_CACHE_SLOT_VALID || slot->readers ||
+            slot->stale) {
+            continue;
+        }
+        if (slot->referenced) {
+            slot->referenced = false;
+            continue;
+        }
+
+        trace_read_cache_evict(bs, slot - s->slots, slot->cluster);
+        read_cache_slot_invalidate(s, slot);
+        s->stats.evictions++;
+        *evicted = true;
+        return slot;
+    }
+
+    return NULL;
+}
+
+static ReadCacheSlot *read_cache_reserve(BlockDriverState *bs,
+                                         uint64_t cluster, bool *evicted)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    ReadCacheSlot *slot = read_cache_get_free_slot(bs, evicted);
+
+    if (!slot) {
+        return NULL;
+    }
+
+    slot->cluster = cluster;
+    slot->state = READ_CACHE_SLOT_FILLING;
+    slot->referenced = false;
+    slot->stale = false;
+    g_hash_table_insert(s->clusters, &slot->cluster, slot);
+    return slot;
+}
+
+/* Called when data has been written to @slot, or if that failed */
+static void read_cache_fill_done(BDRVReadCacheState *s, ReadCacheSlot *slot,
+                                 bool success)
+{
+    assert(slot->state == READ_CACHE_SLOT_FILLING);
+
+    if (slot->stale || !success) {
+        if (!slot->stale) {
+            g_hash_table_remove(s->clusters, &slot->cluster);
+            read_cache_set_index(s, slot, 0);
+        }
+        slot->stale = false;
+        slot->state = READ_CACHE_SLOT_EMPTY;
+        return;
+    }
+
+    slot->state = READ_CACHE_SLOT_VALID;
+    s->nb_valid++;
+    read_cache_set_index(s, slot, slot->cluster + 1);
+}
+
+/*
+ * Get the modification and change times of the local file that stores the
+ * child, or zero if the child isn't stored in a local file
+ */
+static void read_cache_get_image_times(BlockDriverState *bs, uint64_t *mtime,
+                                       uint64_t *ctime)
+{
+    BlockDriverState *leaf = bs->file->bs;
+    struct stat st;
+
+    *mtime = 0;
+    *ctime = 0;
+
+    while (leaf && !leaf->drv->protocol_name) {
+        leaf = bdrv_primary_bs(leaf);
+    }
+    if (!leaf || strcmp(leaf->drv->format_name, "file") ||
+        stat(leaf->filename, &st) < 0)
+    {
+        return;
+    }
+
+#ifdef CONFIG_LINUX
+    *mtime = st.st_mtim.tv_sec * NANOSECONDS_PER_SECOND + st.st_mtim.tv_nsec;
+    *ctime = st.st_ctim.tv_sec * NANOSECONDS_PER_SECOND + st.st_ctim.tv_nsec;
+#else
+    *mtime = st.st_mtime * NANOSECONDS_PER_SECOND;
+    *ctime = st.st_ctime * NANOSECONDS_PER_SECOND;
+#endif
+}
+
+/*
+ * Write the header with @flags and flush it to the disk.  Works both in and
+ * outside of coroutines.
+ */
+static int read_cache_write_header(BlockDriverState *bs, uint32_t flags)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    size_t key_len = strlen(s->key);
+    size_t len = sizeof(ReadCacheHeader) + key_len;
+    g_autofree ReadCacheHeader *header = g_malloc0(len);
+    uint64_t image_mtime, image_ctime;
+    int64_t image_size;
+    int ret;
+
+    image_size = bdrv_getlength(bs->file->bs);
+    if (image_size < 0) {
+        return image_size;
+    }
+    read_cache_get_image_times(bs, &image_mtime, &image_ctime);
+
+    *header = (ReadCacheHeader) {
+        .magic          = cpu_to_be32(READ_CACHE_MAGIC),
+        .version        = cpu_to_be32(READ_CACHE_VERSION),
+        .flags          = cpu_to_be32(flags),
+        .cluster_bits   = cpu_to_be32(s->cluster_bits),
+        .nb_slots       = cpu_to_be64(s->nb_slots),
+        .index_offset   = cpu_to_be64(READ_CACHE_INDEX_OFFSET),
+        .data_offset    = cpu_to_be64(s->data_offset),
+        .image_size     = cpu_to_be64(image_size),
+        .image_mtime    = cpu_to_be64(image_mtime),
+        .image_ctime    = cpu_to_be64(image_ctime),
+        .key_len        = cpu_to_be32(key_len),
+    };
+    memcpy(header + 1, s->key, key_len);
+    header->crc = cpu_to_be32(crc32c(0xffffffff, (uint8_t *)header, len));
+
+    ret = bdrv_pwrite(s->cache_file, 0, header, len);
+    if (ret < 0) {
+        return ret;
+    }
+    return bdrv_flush(s->cache_file->bs);
+}
+
+/*
+ * Mark the start of a request after which the on-disk index may not match
+ * the data area or the child any more.  Must be paired with
+ * read_cache_end_unsafe(), also on failure.
+ */
+static int coroutine_fn read_cache_begin_unsafe(BlockDriverState *bs)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    int ret = 0;
+
+    s->unsafe_in_flight++;
+    if (s->header_dirty) {
+        return 0;
+    }
+
+    qemu_co_mutex_lock(&s->lock);
+    if (!s->header_dirty) {
+        ret = read_cache_write_header(bs, READ_CACHE_FLAG_DIRTY);
+        if (ret < 0) {
+            s->stats.io_errors++;
+        } else {
+            s->header_dirty = true;
+        }
+    }
+    qemu_co_mutex_unlock(&s->lock);
+
+    return ret;
+}
+
+static void read_cache_end_unsafe(BlockDriverState *bs)
+{
+    BDRVReadCacheState *s = bs->opaque;
+
+    assert(s->unsafe_in_flight > 0);
+    s->unsafe_in_flight--;
+}
+
+static int coroutine_fn read_cache_co_flush_to_os(BlockDriverState *bs)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    g_autofree uint64_t *pages = NULL;
+    g_autofree uint8_t *buf = NULL;
+    uint64_t nb_pages = 0, page, i;
+    int ret = 0;
+
+    if (!s->slots) {
+        return 0;
+    }
+
+    qemu_co_mutex_lock(&s->lock);
+
+    nb_pages = bitmap_count_one(s->dirty_pages, s->nb_index_pages);
+    if (!nb_pages && (!s->header_dirty || s->unsafe_in_flight)) {
+        goto out;
+    }
+
+    /*
+     * Copy the dirty pages before flushing the data area, so that only
+     * entries whose data has been written before are stored
+     */
+    pages = g_new(uint64_t, nb_pages);
+    buf = g_malloc(nb_pages * READ_CACHE_PAGE_SIZE);
+    i = 0;
+    for (page = find_first_bit(s->dirty_pages, s->nb_index_pages);
+         page < s->nb_index_pages;
+         page = find_next_bit(s->dirty_pages, s->nb_index_pages, page + 1))
+    {
+        pages[i] = page;
+        memcpy(buf + i * READ_CACHE_PAGE_SIZE,
+               s->index + page * READ_CACHE_PAGE_ENTRIES,
+               READ_CACHE_PAGE_SIZE);
+        clear_bit(page, s->dirty_pages);
+        i++;
+    }
+
+    if (nb_pages) {
+        ret = bdrv_co_flush(s->cache_file->bs);
+    }
+
+    for (i = 0; i < nb_pages; i++) {
+        if (ret == 0) {
+            ret = bdrv_co_pwrite(s->cache_file,
+                                 READ_CACHE_INDEX_OFFSET +
+                                 pages[i] * READ_CACHE_PAGE_SIZE,
+                                 READ_CACHE_PAGE_SIZE,
+                                 buf + i * READ_CACHE_PAGE_SIZE, 0);
+        }
+        if (ret < 0) {
+            set_bit(pages[i], s->dirty_pages);
+        }
+    }
+    if (ret < 0) {
+        goto out;
+    }
+
+    /*
+     * Requests that started while the pages were written make the index
+     * dirty again, and s->lock keeps new ones from starting until the header
+     * is written
+     */
+    if (s->header_dirty && !s->unsafe_in_flight &&
+        find_first_bit(s->dirty_pages, s->nb_index_pages) == s->nb_index_pages)
+    {
+        /*
+         * The child must be stable before its times are recorded, and its
+         * writes must not be lost while the cache already has their data
+         */
+        ret = bdrv_co_flush(bs->file->bs);
+        if (ret == 0) {
+            ret = bdrv_co_flush(s->cache_file->bs);
+        }
+        if (ret == 0) {
+            ret = read_cache_write_header(bs, 0);
+        }
+        if (ret == 0) {
+            s->header_dirty = false;
+        }
+    }
+
+out:
+    qemu_co_mutex_unlock(&s->lock);
+    if (ret < 0) {
+        s->stats.io_errors++;
+    }
+    return ret;
+}
+
+static void read_cache_free(BDRVReadCacheState *s)
+{
+    g_free(s->slots);
+    s->slots = NULL;
+    qemu_vfree(s->index);
+    s->index = NULL;
+    g_free(s->dirty_pages);
+    s->dirty_pages = NULL;
+    if (s->clusters) {
+        g_hash_table_destroy(s->clusters);
+        s->clusters = NULL;
+    }
+    s->nb_valid = 0;
+    s->clock_hand = 0;
+}
+
+static int read_cache_alloc(BlockDriverState *bs, Error **errp)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    size_t index_size = s->nb_index_pages * READ_CACHE_PAGE_SIZE;
+
+    s->slots = g_try_new0(ReadCacheSlot, s->nb_slots);
+    s->index = qemu_try_blockalign0(s->cache_file->bs, index_size);
+    if (!s->slots || !s->index) {
+        read_cache_free(s);
+        error_setg(errp, "Could not allocate the cache index");
+        return -ENOMEM;
+    }
+    s->dirty_pages = bitmap_new(s->nb_index_pages);
+    s->clusters = g_hash_table_new(g_int64_hash, g_int64_equal);
+    return 0;
+}
+
+/* Discard the content of the cache file and write an empty index */
+static int read_cache_format(BlockDriverState *bs, Error **errp)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    size_t index_size = s->nb_index_pages * READ_CACHE_PAGE_SIZE;
+    uint64_t i;
+    int ret;
+
+    for (i = 0; i < s->nb_slots; i++) {
+        s->slots[i] = (ReadCacheSlot) { .state = READ_CACHE_SLOT_EMPTY };
+    }
+    g_hash_table_remove_all(s->clusters);
+    memset(s->index, 0, index_size);
+    bitmap_zero(s->dirty_pages, s->nb_index_pages);
+    s->nb_valid = 0;
+
+    /*
+     * Zero entries never refer to stale data, so the index can be cleared
+     * before the header is updated
+     */
+    ret = bdrv_pwrite(s->cache_file, READ_CACHE_INDEX_OFFSET, s->index,
+                      index_size);
+    if (ret >= 0) {
+        ret = bdrv_flush(s->cache_file->bs);
+    }
+    if (ret >= 0) {
+        ret = read_cache_write_header(bs, 0);
+    }
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not initialize the cache file");
+        return ret;
+    }
+
+    s->header_dirty = false;
+    return 0;
+}
+
+/*
+ * Check the header in @buf.  Returns the reason why it can't be
+ * used, or NULL if it matches the node.
+ */
+static const char *read_cache_check_header(BlockDriverState *bs, uint8_t *buf,
+                                           int64_t image_size)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    ReadCacheHeader *header = (ReadCacheHeader *)buf;
+    size_t key_len = be32_to_cpu(header->key_len);
+    uint32_t crc = be32_to_cpu(header->crc);
+    uint64_t image_mtime, image_ctime;
+
+    if (key_len >= PATH_MAX) {
+        return "invalid key length";
+    }
+    header->crc = 0;
+    if (crc != crc32c(0xffffffff, buf, sizeof(*header) + key_len)) {
+        return "header checksum mismatch";
+    }
+    if (be32_to_cpu(header->flags) & READ_CACHE_FLAG_DIRTY) {
+        return "not closed cleanly";
+    }
+    if (be32_to_cpu(header->cluster_bits) != s->cluster_bits ||
+        be64_to_cpu(header->nb_slots) != s->nb_slots ||
+        be64_to_cpu(header->index_offset) != READ_CACHE_INDEX_OFFSET ||
+        be64_to_cpu(header->data_offset) != s->data_offset)
+    {
+        return "geometry changed";
+    }
+    if (key_len != strlen(s->key) ||
+        memcmp(header + 1, s->key, key_len))
+    {
+        return "image changed";
+    }
+    if (be64_to_cpu(header->image_size) != image_size) {
+        return "image size changed";
+    }
+    read_cache_get_image_times(bs, &image_mtime, &image_ctime);
+    if (be64_to_cpu(header->image_mtime) != image_mtime ||
+        be64_to_cpu(header->image_ctime) != image_ctime)
+    {
+        return "image modified";
+    }
+    return NULL;
+}
+
+/* Build the in-memory state from the on-disk index */
+static const char *read_cache_load_index(BlockDriverState *bs,
+                                         int64_t image_size)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    uint64_t nb_clusters = DIV_ROUND_UP(image_size, s->cluster_size);
+    ReadCacheSlot *slot;
+    uint64_t i, entry;
+
+    for (i = 0; i < s->nb_slots; i++) {
+        entry = be64_to_cpu(s->index[i]);
+        if (!entry) {
+            continue;
+        }
+        if (entry > nb_clusters || read_cache_lookup(s, entry - 1)) {
+            return "invalid index entry";
+        }
+
+        slot = &s->slots[i];
+        slot->cluster = entry - 1;
+        slot->state = READ_CACHE_SLOT_VALID;
+        g_hash_table_insert(s->clusters, &slot->cluster, slot);
+        s->nb_valid++;
+    }
+    return NULL;
+}
+
+/*
+ * Set up the cache from the cache file, or start with an empty cache if
+ * @reset is true or the cache file can't be used
+ */
+static int read_cache_load(BlockDriverState *bs, bool reset, Error **errp)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    size_t header_len = sizeof(ReadCacheHeader) + PATH_MAX;
+    g_autofree uint8_t *buf = NULL;
+    const char *reason = "reset";
+    ReadCacheHeader *header;
+    int64_t len, image_size;
+    int ret;
+
+    ret = read_cache_alloc(bs, errp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (reset) {
+        goto format;
+    }
+
+    len = bdrv_getlength(s->cache_file->bs);
+    image_size = bdrv_getlength(bs->file->bs);
+    if (len < 0 || image_size < 0) {
+        ret = len < 0 ? len : image_size;
+        error_setg_errno(errp, -ret, "Could not get the image size");
+        goto fail;
+    }
+    if (len == 0) {
+        reason = "new cache file";
+        goto format;
+    }
+
+    buf = g_malloc0(header_len);
+    ret = bdrv_pread(s->cache_file, 0, buf, header_len);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read the cache file header");
+        goto fail;
+    }
+
+    /* Refuse to overwrite files that aren't cache files */
+    header = (ReadCacheHeader *)buf;
+    if (be32_to_cpu(header->magic) != READ_CACHE_MAGIC) {
+        error_setg(errp, "The cache file is not empty and not a read-cache "
+                   "file");
+        ret = -EINVAL;
+        goto fail;
+    }
+    if (be32_to_cpu(header->version) != READ_CACHE_VERSION) {
+        error_setg(errp, "Unsupported read-cache file version %" PRIu32,
+                   be32_to_cpu(header->version));
+        ret = -ENOTSUP;
+        goto fail;
+    }
+
+    reason = read_cache_check_header(bs, buf, image_size);
+    if (reason) {
+        goto format;
+    }
+
+    ret = bdrv_pread(s->cache_file, READ_CACHE_INDEX_OFFSET, s->index,
+                     s->nb_index_pages * READ_CACHE_PAGE_SIZE);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read the cache index");
+        goto fail;
+    }
+
+    reason = read_cache_load_index(bs, image_size);
+    if (reason) {
+        goto format;
+    }
+
+    s->stats.restored = s->nb_valid;
+    trace_read_cache_load(bs, s->nb_valid);
+    return 0;
+
+format:
+    trace_read_cache_reset(bs, reason);
+    ret = read_cache_format(bs, errp);
+    if (ret < 0) {
+        goto fail;
+    }
+    return 0;
+
+fail:
+    read_cache_free(s);
+    return ret;
+}
+
+static QemuOptsList read_cache_runtime_opts = {
+    .name = "read-cache",
+    .head = QTAILQ_HEAD_INITIALIZER(read_cache_runtime_opts.head),
+    .desc = {
+        {
+            .name = READ_CACHE_OPT_CACHE_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "capacity of the cache file, default 1G",
+        },
+        {
+            .name = READ_CACHE_OPT_CLUSTER_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "cache granularity, default 64k",
+        },
+        { /* end of list */ }
+    },
+};
+
+static bool read_cache_has_child_options(QDict *options)
+{
+    const QDictEntry *e;
+
+    for (e = qdict_first(options); e; e = qdict_next(options, e)) {
+        if (strstart(qdict_entry_key(e), "cache-file.", NULL)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static int read_cache_open(BlockDriverState *bs, QDict *options, int flags,
+                           Error **errp)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    QemuOpts *opts;
+    int ret;
+
+    opts = qemu_opts_create(&read_cache_runtime_opts, NULL, 0, &error_abort);
+    if (!qemu_opts_absorb_qdict(opts, options, errp)) {
+        qemu_opts_del(opts);
+        return -EINVAL;
+    }
+    s->cache_size = qemu_opt_get_size(opts, READ_CACHE_OPT_CACHE_SIZE,
+                                      READ_CACHE_DEFAULT_CACHE_SIZE);
+    s->cluster_size = qemu_opt_get_size(opts, READ_CACHE_OPT_CLUSTER_SIZE,
+                                        READ_CACHE_DEFAULT_CLUSTER_SIZE);
+    qemu_opts_del(opts);
+
+    if (!is_power_of_2(s->cluster_size) ||
+        s->cluster_size < READ_CACHE_MIN_CLUSTER_SIZE ||
+        s->cluster_size > READ_CACHE_MAX_CLUSTER_SIZE) {
+        error_setg(errp, "cluster-size must be a power of two between %d "
+                   "and %d", READ_CACHE_MIN_CLUSTER_SIZE,
+                   READ_CACHE_MAX_CLUSTER_SIZE);
+        return -EINVAL;
+    }
+    if (s->cache_size < s->cluster_size) {
+        error_setg(errp, "cache-size must be at least cluster-size");
+        return -EINVAL;
+    }
+
+    s->cluster_bits = ctz64(s->cluster_size);
+    s->nb_slots = s->cache_size >> s->cluster_bits;
+    s->nb_index_pages = DIV_ROUND_UP(s->nb_slots, READ_CACHE_PAGE_ENTRIES);
+    s->data_offset = ROUND_UP(READ_CACHE_INDEX_OFFSET +
+                              s->nb_index_pages * READ_CACHE_PAGE_SIZE,
+                              s->cluster_size);
+
+    bs->file = bdrv_open_child(NULL, options, "file", bs, &child_of_bds,
+                               BDRV_CHILD_FILTERED | BDRV_CHILD_PRIMARY,
+                               false, errp);
+    if (!bs->file) {
+        return -EINVAL;
+    }
+
+    /* The cache file is written even if the node is read-only */
+    if (read_cache_has_child_options(options)) {
+        qdict_set_default_str(options, "cache-file." BDRV_OPT_READ_ONLY,
+                              "off");
+    }
+    s->cache_file = bdrv_open_child(NULL, options, "cache-file", bs,
+                                    &child_of_bds, BDRV_CHILD_METADATA,
+                                    false, errp);
+    if (!s->cache_file) {
+        return -EINVAL;
+    }
+    if (bdrv_is_read_only(s->cache_file->bs)) {
+        error_setg(errp, "The cache file must be writable");
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    bs->supported_write_flags = BDRV_REQ_WRITE_UNCHANGED |
+        (BDRV_REQ_FUA & bs->file->bs->supported_write_flags);
+
+    bs->supported_zero_flags = BDRV_REQ_WRITE_UNCHANGED |
+        ((BDRV_REQ_FUA | BDRV_REQ_MAY_UNMAP | BDRV_REQ_NO_FALLBACK) &
+            bs->file->bs->supported_zero_flags);
+
+    /* The key also covers options that change the content of the child */
+    bdrv_refresh_filename(bs->file->bs);
+    s->key = g_strdup_printf("%s:%s", bs->file->bs->drv->format_name,
+                             bs->file->bs->filename);
+    if (strlen(s->key) >= PATH_MAX) {
+        s->key[PATH_MAX - 1] = '\0';
+    }
+
+    qemu_co_mutex_init(&s->lock);
+
+    /* An inactive image may still change, it is loaded on activation */
+    if (!(flags & BDRV_O_INACTIVE)) {
+        ret = read_cache_load(bs, false, errp);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
+    trace_read_cache_open(bs, s->key, s->nb_slots, s->cluster_size);
+    return 0;
+
+fail:
+    g_free(s->key);
+    bdrv_unref_child(bs, s->cache_file);
+    s->cache_file = NULL;
+    return ret;
+}
+
+static void read_cache_close(BlockDriverState *bs)
+{
+    BDRVReadCacheState *s = bs->opaque;
+
+    /* bdrv_close() has flushed the index */
+    read_cache_free(s);
+    g_free(s->key);
+}
+
+static int read_cache_inactivate(BlockDriverState *bs)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    int ret;
+
+    ret = bdrv_flush(bs);
+    read_cache_free(s);
+    return ret;
+}
+
+static void coroutine_fn read_cache_co_invalidate_cache(BlockDriverState *bs,
+                                                        Error **errp)
+{
+    BDRVReadCacheState *s = bs->opaque;
+
+    /*
+     * The image may have been written while the node was inactive, e.g. by
+     * the source of a migration, so nothing in the cache file can be trusted
+     */
+    if (!s->slots) {
+        read_cache_load(bs, true, errp);
+    }
+}
+
+#define PERM_PASSTHROUGH (BLK_PERM_CONSISTENT_READ \
+                          | BLK_PERM_WRITE \
+                          | BLK_PERM_RESIZE)
+#define PERM_UNCHANGED (BLK_PERM_ALL & ~PERM_PASSTHROUGH)
+
+static void read_cache_child_perm(BlockDriverState *bs, BdrvChild *c,
+                                  BdrvChildRole role,
+                                  BlockReopenQueue *reopen_queue,
+                                  uint64_t perm, uint64_t shared,
+                                  uint64_t *nperm, uint64_t *nshared)
+{
+    if (!(role & BDRV_CHILD_FILTERED)) {
+        /* The cache file */
+        if (bs->open_flags & BDRV_O_INACTIVE) {
+            *nperm = 0;
+            *nshared = BLK_PERM_ALL;
+        } else {
+            *nperm = BLK_PERM_CONSISTENT_READ | BLK_PERM_WRITE |
+                     BLK_PERM_RESIZE;
+            *nshared = BLK_PERM_CONSISTENT_READ | BLK_PERM_WRITE_UNCHANGED;
+        }
+        return;
+    }
+
+    *nperm = perm & PERM_PASSTHROUGH;
+    *nshared = (shared & PERM_PASSTHROUGH) | PERM_UNCHANGED;
+
+    /* Writes that bypass the filter would make the cache stale */
+    *nshared &= ~(BLK_PERM_WRITE | BLK_PERM_WRITE_UNCHANGED |
+                  BLK_PERM_RESIZE);
+}
+
+static int64_t read_cache_getlength(BlockDriverState *bs)
+{
+    return bdrv_getlength(bs->file->bs);
+}
+
+static void coroutine_fn read_cache_fill_entry(void *opaque)
+{
+    ReadCacheFill *fill = opaque;
+    BlockDriverState *bs = fill->bs;
+    BDRVReadCacheState *s = bs->opaque;
+    ReadCacheSlot *slot = fill->slot;
+    int ret = 0;
+
+    /* The on-disk index may still point to the old cluster in the slot */
+    if (fill->evicted) {
+        ret = read_cache_begin_unsafe(bs);
+    }
+    if (ret == 0 && !slot->stale) {
+        ret = bdrv_co_pwrite(s->cache_file, read_cache_slot_offset(s, slot),
+                             s->cluster_size, fill->buf, 0);
+        if (ret < 0) {
+            s->stats.io_errors++;
+        }
+    }
+    read_cache_fill_done(s, slot, ret == 0);
+    if (fill->evicted) {
+        read_cache_end_unsafe(bs);
+    }
+
+    qemu_vfree(fill->buf);
+    g_free(fill);
+    bdrv_dec_in_flight(bs);
+}
+
+/*
+ * Read @bytes at @offset_in_cluster of @cluster from the child and add the
+ * cluster to the cache.  The cache file is written in the background.
+ */
+static int coroutine_fn read_cache_co_miss(BlockDriverState *bs,
+                                           uint64_t cluster,
+                                           size_t offset_in_cluster,
+                                           size_t bytes, QEMUIOVector *qiov,
+                                           size_t qiov_offset)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    uint64_t offset = cluster << s->cluster_bits;
+    ReadCacheSlot *slot = NULL;
+    ReadCacheFill *fill;
+    bool evicted = false;
+    void *buf;
+    int ret;
+
+    s->stats.misses++;
+
+    /* Somebody else is already filling the slot for this cluster */
+    if (!read_cache_lookup(s, cluster)) {
+        slot = read_cache_reserve(bs, cluster, &evicted);
+    }
+    buf = slot ? qemu_try_blockalign(bs, s->cluster_size) : NULL;
+    if (!buf) {
+        if (slot) {
+            read_cache_fill_done(s, slot, false);
+        }
+        return bdrv_co_preadv_part(bs->file, offset + offset_in_cluster,
+                                   bytes, qiov, qiov_offset, 0);
+    }
+
+    /*
+     * Read the whole cluster.  Reads beyond the end of the child return
+     * zeroes, which are never passed on because guest requests end at the
+     * end of the node.
+     */
+    ret = bdrv_co_pread(bs->file, offset, s->cluster_size, buf, 0);
+    if (ret < 0) {
+        read_cache_fill_done(s, slot, false);
+        qemu_vfree(buf);
+        return ret;
+    }
+    qemu_iovec_from_buf(qiov, qiov_offset, buf + offset_in_cluster, bytes);
+
+    fill = g_new(ReadCacheFill, 1);
+    *fill = (ReadCacheFill) {
+        .bs         = bs,
+        .slot       = slot,
+        .buf        = buf,
+        .evicted    = evicted,
+    };
+    bdrv_inc_in_flight(bs);
+    aio_co_enter(bdrv_get_aio_context(bs),
+                 qemu_coroutine_create(read_cache_fill_entry, fill));
+    return 0;
+}
+
+static int coroutine_fn read_cache_co_preadv_part(BlockDriverState *bs,
+                                                  uint64_t offset,
+                                                  uint64_t bytes,
+                                                  QEMUIOVector *qiov,
+                                                  size_t qiov_offset,
+                                                  int flags)
+{
+    BDRVReadCacheState *s = bs->opaque;
+
+    if (flags || !s->slots) {
+        return bdrv_co_preadv_part(bs->file, offset, bytes, qiov, qiov_offset,
+                                   flags);
+    }
+
+    while (bytes) {
+        uint64_t cluster = offset >> s->cluster_bits;
+        size_t offset_in_cluster = offset & (s->cluster_size - 1);
+        size_t n = MIN(bytes, s->cluster_size - offset_in_cluster);
+        ReadCacheSlot *slot = read_cache_lookup(s, cluster);
+        int ret;
+
+        if (slot && slot->state == READ_CACHE_SLOT_VALID) {
+            slot->readers++;
+            slot->referenced = true;
+            ret = bdrv_co_preadv_part(s->cache_file,
+                                      read_cache_slot_offset(s, slot) +
+                                      offset_in_cluster,
+                                      n, qiov, qiov_offset, 0);
+            read_cache_slot_put(s, slot);
+            if (ret == 0) {
+                s->stats.hits++;
+                goto next;
+            }
+
+            /* Fall back to the child */
+            s->stats.io_errors++;
+            ret = bdrv_co_preadv_part(bs->file, offset, n, qiov, qiov_offset,
+                                      0);
+        } else {
+            ret = read_cache_co_miss(bs, cluster, offset_in_cluster, n, qiov,
+                                     qiov_offset);
+        }
+        if (ret < 0) {
+            return ret;
+        }
+
+next:
+        offset += n;
+        qiov_offset += n;
+        bytes -= n;
+    }
+
+    return 0;
+}
+
+/*
+ * Modifying requests invalidate the cache both before and after they access
+ * the child.  The first invalidation makes concurrent cache misses discard
+ * what they read, the second one drops anything that was read while the
+ * request was running.
+ */
+
+static int coroutine_fn read_cache_co_pwritev_part(BlockDriverState *bs,
+                                                   uint64_t offset,
+                                                   uint64_t bytes,
+                                                   QEMUIOVector *qiov,
+                                                   size_t qiov_offset,
+                                                   int flags)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    g_autofree ReadCacheSlot **update = NULL;
+    uint64_t first, last, nb_clusters, cluster, cluster_offset, i;
+    ReadCacheSlot *slot;
+    int ret;
+
+    if (!s->slots || !bytes) {
+        return bdrv_co_pwritev_part(bs->file, offset, bytes, qiov,
+                                    qiov_offset, flags);
+    }
+
+    ret = read_cache_begin_unsafe(bs);
+    if (ret < 0) {
+        goto out;
+    }
+
+    first = offset >> s->cluster_bits;
+    last = (offset + bytes - 1) >> s->cluster_bits;
+    nb_clusters = last - first + 1;
+
+    /*
+     * Cached clusters that are written completely are updated in the cache
+     * file.  Their slots stay in s->clusters as FILLING, so they are neither
+     * read nor filled by others.
+     */
+    update = g_new0(ReadCacheSlot *, nb_clusters);
+    for (i = 0; i < nb_clusters; i++) {
+        cluster = first + i;
+        cluster_offset = cluster << s->cluster_bits;
+        slot = read_cache_lookup(s, cluster);
+        if (!slot) {
+            continue;
+        }
+
+        if (slot->state == READ_CACHE_SLOT_VALID && !slot->readers &&
+            cluster_offset >= offset &&
+            cluster_offset + s->cluster_size <= offset + bytes)
+        {
+            slot->state = READ_CACHE_SLOT_FILLING;
+            s->nb_valid--;
+            update[i] = slot;
+        } else {
+            read_cache_slot_invalidate(s, slot);
+        }
+    }
+
+    ret = bdrv_co_pwritev_part(bs->file, offset, bytes, qiov, qiov_offset,
+                               flags);
+
+    for (i = 0; i < nb_clusters; i++) {
+        cluster = first + i;
+        cluster_offset = cluster << s->cluster_bits;
+        slot = update[i];
+
+        if (slot) {
+            int update_ret = ret;
+
+            if (update_ret == 0 && !slot->stale) {
+                update_ret = bdrv_co_pwritev_part(
+                    s->cache_file, read_cache_slot_offset(s, slot),
+                    s->cluster_size, qiov,
+                    qiov_offset + (cluster_offset - offset), 0);
+                if (update_ret < 0) {
+                    s->stats.io_errors++;
+                }
+            }
+            read_cache_fill_done(s, slot, update_ret == 0);
+        }
+
+        slot = read_cache_lookup(s, cluster);
+        if (slot && slot != update[i]) {
+            read_cache_slot_invalidate(s, slot);
+        }
+    }
+
+out:
+    read_cache_end_unsafe(bs);
+    return ret;
+}
+
+static int coroutine_fn read_cache_co_pwrite_zeroes(BlockDriverState *bs,
+                                                    int64_t offset, int bytes,
+                                                    BdrvRequestFlags flags)
+{
+    int ret;
+
+    ret = read_cache_begin_unsafe(bs);
+    if (ret == 0) {
+        read_cache_invalidate(bs, offset, bytes);
+        ret = bdrv_co_pwrite_zeroes(bs->file, offset, bytes, flags);
+        read_cache_invalidate(bs, offset, bytes);
+    }
+    read_cache_end_unsafe(bs);
+    return ret;
+}
+
+static int coroutine_fn read_cache_co_pdiscard(BlockDriverState *bs,
+                                               int64_t offset, int bytes)
+{
+    int ret;
+
+    ret = read_cache_begin_unsafe(bs);
+    if (ret == 0) {
+        read_cache_invalidate(bs, offset, bytes);
+        ret = bdrv_co_pdiscard(bs->file, offset, bytes);
+        read_cache_invalidate(bs, offset, bytes);
+    }
+    read_cache_end_unsafe(bs);
+    return ret;
+}
+
+static int coroutine_fn read_cache_co_pwritev_compressed(BlockDriverState *bs,
+                                                         uint64_t offset,
+                                                         uint64_t bytes,
+                                                         QEMUIOVector *qiov)
+{
+    int ret;
+
+    ret = read_cache_begin_unsafe(bs);
+    if (ret == 0) {
+        read_cache_invalidate(bs, offset, bytes);
+        ret = bdrv_co_pwritev(bs->file, offset, bytes, qiov,
+                              BDRV_REQ_WRITE_COMPRESSED);
+        read_cache_invalidate(bs, offset, bytes);
+    }
+    read_cache_end_unsafe(bs);
+    return ret;
+}
+
+static int coroutine_fn read_cache_co_truncate(BlockDriverState *bs,
+                                               int64_t offset, bool exact,
+                                               PreallocMode prealloc,
+                                               BdrvRequestFlags flags,
+                                               Error **errp)
+{
+    int ret;
+
+    ret = read_cache_begin_unsafe(bs);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not update the cache file");
+    } else {
+        /* The cluster at the old end of the image changes, drop everything */
+        read_cache_invalidate_all(bs);
+        ret = bdrv_co_truncate(bs->file, offset, exact, prealloc, flags, errp);
+        read_cache_invalidate_all(bs);
+    }
+    read_cache_end_unsafe(bs);
+    return ret;
+}
+
+static BlockStatsSpecific *read_cache_get_specific_stats(BlockDriverState *bs)
+{
+    BlockStatsSpecific *stats = g_new(BlockStatsSpecific, 1);
+    BDRVReadCacheState *s = bs->opaque;
+    uint64_t reads = s->stats.hits + s->stats.misses;
+
+    stats->driver = BLOCKDEV_DRIVER_READ_CACHE;
+    stats->u.read_cache = (BlockStatsSpecificReadCache) {
+        .hits = s->stats.hits,
+        .misses = s->stats.misses,
+        .hit_ratio = reads ? (double)s->stats.hits / reads : 0,
+        .restored = s->stats.restored,
+        .cache_used = s->nb_valid << s->cluster_bits,
+        .cache_size = s->nb_slots << s->cluster_bits,
+        .evictions = s->stats.evictions,
+        .io_errors = s->stats.io_errors,
+    };
+
+    return stats;
+}
+
+static void read_cache_eject(BlockDriverState *bs, bool eject_flag)
+{
+    bdrv_eject(bs->file->bs, eject_flag);
+}
+
+static void read_cache_lock_medium(BlockDriverState *bs, bool locked)
+{
+    bdrv_lock_medium(bs->file->bs, locked);
+}
+
+static BlockDriver bdrv_read_cache = {
+    .format_name                        = "read-cache",
+    .instance_size                      = sizeof(BDRVReadCacheState),
+
+    .bdrv_open                          = read_cache_open,
+    .bdrv_close                         = read_cache_close,
+    .bdrv_child_perm                    = read_cache_child_perm,
+
+    .bdrv_getlength                     = read_cache_getlength,
+
+    .bdrv_co_preadv_part                = read_cache_co_preadv_part,
+    .bdrv_co_pwritev_part               = read_cache_co_pwritev_part,
+    .bdrv_co_pwrite_zeroes              = read_cache_co_pwrite_zeroes,
+    .bdrv_co_pdiscard                   = read_cache_co_pdiscard,
+    .bdrv_co_pwritev_compressed         = read_cache_co_pwritev_compressed,
+    .bdrv_co_truncate                   = read_cache_co_truncate,
+    .bdrv_co_flush_to_os                = read_cache_co_flush_to_os,
+
+    .bdrv_co_invalidate_cache           = read_cache_co_invalidate_cache,
+    .bdrv_inactivate                    = read_cache_inactivate,
+
+    .bdrv_get_specific_stats            = read_cache_get_specific_stats,
+
+    .bdrv_eject                         = read_cache_eject,
+    .bdrv_lock_medium                   = read_cache_lock_medium,
+
+    .has_variable_length                = true,
+    .is_filter                          = true,
+};
+
+static void bdrv_read_cache_init(void)
+{
+    bdrv_register(&bdrv_read_cache);
+}
+
+block_init(bdrv_read_cache_init);
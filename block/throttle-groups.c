@@ -62,6 +62,14 @@ static void timer_cb(ThrottleGroupMember *tgm, bool is_write);
  * blk_set_aio_context()). Therefore in this file a thread will
  * access some other ThrottleGroupMember's timers only after verifying that
  * that ThrottleGroupMember has throttled requests in the queue.
+ *
+ * Requests that fit in the budget of the group do not take the lock at
+ * all. Whenever a member goes through the locked path and the group is not
+ * throttling, it is leased a share of the headroom left in the buckets,
+ * which is accounted in advance. The next requests of that member consume
+ * the lease with a single atomic operation. Leases are revoked, and what is
+ * left of them given back to the buckets, before the group starts
+ * throttling and when its configuration changes.
  */
 struct ThrottleGroup {
     Object parent_obj;
@@ -70,13 +78,18 @@ struct ThrottleGroup {
     bool is_initialized;
     char *name; /* This is constant during the lifetime of the group */
 
-    QemuMutex lock; /* This lock protects the following four fields */
+    QemuMutex lock; /* This lock protects the following six fields */
     ThrottleState ts;
     QLIST_HEAD(, ThrottleGroupMember) head;
     ThrottleGroupMember *tokens[2];
     bool any_timer_armed[2];
+    unsigned nr_members;
+    bool leases_granted[2];
     QEMUClockType clock_type;
 
+    /* Copy of ts.cfg.op_size for lease holders, accessed atomically */
+    uint64_t op_size;
+
     /* This field is protected by the global QEMU mutex */
     QTAILQ_ENTRY(ThrottleGroup) list;
 };
@@ -170,6 +183,200 @@ const char *throttle_group_get_name(ThrottleGroupMember *tgm)
     return tg->name;
 }
 
+/*
+ * A lease packs the bytes left in its upper bits and the operations left, in
+ * units of 1/THROTTLE_LEASE_UNIT_SCALE, in its lower bits.
+ */
+#define THROTTLE_LEASE_UNIT_SCALE 1024
+#define THROTTLE_LEASE_UNITS_BITS 24
+#define THROTTLE_LEASE_UNITS_MAX  ((1ULL << THROTTLE_LEASE_UNITS_BITS) - 1)
+#define THROTTLE_LEASE_BYTES_MAX  (UINT64_MAX >> THROTTLE_LEASE_UNITS_BITS)
+
+static inline uint64_t throttle_lease_pack(uint64_t bytes, uint64_t units)
+{
+    return (bytes << THROTTLE_LEASE_UNITS_BITS) | units;
+}
+
+static inline uint64_t throttle_lease_bytes(uint64_t lease)
+{
+    return lease >> THROTTLE_LEASE_UNITS_BITS;
+}
+
+static inline uint64_t throttle_lease_units(uint64_t lease)
+{
+    return lease & THROTTLE_LEASE_UNITS_MAX;
+}
+
+/* Consume the lease of a ThrottleGroupMember for an I/O request, without
+ * taking tg->lock. This must be called from the member's AioContext.
+ *
+ * @tgm:       the current ThrottleGroupMember
+ * @bytes:     the number of bytes for this I/O
+ * @is_write:  the type of operation (read/write)
+ * @ret:       whether the lease covered the request
+ */
+static bool throttle_group_consume_lease(ThrottleGroupMember *tgm,
+                                         int64_t bytes, bool is_write)
+{
+#ifdef CONFIG_ATOMIC64
+    ThrottleGroup *tg = container_of(tgm->throttle_state, ThrottleGroup, ts);
+    uint64_t op_size, units, lease, old;
+
+    if (bytes > THROTTLE_LEASE_BYTES_MAX) {
+        return false;
+    }
+
+    /* Same unit count as throttle_account(), rounded up */
+    op_size = qatomic_read__nocheck(&tg->op_size);
+    units = THROTTLE_LEASE_UNIT_SCALE;
+    if (op_size && bytes > op_size) {
+        units = DIV_ROUND_UP(bytes * THROTTLE_LEASE_UNIT_SCALE, op_size);
+    }
+
+    lease = qatomic_read__nocheck(&tgm->lease[is_write]);
+    do {
+        if (throttle_lease_bytes(lease) < bytes ||
+            throttle_lease_units(lease) < units) {
+            return false;
+        }
+        old = lease;
+        lease = qatomic_cmpxchg__nocheck(&tgm->lease[is_write], old,
+                                         old - throttle_lease_pack(bytes,
+                                                                   units));
+    } while (lease != old);
+
+    return true;
+#else
+    return false;
+#endif
+}
+
+/* Take back the lease of a ThrottleGroupMember.
+ *
+ * This assumes that tg->lock is held.
+ *
+ * @tgm:       the ThrottleGroupMember
+ * @is_write:  the type of operation (read/write)
+ * @refund:    whether to give the unused budget back to the buckets
+ */
+static void throttle_group_revoke_lease(ThrottleGroupMember *tgm,
+                                        bool is_write, bool refund)
+{
+#ifdef CONFIG_ATOMIC64
+    ThrottleGroup *tg = container_of(tgm->throttle_state, ThrottleGroup, ts);
+    uint64_t lease = qatomic_xchg__nocheck(&tgm->lease[is_write], 0);
+    uint64_t charged = tgm->lease_charged[is_write];
+
+    if (lease && refund) {
+        throttle_refund_units(tgm->throttle_state, is_write,
+                              tgm->lease_charged_at[is_write],
+                              qemu_clock_get_ns(tg->clock_type),
+                              throttle_lease_bytes(charged),
+                              (double) throttle_lease_units(charged) /
+                              THROTTLE_LEASE_UNIT_SCALE,
+                              throttle_lease_bytes(lease),
+                              (double) throttle_lease_units(lease) /
+                              THROTTLE_LEASE_UNIT_SCALE);
+    }
+    tgm->lease_charged[is_write] = 0;
+#endif
+}
+
+/* Take back the leases of all members of a group.
+ *
+ * This assumes that tg->lock is held.
+ *
+ * @tg:        the ThrottleGroup
+ * @is_write:  the type of operation (read/write)
+ * @refund:    whether to give the unused budget back to the buckets
+ */
+static void throttle_group_revoke_leases(ThrottleGroup *tg, bool is_write,
+                                         bool refund)
+{
+    ThrottleGroupMember *tgm;
+
+    if (!tg->leases_granted[is_write]) {
+        return;
+    }
+
+    QLIST_FOREACH(tgm, &tg->head, round_robin) {
+        throttle_group_revoke_lease(tgm, is_write, refund);
+    }
+    tg->leases_granted[is_write] = false;
+}
+
+/* Lease a ThrottleGroupMember a share of the budget left in its group, so
+ * that its next requests can be accounted without taking tg->lock.
+ *
+ * This assumes that tg->lock is held.
+ *
+ * @tgm:       the ThrottleGroupMember
+ * @is_write:  the type of operation (read/write)
+ */
+static void throttle_group_grant_lease(ThrottleGroupMember *tgm,
+                                       bool is_write)
+{
+#ifdef CONFIG_ATOMIC64
+    ThrottleState *ts = tgm->throttle_state;
+    ThrottleGroup *tg = container_of(ts, ThrottleGroup, ts);
+    int64_t now = qemu_clock_get_ns(tg->clock_type);
+    double bytes, units;
+    uint64_t lease_bytes, lease_units;
+
+    /* Requests that wait for their turn are scheduled with the lock held */
+    if (tgm->pending_reqs[is_write] || tg->any_timer_armed[is_write] ||
+        qatomic_read(&tgm->io_limits_disabled) ||
+        qatomic_read__nocheck(&tgm->lease[is_write])) {
+        return;
+    }
+
+    throttle_get_headroom(ts, is_write, now, &bytes, &units);
+
+    /* Keep at least half of the headroom for the other members */
+    bytes = MIN(bytes / (2 * tg->nr_members), THROTTLE_LEASE_BYTES_MAX);
+    units = MIN(units * THROTTLE_LEASE_UNIT_SCALE / (2 * tg->nr_members),
+                THROTTLE_LEASE_UNITS_MAX);
+    lease_bytes = bytes;
+    lease_units = units;
+
+    /* Not worth it if the lease cannot cover a single request */
+    if (!lease_bytes || lease_units < THROTTLE_LEASE_UNIT_SCALE) {
+        return;
+    }
+
+    throttle_account_units(ts, is_write, lease_bytes,
+                           (double) lease_units / THROTTLE_LEASE_UNIT_SCALE);
+    tgm->lease_charged[is_write] = throttle_lease_pack(lease_bytes,
+                                                       lease_units);
+    tgm->lease_charged_at[is_write] = now;
+    qatomic_set__nocheck(&tgm->lease[is_write],
+                         tgm->lease_charged[is_write]);
+    tg->leases_granted[is_write] = true;
+#endif
+}
+
+/* Update the configuration of a group. The leases granted with the old
+ * configuration are dropped, since throttle_config() resets the buckets.
+ *
+ * This assumes that tg->lock is held.
+ *
+ * @tg:  the ThrottleGroup
+ * @cfg: the configuration to set
+ */
+static void throttle_group_apply_config(ThrottleGroup *tg,
+                                        ThrottleConfig *cfg)
+{
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        throttle_group_revoke_leases(tg, i, false);
+    }
+    throttle_config(&tg->ts, tg->clock_type, cfg);
+#ifdef CONFIG_ATOMIC64
+    qatomic_set__nocheck(&tg->op_size, cfg->op_size);
+#endif
+}
+
 /* Return the next ThrottleGroupMember in the round-robin sequence, simulating
  * a circular list.
  *
@@ -283,6 +490,13 @@ static bool throttle_group_schedule_timer(ThrottleGroupMember *tgm,
 
     must_wait = throttle_schedule_timer(ts, tt, is_write);
 
+    /* Before throttling, check again with the unused leases given back */
+    if (must_wait && tg->leases_granted[is_write]) {
+        throttle_group_revoke_leases(tg, is_write, true);
+        timer_del(tt->timers[is_write]);
+        must_wait = throttle_schedule_timer(ts, tt, is_write);
+    }
+
     /* If a timer just got armed, set tgm as the current token */
     if (must_wait) {
         tg->tokens[is_write] = tgm;
@@ -367,8 +581,17 @@ void coroutine_fn throttle_group_co_io_limits_intercept(ThrottleGroupMember *tgm
 
     assert(bytes >= 0);
 
+    /* Requests that fit in the lease of this member can go right away */
+    if (!tgm->pending_reqs[is_write] &&
+        throttle_group_consume_lease(tgm, bytes, is_write)) {
+        return;
+    }
+
     qemu_mutex_lock(&tg->lock);
 
+    /* What is left of the lease is too small for this I/O, give it back */
+    throttle_group_revoke_lease(tgm, is_write, true);
+
     /* First we check if this I/O has to be throttled. */
     token = next_throttle_token(tgm, is_write);
     must_wait = throttle_group_schedule_timer(token, is_write);
@@ -391,6 +614,9 @@ void coroutine_fn throttle_group_co_io_limits_intercept(ThrottleGroupMember *tgm
     /* Schedule the next request */
     schedule_next_request(tgm, is_write);
 
+    /* Let the next requests of this member skip the lock if possible */
+    throttle_group_grant_lease(tgm, is_write);
+
     qemu_mutex_unlock(&tg->lock);
 }
 
@@ -474,7 +700,7 @@ void throttle_group_config(ThrottleGroupMember *tgm, ThrottleConfig *cfg)
     ThrottleState *ts = tgm->throttle_state;
     ThrottleGroup *tg = container_of(ts, ThrottleGroup, ts);
     qemu_mutex_lock(&tg->lock);
-    throttle_config(ts, tg->clock_type, cfg);
+    throttle_group_apply_config(tg, cfg);
     qemu_mutex_unlock(&tg->lock);
 
     throttle_group_restart_tgm(tgm);
@@ -548,6 +774,8 @@ void throttle_group_register_tgm(ThrottleGroupMember *tgm,
     tgm->throttle_state = ts;
     tgm->aio_context = ctx;
     qatomic_set(&tgm->restart_pending, 0);
+    tgm->lease[0] = tgm->lease[1] = 0;
+    tgm->lease_charged[0] = tgm->lease_charged[1] = 0;
 
     QEMU_LOCK_GUARD(&tg->lock);
     /* If the ThrottleGroup is new set this ThrottleGroupMember as the token */
@@ -558,6 +786,7 @@ void throttle_group_register_tgm(ThrottleGroupMember *tgm,
     }
 
     QLIST_INSERT_HEAD(&tg->head, tgm, round_robin);
+    tg->nr_members++;
 
     throttle_timers_init(&tgm->throttle_timers,
                          tgm->aio_context,
@@ -600,6 +829,7 @@ void throttle_group_unregister_tgm(ThrottleGroupMember *tgm)
             assert(tgm->pending_reqs[i] == 0);
             assert(qemu_co_queue_empty(&tgm->throttled_reqs[i]));
             assert(!timer_pending(tgm->throttle_timers.timers[i]));
+            throttle_group_revoke_lease(tgm, i, true);
             if (tg->tokens[i] == tgm) {
                 token = throttle_group_next_tgm(tgm);
                 /* Take care of the case where this is the last tgm in the group */
@@ -612,6 +842,7 @@ void throttle_group_unregister_tgm(ThrottleGroupMember *tgm)
 
         /* remove the current tgm from the list */
         QLIST_REMOVE(tgm, round_robin);
+        tg->nr_members--;
         throttle_timers_destroy(&tgm->throttle_timers);
     }
 
@@ -788,7 +1019,7 @@ static void throttle_group_obj_complete(UserCreatable *obj, Error **errp)
     if (!throttle_is_valid(&cfg, errp)) {
         return;
     }
-    throttle_config(&tg->ts, tg->clock_type, &cfg);
+    throttle_group_apply_config(tg, &cfg);
     QTAILQ_INSERT_TAIL(&throttle_groups, tg, list);
     tg->is_initialized = true;
 }
@@ -899,7 +1130,7 @@ static void throttle_group_set_limits(Object *obj, Visitor *v,
     if (local_err) {
         goto unlock;
     }
-    throttle_config(&tg->ts, tg->clock_type, &cfg);
+    throttle_group_apply_config(tg, &cfg);
 
 unlock:
     qemu_mutex_unlock(&tg->lock);
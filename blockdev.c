@@ -2630,6 +2630,49 @@ out:
     aio_context_release(aio_context);
 }
 
+void qmp_block_defrag(bool has_job_id, const char *job_id, const char *device,
+                      bool has_speed, int64_t speed,
+                      bool has_auto_finalize, bool auto_finalize,
+                      bool has_auto_dismiss, bool auto_dismiss,
+                      Error **errp)
+{
+    BlockDriverState *bs;
+    AioContext *aio_context;
+    Error *local_err = NULL;
+    int job_flags = JOB_DEFAULT;
+
+    bs = bdrv_lookup_bs(device, device, errp);
+    if (!bs) {
+        return;
+    }
+
+    aio_context = bdrv_get_aio_context(bs);
+    aio_context_acquire(aio_context);
+
+    if (bdrv_op_is_blocked(bs, BLOCK_OP_TYPE_DEFRAG, errp)) {
+        goto out;
+    }
+
+    if (has_auto_finalize && !auto_finalize) {
+        job_flags |= JOB_MANUAL_FINALIZE;
+    }
+    if (has_auto_dismiss && !auto_dismiss) {
+        job_flags |= JOB_MANUAL_DISMISS;
+    }
+
+    defrag_start(has_job_id ? job_id : NULL, bs, job_flags,
+                 has_speed ? speed : 0, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        goto out;
+    }
+
+    trace_qmp_block_defrag(bs);
+
+out:
+    aio_context_release(aio_context);
+}
+
 void qmp_block_commit(bool has_job_id, const char *job_id, const char *device,
                       bool has_base_node, const char *base_node,
                       bool has_base, const char *base,
@@ -2863,6 +2906,9 @@ static BlockJob *do_backup_common(BackupCommon *backup,
         if (backup->x_perf->has_max_chunk) {
             perf.max_chunk = backup->x_perf->max_chunk;
         }
+        if (backup->x_perf->has_adaptive) {
+            perf.adaptive = backup->x_perf->adaptive;
+        }
     }
 
     if ((backup->sync == MIRROR_SYNC_MODE_BITMAP) ||
@@ -2982,6 +3028,8 @@ void qmp_blockdev_backup(BlockdevBackup *backup, Error **errp)
  **/
 static void blockdev_mirror_common(const char *job_id, BlockDriverState *bs,
                                    BlockDriverState *target,
+                                   BlockDriverState **extra_targets,
+                                   int nb_extra_targets,
                                    bool has_replaces, const char *replaces,
                                    enum MirrorSyncMode sync,
                                    BlockMirrorBackingMode backing_mode,
@@ -3003,6 +3051,7 @@ static void blockdev_mirror_common(const char *job_id, BlockDriverState *bs,
 {
     BlockDriverState *unfiltered_bs;
     int job_flags = JOB_DEFAULT;
+    int i;
 
     if (!has_speed) {
         speed = 0;
@@ -3052,6 +3101,12 @@ static void blockdev_mirror_common(const char *job_id, BlockDriverState *bs,
     if (bdrv_op_is_blocked(target, BLOCK_OP_TYPE_MIRROR_TARGET, errp)) {
         return;
     }
+    for (i = 0; i < nb_extra_targets; i++) {
+        if (bdrv_op_is_blocked(extra_targets[i], BLOCK_OP_TYPE_MIRROR_TARGET,
+                               errp)) {
+            return;
+        }
+    }
 
     if (!bdrv_backing_chain_next(bs) && sync == MIRROR_SYNC_MODE_TOP) {
         sync = MIRROR_SYNC_MODE_FULL;
@@ -3102,7 +3157,7 @@ static void blockdev_mirror_common(const char *job_id, BlockDriverState *bs,
     /* pass the node name to replace to mirror start since it's loose coupling
      * and will allow to check whether the node still exist at mirror completion
      */
-    mirror_start(job_id, bs, target,
+    mirror_start(job_id, bs, target, extra_targets, nb_extra_targets,
                  has_replaces ? replaces : NULL, job_flags,
                  speed, granularity, buf_size, sync, backing_mode, zero_target,
                  on_source_error, on_target_error, unmap, filter_node_name,
@@ -3248,7 +3303,7 @@ void qmp_drive_mirror(DriveMirror *arg, Error **errp)
     aio_context_acquire(aio_context);
 
     blockdev_mirror_common(arg->has_job_id ? arg->job_id : NULL, bs, target_bs,
-                           arg->has_replaces, arg->replaces, arg->sync,
+                           NULL, 0, arg->has_replaces, arg->replaces, arg->sync,
                            backing_mode, zero_target,
                            arg->has_speed, arg->speed,
                            arg->has_granularity, arg->granularity,
@@ -3282,15 +3337,19 @@ void qmp_blockdev_mirror(bool has_job_id, const char *job_id,
                          bool has_copy_mode, MirrorCopyMode copy_mode,
                          bool has_auto_finalize, bool auto_finalize,
                          bool has_auto_dismiss, bool auto_dismiss,
+                         bool has_extra_targets, strList *extra_targets,
                          Error **errp)
 {
     BlockDriverState *bs;
     BlockDriverState *target_bs;
+    g_autofree BlockDriverState **extra_bs = NULL;
+    int nb_extra_bs = 0;
     AioContext *aio_context;
     AioContext *old_context;
     BlockMirrorBackingMode backing_mode = MIRROR_LEAVE_BACKING_CHAIN;
     bool zero_target;
-    int ret;
+    strList *e;
+    int i, ret;
 
     bs = qmp_get_root_bs(device, errp);
     if (!bs) {
@@ -3302,6 +3361,19 @@ void qmp_blockdev_mirror(bool has_job_id, const char *job_id,
         return;
     }
 
+    for (e = extra_targets; e; e = e->next) {
+        nb_extra_bs++;
+    }
+    extra_bs = g_new(BlockDriverState *, nb_extra_bs);
+    nb_extra_bs = 0;
+    for (e = extra_targets; e; e = e->next) {
+        extra_bs[nb_extra_bs] = bdrv_lookup_bs(e->value, e->value, errp);
+        if (!extra_bs[nb_extra_bs]) {
+            return;
+        }
+        nb_extra_bs++;
+    }
+
     zero_target = (sync == MIRROR_SYNC_MODE_FULL);
 
     /* Honor bdrv_try_set_aio_context() context acquisition requirements. */
@@ -3318,7 +3390,23 @@ void qmp_blockdev_mirror(bool has_job_id, const char *job_id,
         goto out;
     }
 
+    for (i = 0; i < nb_extra_bs; i++) {
+        old_context = bdrv_get_aio_context(extra_bs[i]);
+        aio_context_release(aio_context);
+        aio_context_acquire(old_context);
+
+        ret = bdrv_try_set_aio_context(extra_bs[i], aio_context, errp);
+
+        aio_context_release(old_context);
+        aio_context_acquire(aio_context);
+
+        if (ret < 0) {
+            goto out;
+        }
+    }
+
     blockdev_mirror_common(has_job_id ? job_id : NULL, bs, target_bs,
+                           extra_bs, nb_extra_bs,
                            has_replaces, replaces, sync, backing_mode,
                            zero_target, has_speed, speed,
                            has_granularity, granularity,
@@ -27,6 +27,7 @@
 
 #include "qemu/timed-average.h"
 #include "qemu/thread.h"
+#include "qemu/stats64.h"
 #include "qapi/qapi-builtin-types.h"
 
 typedef struct BlockAcctTimedStats BlockAcctTimedStats;
@@ -120,4 +121,43 @@ int block_latency_histogram_set(BlockAcctStats *stats, enum BlockAcctType type,
                                 uint64List *boundaries);
 void block_latency_histograms_clear(BlockAcctStats *stats);
 
+/*
+ * Per-node statistics.  Unlike BlockAcctStats, these are kept for every
+ * BlockDriverState and updated without taking a lock, so that they can
+ * always be enabled.  Histograms have fixed power-of-two buckets:
+ *
+ * bucket 0:                  [0, 2^shift)
+ * bucket i (0 < i < n - 1):  [2^(shift + i - 1), 2^(shift + i))
+ * bucket n - 1:              [2^(shift + n - 2), +inf)
+ */
+#define BLOCK_NODE_LATENCY_SHIFT    10  /* ~1 us */
+#define BLOCK_NODE_LATENCY_BUCKETS  26  /* last bucket starts at ~17 s */
+#define BLOCK_NODE_SIZE_SHIFT       9   /* 512 bytes */
+#define BLOCK_NODE_SIZE_BUCKETS     17  /* last bucket starts at 16 MiB */
+
+typedef struct BlockNodeOpStats {
+    Stat64 ops;
+    Stat64 failed_ops;
+    Stat64 bytes;
+    Stat64 total_time_ns;
+    Stat64 latency[BLOCK_NODE_LATENCY_BUCKETS];
+    Stat64 size[BLOCK_NODE_SIZE_BUCKETS];
+} BlockNodeOpStats;
+
+typedef struct BlockNodeStats {
+    BlockNodeOpStats op[BLOCK_MAX_IOTYPE];
+} BlockNodeStats;
+
+/* Returns the start time to pass to block_node_stats_done() */
+int64_t block_node_stats_start(void);
+void block_node_stats_done(BlockNodeStats *stats, enum BlockAcctType type,
+                           int64_t bytes, int64_t start_ns, int ret);
+void block_node_stats_clear(BlockNodeStats *stats);
+
+/* Lower bound of histogram bucket @i, see above */
+static inline uint64_t block_node_stats_bucket_start(int shift, int i)
+{
+    return i ? 1ULL << (shift + i - 1) : 0;
+}
+
 #endif
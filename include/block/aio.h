@@ -22,6 +22,7 @@
 #include "qemu/event_notifier.h"
 #include "qemu/thread.h"
 #include "qemu/timer.h"
+#include "qemu/stats64.h"
 
 typedef struct BlockAIOCB BlockAIOCB;
 typedef void BlockCompletionFunc(void *opaque, int ret);
@@ -121,6 +122,11 @@ struct BHListSlice {
 
 typedef QSLIST_HEAD(, AioHandler) AioHandlerSList;
 
+/* Flags for aio_setup_linux_io_uring() */
+#define LURING_SETUP_SQPOLL (1 << 0)  /* kernel thread polls the SQ */
+#define LURING_SETUP_IOPOLL (1 << 1)  /* busy-poll for completions */
+#define LURING_SETUP_MASK   (LURING_SETUP_SQPOLL | LURING_SETUP_IOPOLL)
+
 struct AioContext {
     GSource source;
 
@@ -197,6 +203,18 @@ struct AioContext {
      */
     struct ThreadPool *thread_pool;
 
+    /*
+     * Thread pool parameters, see aio_context_set_thread_pool_params().
+     * They are set from the main loop while the pool is used in the
+     * AioContext's thread.  thread_pool_lock protects them, and the
+     * creation of thread_pool so that a new pool sees the latest ones.
+     */
+    QemuMutex thread_pool_lock;
+    int64_t thread_pool_min;
+    int64_t thread_pool_max;
+    unsigned long *thread_pool_cpus;
+    unsigned long thread_pool_nr_cpus;
+
 #ifdef CONFIG_LINUX_AIO
     /*
      * State for native Linux AIO.  Uses aio_context_acquire/release for
@@ -206,14 +224,16 @@ struct AioContext {
 #endif
 #ifdef CONFIG_LINUX_IO_URING
     /*
-     * State for Linux io_uring.  Uses aio_context_acquire/release for
-     * locking.
+     * State for Linux io_uring, one ring per combination of
+     * LURING_SETUP_* flags.  Uses aio_context_acquire/release for locking.
      */
-    struct LuringState *linux_io_uring;
+    struct LuringState *linux_io_uring[LURING_SETUP_MASK + 1];
 
     /* State for file descriptor monitoring using Linux io_uring */
     struct io_uring fdmon_io_uring;
     AioHandlerSList submit_list;
+    Stat64 fdmon_io_uring_sqes;
+    Stat64 fdmon_io_uring_cqes;
 #endif
 
     /* TimerLists for calling timers - one per clock type.  Has its own
@@ -487,11 +507,15 @@ struct LinuxAioState *aio_setup_linux_aio(AioContext *ctx, Error **errp);
 /* Return the LinuxAioState bound to this AioContext */
 struct LinuxAioState *aio_get_linux_aio(AioContext *ctx);
 
-/* Setup the LuringState bound to this AioContext */
-struct LuringState *aio_setup_linux_io_uring(AioContext *ctx, Error **errp);
+/*
+ * Setup the LuringState bound to this AioContext.  @flags is a combination
+ * of LURING_SETUP_* flags and selects the ring.
+ */
+struct LuringState *aio_setup_linux_io_uring(AioContext *ctx, int flags,
+                                             Error **errp);
 
 /* Return the LuringState bound to this AioContext */
-struct LuringState *aio_get_linux_io_uring(AioContext *ctx);
+struct LuringState *aio_get_linux_io_uring(AioContext *ctx, int flags);
 /**
  * aio_timer_new_with_attrs:
  * @ctx: the aio context
@@ -714,6 +738,17 @@ void aio_context_destroy(AioContext *ctx);
 /* Used internally, do not call outside AioContext code */
 void aio_context_use_g_source(AioContext *ctx);
 
+/**
+ * aio_context_get_fdmon_stats:
+ * @ctx: the aio context
+ * @sqes: number of io_uring sqes submitted for file descriptor monitoring
+ * @cqes: number of io_uring cqes processed for file descriptor monitoring
+ *
+ * Returns false if @ctx does not monitor file descriptors with io_uring.
+ */
+bool aio_context_get_fdmon_stats(AioContext *ctx, uint64_t *sqes,
+                                 uint64_t *cqes);
+
 /**
  * aio_context_set_poll_params:
  * @ctx: the aio context
@@ -727,4 +762,29 @@ void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
                                  int64_t grow, int64_t shrink,
                                  Error **errp);
 
+/**
+ * aio_context_set_thread_pool_params:
+ * @ctx: the aio context
+ * @min: number of worker threads that are kept around even when idle
+ * @max: maximum number of worker threads
+ * @cpus: bitmap of the host CPUs to run worker threads on, or NULL to let them
+ *        inherit the affinity of the thread that runs @ctx
+ * @nr_cpus: number of bits in @cpus
+ *
+ * The parameters also apply to an already existing thread pool.
+ */
+void aio_context_set_thread_pool_params(AioContext *ctx, int64_t min,
+                                        int64_t max, unsigned long *cpus,
+                                        unsigned long nr_cpus, Error **errp);
+
+/**
+ * aio_context_get_thread_pool_stats:
+ * @ctx: the aio context
+ * @stats: filled with statistics of the thread pool
+ *
+ * Returns false if @ctx has no thread pool yet.
+ */
+bool aio_context_get_thread_pool_stats(AioContext *ctx,
+                                       struct ThreadPoolStats *stats);
+
 #endif
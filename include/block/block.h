@@ -224,6 +224,7 @@ typedef enum BlockOpType {
     BLOCK_OP_TYPE_COMMIT_SOURCE,
     BLOCK_OP_TYPE_COMMIT_TARGET,
     BLOCK_OP_TYPE_DATAPLANE,
+    BLOCK_OP_TYPE_DEFRAG,
     BLOCK_OP_TYPE_DRIVE_DEL,
     BLOCK_OP_TYPE_EJECT,
     BLOCK_OP_TYPE_EXTERNAL_SNAPSHOT,
@@ -508,6 +509,9 @@ void bdrv_drain_all(void);
 int generated_co_wrapper bdrv_pdiscard(BdrvChild *child, int64_t offset,
                                        int64_t bytes);
 int bdrv_co_pdiscard(BdrvChild *child, int64_t offset, int64_t bytes);
+int coroutine_fn bdrv_co_defragment(BlockDriverState *bs, int64_t offset,
+                                    int64_t bytes, int64_t *moved);
+int coroutine_fn bdrv_co_compact(BlockDriverState *bs, Error **errp);
 int bdrv_has_zero_init_1(BlockDriverState *bs);
 int bdrv_has_zero_init(BlockDriverState *bs);
 bool bdrv_can_write_zeroes_with_unmap(BlockDriverState *bs);
@@ -851,6 +855,38 @@ int coroutine_fn bdrv_co_copy_range(BdrvChild *src, int64_t src_offset,
                                     int64_t bytes, BdrvRequestFlags read_flags,
                                     BdrvRequestFlags write_flags);
 
+/**
+ * bdrv_can_sendfile:
+ *
+ * Return whether bdrv_co_sendfile() can be used on @bs, i.e. whether the
+ * data of @bs is stored unchanged in a file that the kernel can send to a
+ * socket directly.  The answer may change when the graph changes, so ask
+ * again before each request.
+ */
+bool bdrv_can_sendfile(BlockDriverState *bs);
+
+/**
+ * bdrv_co_sendfile:
+ *
+ * Write @bytes of data at @offset of @child to @out_fd, which must be a
+ * non-blocking socket or pipe, without copying it through a userspace buffer
+ * (zero-copy read).  The caller has to serialize writes to @out_fd.
+ *
+ * This never waits for @out_fd to become writable, so that a peer that does
+ * not read cannot keep the request in flight.  If @out_fd is full, the
+ * caller waits for it (e.g. with qio_channel_yield()) and calls again for
+ * the rest of the data.
+ *
+ * Returns: the number of bytes written, which is less than @bytes if @out_fd
+ * became full.  -EAGAIN if @out_fd is full and nothing was written.
+ * -ENOTSUP if zero-copy is not possible, in which case nothing has been
+ * written to @out_fd.  Any other negative error code may come after part of
+ * the data has been written to @out_fd, so the stream on @out_fd must then
+ * be considered broken.
+ **/
+int coroutine_fn bdrv_co_sendfile(BdrvChild *child, int64_t offset,
+                                  int64_t bytes, int out_fd);
+
 void bdrv_cancel_in_flight(BlockDriverState *bs);
 
 #endif
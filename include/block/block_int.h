@@ -299,6 +299,18 @@ struct BlockDriver {
     int coroutine_fn (*bdrv_co_pdiscard)(BlockDriverState *bs,
         int64_t offset, int bytes);
 
+    /*
+     * Move the host clusters backing [offset, offset + bytes) so that they
+     * are laid out in guest order, without changing the guest-visible data.
+     * The generic layer serialises the request against guest I/O at cluster
+     * granularity.  @moved is increased by the number of bytes moved.
+     */
+    int coroutine_fn (*bdrv_co_defragment)(BlockDriverState *bs,
+        int64_t offset, int64_t bytes, int64_t *moved);
+
+    /* Release unused space at the end of the image file */
+    int coroutine_fn (*bdrv_co_compact)(BlockDriverState *bs, Error **errp);
+
     /* Map [offset, offset + nbytes) range onto a child of @bs to copy from,
      * and invoke bdrv_co_copy_range_from(child, ...), or invoke
      * bdrv_co_copy_range_to() if @bs is the leaf child to copy data from.
@@ -332,6 +344,21 @@ struct BlockDriver {
                                               BdrvRequestFlags read_flags,
                                               BdrvRequestFlags write_flags);
 
+    /*
+     * Map [offset, offset + bytes) onto a child of @bs and invoke
+     * bdrv_co_sendfile() on it, or, if @bs is the leaf, write the data
+     * straight to @out_fd (a socket or a pipe) without a userspace bounce
+     * buffer.  @out_fd may be non-blocking.
+     *
+     * bdrv_can_sendfile() is true for a node if it implements this callback
+     * and bdrv_can_sendfile is either NULL or returns true.  See the comment
+     * of bdrv_co_sendfile for the return value semantics.
+     */
+    bool (*bdrv_can_sendfile)(BlockDriverState *bs);
+    int coroutine_fn (*bdrv_co_sendfile)(BlockDriverState *bs,
+                                         uint64_t offset, uint64_t bytes,
+                                         int out_fd);
+
     /*
      * Building block for bdrv_block_status[_above] and
      * bdrv_is_allocated[_above].  The driver should answer only
@@ -974,6 +1001,9 @@ struct BlockDriverState {
     /* Offset after the highest byte written to */
     Stat64 wr_highest_offset;
 
+    /* Per-operation latency and request size statistics */
+    BlockNodeStats node_stats;
+
     /* If true, copy read backing sectors into image.  Can be >1 if more
      * than one client has requested copy-on-read.  Accessed with atomic
      * ops.
@@ -1224,12 +1254,35 @@ BlockJob *commit_active_start(const char *job_id, BlockDriverState *bs,
                               const char *filter_node_name,
                               BlockCompletionFunc *cb, void *opaque,
                               bool auto_complete, Error **errp);
+
+/**
+ * defrag_start:
+ * @job_id: The id of the newly-created job, or %NULL to use the
+ * device name of @bs.
+ * @bs: Block device to operate on.
+ * @creation_flags: Flags that control the behavior of the Job lifetime.
+ *                  See @BlockJobCreateFlags
+ * @speed: The maximum speed, in bytes per second of moved data, or 0 for
+ * unlimited.
+ * @errp: Error object.
+ *
+ * Start a defragmentation operation on @bs.  The data clusters of @bs are
+ * moved so that they follow guest offset order in the image file, and the
+ * free space at the end of the image file is released when the job
+ * completes.  The guest-visible content of @bs does not change.
+ */
+void defrag_start(const char *job_id, BlockDriverState *bs,
+                  int creation_flags, int64_t speed, Error **errp);
+
 /*
  * mirror_start:
  * @job_id: The id of the newly-created job, or %NULL to use the
  * device name of @bs.
  * @bs: Block device to operate on.
  * @target: Block device to write to.
+ * @extra_targets: Further block devices that access the same image as
+ *                 @target.  Writes are distributed over all of them.
+ * @nb_extra_targets: Number of elements in @extra_targets.
  * @replaces: Block graph node name to replace once the mirror is done. Can
  *            only be used when full mirroring is selected.
  * @creation_flags: Flags that control the behavior of the Job lifetime.
@@ -1255,7 +1308,9 @@ BlockJob *commit_active_start(const char *job_id, BlockDriverState *bs,
  * @bs will be switched to read from @target.
  */
 void mirror_start(const char *job_id, BlockDriverState *bs,
-                  BlockDriverState *target, const char *replaces,
+                  BlockDriverState *target,
+                  BlockDriverState **extra_targets, int nb_extra_targets,
+                  const char *replaces,
                   int creation_flags, int64_t speed,
                   uint32_t granularity, int64_t buf_size,
                   MirrorSyncMode mode, BlockMirrorBackingMode backing_mode,
@@ -24,9 +24,30 @@ typedef int ThreadPoolFunc(void *opaque);
 
 typedef struct ThreadPool ThreadPool;
 
+/* Default maximum number of worker threads per pool */
+#define THREAD_POOL_MAX_THREADS_DEFAULT 64
+
+typedef struct ThreadPoolStats {
+    int threads;            /* worker threads, including idle ones */
+    int idle_threads;
+    int queue_depth;        /* requests waiting for a worker */
+    int max_queue_depth;
+    uint64_t requests;      /* requests that were picked up by a worker */
+    uint64_t wait_ns;       /* total time those waited for a worker */
+    uint64_t max_wait_ns;
+} ThreadPoolStats;
+
 ThreadPool *thread_pool_new(struct AioContext *ctx);
 void thread_pool_free(ThreadPool *pool);
 
+/*
+ * Apply the thread pool parameters of @ctx (see
+ * aio_context_set_thread_pool_params()) to @pool.  Must be called with
+ * ctx->thread_pool_lock held.
+ */
+void thread_pool_update_params(ThreadPool *pool, struct AioContext *ctx);
+void thread_pool_get_stats(ThreadPool *pool, ThreadPoolStats *stats);
+
 BlockAIOCB *thread_pool_submit_aio(ThreadPool *pool,
         ThreadPoolFunc *func, void *arg,
         BlockCompletionFunc *cb, void *opaque);
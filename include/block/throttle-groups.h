@@ -49,12 +49,22 @@ typedef struct ThrottleGroupMember {
      */
     unsigned int restart_pending;
 
+    /* Budget leased from the group for requests that do not need to take
+     * the ThrottleGroup lock.  Accessed with atomic operations.
+     */
+    uint64_t lease[2];
+
     /* The following fields are protected by the ThrottleGroup lock.
      * See the ThrottleGroup documentation for details.
-     * throttle_state tells us if I/O limits are configured. */
+     * throttle_state tells us if I/O limits are configured.
+     * pending_reqs is only modified from aio_context, which can therefore
+     * read it without the lock. */
     ThrottleState *throttle_state;
     ThrottleTimers throttle_timers;
     unsigned       pending_reqs[2];
+    /* What the current leases were charged to the buckets, and when */
+    uint64_t       lease_charged[2];
+    int64_t        lease_charged_at[2];
     QLIST_ENTRY(ThrottleGroupMember) round_robin;
 
 } ThrottleGroupMember;
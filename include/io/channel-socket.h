@@ -47,6 +47,8 @@ struct QIOChannelSocket {
     socklen_t localAddrLen;
     struct sockaddr_storage remoteAddr;
     socklen_t remoteAddrLen;
+    uint64_t zero_copy_queued;  /* zero copy sendmsg() calls issued */
+    uint64_t zero_copy_sent;    /* and completed by the kernel */
 };
 
 
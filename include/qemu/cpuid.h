@@ -51,10 +51,66 @@
 #ifndef bit_BMI2
 #define bit_BMI2        (1 << 8)
 #endif
+#ifndef bit_AVX512BW
+#define bit_AVX512BW    (1 << 30)
+#endif
 
 /* Leaf 0x80000001, %ecx */
 #ifndef bit_LZCNT
 #define bit_LZCNT       (1 << 5)
 #endif
 
+/*
+ * Vector extensions that are both supported by the host and enabled by
+ * the OS, as returned by cpuid_vector_features().
+ */
+#define CPUID_VEC_SSE2      (1 << 0)
+#define CPUID_VEC_SSE4_1    (1 << 1)
+#define CPUID_VEC_AVX2      (1 << 2)
+#define CPUID_VEC_AVX512F   (1 << 3)
+#define CPUID_VEC_AVX512BW  (1 << 4)
+
+static inline unsigned cpuid_vector_features(void)
+{
+    int max = __get_cpuid_max(0, NULL);
+    int a, b, c, d;
+    unsigned features = 0;
+
+    if (max < 1) {
+        return 0;
+    }
+
+    __cpuid(1, a, b, c, d);
+    if (d & bit_SSE2) {
+        features |= CPUID_VEC_SSE2;
+    }
+    if (c & bit_SSE4_1) {
+        features |= CPUID_VEC_SSE4_1;
+    }
+
+    /* We must check that AVX is not just available, but usable.  */
+    if ((c & bit_OSXSAVE) && (c & bit_AVX) && max >= 7) {
+        int bv;
+        __asm("xgetbv" : "=a"(bv), "=d"(d) : "c"(0));
+        __cpuid_count(7, 0, a, b, c, d);
+        if ((bv & 0x6) == 0x6 && (b & bit_AVX2)) {
+            features |= CPUID_VEC_AVX2;
+        }
+        /* 0xe6:
+         *  XCR0[7:5] = 111b (OPMASK state, upper 256-bit of ZMM0-ZMM15
+         *                    and ZMM16-ZMM31 state are enabled by OS)
+         *  XCR0[2:1] = 11b (XMM state and YMM state are enabled by OS)
+         */
+        if ((bv & 0xe6) == 0xe6) {
+            if (b & bit_AVX512F) {
+                features |= CPUID_VEC_AVX512F;
+            }
+            if (b & bit_AVX512BW) {
+                features |= CPUID_VEC_AVX512BW;
+            }
+        }
+    }
+    return features;
+}
+
 #endif /* QEMU_CPUID_H */
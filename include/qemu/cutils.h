@@ -174,6 +174,8 @@ char *freq_to_str(uint64_t freq_hz);
 #define STR_OR_NULL(str) ((str) ? (str) : "null")
 
 bool buffer_is_zero(const void *buf, size_t len);
+size_t buffer_find_zero_extent(const void *buf, size_t len, size_t block,
+                               bool *is_zero);
 bool test_buffer_is_zero_next_accel(void);
 
 /*
@@ -349,4 +349,14 @@ bool hbitmap_next_dirty_area(const HBitmap *hb, int64_t start, int64_t end,
  */
 int64_t hbitmap_iter_next(HBitmapIter *hbi);
 
+/**
+ * test_hbitmap_next_accel:
+ *
+ * Switch the word search used by hbitmap_next_zero and
+ * hbitmap_deserialize_finish to the next less preferred implementation.
+ * Returns false once the generic implementation has been tested.  For
+ * unit tests only.
+ */
+bool test_hbitmap_next_accel(void);
+
 #endif
@@ -177,6 +177,13 @@ void qemu_thread_create(QemuThread *thread, const char *name,
 void *qemu_thread_join(QemuThread *thread);
 void qemu_thread_get_self(QemuThread *thread);
 bool qemu_thread_is_self(QemuThread *thread);
+/*
+ * Restrict @thread to the host CPUs set in the @nbits bitmap @host_cpus.
+ * Returns 0 on success, -ENOSYS if the host does not support it, or another
+ * negative errno value.
+ */
+int qemu_thread_set_affinity(QemuThread *thread, unsigned long *host_cpus,
+                             unsigned long nbits);
 void qemu_thread_exit(void *retval) QEMU_NORETURN;
 void qemu_thread_naming(bool enable);
 
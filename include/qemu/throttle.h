@@ -151,6 +151,15 @@ bool throttle_schedule_timer(ThrottleState *ts,
                              ThrottleTimers *tt,
                              bool is_write);
 
+void throttle_get_headroom(ThrottleState *ts, bool is_write, int64_t now,
+                           double *bytes, double *units);
+
+void throttle_account_units(ThrottleState *ts, bool is_write,
+                            double bytes, double units);
+void throttle_refund_units(ThrottleState *ts, bool is_write,
+                           int64_t charged_at, int64_t now,
+                           double charged_bytes, double charged_units,
+                           double bytes, double units);
 void throttle_account(ThrottleState *ts, bool is_write, uint64_t size);
 void throttle_limits_to_config(ThrottleLimits *arg, ThrottleConfig *cfg,
                                Error **errp);
@@ -16,6 +16,7 @@
 #include "io/channel-file.h"
 #include "io/net-listener.h"
 #include "qemu/error-report.h"
+#include "qemu/thread.h"
 #include "qapi/error.h"
 #include "standard-headers/linux/virtio_blk.h"
 
@@ -25,6 +26,9 @@ typedef struct VuFdWatch {
     int fd; /*kick fd*/
     void *pvt;
     vu_watch_cb cb;
+    /* Fixed AioContext for the fd, or NULL to follow VuServer.ctx */
+    AioContext *queue_ctx;
+    bool removed;
     QTAILQ_ENTRY(VuFdWatch) next;
 } VuFdWatch;
 
@@ -32,7 +36,8 @@ typedef struct VuFdWatch {
  * VuServer:
  * A vhost-user server instance with user-defined VuDevIface callbacks.
  * Vhost-user device backends can be implemented using VuServer. VuDevIface
- * callbacks and virtqueue kicks run in the given AioContext.
+ * callbacks and virtqueue kicks run in the given AioContext, except for
+ * kicks of virtqueues that have been assigned their own AioContext.
  */
 typedef struct {
     QIONetListener *listener;
@@ -41,6 +46,29 @@ typedef struct {
     int max_queues;
     const VuDevIface *vu_iface;
 
+    /*
+     * queue_ctx[i] is the AioContext in which kicks of virtqueue i are
+     * handled, or NULL for ctx.  NULL if no virtqueue has its own.
+     */
+    AioContext **queue_ctx;
+
+    /*
+     * Serializes access to vu_dev between ctx and the queue AioContexts.
+     * Held while handling kicks and vhost-user messages; device code must
+     * take it itself when calling into libvhost-user from anywhere else
+     * (e.g. to complete requests).
+     */
+    QemuRecMutex vu_lock;
+    bool msg_locked; /* vu_lock is held for the current message */
+
+    /*
+     * Requests that device code has taken from a virtqueue, but not
+     * completed yet.  The client connection (and vu_lock) is kept until
+     * they are.  Accessed atomically.
+     */
+    unsigned int in_flight;
+    bool wait_idle; /* vu_client_trip() waits for in_flight to reach 0 */
+
     /* Protected by ctx lock */
     VuDev vu_dev;
     QIOChannel *ioc; /* The I/O channel with the client */
@@ -54,11 +82,15 @@ bool vhost_user_server_start(VuServer *server,
                              SocketAddress *unix_socket,
                              AioContext *ctx,
                              uint16_t max_queues,
+                             AioContext **queue_ctx,
                              const VuDevIface *vu_iface,
                              Error **errp);
 
 void vhost_user_server_stop(VuServer *server);
 
+void vhost_user_server_inc_in_flight(VuServer *server);
+void vhost_user_server_dec_in_flight(VuServer *server);
+
 void vhost_user_server_attach_aio_context(VuServer *server, AioContext *ctx);
 void vhost_user_server_detach_aio_context(VuServer *server);
 
@@ -37,6 +37,12 @@ struct IOThread {
     int64_t poll_max_ns;
     int64_t poll_grow;
     int64_t poll_shrink;
+
+    /* AioContext thread pool parameters */
+    int64_t thread_pool_min;
+    int64_t thread_pool_max;
+    char *thread_pool_cpus;     /* host CPU list like "0-3,8", or NULL */
+    int64_t thread_pool_node;   /* host NUMA node, or -1 */
 };
 typedef struct IOThread IOThread;
 
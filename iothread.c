@@ -17,9 +17,12 @@
 #include "qemu/module.h"
 #include "block/aio.h"
 #include "block/block.h"
+#include "block/thread-pool.h"
 #include "sysemu/iothread.h"
 #include "qapi/error.h"
 #include "qapi/qapi-commands-misc.h"
+#include "qemu/bitmap.h"
+#include "qemu/cutils.h"
 #include "qemu/error-report.h"
 #include "qemu/rcu.h"
 #include "qemu/main-loop.h"
@@ -39,6 +42,9 @@ DECLARE_CLASS_CHECKERS(IOThreadClass, IOTHREAD,
 #define IOTHREAD_POLL_MAX_NS_DEFAULT 0ULL
 #endif
 
+/* Upper bound for host CPU numbers in thread-pool-cpus */
+#define IOTHREAD_MAX_HOST_CPUS 65536
+
 static __thread IOThread *my_iothread;
 
 AioContext *qemu_get_current_aio_context(void)
@@ -113,6 +119,8 @@ static void iothread_instance_init(Object *obj)
     IOThread *iothread = IOTHREAD(obj);
 
     iothread->poll_max_ns = IOTHREAD_POLL_MAX_NS_DEFAULT;
+    iothread->thread_pool_max = THREAD_POOL_MAX_THREADS_DEFAULT;
+    iothread->thread_pool_node = -1;
     iothread->thread_id = -1;
     qemu_sem_init(&iothread->init_done_sem, 0);
     /* By default, we don't run gcontext */
@@ -146,6 +154,7 @@ static void iothread_instance_finalize(Object *obj)
         iothread->main_loop = NULL;
     }
     qemu_sem_destroy(&iothread->init_done_sem);
+    g_free(iothread->thread_pool_cpus);
 }
 
 static void iothread_init_gcontext(IOThread *iothread)
@@ -159,6 +168,108 @@ static void iothread_init_gcontext(IOThread *iothread)
     iothread->main_loop = g_main_loop_new(iothread->worker_context, TRUE);
 }
 
+/*
+ * Parse a host CPU list like "0-3,8" into a newly allocated bitmap of
+ * *nr_cpus bits.
+ */
+static unsigned long *iothread_parse_cpu_list(const char *str,
+                                              unsigned long *nr_cpus,
+                                              Error **errp)
+{
+    g_auto(GStrv) ranges = g_strsplit(str, ",", -1);
+    g_autofree unsigned long *first = g_new(unsigned long,
+                                            g_strv_length(ranges));
+    g_autofree unsigned long *last = g_new(unsigned long,
+                                           g_strv_length(ranges));
+    unsigned long *cpus;
+    int i;
+
+    *nr_cpus = 0;
+    for (i = 0; ranges[i]; i++) {
+        const char *end;
+
+        if (qemu_strtoul(ranges[i], &end, 10, &first[i]) < 0) {
+            goto fail;
+        }
+        last[i] = first[i];
+        if (*end == '-' && qemu_strtoul(end + 1, &end, 10, &last[i]) < 0) {
+            goto fail;
+        }
+        if (*end || last[i] < first[i] || last[i] >= IOTHREAD_MAX_HOST_CPUS) {
+            goto fail;
+        }
+        *nr_cpus = MAX(*nr_cpus, last[i] + 1);
+    }
+    if (!*nr_cpus) {
+        goto fail;
+    }
+
+    cpus = bitmap_new(*nr_cpus);
+    for (i = 0; ranges[i]; i++) {
+        bitmap_set(cpus, first[i], last[i] - first[i] + 1);
+    }
+    return cpus;
+
+fail:
+    error_setg(errp, "Invalid host CPU list '%s'", str);
+    return NULL;
+}
+
+/* Returns a bitmap of the host CPUs of a NUMA node */
+static unsigned long *iothread_get_node_cpus(int64_t node,
+                                             unsigned long *nr_cpus,
+                                             Error **errp)
+{
+#ifdef CONFIG_LINUX
+    g_autofree char *path = NULL;
+    g_autofree char *cpulist = NULL;
+    g_autoptr(GError) err = NULL;
+
+    path = g_strdup_printf("/sys/devices/system/node/node%" PRId64 "/cpulist",
+                           node);
+    if (!g_file_get_contents(path, &cpulist, NULL, &err)) {
+        error_setg(errp, "Cannot get CPUs of host NUMA node %" PRId64 ": %s",
+                   node, err->message);
+        return NULL;
+    }
+    return iothread_parse_cpu_list(g_strstrip(cpulist), nr_cpus, errp);
+#else
+    error_setg(errp, "thread-pool-node is not supported on this host");
+    return NULL;
+#endif
+}
+
+static void iothread_set_thread_pool_params(IOThread *iothread, Error **errp)
+{
+    g_autofree unsigned long *cpus = NULL;
+    unsigned long nr_cpus = 0;
+
+    if (iothread->thread_pool_cpus && iothread->thread_pool_node >= 0) {
+        error_setg(errp, "thread-pool-cpus and thread-pool-node are mutually "
+                   "exclusive");
+        return;
+    }
+
+    if (iothread->thread_pool_cpus) {
+        cpus = iothread_parse_cpu_list(iothread->thread_pool_cpus, &nr_cpus,
+                                       errp);
+        if (!cpus) {
+            return;
+        }
+    } else if (iothread->thread_pool_node >= 0) {
+        cpus = iothread_get_node_cpus(iothread->thread_pool_node, &nr_cpus,
+                                      errp);
+        if (!cpus) {
+            return;
+        }
+    }
+
+    aio_context_set_thread_pool_params(iothread->ctx,
+                                       iothread->thread_pool_min,
+                                       iothread->thread_pool_max,
+                                       cpus, nr_cpus, errp);
+}
+
 static void iothread_complete(UserCreatable *obj, Error **errp)
 {
     Error *local_error = NULL;
@@ -183,6 +294,9 @@ static void iothread_complete(UserCreatable *obj, Error **errp)
                                 iothread->poll_grow,
                                 iothread->poll_shrink,
                                 &local_error);
+    if (!local_error) {
+        iothread_set_thread_pool_params(iothread, &local_error);
+    }
     if (local_error) {
         error_propagate(errp, local_error);
         aio_context_unref(iothread->ctx);
@@ -259,6 +373,77 @@ static void iothread_set_poll_param(Object *obj, Visitor *v,
     }
 }
 
+static PollParamInfo thread_pool_min_info = {
+    "thread-pool-min", offsetof(IOThread, thread_pool_min),
+};
+static PollParamInfo thread_pool_max_info = {
+    "thread-pool-max", offsetof(IOThread, thread_pool_max),
+};
+static PollParamInfo thread_pool_node_info = {
+    "thread-pool-node", offsetof(IOThread, thread_pool_node),
+};
+
+static void iothread_set_thread_pool_param(Object *obj, Visitor *v,
+        const char *name, void *opaque, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+    PollParamInfo *info = opaque;
+    int64_t *field = (void *)iothread + info->offset;
+    int64_t value, old_value;
+    Error *local_err = NULL;
+
+    if (!visit_type_int64(v, name, &value, errp)) {
+        return;
+    }
+
+    /* thread-pool-node uses -1 for no binding */
+    if (value < (info == &thread_pool_node_info ? -1 : 0) ||
+        value > INT_MAX) {
+        error_setg(errp, "%s value must be in range [%d, %d]", info->name,
+                   info == &thread_pool_node_info ? -1 : 0, INT_MAX);
+        return;
+    }
+
+    old_value = *field;
+    *field = value;
+
+    if (iothread->ctx) {
+        iothread_set_thread_pool_params(iothread, &local_err);
+        if (local_err) {
+            error_propagate(errp, local_err);
+            *field = old_value;
+        }
+    }
+}
+
+static char *iothread_get_thread_pool_cpus(Object *obj, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+
+    return g_strdup(iothread->thread_pool_cpus ?: "");
+}
+
+static void iothread_set_thread_pool_cpus(Object *obj, const char *value,
+                                          Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+    char *old_value = iothread->thread_pool_cpus;
+    Error *local_err = NULL;
+
+    iothread->thread_pool_cpus = *value ? g_strdup(value) : NULL;
+
+    if (iothread->ctx) {
+        iothread_set_thread_pool_params(iothread, &local_err);
+        if (local_err) {
+            error_propagate(errp, local_err);
+            g_free(iothread->thread_pool_cpus);
+            iothread->thread_pool_cpus = old_value;
+            return;
+        }
+    }
+    g_free(old_value);
+}
+
 static void iothread_class_init(ObjectClass *klass, void *class_data)
 {
     UserCreatableClass *ucc = USER_CREATABLE_CLASS(klass);
@@ -276,6 +461,21 @@ static void iothread_class_init(ObjectClass *klass, void *class_data)
                               iothread_get_poll_param,
                               iothread_set_poll_param,
                               NULL, &poll_shrink_info);
+    object_class_property_add(klass, "thread-pool-min", "int",
+                              iothread_get_poll_param,
+                              iothread_set_thread_pool_param,
+                              NULL, &thread_pool_min_info);
+    object_class_property_add(klass, "thread-pool-max", "int",
+                              iothread_get_poll_param,
+                              iothread_set_thread_pool_param,
+                              NULL, &thread_pool_max_info);
+    object_class_property_add(klass, "thread-pool-node", "int",
+                              iothread_get_poll_param,
+                              iothread_set_thread_pool_param,
+                              NULL, &thread_pool_node_info);
+    object_class_property_add_str(klass, "thread-pool-cpus",
+                                  iothread_get_thread_pool_cpus,
+                                  iothread_set_thread_pool_cpus);
 }
 
 static const TypeInfo iothread_info = {
@@ -325,6 +525,33 @@ static int query_one_iothread(Object *object, void *opaque)
     info->poll_max_ns = iothread->poll_max_ns;
     info->poll_grow = iothread->poll_grow;
     info->poll_shrink = iothread->poll_shrink;
+    info->thread_pool_min = iothread->thread_pool_min;
+    info->thread_pool_max = iothread->thread_pool_max;
+    if (iothread->ctx) {
+        uint64_t sqes, cqes;
+        ThreadPoolStats stats;
+
+        if (aio_context_get_fdmon_stats(iothread->ctx, &sqes, &cqes)) {
+            info->has_io_uring_sqes = true;
+            info->io_uring_sqes = sqes;
+            info->has_io_uring_cqes = true;
+            info->io_uring_cqes = cqes;
+        }
+
+        if (aio_context_get_thread_pool_stats(iothread->ctx, &stats)) {
+            info->has_thread_pool = true;
+            info->thread_pool = g_new(ThreadPoolInfo, 1);
+            *info->thread_pool = (ThreadPoolInfo) {
+                .threads            = stats.threads,
+                .idle_threads       = stats.idle_threads,
+                .queue_depth        = stats.queue_depth,
+                .max_queue_depth    = stats.max_queue_depth,
+                .requests           = stats.requests,
+                .wait_ns            = stats.wait_ns,
+                .max_wait_ns        = stats.max_wait_ns,
+            };
+        }
+    }
 
     QAPI_LIST_APPEND(*tail, info);
     return 0;
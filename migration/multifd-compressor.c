@@ -0,0 +1,354 @@
+/*
+ * Multifd page compressors
+ *
+ * Framing for compression methods that work on one page at a time.  The
+ * packet payload is the dictionary size used by the sender, followed by
+ * the compressed size of every page and then the compressed pages:
+ *
+ *   be32 dict_size, be32 size[used], data
+ *
+ * The pages of a channel are compressed as one stream, so every page can
+ * refer back to the last dict_size bytes of the pages sent before it on
+ * the same channel.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/bswap.h"
+#include "exec/target_page.h"
+#include "qapi/error.h"
+#include "migration.h"
+#include "trace.h"
+#include "multifd.h"
+
+struct compressor_data {
+    const MultiFDCompressor *c;
+    /* compressor or decompressor state */
+    void *state;
+    /* history shared with the other side, NULL if dict_size is 0 */
+    uint8_t *ring;
+    uint32_t ring_size;
+    uint32_t ring_offset;
+    /* packet payload */
+    uint8_t *buf;
+    uint32_t buf_len;
+};
+
+static const MultiFDCompressor *compressors[MULTIFD_COMPRESSION__MAX];
+
+static size_t compressor_header_size(uint32_t used)
+{
+    return sizeof(uint32_t) * (1 + used);
+}
+
+/**
+ * compressor_ring_get: find the place of the next page in the history
+ *
+ * Both sides must get the same address for the same page, so that the
+ * references into the history resolve to the same data.
+ *
+ * Returns the address in the ring buffer
+ *
+ * @z: compressor data of the channel
+ * @page_size: size of the page
+ */
+static uint8_t *compressor_ring_get(struct compressor_data *z,
+                                    size_t page_size)
+{
+    uint8_t *p;
+
+    if (z->ring_offset + page_size > z->ring_size) {
+        z->ring_offset = 0;
+    }
+    p = z->ring + z->ring_offset;
+    z->ring_offset += page_size;
+    return p;
+}
+
+static struct compressor_data *compressor_data_new(uint32_t page_count,
+                                                   uint32_t dict_size)
+{
+    struct compressor_data *z = g_new0(struct compressor_data, 1);
+    size_t page_size = qemu_target_page_size();
+
+    z->c = compressors[migrate_multifd_compression()];
+    if (dict_size) {
+        z->ring_size = ROUND_UP(dict_size, page_size) + page_size;
+        z->ring = g_malloc0(z->ring_size);
+    }
+    z->buf_len = compressor_header_size(page_count) +
+                 page_count * z->c->compress_bound(page_size);
+    z->buf = g_try_malloc(z->buf_len);
+    return z;
+}
+
+static void compressor_data_free(struct compressor_data *z)
+{
+    g_free(z->ring);
+    g_free(z->buf);
+    g_free(z);
+}
+
+/**
+ * compressor_send_setup: setup send side
+ *
+ * Setup each channel with the compressor of the selected method.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int compressor_send_setup(MultiFDSendParams *p, Error **errp)
+{
+    uint32_t page_count = MULTIFD_PACKET_SIZE / qemu_target_page_size();
+    uint32_t dict_size = migrate_multifd_dict_size();
+    struct compressor_data *z = compressor_data_new(page_count, dict_size);
+
+    if (!z->buf) {
+        compressor_data_free(z);
+        error_setg(errp, "multifd %d: out of memory for compressed buffer",
+                   p->id);
+        return -1;
+    }
+
+    z->state = z->c->compress_init(dict_size, errp);
+    if (!z->state) {
+        compressor_data_free(z);
+        error_prepend(errp, "multifd %d: ", p->id);
+        return -1;
+    }
+    p->data = z;
+    return 0;
+}
+
+/**
+ * compressor_send_cleanup: cleanup send side
+ *
+ * Free the compressor state and the buffers.
+ *
+ * @p: Params for the channel that we are using
+ */
+static void compressor_send_cleanup(MultiFDSendParams *p, Error **errp)
+{
+    struct compressor_data *z = p->data;
+
+    z->c->compress_cleanup(z->state);
+    compressor_data_free(z);
+    p->data = NULL;
+}
+
+/**
+ * compressor_send_prepare: prepare date to be able to send
+ *
+ * Compress the pages one after the other into the packet payload.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @used: number of pages used
+ * @errp: pointer to an error
+ */
+static int compressor_send_prepare(MultiFDSendParams *p, uint32_t used,
+                                   Error **errp)
+{
+    struct iovec *iov = p->pages->iov;
+    struct compressor_data *z = p->data;
+    uint32_t *header = (uint32_t *)z->buf;
+    size_t offset = compressor_header_size(used);
+    uint32_t i;
+
+    header[0] = cpu_to_be32(z->ring ? z->ring_size - qemu_target_page_size()
+                                    : 0);
+
+    for (i = 0; i < used; i++) {
+        const uint8_t *src = iov[i].iov_base;
+        int ret;
+
+        if (z->ring) {
+            uint8_t *page = compressor_ring_get(z, iov[i].iov_len);
+
+            memcpy(page, src, iov[i].iov_len);
+            src = page;
+        }
+
+        ret = z->c->compress(z->state, src, iov[i].iov_len, z->buf + offset,
+                             z->buf_len - offset, errp);
+        if (ret < 0) {
+            error_prepend(errp, "multifd %d: ", p->id);
+            return -1;
+        }
+        header[i + 1] = cpu_to_be32(ret);
+        offset += ret;
+    }
+    p->next_packet_size = offset;
+    p->flags |= z->c->flag;
+
+    return 0;
+}
+
+/**
+ * compressor_send_write: do the actual write of the data
+ *
+ * Do the actual write of the compressed buffer.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @used: number of pages used
+ * @errp: pointer to an error
+ */
+static int compressor_send_write(MultiFDSendParams *p, uint32_t used,
+                                 Error **errp)
+{
+    struct compressor_data *z = p->data;
+
+    return qio_channel_write_all(p->c, (void *)z->buf, p->next_packet_size,
+                                 errp);
+}
+
+/**
+ * compressor_recv_setup: setup receive side
+ *
+ * Create the decompressor state and the buffers.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int compressor_recv_setup(MultiFDRecvParams *p, Error **errp)
+{
+    uint32_t page_count = MULTIFD_PACKET_SIZE / qemu_target_page_size();
+    uint32_t dict_size = migrate_multifd_dict_size();
+    struct compressor_data *z = compressor_data_new(page_count, dict_size);
+
+    if (!z->buf) {
+        compressor_data_free(z);
+        error_setg(errp, "multifd %d: out of memory for compressed buffer",
+                   p->id);
+        return -1;
+    }
+
+    z->state = z->c->decompress_init(dict_size, errp);
+    if (!z->state) {
+        compressor_data_free(z);
+        error_prepend(errp, "multifd %d: ", p->id);
+        return -1;
+    }
+    p->data = z;
+    return 0;
+}
+
+/**
+ * compressor_recv_cleanup: cleanup receive side
+ *
+ * Free the decompressor state and the buffers.
+ *
+ * @p: Params for the channel that we are using
+ */
+static void compressor_recv_cleanup(MultiFDRecvParams *p)
+{
+    struct compressor_data *z = p->data;
+
+    z->c->decompress_cleanup(z->state);
+    compressor_data_free(z);
+    p->data = NULL;
+}
+
+/**
+ * compressor_recv_pages: read the data from the channel into actual pages
+ *
+ * Read the compressed buffer, and uncompress it page by page.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @used: number of pages used
+ * @errp: pointer to an error
+ */
+static int compressor_recv_pages(MultiFDRecvParams *p, uint32_t used,
+                                 Error **errp)
+{
+    struct compressor_data *z = p->data;
+    uint32_t in_size = p->next_packet_size;
+    uint32_t flags = p->flags & MULTIFD_FLAG_COMPRESSION_MASK;
+    uint32_t *header = (uint32_t *)z->buf;
+    uint32_t dict_size = z->ring ? z->ring_size - qemu_target_page_size() : 0;
+    size_t offset = compressor_header_size(used);
+    uint32_t i;
+    int ret;
+
+    if (flags != z->c->flag) {
+        error_setg(errp, "multifd %d: flags received %x flags expected %x",
+                   p->id, flags, z->c->flag);
+        return -1;
+    }
+    if (in_size > z->buf_len || in_size < offset) {
+        error_setg(errp, "multifd %d: packet size received %u size "
+                   "expected at least %zu and at most %u",
+                   p->id, in_size, offset, z->buf_len);
+        return -1;
+    }
+
+    ret = qio_channel_read_all(p->c, (void *)z->buf, in_size, errp);
+    if (ret != 0) {
+        return ret;
+    }
+
+    if (be32_to_cpu(header[0]) != dict_size) {
+        error_setg(errp, "multifd %d: dictionary size received %u size "
+                   "expected %u", p->id, be32_to_cpu(header[0]), dict_size);
+        return -1;
+    }
+
+    for (i = 0; i < used; i++) {
+        struct iovec *iov = &p->pages->iov[i];
+        uint32_t len = be32_to_cpu(header[i + 1]);
+        uint8_t *dst = iov->iov_base;
+
+        if (len > in_size - offset) {
+            error_setg(errp, "multifd %d: page %u is truncated", p->id, i);
+            return -1;
+        }
+        if (z->ring) {
+            dst = compressor_ring_get(z, iov->iov_len);
+        }
+
+        ret = z->c->decompress(z->state, z->buf + offset, len, dst,
+                               iov->iov_len, errp);
+        if (ret < 0) {
+            error_prepend(errp, "multifd %d: ", p->id);
+            return -1;
+        }
+        if (z->ring) {
+            memcpy(iov->iov_base, dst, iov->iov_len);
+        }
+        offset += len;
+    }
+    if (offset != in_size) {
+        error_setg(errp, "multifd %d: packet size received %u size used %zu",
+                   p->id, in_size, offset);
+        return -1;
+    }
+    return 0;
+}
+
+static MultiFDMethods multifd_compressor_ops = {
+    .send_setup = compressor_send_setup,
+    .send_cleanup = compressor_send_cleanup,
+    .send_prepare = compressor_send_prepare,
+    .send_write = compressor_send_write,
+    .recv_setup = compressor_recv_setup,
+    .recv_cleanup = compressor_recv_cleanup,
+    .recv_pages = compressor_recv_pages
+};
+
+void multifd_register_compressor(int method, const MultiFDCompressor *c)
+{
+    assert(0 < method && method < MULTIFD_COMPRESSION__MAX);
+    compressors[method] = c;
+    multifd_register_ops(method, &multifd_compressor_ops);
+}
@@ -0,0 +1,150 @@
+/*
+ * Multifd lz4 compression implementation
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <lz4.h>
+#include <lz4hc.h>
+#include "qapi/error.h"
+#include "migration.h"
+#include "multifd.h"
+
+struct lz4_data {
+    /* stream for fast compression (level 1) */
+    LZ4_stream_t *stream;
+    /* stream for high compression (levels 2 to 12) */
+    LZ4_streamHC_t *stream_hc;
+    /* stream for decompression */
+    LZ4_streamDecode_t *stream_decode;
+    int level;
+    /* whether the previous pages are used as history */
+    bool dict;
+};
+
+static size_t lz4_compress_bound(size_t len)
+{
+    return LZ4_compressBound(len);
+}
+
+static void *lz4_compress_init(uint32_t dict_size, Error **errp)
+{
+    struct lz4_data *z = g_new0(struct lz4_data, 1);
+
+    z->level = migrate_multifd_lz4_level();
+    z->dict = dict_size != 0;
+    if (z->level > 1) {
+        z->stream_hc = LZ4_createStreamHC();
+        if (z->stream_hc) {
+            LZ4_resetStreamHC_fast(z->stream_hc, z->level);
+        }
+    } else {
+        z->stream = LZ4_createStream();
+    }
+    if (!z->stream && !z->stream_hc) {
+        g_free(z);
+        error_setg(errp, "lz4 create stream failed");
+        return NULL;
+    }
+    return z;
+}
+
+static void lz4_compress_cleanup(void *state)
+{
+    struct lz4_data *z = state;
+
+    LZ4_freeStream(z->stream);
+    LZ4_freeStreamHC(z->stream_hc);
+    g_free(z);
+}
+
+static int lz4_compress(void *state, const uint8_t *src, size_t len,
+                        uint8_t *dst, size_t dst_len, Error **errp)
+{
+    struct lz4_data *z = state;
+    int ret;
+
+    if (z->stream_hc) {
+        if (!z->dict) {
+            LZ4_resetStreamHC_fast(z->stream_hc, z->level);
+        }
+        ret = LZ4_compress_HC_continue(z->stream_hc, (const char *)src,
+                                       (char *)dst, len, dst_len);
+    } else {
+        if (!z->dict) {
+            LZ4_resetStream_fast(z->stream);
+        }
+        ret = LZ4_compress_fast_continue(z->stream, (const char *)src,
+                                         (char *)dst, len, dst_len, 1);
+    }
+    if (ret <= 0) {
+        error_setg(errp, "lz4 compression failed");
+        return -1;
+    }
+    return ret;
+}
+
+static void *lz4_decompress_init(uint32_t dict_size, Error **errp)
+{
+    struct lz4_data *z = g_new0(struct lz4_data, 1);
+
+    z->dict = dict_size != 0;
+    z->stream_decode = LZ4_createStreamDecode();
+    if (!z->stream_decode) {
+        g_free(z);
+        error_setg(errp, "lz4 create decode stream failed");
+        return NULL;
+    }
+    return z;
+}
+
+static void lz4_decompress_cleanup(void *state)
+{
+    struct lz4_data *z = state;
+
+    LZ4_freeStreamDecode(z->stream_decode);
+    g_free(z);
+}
+
+static int lz4_decompress(void *state, const uint8_t *src, size_t src_len,
+                          uint8_t *dst, size_t len, Error **errp)
+{
+    struct lz4_data *z = state;
+    int ret;
+
+    if (z->dict) {
+        ret = LZ4_decompress_safe_continue(z->stream_decode,
+                                           (const char *)src, (char *)dst,
+                                           src_len, len);
+    } else {
+        ret = LZ4_decompress_safe((const char *)src, (char *)dst,
+                                  src_len, len);
+    }
+    if (ret != len) {
+        error_setg(errp, "lz4 decompression failed: got %d bytes, "
+                   "expected %zu", ret, len);
+        return -1;
+    }
+    return 0;
+}
+
+static const MultiFDCompressor multifd_lz4_compressor = {
+    .flag = MULTIFD_FLAG_LZ4,
+    .compress_bound = lz4_compress_bound,
+    .compress_init = lz4_compress_init,
+    .compress_cleanup = lz4_compress_cleanup,
+    .compress = lz4_compress,
+    .decompress_init = lz4_decompress_init,
+    .decompress_cleanup = lz4_decompress_cleanup,
+    .decompress = lz4_decompress,
+};
+
+static void multifd_lz4_register(void)
+{
+    multifd_register_compressor(MULTIFD_COMPRESSION_LZ4,
+                                &multifd_lz4_compressor);
+}
+
+migration_init(multifd_lz4_register);
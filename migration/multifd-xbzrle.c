@@ -0,0 +1,412 @@
+/*
+ * Multifd xbzrle delta encoding
+ *
+ * Every page that is sent is kept in a page cache.  When the page is sent
+ * again, only the difference to the cached version is sent, encoded with
+ * xbzrle.  The receiving side applies the difference to the page in guest
+ * memory, so it needs no cache.
+ *
+ * The cache is split into one shard per channel.  A page is always looked
+ * up in the same shard, whichever channel sends it, and the shards are
+ * locked separately so that the channels rarely wait for each other.
+ *
+ * The packet payload is the size of every page, followed by the data:
+ *
+ *   be32 size[used], data
+ *
+ * A size of 0 means that the page did not change, a size of a whole page
+ * that the page is sent as is, any other size is an xbzrle encoded page.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/bswap.h"
+#include "qemu/host-utils.h"
+#include "exec/ramblock.h"
+#include "exec/target_page.h"
+#include "qapi/error.h"
+#include "migration.h"
+#include "ram.h"
+#include "page_cache.h"
+#include "xbzrle.h"
+#include "multifd.h"
+
+typedef struct {
+    QemuMutex lock;
+    PageCache *cache;
+} XBZRLEShard;
+
+static struct {
+    XBZRLEShard *shards;
+    int count;
+    /* number of channels that use the shards */
+    int users;
+    uint8_t *zero_page;
+} xbzrle_shards;
+
+struct xbzrle_data {
+    /* packet payload */
+    uint8_t *buf;
+    uint32_t buf_len;
+    /* copy of the page that is being sent */
+    uint8_t *current;
+};
+
+/*
+ * Consecutive pages mostly end up in the same packet, so keep them in the
+ * same shard too.
+ */
+static XBZRLEShard *xbzrle_shard_get(ram_addr_t addr)
+{
+    return &xbzrle_shards.shards[(addr / MULTIFD_PACKET_SIZE) %
+                                 xbzrle_shards.count];
+}
+
+/**
+ * multifd_xbzrle_cache_zero_page: let the cache know about a zero page
+ *
+ * Zero pages are not sent through the compression method, so the cache
+ * must be told that the page is now zero.  Otherwise a later version of
+ * the page would be encoded against stale data.
+ *
+ * @addr: address of the page in the ram_addr_t space
+ */
+void multifd_xbzrle_cache_zero_page(ram_addr_t addr)
+{
+    XBZRLEShard *shard;
+
+    if (!xbzrle_shards.shards) {
+        return;
+    }
+
+    shard = xbzrle_shard_get(addr);
+    qemu_mutex_lock(&shard->lock);
+    /* We don't care if this fails to allocate a new cache page */
+    cache_insert(shard->cache, addr, xbzrle_shards.zero_page,
+                 ram_counters.dirty_sync_count);
+    qemu_mutex_unlock(&shard->lock);
+}
+
+/**
+ * xbzrle_send_setup: setup send side
+ *
+ * Create the cache shard of the channel and the buffers.  The setup of
+ * all channels is done before any of the channels starts sending, so the
+ * shards of the other channels are ready when they are needed.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int xbzrle_send_setup(MultiFDSendParams *p, Error **errp)
+{
+    size_t page_size = qemu_target_page_size();
+    uint32_t page_count = MULTIFD_PACKET_SIZE / page_size;
+    struct xbzrle_data *z;
+    XBZRLEShard *shard;
+    uint64_t cache_size;
+
+    if (!xbzrle_shards.shards) {
+        xbzrle_shards.count = migrate_multifd_channels();
+        xbzrle_shards.shards = g_new0(XBZRLEShard, xbzrle_shards.count);
+        xbzrle_shards.zero_page = g_malloc0(page_size);
+    }
+    xbzrle_shards.users++;
+
+    shard = &xbzrle_shards.shards[p->id];
+    cache_size = migrate_xbzrle_cache_size() / xbzrle_shards.count;
+    cache_size = pow2floor(MAX(cache_size / page_size, 1)) * page_size;
+    shard->cache = cache_init(cache_size, page_size, errp);
+    if (!shard->cache) {
+        error_prepend(errp, "multifd %d: ", p->id);
+        return -1;
+    }
+    qemu_mutex_init(&shard->lock);
+
+    z = g_new0(struct xbzrle_data, 1);
+    z->buf_len = sizeof(uint32_t) * page_count + MULTIFD_PACKET_SIZE;
+    z->buf = g_try_malloc(z->buf_len);
+    z->current = g_try_malloc(page_size);
+    p->data = z;
+    if (!z->buf || !z->current) {
+        error_setg(errp, "multifd %d: out of memory for xbzrle buffers",
+                   p->id);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * xbzrle_send_cleanup: cleanup send side
+ *
+ * Free the cache shard of the channel and the buffers.  The last channel
+ * frees the shards.
+ *
+ * @p: Params for the channel that we are using
+ */
+static void xbzrle_send_cleanup(MultiFDSendParams *p, Error **errp)
+{
+    struct xbzrle_data *z = p->data;
+    XBZRLEShard *shard;
+
+    if (!xbzrle_shards.shards || p->id >= xbzrle_shards.count) {
+        return;
+    }
+
+    shard = &xbzrle_shards.shards[p->id];
+    if (shard->cache) {
+        cache_fini(shard->cache);
+        shard->cache = NULL;
+        qemu_mutex_destroy(&shard->lock);
+    }
+    if (z) {
+        g_free(z->buf);
+        g_free(z->current);
+        g_free(z);
+        p->data = NULL;
+    }
+
+    if (--xbzrle_shards.users == 0) {
+        g_free(xbzrle_shards.shards);
+        xbzrle_shards.shards = NULL;
+        g_free(xbzrle_shards.zero_page);
+        xbzrle_shards.zero_page = NULL;
+        xbzrle_shards.count = 0;
+    }
+}
+
+/**
+ * xbzrle_send_page: encode one page into the packet payload
+ *
+ * The page is copied first, so that the cache gets exactly the data that
+ * the other side will have, even if the guest is changing the page.
+ *
+ * Returns the size of the page in the payload
+ *
+ * @z: xbzrle data of the channel
+ * @addr: address of the page in the ram_addr_t space
+ * @page: the page in guest memory
+ * @out: where to put the page in the payload
+ */
+static uint32_t xbzrle_send_page(struct xbzrle_data *z, ram_addr_t addr,
+                                 const uint8_t *page, uint8_t *out)
+{
+    size_t page_size = qemu_target_page_size();
+    uint64_t age = ram_counters.dirty_sync_count;
+    XBZRLEShard *shard = xbzrle_shard_get(addr);
+    int ret = -1;
+
+    memcpy(z->current, page, page_size);
+
+    qemu_mutex_lock(&shard->lock);
+    if (cache_is_cached(shard->cache, addr, age)) {
+        uint8_t *cached = get_cached_data(shard->cache, addr);
+
+        /* Anything that is not smaller than the page is sent as is */
+        ret = xbzrle_encode_buffer(cached, z->current, page_size, out,
+                                   page_size - 1);
+        if (ret >= 0) {
+            memcpy(cached, z->current, page_size);
+        }
+    }
+    if (ret < 0) {
+        /* We don't care if this fails to allocate a new cache page */
+        cache_insert(shard->cache, addr, z->current, age);
+    }
+    qemu_mutex_unlock(&shard->lock);
+
+    if (ret < 0) {
+        memcpy(out, z->current, page_size);
+        return page_size;
+    }
+    return ret;
+}
+
+/**
+ * xbzrle_send_prepare: prepare date to be able to send
+ *
+ * Encode the pages against the cache, and update the cache with the
+ * zero pages that the channel found.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @used: number of pages used
+ * @errp: pointer to an error
+ */
+static int xbzrle_send_prepare(MultiFDSendParams *p, uint32_t used,
+                               Error **errp)
+{
+    struct xbzrle_data *z = p->data;
+    MultiFDPages_t *pages = p->pages;
+    uint32_t *header = (uint32_t *)z->buf;
+    size_t offset = sizeof(uint32_t) * used;
+    uint32_t i;
+
+    for (i = 0; i < used; i++) {
+        uint32_t size;
+
+        size = xbzrle_send_page(z, pages->block->offset + pages->offset[i],
+                                pages->iov[i].iov_base, z->buf + offset);
+        header[i] = cpu_to_be32(size);
+        offset += size;
+    }
+    for (i = used; i < pages->used; i++) {
+        multifd_xbzrle_cache_zero_page(pages->block->offset +
+                                       pages->offset[i]);
+    }
+    p->next_packet_size = offset;
+    p->flags |= MULTIFD_FLAG_XBZRLE;
+
+    return 0;
+}
+
+/**
+ * xbzrle_send_write: do the actual write of the data
+ *
+ * Do the actual write of the encoded buffer.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @used: number of pages used
+ * @errp: pointer to an error
+ */
+static int xbzrle_send_write(MultiFDSendParams *p, uint32_t used, Error **errp)
+{
+    struct xbzrle_data *z = p->data;
+
+    return qio_channel_write_all(p->c, (void *)z->buf, p->next_packet_size,
+                                 errp);
+}
+
+/**
+ * xbzrle_recv_setup: setup receive side
+ *
+ * Create the buffer for the payload.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int xbzrle_recv_setup(MultiFDRecvParams *p, Error **errp)
+{
+    uint32_t page_count = MULTIFD_PACKET_SIZE / qemu_target_page_size();
+    struct xbzrle_data *z = g_new0(struct xbzrle_data, 1);
+
+    z->buf_len = sizeof(uint32_t) * page_count + MULTIFD_PACKET_SIZE;
+    z->buf = g_try_malloc(z->buf_len);
+    if (!z->buf) {
+        g_free(z);
+        error_setg(errp, "multifd %d: out of memory for xbzrle buffer",
+                   p->id);
+        return -1;
+    }
+    p->data = z;
+    return 0;
+}
+
+/**
+ * xbzrle_recv_cleanup: cleanup receive side
+ *
+ * Free the buffer for the payload.
+ *
+ * @p: Params for the channel that we are using
+ */
+static void xbzrle_recv_cleanup(MultiFDRecvParams *p)
+{
+    struct xbzrle_data *z = p->data;
+
+    g_free(z->buf);
+    g_free(z);
+    p->data = NULL;
+}
+
+/**
+ * xbzrle_recv_pages: read the data from the channel into actual pages
+ *
+ * Read the payload, and apply the differences to the pages in guest
+ * memory.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @used: number of pages used
+ * @errp: pointer to an error
+ */
+static int xbzrle_recv_pages(MultiFDRecvParams *p, uint32_t used, Error **errp)
+{
+    struct xbzrle_data *z = p->data;
+    size_t page_size = qemu_target_page_size();
+    uint32_t in_size = p->next_packet_size;
+    uint32_t flags = p->flags & MULTIFD_FLAG_COMPRESSION_MASK;
+    uint32_t *header = (uint32_t *)z->buf;
+    size_t offset = sizeof(uint32_t) * used;
+    uint32_t i;
+    int ret;
+
+    if (flags != MULTIFD_FLAG_XBZRLE) {
+        error_setg(errp, "multifd %d: flags received %x flags expected %x",
+                   p->id, flags, MULTIFD_FLAG_XBZRLE);
+        return -1;
+    }
+    if (in_size > z->buf_len || in_size < offset) {
+        error_setg(errp, "multifd %d: packet size received %u size "
+                   "expected at least %zu and at most %u",
+                   p->id, in_size, offset, z->buf_len);
+        return -1;
+    }
+
+    ret = qio_channel_read_all(p->c, (void *)z->buf, in_size, errp);
+    if (ret != 0) {
+        return ret;
+    }
+
+    for (i = 0; i < used; i++) {
+        struct iovec *iov = &p->pages->iov[i];
+        uint32_t size = be32_to_cpu(header[i]);
+
+        if (size > page_size || size > in_size - offset) {
+            error_setg(errp, "multifd %d: page %u has invalid size %u",
+                       p->id, i, size);
+            return -1;
+        }
+        if (size == page_size) {
+            memcpy(iov->iov_base, z->buf + offset, page_size);
+        } else if (size &&
+                   xbzrle_decode_buffer(z->buf + offset, size, iov->iov_base,
+                                        page_size) < 0) {
+            error_setg(errp, "multifd %d: failed to decode page %u",
+                       p->id, i);
+            return -1;
+        }
+        offset += size;
+    }
+    if (offset != in_size) {
+        error_setg(errp, "multifd %d: packet size received %u size used %zu",
+                   p->id, in_size, offset);
+        return -1;
+    }
+    return 0;
+}
+
+static MultiFDMethods multifd_xbzrle_ops = {
+    .send_setup = xbzrle_send_setup,
+    .send_cleanup = xbzrle_send_cleanup,
+    .send_prepare = xbzrle_send_prepare,
+    .send_write = xbzrle_send_write,
+    .recv_setup = xbzrle_recv_setup,
+    .recv_cleanup = xbzrle_recv_cleanup,
+    .recv_pages = xbzrle_recv_pages
+};
+
+static void multifd_xbzrle_register(void)
+{
+    multifd_register_ops(MULTIFD_COMPRESSION_XBZRLE, &multifd_xbzrle_ops);
+}
+
+migration_init(multifd_xbzrle_register);
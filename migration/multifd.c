@@ -12,6 +12,7 @@
 
 #include "qemu/osdep.h"
 #include "qemu/rcu.h"
+#include "qemu/cutils.h"
 #include "exec/target_page.h"
 #include "sysemu/sysemu.h"
 #include "exec/ramblock.h"
@@ -94,7 +95,8 @@ static int nocomp_send_prepare(MultiFDSendParams *p, uint32_t used,
 /**
  * nocomp_send_write: do the actual write of the data
  *
- * For no compression we just have to write the data.
+ * For no compression we just have to write the data.  With zero copy
+ * send, it is sent straight from guest memory.
  *
  * Returns 0 for success or -1 for error
  *
@@ -104,7 +106,8 @@ static int nocomp_send_prepare(MultiFDSendParams *p, uint32_t used,
  */
 static int nocomp_send_write(MultiFDSendParams *p, uint32_t used, Error **errp)
 {
-    return qio_channel_writev_all(p->c, p->pages->iov, used, errp);
+    return qio_channel_writev_full_all(p->c, p->pages->iov, used, NULL, 0,
+                                       p->write_flags, errp);
 }
 
 /**
@@ -253,6 +256,8 @@ static void multifd_pages_clear(MultiFDPages_t *pages)
 {
     pages->used = 0;
     pages->allocated = 0;
+    pages->normal_num = 0;
+    pages->zero_num = 0;
     pages->packet_num = 0;
     pages->block = NULL;
     g_free(pages->iov);
@@ -269,7 +274,8 @@ static void multifd_send_fill_packet(MultiFDSendParams *p)
 
     packet->flags = cpu_to_be32(p->flags);
     packet->pages_alloc = cpu_to_be32(p->pages->allocated);
-    packet->pages_used = cpu_to_be32(p->pages->used);
+    packet->pages_used = cpu_to_be32(p->pages->normal_num);
+    packet->zero_pages = cpu_to_be32(p->pages->zero_num);
     packet->next_packet_size = cpu_to_be32(p->next_packet_size);
     packet->packet_num = cpu_to_be64(p->packet_num);
 
@@ -330,13 +336,17 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
         p->pages = multifd_pages_init(packet->pages_alloc);
     }
 
-    p->pages->used = be32_to_cpu(packet->pages_used);
-    if (p->pages->used > packet->pages_alloc) {
+    p->pages->normal_num = be32_to_cpu(packet->pages_used);
+    p->pages->zero_num = be32_to_cpu(packet->zero_pages);
+    if (p->pages->normal_num > packet->pages_alloc ||
+        p->pages->zero_num > packet->pages_alloc - p->pages->normal_num) {
         error_setg(errp, "multifd: received packet "
-                   "with %d pages and expected maximum pages are %d",
-                   p->pages->used, packet->pages_alloc) ;
+                   "with %d pages and %d zero pages and expected maximum "
+                   "pages are %d", p->pages->normal_num, p->pages->zero_num,
+                   packet->pages_alloc);
         return -1;
     }
+    p->pages->used = p->pages->normal_num + p->pages->zero_num;
 
     p->next_packet_size = be32_to_cpu(packet->next_packet_size);
     p->packet_num = be64_to_cpu(packet->packet_num);
@@ -406,6 +416,28 @@ struct {
  * false.
  */
 
+/*
+ * The migration thread accounts the pages it queues as normal pages.
+ * Fix that up for the zero pages that the channel found since, which
+ * were not sent.  Must be called with p->mutex held.
+ */
+static void multifd_send_account_zero_pages(QEMUFile *f, MultiFDSendParams *p)
+{
+    uint64_t zero_pages = p->zero_pages_unaccounted;
+    uint64_t bytes = zero_pages * qemu_target_page_size();
+
+    if (!zero_pages) {
+        return;
+    }
+
+    qemu_file_update_transfer(f, -(int64_t)bytes);
+    ram_counters.multifd_bytes -= bytes;
+    ram_counters.transferred -= bytes;
+    ram_counters.normal -= zero_pages;
+    ram_counters.duplicate += zero_pages;
+    p->zero_pages_unaccounted = 0;
+}
+
 static int multifd_send_pages(QEMUFile *f)
 {
     int i;
@@ -452,6 +484,7 @@ static int multifd_send_pages(QEMUFile *f)
     qemu_file_update_transfer(f, transferred);
     ram_counters.multifd_bytes += transferred;
     ram_counters.transferred += transferred;
+    multifd_send_account_zero_pages(f, p);
     qemu_mutex_unlock(&p->mutex);
     qemu_sem_post(&p->sem);
 
@@ -614,10 +647,56 @@ void multifd_send_sync_main(QEMUFile *f)
 
         trace_multifd_send_sync_main_wait(p->id);
         qemu_sem_wait(&p->sem_sync);
+
+        qemu_mutex_lock(&p->mutex);
+        multifd_send_account_zero_pages(f, p);
+        qemu_mutex_unlock(&p->mutex);
     }
     trace_multifd_send_sync_main(multifd_send_state->packet_num);
 }
 
+/**
+ * multifd_send_zero_page_detect: find the zero pages of a packet
+ *
+ * Reorders the pages so that the ones with data come first, and sets
+ * normal_num and zero_num.  Only the offsets of the zero pages are sent.
+ *
+ * @p: Params for the channel that we are using
+ */
+static void multifd_send_zero_page_detect(MultiFDSendParams *p)
+{
+    MultiFDPages_t *pages = p->pages;
+    size_t page_size = qemu_target_page_size();
+    uint32_t i = 0, end = pages->used;
+
+    if (!p->zero_page_detect) {
+        pages->normal_num = pages->used;
+        pages->zero_num = 0;
+        return;
+    }
+
+    /* Move the zero pages to the end, the order of pages doesn't matter */
+    while (i < end) {
+        if (buffer_is_zero(pages->iov[i].iov_base, page_size)) {
+            end--;
+            if (i != end) {
+                ram_addr_t offset = pages->offset[i];
+                struct iovec iov = pages->iov[i];
+
+                pages->offset[i] = pages->offset[end];
+                pages->iov[i] = pages->iov[end];
+                pages->offset[end] = offset;
+                pages->iov[end] = iov;
+            }
+        } else {
+            i++;
+        }
+    }
+
+    pages->normal_num = end;
+    pages->zero_num = pages->used - end;
+}
+
 static void *multifd_send_thread(void *opaque)
 {
     MultiFDSendParams *p = opaque;
@@ -644,10 +723,14 @@ static void *multifd_send_thread(void *opaque)
         qemu_mutex_lock(&p->mutex);
 
         if (p->pending_job) {
-            uint32_t used = p->pages->used;
+            uint32_t used, zero_num;
             uint64_t packet_num = p->packet_num;
             flags = p->flags;
 
+            multifd_send_zero_page_detect(p);
+            /* Only the pages with data go through the methods */
+            zero_num = p->pages->zero_num;
+            used = p->pages->normal_num;
             if (used) {
                 ret = multifd_send_state->ops->send_prepare(p, used,
                                                             &local_err);
@@ -660,11 +743,14 @@ static void *multifd_send_thread(void *opaque)
             p->flags = 0;
             p->num_packets++;
             p->num_pages += used;
+            p->zero_pages_unaccounted += zero_num;
             p->pages->used = 0;
+            p->pages->normal_num = 0;
+            p->pages->zero_num = 0;
             p->pages->block = NULL;
             qemu_mutex_unlock(&p->mutex);
 
-            trace_multifd_send(p->id, packet_num, used, flags,
+            trace_multifd_send(p->id, packet_num, used, zero_num, flags,
                                p->next_packet_size);
 
             ret = qio_channel_write_all(p->c, (void *)p->packet,
@@ -685,6 +771,21 @@ static void *multifd_send_thread(void *opaque)
             qemu_mutex_unlock(&p->mutex);
 
             if (flags & MULTIFD_FLAG_SYNC) {
+                /*
+                 * Pages sent with zero copy may still be read by the
+                 * kernel.  Wait for them before the main thread syncs
+                 * the dirty bitmap, or a page that is re-dirtied and
+                 * sent on another channel could arrive before the old
+                 * version of it.
+                 */
+                if (p->write_flags & QIO_CHANNEL_WRITE_FLAG_ZERO_COPY) {
+                    ret = qio_channel_flush(p->c, &local_err);
+                    if (ret < 0) {
+                        break;
+                    }
+                    trace_multifd_send_flush(p->id, ret);
+                    ret = 0;
+                }
                 qemu_sem_post(&p->sem_sync);
             }
             qemu_sem_post(&multifd_send_state->channels_ready);
@@ -841,6 +942,13 @@ static void multifd_new_send_channel_async(QIOTask *task, gpointer opaque)
     if (qio_task_propagate_error(task, &local_err)) {
         goto cleanup;
     } else {
+        if ((p->write_flags & QIO_CHANNEL_WRITE_FLAG_ZERO_COPY) &&
+            !qio_channel_has_feature(sioc,
+                                     QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY)) {
+            error_setg(&local_err, "multifd: zero copy send is not "
+                       "supported by the migration channel");
+            goto cleanup;
+        }
         p->c = QIO_CHANNEL(sioc);
         qio_channel_set_delay(p->c, false);
         p->running = true;
@@ -890,6 +998,10 @@ int multifd_save_setup(Error **errp)
         p->packet->version = cpu_to_be32(MULTIFD_VERSION);
         p->name = g_strdup_printf("multifdsend_%d", i);
         p->tls_hostname = g_strdup(s->hostname);
+        p->write_flags = migrate_use_zero_copy_send() ?
+                         QIO_CHANNEL_WRITE_FLAG_ZERO_COPY : 0;
+        p->zero_page_detect = migrate_zero_page_detection() ==
+                              ZERO_PAGE_DETECTION_MULTIFD;
         socket_send_channel_create(multifd_new_send_channel_async, p);
     }
 
@@ -1033,6 +1145,31 @@ void multifd_recv_sync_main(void)
     trace_multifd_recv_sync_main(multifd_recv_state->packet_num);
 }
 
+/**
+ * multifd_recv_zero_pages: clear the zero pages of a packet
+ *
+ * Pages that already read as zero are left alone, so that memory the
+ * guest never touched does not get allocated.
+ *
+ * @p: Params for the channel that we are using
+ * @first: index of the first zero page in p->pages
+ * @zero_num: number of zero pages
+ */
+static void multifd_recv_zero_pages(MultiFDRecvParams *p, uint32_t first,
+                                    uint32_t zero_num)
+{
+    size_t page_size = qemu_target_page_size();
+    uint32_t i;
+
+    for (i = first; i < first + zero_num; i++) {
+        void *page = p->pages->iov[i].iov_base;
+
+        if (!buffer_is_zero(page, page_size)) {
+            memset(page, 0, page_size);
+        }
+    }
+}
+
 static void *multifd_recv_thread(void *opaque)
 {
     MultiFDRecvParams *p = opaque;
@@ -1044,6 +1181,7 @@ static void *multifd_recv_thread(void *opaque)
 
     while (true) {
         uint32_t used;
+        uint32_t zero_num;
         uint32_t flags;
 
         if (p->quit) {
@@ -1066,11 +1204,12 @@ static void *multifd_recv_thread(void *opaque)
             break;
         }
 
-        used = p->pages->used;
+        used = p->pages->normal_num;
+        zero_num = p->pages->zero_num;
         flags = p->flags;
         /* recv methods don't know how to handle the SYNC flag */
         p->flags &= ~MULTIFD_FLAG_SYNC;
-        trace_multifd_recv(p->id, p->packet_num, used, flags,
+        trace_multifd_recv(p->id, p->packet_num, used, zero_num, flags,
                            p->next_packet_size);
         p->num_packets++;
         p->num_pages += used;
@@ -1083,6 +1222,10 @@ static void *multifd_recv_thread(void *opaque)
             }
         }
 
+        if (zero_num) {
+            multifd_recv_zero_pages(p, used, zero_num);
+        }
+
         if (flags & MULTIFD_FLAG_SYNC) {
             qemu_sem_post(&multifd_recv_state->sem_sync);
             qemu_sem_wait(&p->sem_sync);
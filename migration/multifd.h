@@ -32,6 +32,8 @@ int multifd_queue_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset);
 #define MULTIFD_FLAG_NOCOMP (0 << 1)
 #define MULTIFD_FLAG_ZLIB (1 << 1)
 #define MULTIFD_FLAG_ZSTD (2 << 1)
+#define MULTIFD_FLAG_LZ4 (3 << 1)
+#define MULTIFD_FLAG_XBZRLE (4 << 1)
 
 /* This value needs to be a multiple of qemu_target_page_size() */
 #define MULTIFD_PACKET_SIZE (512 * 1024)
@@ -46,7 +48,10 @@ typedef struct {
     /* size of the next packet that contains pages */
     uint32_t next_packet_size;
     uint64_t packet_num;
-    uint64_t unused[4];    /* Reserved for future use */
+    /* zero pages, their offsets come after the ones of the used pages */
+    uint32_t zero_pages;
+    uint32_t unused32[1];    /* Reserved for future use */
+    uint64_t unused64[3];    /* Reserved for future use */
     char ramblock[256];
     uint64_t offset[];
 } __attribute__((packed)) MultiFDPacket_t;
@@ -56,6 +61,13 @@ typedef struct {
     uint32_t used;
     /* number of allocated pages */
     uint32_t allocated;
+    /*
+     * Pages that have data, they come first in offset and iov.  Only set
+     * by the channel threads, together with zero_num.
+     */
+    uint32_t normal_num;
+    /* zero pages, they come after the normal pages */
+    uint32_t zero_num;
     /* global number of generated multifd packets */
     uint64_t packet_num;
     /* offset of each page */
@@ -77,6 +89,10 @@ typedef struct {
     QemuThread thread;
     /* communication channel */
     QIOChannel *c;
+    /* flags for writing the pages to the channel */
+    int write_flags;
+    /* look for zero pages before sending */
+    bool zero_page_detect;
     /* sem where to wait for more work */
     QemuSemaphore sem;
     /* this mutex protects the following parameters */
@@ -99,6 +115,8 @@ typedef struct {
     uint32_t next_packet_size;
     /* global number of generated multifd packets */
     uint64_t packet_num;
+    /* zero pages found that the migration thread didn't account yet */
+    uint64_t zero_pages_unaccounted;
     /* thread local variables */
     /* packets sent through this channel */
     uint64_t num_packets;
@@ -168,5 +186,43 @@ typedef struct {
 
 void multifd_register_ops(int method, MultiFDMethods *ops);
 
+void multifd_xbzrle_cache_zero_page(ram_addr_t addr);
+
+/* Largest history that a page compressor keeps per channel */
+#define MULTIFD_DICT_SIZE_MAX (64 * 1024)
+
+/*
+ * A page compressor works on one page at a time.  The generic code in
+ * multifd-compressor.c does the packet framing, so a new compression
+ * method only needs to provide these hooks (and a software or hardware
+ * implementation behind them).
+ *
+ * @dict_size bytes of the previous pages of the channel are available
+ * as history when a page is compressed.  The pages are passed in a ring
+ * buffer of @dict_size plus one page, that is wrapped in the same way on
+ * both sides, so the history may be referenced directly.  With a
+ * @dict_size of 0 every page is compressed independently.
+ */
+typedef struct {
+    /* MULTIFD_FLAG_* of the method */
+    uint32_t flag;
+    /* Worst case compressed size for @len bytes of input */
+    size_t (*compress_bound)(size_t len);
+    /* Allocate the state of a channel for compression */
+    void *(*compress_init)(uint32_t dict_size, Error **errp);
+    void (*compress_cleanup)(void *state);
+    /* Returns the compressed size or -1 for error */
+    int (*compress)(void *state, const uint8_t *src, size_t len,
+                    uint8_t *dst, size_t dst_len, Error **errp);
+    /* Allocate the state of a channel for decompression */
+    void *(*decompress_init)(uint32_t dict_size, Error **errp);
+    void (*decompress_cleanup)(void *state);
+    /* Returns 0 for success or -1 for error */
+    int (*decompress)(void *state, const uint8_t *src, size_t src_len,
+                      uint8_t *dst, size_t len, Error **errp);
+} MultiFDCompressor;
+
+void multifd_register_compressor(int method, const MultiFDCompressor *c);
+
 #endif
 
@@ -12,6 +12,7 @@
  */
 #include "qemu/osdep.h"
 #include "qemu/cutils.h"
+#include "qemu/host-utils.h"
 #include "xbzrle.h"
 
 /*
@@ -24,8 +25,8 @@
 
   length = uleb128 encoded integer
  */
-int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
-                         uint8_t *dst, int dlen)
+static int xbzrle_encode_buffer_int(uint8_t *old_buf, uint8_t *new_buf,
+                                    int slen, uint8_t *dst, int dlen)
 {
     uint32_t zrun_len = 0, nzrun_len = 0;
     int d = 0, i = 0;
@@ -126,6 +127,215 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
     return d;
 }
 
+#if defined(CONFIG_AVX512BW_OPT) || defined(CONFIG_AVX2_OPT)
+/*
+ * The vectorized encoders compare 64 bytes at a time, and find the end of
+ * a run with a count of trailing zeros on the mask of changed bytes.  The
+ * output is the same as the one of xbzrle_encode_buffer_int(), including
+ * where an overflow is detected.
+ *
+ * A run_end function returns the offset of the first byte at or after @i
+ * that is unchanged (if @zrun is false) or changed (if @zrun is true).
+ */
+typedef int (*xbzrle_run_end_fn)(const uint8_t *old_buf,
+                                 const uint8_t *new_buf,
+                                 int i, int slen, bool zrun);
+
+static int xbzrle_run_end_tail(const uint8_t *old_buf, const uint8_t *new_buf,
+                               int i, int slen, bool zrun)
+{
+    while (i < slen && (old_buf[i] == new_buf[i]) == zrun) {
+        i++;
+    }
+    return i;
+}
+
+static int xbzrle_encode_runs(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                              uint8_t *dst, int dlen, xbzrle_run_end_fn run_end)
+{
+    int d = 0, i = 0;
+    int end;
+
+    g_assert(!(((uintptr_t)old_buf | (uintptr_t)new_buf | slen) %
+               sizeof(long)));
+
+    while (i < slen) {
+        /* overflow */
+        if (d + 2 > dlen) {
+            return -1;
+        }
+
+        end = run_end(old_buf, new_buf, i, slen, true);
+
+        /* buffer unchanged */
+        if (end - i == slen) {
+            return 0;
+        }
+
+        /* skip last zero run */
+        if (end == slen) {
+            return d;
+        }
+
+        d += uleb128_encode_small(dst + d, end - i);
+        i = end;
+
+        /* overflow */
+        if (d + 2 > dlen) {
+            return -1;
+        }
+
+        end = run_end(old_buf, new_buf, i, slen, false);
+        d += uleb128_encode_small(dst + d, end - i);
+
+        /* overflow */
+        if (d + end - i > dlen) {
+            return -1;
+        }
+        memcpy(dst + d, new_buf + i, end - i);
+        d += end - i;
+        i = end;
+    }
+
+    return d;
+}
+#endif
+
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+static int xbzrle_run_end_avx2(const uint8_t *old_buf, const uint8_t *new_buf,
+                               int i, int slen, bool zrun)
+{
+    for (; i + 64 <= slen; i += 64) {
+        __m256i o0 = _mm256_loadu_si256((__m256i *)(old_buf + i));
+        __m256i o1 = _mm256_loadu_si256((__m256i *)(old_buf + i + 32));
+        __m256i n0 = _mm256_loadu_si256((__m256i *)(new_buf + i));
+        __m256i n1 = _mm256_loadu_si256((__m256i *)(new_buf + i + 32));
+        uint64_t same, stop;
+
+        same = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(o0, n0)) |
+               (uint64_t)(uint32_t)_mm256_movemask_epi8(
+                   _mm256_cmpeq_epi8(o1, n1)) << 32;
+        stop = zrun ? ~same : same;
+        if (stop) {
+            return i + ctz64(stop);
+        }
+    }
+    return xbzrle_run_end_tail(old_buf, new_buf, i, slen, zrun);
+}
+
+static int xbzrle_encode_buffer_avx2(uint8_t *old_buf, uint8_t *new_buf,
+                                     int slen, uint8_t *dst, int dlen)
+{
+    return xbzrle_encode_runs(old_buf, new_buf, slen, dst, dlen,
+                              xbzrle_run_end_avx2);
+}
+#pragma GCC pop_options
+#endif /* CONFIG_AVX2_OPT */
+
+#ifdef CONFIG_AVX512BW_OPT
+#pragma GCC push_options
+#pragma GCC target("avx512bw")
+#include <immintrin.h>
+
+static int xbzrle_run_end_avx512(const uint8_t *old_buf,
+                                 const uint8_t *new_buf,
+                                 int i, int slen, bool zrun)
+{
+    for (; i + 64 <= slen; i += 64) {
+        __m512i o = _mm512_loadu_si512(old_buf + i);
+        __m512i n = _mm512_loadu_si512(new_buf + i);
+        uint64_t same = _mm512_cmpeq_epi8_mask(o, n);
+        uint64_t stop = zrun ? ~same : same;
+
+        if (stop) {
+            return i + ctz64(stop);
+        }
+    }
+    return xbzrle_run_end_tail(old_buf, new_buf, i, slen, zrun);
+}
+
+static int xbzrle_encode_buffer_avx512(uint8_t *old_buf, uint8_t *new_buf,
+                                       int slen, uint8_t *dst, int dlen)
+{
+    return xbzrle_encode_runs(old_buf, new_buf, slen, dst, dlen,
+                              xbzrle_run_end_avx512);
+}
+#pragma GCC pop_options
+#endif /* CONFIG_AVX512BW_OPT */
+
+#if defined(CONFIG_AVX512BW_OPT) || defined(CONFIG_AVX2_OPT)
+#include "qemu/cpuid.h"
+
+/* The most preferred ISA must have the least significant bit. */
+#define CACHE_AVX512BW 1
+#define CACHE_AVX2     2
+
+static unsigned cpuid_cache;
+static int (*encode_accel)(uint8_t *, uint8_t *, int, uint8_t *, int) =
+    xbzrle_encode_buffer_int;
+
+static void init_accel(unsigned cache)
+{
+    int (*fn)(uint8_t *, uint8_t *, int, uint8_t *, int) =
+        xbzrle_encode_buffer_int;
+
+#ifdef CONFIG_AVX2_OPT
+    if (cache & CACHE_AVX2) {
+        fn = xbzrle_encode_buffer_avx2;
+    }
+#endif
+#ifdef CONFIG_AVX512BW_OPT
+    if (cache & CACHE_AVX512BW) {
+        fn = xbzrle_encode_buffer_avx512;
+    }
+#endif
+    encode_accel = fn;
+}
+
+static void __attribute__((constructor)) init_cpuid_cache(void)
+{
+    unsigned features = cpuid_vector_features();
+    unsigned cache = 0;
+
+    if (features & CPUID_VEC_AVX2) {
+        cache |= CACHE_AVX2;
+    }
+    if (features & CPUID_VEC_AVX512BW) {
+        cache |= CACHE_AVX512BW;
+    }
+    cpuid_cache = cache;
+    init_accel(cache);
+}
+
+bool test_xbzrle_encode_next_accel(void)
+{
+    /* If no bits set, we just tested xbzrle_encode_buffer_int.  */
+    if (cpuid_cache == 0) {
+        return false;
+    }
+    /* Disable the accelerator we used before and select a new one.  */
+    cpuid_cache &= cpuid_cache - 1;
+    init_accel(cpuid_cache);
+    return true;
+}
+#else
+#define encode_accel xbzrle_encode_buffer_int
+bool test_xbzrle_encode_next_accel(void)
+{
+    return false;
+}
+#endif
+
+int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                         uint8_t *dst, int dlen)
+{
+    return encode_accel(old_buf, new_buf, slen, dst, dlen);
+}
+
 int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen)
 {
     int i = 0, d = 0;
@@ -478,6 +478,15 @@ void hmp_info_migrate_parameters(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, "%s: %s\n",
             MigrationParameter_str(MIGRATION_PARAMETER_MULTIFD_COMPRESSION),
             MultiFDCompression_str(params->multifd_compression));
+        monitor_printf(mon, "%s: %s\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_ZERO_PAGE_DETECTION),
+            ZeroPageDetection_str(params->zero_page_detection));
+        monitor_printf(mon, "%s: %u\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_MULTIFD_LZ4_LEVEL),
+            params->multifd_lz4_level);
+        monitor_printf(mon, "%s: %u bytes\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_MULTIFD_DICT_SIZE),
+            params->multifd_dict_size);
         monitor_printf(mon, "%s: %" PRIu64 " bytes\n",
             MigrationParameter_str(MIGRATION_PARAMETER_XBZRLE_CACHE_SIZE),
             params->xbzrle_cache_size);
@@ -1386,6 +1395,11 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
         visit_type_MultiFDCompression(v, param, &p->multifd_compression,
                                       &err);
         break;
+    case MIGRATION_PARAMETER_ZERO_PAGE_DETECTION:
+        p->has_zero_page_detection = true;
+        visit_type_ZeroPageDetection(v, param, &p->zero_page_detection,
+                                     &err);
+        break;
     case MIGRATION_PARAMETER_MULTIFD_ZLIB_LEVEL:
         p->has_multifd_zlib_level = true;
         visit_type_uint8(v, param, &p->multifd_zlib_level, &err);
@@ -1394,6 +1408,14 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
         p->has_multifd_zstd_level = true;
         visit_type_uint8(v, param, &p->multifd_zstd_level, &err);
         break;
+    case MIGRATION_PARAMETER_MULTIFD_LZ4_LEVEL:
+        p->has_multifd_lz4_level = true;
+        visit_type_uint8(v, param, &p->multifd_lz4_level, &err);
+        break;
+    case MIGRATION_PARAMETER_MULTIFD_DICT_SIZE:
+        p->has_multifd_dict_size = true;
+        visit_type_uint32(v, param, &p->multifd_dict_size, &err);
+        break;
     case MIGRATION_PARAMETER_XBZRLE_CACHE_SIZE:
         p->has_xbzrle_cache_size = true;
         if (!visit_type_size(v, param, &cache_size, &err)) {
@@ -1936,6 +1958,30 @@ void hmp_info_iothreads(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, "  poll-max-ns=%" PRId64 "\n", value->poll_max_ns);
         monitor_printf(mon, "  poll-grow=%" PRId64 "\n", value->poll_grow);
         monitor_printf(mon, "  poll-shrink=%" PRId64 "\n", value->poll_shrink);
+        if (value->has_io_uring_sqes) {
+            monitor_printf(mon, "  io-uring-sqes=%" PRId64 "\n",
+                           value->io_uring_sqes);
+            monitor_printf(mon, "  io-uring-cqes=%" PRId64 "\n",
+                           value->io_uring_cqes);
+        }
+        monitor_printf(mon, "  thread-pool-min=%" PRId64 "\n",
+                       value->thread_pool_min);
+        monitor_printf(mon, "  thread-pool-max=%" PRId64 "\n",
+                       value->thread_pool_max);
+        if (value->has_thread_pool) {
+            ThreadPoolInfo *tp = value->thread_pool;
+
+            monitor_printf(mon, "  thread-pool: threads=%" PRId64
+                           " idle=%" PRId64 " queue-depth=%" PRId64
+                           " max-queue-depth=%" PRId64 "\n",
+                           tp->threads, tp->idle_threads, tp->queue_depth,
+                           tp->max_queue_depth);
+            monitor_printf(mon, "  thread-pool: requests=%" PRIu64
+                           " avg-wait-ns=%" PRIu64 " max-wait-ns=%" PRIu64
+                           "\n", tp->requests,
+                           tp->requests ? tp->wait_ns / tp->requests : 0,
+                           tp->max_wait_ns);
+        }
     }
 
     qapi_free_IOThreadInfoList(info_list);
@@ -1603,7 +1603,6 @@ static int nbd_export_create(BlockExport *blk_exp, BlockExportOptions *exp_args,
     int64_t size;
     uint64_t perm, shared_perm;
     bool readonly = !exp_args->writable;
-    bool shared = !exp_args->writable;
     strList *bitmaps;
     size_t i;
     int ret;
@@ -1656,13 +1655,18 @@ static int nbd_export_create(BlockExport *blk_exp, BlockExportOptions *exp_args,
                      NBD_FLAG_SEND_FUA | NBD_FLAG_SEND_CACHE);
     if (readonly) {
         exp->nbdflags |= NBD_FLAG_READ_ONLY;
-        if (shared) {
-            exp->nbdflags |= NBD_FLAG_CAN_MULTI_CONN;
-        }
     } else {
         exp->nbdflags |= (NBD_FLAG_SEND_TRIM | NBD_FLAG_SEND_WRITE_ZEROES |
                           NBD_FLAG_SEND_FAST_ZERO);
     }
+    /*
+     * All clients of an export go through the same BlockBackend, so a
+     * flush from any of them flushes the writes of all of them.
+     */
+    if (arg->multi_conn == ON_OFF_AUTO_ON ||
+        (arg->multi_conn == ON_OFF_AUTO_AUTO && readonly)) {
+        exp->nbdflags |= NBD_FLAG_CAN_MULTI_CONN;
+    }
     exp->size = QEMU_ALIGN_DOWN(size, BDRV_SECTOR_SIZE);
 
     for (bitmaps = arg->bitmaps; bitmaps; bitmaps = bitmaps->next) {
@@ -1898,6 +1902,105 @@ static int coroutine_fn nbd_co_send_structured_read(NBDClient *client,
     return nbd_co_send_iov(client, iov, 2, errp);
 }
 
+/*
+ * Zero-copy reads: with a plain socket and an export that ends in a raw
+ * file, the payload can go from the page cache straight to the socket
+ * without bouncing through a userspace buffer.  TLS needs the data in
+ * userspace anyway, and formats with metadata fall back to blk_pread().
+ */
+static bool nbd_can_sendfile(NBDClient *client)
+{
+    return !client->tlscreds && client->ioc == QIO_CHANNEL(client->sioc) &&
+           blk_can_sendfile(client->exp->common.blk);
+}
+
+/*
+ * Send a read reply for @size bytes at @offset, with the payload sent by
+ * blk_co_sendfile().  Once the header is on the wire a read error can no
+ * longer be reported to the client, so any failure breaks the connection.
+ * @data is only used if the block layer declines zero-copy after all.
+ */
+static int coroutine_fn nbd_co_send_read_sendfile(NBDClient *client,
+                                                  uint64_t handle,
+                                                  uint64_t offset,
+                                                  uint8_t *data,
+                                                  size_t size,
+                                                  bool final,
+                                                  Error **errp)
+{
+    BlockBackend *blk = client->exp->common.blk;
+    NBDSimpleReply reply;
+    NBDStructuredReadData chunk;
+    struct iovec iov;
+    size_t done = 0;
+    int ret;
+
+    assert(size);
+    trace_nbd_co_send_read_sendfile(handle, offset, size);
+    if (client->structured_reply) {
+        set_be_chunk(&chunk.h, final ? NBD_REPLY_FLAG_DONE : 0,
+                     NBD_REPLY_TYPE_OFFSET_DATA, handle,
+                     sizeof(chunk) - sizeof(chunk.h) + size);
+        stq_be_p(&chunk.offset, offset);
+        iov = (struct iovec) { .iov_base = &chunk, .iov_len = sizeof(chunk) };
+    } else {
+        set_be_simple_reply(&reply, 0, handle);
+        iov = (struct iovec) { .iov_base = &reply, .iov_len = sizeof(reply) };
+    }
+
+    g_assert(qemu_in_coroutine());
+    qemu_co_mutex_lock(&client->send_lock);
+    client->send_coroutine = qemu_coroutine_self();
+
+    if (qio_channel_writev_all(client->ioc, &iov, 1, errp) < 0) {
+        ret = -EIO;
+        goto out;
+    }
+
+    while (done < size) {
+        /*
+         * blk_co_sendfile() does not wait for the socket to drain, so that
+         * a client that stops reading does not keep a request in flight
+         * and hang drain.  Wait here, outside of the block layer.
+         */
+        ret = blk_co_sendfile(blk, offset + done, size - done,
+                              client->sioc->fd);
+        if (ret == -EAGAIN) {
+            qio_channel_yield(client->ioc, G_IO_OUT);
+            continue;
+        }
+        if (ret == -ENOTSUP && !done) {
+            /* Nothing of the payload was sent yet, do it the slow way */
+            ret = blk_pread(blk, offset, data, size);
+            if (ret < 0) {
+                error_setg_errno(errp, -ret, "reading from file failed");
+                ret = -EIO;
+                goto out;
+            }
+            if (qio_channel_write_all(client->ioc, (char *)data, size,
+                                      errp) < 0) {
+                ret = -EIO;
+                goto out;
+            }
+            break;
+        }
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "reading from file failed");
+            ret = -EIO;
+            goto out;
+        }
+        done += ret;
+        trace_nbd_co_send_read_sendfile_done(handle, ret);
+    }
+    ret = 0;
+
+out:
+    client->send_coroutine = NULL;
+    qemu_co_mutex_unlock(&client->send_lock);
+
+    return ret;
+}
+
 static int coroutine_fn nbd_co_send_structured_error(NBDClient *client,
                                                      uint64_t handle,
                                                      uint32_t error,
@@ -1936,6 +2039,7 @@ static int coroutine_fn nbd_co_send_sparse_read(NBDClient *client,
     int ret = 0;
     NBDExport *exp = client->exp;
     size_t progress = 0;
+    bool zero_copy = nbd_can_sendfile(client);
 
     while (progress < size) {
         int64_t pnum;
@@ -1970,6 +2074,10 @@ static int coroutine_fn nbd_co_send_sparse_read(NBDClient *client,
             stq_be_p(&chunk.offset, offset + progress);
             stl_be_p(&chunk.length, pnum);
             ret = nbd_co_send_iov(client, iov, 1, errp);
+        } else if (zero_copy) {
+            ret = nbd_co_send_read_sendfile(client, handle, offset + progress,
+                                            data + progress, pnum, final,
+                                            errp);
         } else {
             ret = blk_pread(exp->common.blk, offset + progress,
                             data + progress, pnum);
@@ -2377,6 +2485,12 @@ static coroutine_fn int nbd_do_cmd_read(NBDClient *client, NBDRequest *request,
                                        data, request->len, errp);
     }
 
+    if (request->len && nbd_can_sendfile(client)) {
+        return nbd_co_send_read_sendfile(client, request->handle,
+                                         request->from, data, request->len,
+                                         true, errp);
+    }
+
     ret = blk_pread(exp->common.blk, request->from, data, request->len);
     if (ret < 0) {
         return nbd_send_generic_reply(client, request->handle, ret,
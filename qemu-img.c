@@ -197,7 +197,8 @@ static void QEMU_NORETURN help(void)
            "Parameters to convert subcommand:\n"
            "  '--bitmaps' copies all top-level persistent bitmaps to destination\n"
            "  '-m' specifies how many coroutines work in parallel during the convert\n"
-           "       process (defaults to 8)\n"
+           "       process (defaults to 8, or when compressing to twice the number\n"
+           "       of host CPUs, up to 64)\n"
            "  '-W' allow to write to the target out of order rather than sequential\n"
            "\n"
            "Parameters to snapshot subcommand:\n"
@@ -1209,13 +1210,8 @@ static int is_allocated_sectors(const uint8_t *buf, int n, int *pnum,
         *pnum = 0;
         return 0;
     }
-    is_zero = buffer_is_zero(buf, BDRV_SECTOR_SIZE);
-    for(i = 1; i < n; i++) {
-        buf += BDRV_SECTOR_SIZE;
-        if (is_zero != buffer_is_zero(buf, BDRV_SECTOR_SIZE)) {
-            break;
-        }
-    }
+    i = buffer_find_zero_extent(buf, n * BDRV_SECTOR_SIZE, BDRV_SECTOR_SIZE,
+                                &is_zero) / BDRV_SECTOR_SIZE;
 
     tail = (sector_num + i) & (alignment - 1);
     if (tail) {
@@ -1668,7 +1664,7 @@ enum ImgConvertBlockStatus {
     BLK_BACKING_FILE,
 };
 
-#define MAX_COROUTINES 16
+#define MAX_COROUTINES 64
 #define CONVERT_THROTTLE_GROUP "img_convert"
 
 typedef struct ImgConvertState {
@@ -1690,6 +1686,7 @@ typedef struct ImgConvertState {
     bool target_has_backing;
     int64_t target_backing_sectors; /* negative if unknown */
     bool wr_in_order;
+    bool wr_pipelined;
     bool copy_range;
     bool salvage;
     bool quiet;
@@ -1972,6 +1969,26 @@ static int coroutine_fn convert_co_copy_range(ImgConvertState *s, int64_t sector
     return 0;
 }
 
+/*
+ * Hand the right to issue the next write over to the coroutine waiting for
+ * @next_sector.  It is entered from the main loop, i.e. only once the
+ * current coroutine has issued its own write and yielded.
+ */
+static void coroutine_fn convert_co_pass_turn(ImgConvertState *s,
+                                              int64_t next_sector)
+{
+    int i;
+
+    s->wr_offs = next_sector;
+    for (i = 0; i < s->num_coroutines; i++) {
+        if (s->co[i] && s->wait_sector_num[i] == next_sector) {
+            s->wait_sector_num[i] = -1;
+            aio_co_schedule(qemu_get_aio_context(), s->co[i]);
+            break;
+        }
+    }
+}
+
 static void coroutine_fn convert_co_do_copy(void *opaque)
 {
     ImgConvertState *s = opaque;
@@ -2047,6 +2064,15 @@ retry:
             s->wait_sector_num[index] = -1;
         }
 
+        if (s->wr_pipelined) {
+            /*
+             * The target allocates compressed clusters in the order the
+             * writes are issued, so the next request may be issued as soon
+             * as this one has been.  Compression of both then overlaps.
+             */
+            convert_co_pass_turn(s, sector_num + n);
+        }
+
         if (s->ret == -EINPROGRESS) {
             if (copy_range) {
                 ret = convert_co_copy_range(s, sector_num, n);
@@ -2064,7 +2090,7 @@ retry:
             }
         }
 
-        if (s->wr_in_order) {
+        if (s->wr_in_order && !s->wr_pipelined) {
             /* reenter the coroutine that might have waited
              * for this write to complete */
             s->wr_offs = sector_num + n;
@@ -2216,6 +2242,7 @@ static int img_convert(int argc, char **argv)
     bool force_share = false;
     bool explict_min_sparse = false;
     bool bitmaps = false;
+    bool explicit_num_coroutines = false;
     int64_t rate_limit = 0;
 
     ImgConvertState s = (ImgConvertState) {
@@ -2329,6 +2356,7 @@ static int img_convert(int argc, char **argv)
                              " coroutines is between 1 and %d", MAX_COROUTINES);
                 goto fail_getopt;
             }
+            explicit_num_coroutines = true;
             break;
         case 'W':
             s.wr_in_order = false;
@@ -2735,6 +2763,24 @@ static int img_convert(int argc, char **argv)
         set_rate_limit(s.target, rate_limit);
     }
 
+    /*
+     * Compression is done by the target driver in the context of each write,
+     * so with in-order writes let the next write start as soon as the
+     * previous one has been issued instead of when it has completed.  This
+     * relies on the target allocating compressed clusters in submission
+     * order, which only qcow2 guarantees and which throttling could break.
+     * The number of coroutines then bounds the amount of data in flight;
+     * unless set explicitly, size it so that every host CPU has a cluster to
+     * compress.
+     */
+    s.wr_pipelined = s.compressed && s.wr_in_order && !rate_limit &&
+                     !strcmp(bdrv_get_format_name(out_bs), "qcow2");
+    if (s.compressed && !explicit_num_coroutines) {
+        s.num_coroutines = MIN(MAX_COROUTINES,
+                               MAX(s.num_coroutines,
+                                   2 * g_get_num_processors()));
+    }
+
     ret = convert_do_copy(&s);
 
     /* Now copy the bitmaps */
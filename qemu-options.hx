@@ -139,6 +139,7 @@ DEF("accel", HAS_ARG, QEMU_OPTION_accel,
     "                igd-passthru=on|off (enable Xen integrated Intel graphics passthrough, default=off)\n"
     "                kernel-irqchip=on|off|split controls accelerated irqchip support (default=on)\n"
     "                kvm-shadow-mem=size of KVM shadow MMU in bytes\n"
+    "                dirty-ring-size=n (KVM dirty ring size in entries, 0 = use dirty bitmap)\n"
     "                split-wx=on|off (enable TCG split w^x mapping)\n"
     "                tb-size=n (TCG translation block cache size)\n"
     "                thread=single|multi (enable multi-threaded TCG)\n", QEMU_ARCH_ALL)
@@ -165,6 +166,16 @@ SRST
     ``kvm-shadow-mem=size``
         Defines the size of the KVM shadow MMU.
 
+    ``dirty-ring-size=n``
+        When KVM accelerator is used, it controls the size of the per-vCPU
+        dirty page ring buffer (number of entries for each vCPU). It must be
+        a power of two. With the dirty ring, the cost of collecting dirty
+        pages, e.g. during live migration, depends on the number of pages
+        dirtied rather than on the guest memory size. The default is 0,
+        which uses the dirty bitmap instead. A value of at least 1024 is
+        recommended; if the host does not support the dirty ring, the dirty
+        bitmap is used.
+
     ``split-wx=on|off``
         Controls the use of split w^x mapping for the TCG code generation
         buffer. Some operating systems require this to be enabled, and in
@@ -1085,6 +1096,33 @@ SRST
             Specifies the AIO backend (threads/native/io_uring,
             default: threads)
 
+        ``io-uring-fixed``
+            Registers the file descriptor, guest RAM and any I/O buffers
+            that the user of the node announces with io_uring. This saves
+            the kernel looking up the file and pinning the buffer pages for
+            every request. Registering buffers needs Linux 5.13 and counts
+            against RLIMIT_MEMLOCK; without either, requests use the
+            normal path. Guest RAM cannot be discarded (e.g. by
+            virtio-balloon) while it is registered, and is not registered
+            if a device that needs discarding (e.g. virtio-mem) is in use.
+            Requires ``aio=io_uring``. (on/off, default: off)
+
+        ``io-uring-sqpoll``
+            Lets a kernel thread poll the io_uring submission queue, so
+            that submitting requests needs no system call. Each
+            combination of ``io-uring-sqpoll`` and ``io-uring-iopoll``
+            gets its own ring per IOThread. Kernels before 5.11 also
+            require ``io-uring-fixed=on`` and CAP_SYS_ADMIN. Requires
+            ``aio=io_uring``. (on/off, default: off)
+
+        ``io-uring-iopoll``
+            Busy-polls the device for completions instead of waiting for
+            interrupts. The IOThread keeps spinning while requests are in
+            flight, which lowers latency at the cost of CPU time.
+            Flushes are handled by the thread pool. Requires
+            ``aio=io_uring`` and ``cache.direct=on``. (on/off, default:
+            off)
+
         ``locking``
             Specifies whether the image file is protected with Linux OFD
             / POSIX locks. The default is to use the Linux Open File
@@ -1162,6 +1200,13 @@ SRST
             supporting platforms, and 0 on other platforms. Setting it
             to 0 disables this feature.
 
+        ``cluster-pool-size``
+            The size in bytes of the run of host clusters that is
+            reserved ahead of allocating writes, so that refcounts are
+            updated once per run rather than once per write. Unused
+            reserved clusters are freed when the image is closed
+            (default: 0, which disables the pool)
+
         ``pass-discard-request``
             Whether discard requests to the qcow2 device should be
             forwarded to the data source (on/off; default: on if
@@ -5132,7 +5177,7 @@ SRST
 
             CN=laptop.example.com,O=Example Home,L=London,ST=London,C=GB
 
-    ``-object iothread,id=id,poll-max-ns=poll-max-ns,poll-grow=poll-grow,poll-shrink=poll-shrink``
+    ``-object iothread,id=id,poll-max-ns=poll-max-ns,poll-grow=poll-grow,poll-shrink=poll-shrink,thread-pool-min=min,thread-pool-max=max,thread-pool-cpus=cpus,thread-pool-node=node``
         Creates a dedicated event loop thread that devices can be
         assigned to. This is known as an IOThread. By default device
         emulation happens in vCPU threads or the main event loop thread.
@@ -5168,6 +5213,21 @@ SRST
         the polling time when the algorithm detects it is spending too
         long polling without encountering events.
 
+        Blocking operations, such as file I/O without native AIO, are
+        offloaded to a pool of worker threads that belongs to the
+        IOThread. The ``thread-pool-min`` parameter is the number of
+        workers that are kept around even when idle (default 0), and
+        ``thread-pool-max`` the maximum number of workers (default 64).
+
+        The ``thread-pool-cpus`` parameter restricts the workers to a
+        list of host CPUs like ``0-3,8``. Alternatively,
+        ``thread-pool-node`` restricts them to the CPUs of a host NUMA
+        node, e.g. the one that holds the guest RAM. By default workers
+        inherit the affinity of the IOThread.
+
+        The ``query-iothreads`` QMP command reports queue depth and wait
+        time statistics of the thread pool.
+
         The polling parameters can be modified at run-time using the
         ``qom-set`` command (where ``iothread1`` is the IOThread's
         ``id``):
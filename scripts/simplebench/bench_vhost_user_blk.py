@@ -0,0 +1,151 @@
+#!/usr/bin/env python3
+#
+# Benchmark vhost-user-blk export virtqueues processed in several iothreads
+#
+# Starts qemu-storage-daemon with a null-co node exported over vhost-user-blk
+# and runs fio's libblkio engine against it with one job per virtqueue.
+# Comparing the environments shows how IOPS scale with the number of queues
+# when all of them are handled in the node's iothread and when each queue
+# has an iothread of its own.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#
+
+
+import sys
+import os
+import subprocess
+import json
+import tempfile
+import time
+
+import simplebench
+from results_to_text import results_to_text
+
+
+def start_daemon(env, case, sock):
+    queues = case['queues']
+    args = [env['qsd-binary'],
+            '--blockdev', 'null-co,node-name=null0,size=8G,read-zeroes=off',
+            '--object', 'iothread,id=iothread-node']
+
+    export = {
+        'type': 'vhost-user-blk',
+        'id': 'exp0',
+        'node-name': 'null0',
+        'iothread': 'iothread-node',
+        'writable': True,
+        'num-queues': queues,
+        'addr': {'type': 'unix', 'path': sock}
+    }
+
+    if env['queue-iothreads']:
+        ids = [f'iothread-q{i}' for i in range(queues)]
+        for i in ids:
+            args += ['--object', f'iothread,id={i}']
+        export['queue-iothreads'] = ids
+
+    args += ['--export', json.dumps(export)]
+
+    p = subprocess.Popen(args, stdout=subprocess.DEVNULL,
+                         stderr=subprocess.PIPE, universal_newlines=True)
+
+    for _ in range(100):
+        if os.path.exists(sock):
+            return p
+        if p.poll() is not None:
+            break
+        time.sleep(0.1)
+
+    p.kill()
+    raise RuntimeError(f'qemu-storage-daemon failed: {p.communicate()[1]}')
+
+
+def bench_func(env, case):
+    with tempfile.TemporaryDirectory() as tmp:
+        sock = os.path.join(tmp, 'vhost-user-blk.sock')
+        try:
+            daemon = start_daemon(env, case, sock)
+        except RuntimeError as e:
+            return {'error': str(e)}
+
+        queues = case['queues']
+        args = [env['fio-binary'], '--name=vhost-user-blk',
+                '--output-format=json', '--thread',
+                '--ioengine=libblkio',
+                '--libblkio_driver=virtio-blk-vhost-user',
+                f'--libblkio_path={sock}',
+                f'--libblkio_pre_start_props=num-queues={queues}',
+                f'--numjobs={queues}', '--group_reporting',
+                f"--rw={case['rw']}", f"--bs={case['block-size']}",
+                '--iodepth=32', '--direct=1', '--time_based',
+                '--runtime=10', '--ramp_time=2']
+
+        p = subprocess.run(args, stdout=subprocess.PIPE,
+                           stderr=subprocess.STDOUT, universal_newlines=True)
+
+        daemon.terminate()
+        daemon.wait()
+
+    if p.returncode != 0:
+        return {'error': f'fio failed: {p.returncode}: {p.stdout}'}
+
+    try:
+        job = json.loads(p.stdout)['jobs'][0]
+        iops = job['read']['iops'] + job['write']['iops']
+    except Exception:
+        return {'error': f'failed to parse fio output: {p.stdout}'}
+
+    return {'iops': iops}
+
+
+if __name__ == '__main__':
+    if len(sys.argv) < 3:
+        print(f'USAGE: {sys.argv[0]} <qemu-storage-daemon binary> '
+              '<fio binary> [QUEUES ...]')
+        exit(1)
+
+    qsd = sys.argv[1]
+    fio = sys.argv[2]
+    queue_counts = [int(q) for q in sys.argv[3:]] or [1, 2, 4, 8]
+
+    envs = [
+        {
+            'id': 'node iothread',
+            'qsd-binary': qsd,
+            'fio-binary': fio,
+            'queue-iothreads': False
+        },
+        {
+            'id': 'queue iothreads',
+            'qsd-binary': qsd,
+            'fio-binary': fio,
+            'queue-iothreads': True
+        }
+    ]
+
+    cases = []
+    for rw in ('randread', 'randwrite'):
+        for queues in queue_counts:
+            cases.append({
+                'id': f'{rw} 4k, {queues} queue(s)',
+                'rw': rw,
+                'block-size': '4k',
+                'queues': queues
+            })
+
+    result = simplebench.bench(bench_func, envs, cases, count=3)
+    print(results_to_text(result))
+    with open('results.json', 'w') as f:
+        json.dump(result, f, indent=4)
@@ -0,0 +1,133 @@
+/*
+ * HBitmap speed benchmark
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/units.h"
+#include "qemu/hbitmap.h"
+
+typedef struct HBitmapBenchOpts {
+    uint64_t disk_size;
+    int granularity;
+} HBitmapBenchOpts;
+
+/* Number of bits in a bitmap for @opts, i.e. the number of dirty clusters */
+static uint64_t bench_nb_bits(const HBitmapBenchOpts *opts)
+{
+    return opts->disk_size >> opts->granularity;
+}
+
+/* Guest writes: set random 4k..1M ranges, as bdrv_set_dirty() does */
+static void test_hbitmap_set_speed(const void *opaque)
+{
+    const HBitmapBenchOpts *opts = opaque;
+    HBitmap *hb = hbitmap_alloc(opts->disk_size, opts->granularity);
+    const int nb_ops = 4 * 1000 * 1000;
+    int i;
+
+    g_test_timer_start();
+    for (i = 0; i < nb_ops; i++) {
+        uint64_t len = 4 * KiB << g_test_rand_int_range(0, 9);
+        uint32_t r = g_test_rand_int(); /* gint32, must not sign-extend */
+        uint64_t offset = QEMU_ALIGN_DOWN(r * (opts->disk_size >> 32), 4 * KiB);
+
+        hbitmap_set(hb, offset, MIN(len, opts->disk_size - offset));
+    }
+    g_test_timer_elapsed();
+
+    g_test_message("set: disk %" PRIu64 " GiB, %.2f Mops/sec",
+                   opts->disk_size / GiB, nb_ops / g_test_timer_last() / 1e6);
+    hbitmap_free(hb);
+}
+
+/*
+ * Full backup: walk a bitmap with every bit set in chunks, as block-copy does
+ * with bdrv_dirty_bitmap_next_dirty_area()
+ */
+static void test_hbitmap_dirty_area_speed(const void *opaque)
+{
+    const HBitmapBenchOpts *opts = opaque;
+    HBitmap *hb = hbitmap_alloc(opts->disk_size, opts->granularity);
+    int64_t offset = 0, dirty_start, dirty_count;
+    uint64_t nb_areas = 0;
+
+    hbitmap_set(hb, 0, opts->disk_size);
+
+    g_test_timer_start();
+    while (hbitmap_next_dirty_area(hb, offset, opts->disk_size, 1 * GiB,
+                                   &dirty_start, &dirty_count)) {
+        offset = dirty_start + dirty_count;
+        nb_areas++;
+    }
+    g_test_timer_elapsed();
+
+    g_assert_cmpint(offset, ==, opts->disk_size);
+    g_test_message("next_dirty_area: disk %" PRIu64 " GiB, %" PRIu64
+                   " bits, %" PRIu64 " areas, %.2f Gbits/sec",
+                   opts->disk_size / GiB, bench_nb_bits(opts), nb_areas,
+                   bench_nb_bits(opts) / g_test_timer_last() / 1e9);
+    hbitmap_free(hb);
+}
+
+/* Incremental backup: iterate over a sparse bitmap */
+static void test_hbitmap_next_dirty_speed(const void *opaque)
+{
+    const HBitmapBenchOpts *opts = opaque;
+    HBitmap *hb = hbitmap_alloc(opts->disk_size, opts->granularity);
+    uint64_t cluster_size = 1ULL << opts->granularity;
+    uint64_t nb_dirty = 0;
+    int64_t offset;
+    int i;
+
+    /* One dirty cluster in about every thousand */
+    for (i = 0; i < bench_nb_bits(opts) / 1024; i++) {
+        hbitmap_set(hb, g_test_rand_int_range(0, bench_nb_bits(opts)) *
+                        cluster_size, 1);
+    }
+
+    g_test_timer_start();
+    for (offset = hbitmap_next_dirty(hb, 0, INT64_MAX); offset >= 0;
+         offset = hbitmap_next_dirty(hb, offset + cluster_size, INT64_MAX)) {
+        nb_dirty++;
+    }
+    g_test_timer_elapsed();
+
+    g_test_message("next_dirty: disk %" PRIu64 " GiB, %" PRIu64
+                   " dirty, %.2f Mbits/sec",
+                   opts->disk_size / GiB, nb_dirty,
+                   bench_nb_bits(opts) / g_test_timer_last() / 1e6);
+    hbitmap_free(hb);
+}
+
+int main(int argc, char **argv)
+{
+    char name[64];
+
+    g_test_init(&argc, &argv, NULL);
+
+#define TEST_ONE(size, gran)                                            \
+    static const HBitmapBenchOpts opts_ ## size ## _ ## gran = {        \
+        .disk_size = size * TiB, .granularity = gran,                   \
+    };                                                                  \
+    snprintf(name, sizeof(name), "/hbitmap/benchmark/set/%dT-%d",       \
+             size, gran);                                               \
+    g_test_add_data_func(name, &opts_ ## size ## _ ## gran,             \
+                         test_hbitmap_set_speed);                       \
+    snprintf(name, sizeof(name),                                        \
+             "/hbitmap/benchmark/next_dirty_area/%dT-%d", size, gran);  \
+    g_test_add_data_func(name, &opts_ ## size ## _ ## gran,             \
+                         test_hbitmap_dirty_area_speed);                \
+    snprintf(name, sizeof(name),                                        \
+             "/hbitmap/benchmark/next_dirty/%dT-%d", size, gran);       \
+    g_test_add_data_func(name, &opts_ ## size ## _ ## gran,             \
+                         test_hbitmap_next_dirty_speed);
+
+    TEST_ONE(1, 16);
+    TEST_ONE(16, 16);
+    TEST_ONE(16, 20);
+
+    return g_test_run();
+}
@@ -0,0 +1,136 @@
+/*
+ * Throttle group speed benchmark
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/main-loop.h"
+#include "qemu/module.h"
+#include "qemu/coroutine.h"
+#include "qapi/error.h"
+#include "block/throttle-groups.h"
+#include "iothread.h"
+
+#define NB_MEMBERS   32
+#define NB_IOTHREADS 4
+
+typedef struct ThrottleBenchOpts {
+    uint64_t iops;          /* group limit, 0 for one that is never reached */
+    uint64_t request_size;
+} ThrottleBenchOpts;
+
+typedef struct ThrottleBenchMember {
+    ThrottleGroupMember tgm;
+    const ThrottleBenchOpts *opts;
+    uint64_t nb_requests;
+} ThrottleBenchMember;
+
+static bool bench_stop;
+static unsigned bench_done;
+
+/* One guest queue: submit requests back to back until told to stop */
+static void coroutine_fn bench_member_entry(void *opaque)
+{
+    ThrottleBenchMember *m = opaque;
+
+    while (!qatomic_read(&bench_stop)) {
+        throttle_group_co_io_limits_intercept(&m->tgm, m->opts->request_size,
+                                              false);
+        m->nb_requests++;
+
+        /* Complete the request and let the other members run */
+        aio_co_schedule(m->tgm.aio_context, qemu_coroutine_self());
+        qemu_coroutine_yield();
+    }
+
+    qatomic_inc(&bench_done);
+}
+
+static void test_throttle_groups_speed(const void *opaque)
+{
+    const ThrottleBenchOpts *opts = opaque;
+    ThrottleBenchMember members[NB_MEMBERS] = {};
+    IOThread *iothreads[NB_IOTHREADS];
+    ThrottleConfig cfg;
+    uint64_t nb_requests = 0;
+    int i;
+
+    for (i = 0; i < NB_IOTHREADS; i++) {
+        iothreads[i] = iothread_new();
+    }
+
+    for (i = 0; i < NB_MEMBERS; i++) {
+        AioContext *ctx = iothread_get_aio_context(iothreads[i % NB_IOTHREADS]);
+
+        members[i].opts = opts;
+        throttle_group_register_tgm(&members[i].tgm, "bench", ctx);
+    }
+
+    throttle_config_init(&cfg);
+    cfg.buckets[THROTTLE_OPS_TOTAL].avg = opts->iops ?: THROTTLE_VALUE_MAX;
+    throttle_group_config(&members[0].tgm, &cfg);
+
+    qatomic_set(&bench_stop, false);
+    qatomic_set(&bench_done, 0);
+
+    g_test_timer_start();
+    for (i = 0; i < NB_MEMBERS; i++) {
+        Coroutine *co = qemu_coroutine_create(bench_member_entry, &members[i]);
+        aio_co_enter(members[i].tgm.aio_context, co);
+    }
+    g_usleep(G_USEC_PER_SEC);
+    qatomic_set(&bench_stop, true);
+    while (qatomic_read(&bench_done) < NB_MEMBERS) {
+        g_usleep(1000);
+    }
+    g_test_timer_elapsed();
+
+    for (i = 0; i < NB_MEMBERS; i++) {
+        AioContext *ctx = members[i].tgm.aio_context;
+
+        nb_requests += members[i].nb_requests;
+        aio_context_acquire(ctx);
+        throttle_group_unregister_tgm(&members[i].tgm);
+        aio_context_release(ctx);
+    }
+
+    for (i = 0; i < NB_IOTHREADS; i++) {
+        iothread_join(iothreads[i]);
+    }
+
+    if (opts->iops) {
+        g_test_message("%d members, %d iothreads, limit %" PRIu64
+                       " iops: %.0f iops",
+                       NB_MEMBERS, NB_IOTHREADS, opts->iops,
+                       nb_requests / g_test_timer_last());
+    } else {
+        g_test_message("%d members, %d iothreads, no limit reached: "
+                       "%.2f Miops",
+                       NB_MEMBERS, NB_IOTHREADS,
+                       nb_requests / g_test_timer_last() / 1e6);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    static const ThrottleBenchOpts unbound = {
+        .iops = 0, .request_size = 4096,
+    };
+    static const ThrottleBenchOpts bound = {
+        .iops = 200000, .request_size = 4096,
+    };
+
+    qemu_init_main_loop(&error_abort);
+    module_call_init(MODULE_INIT_QOM);
+
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_data_func("/throttle-groups/benchmark/unbound", &unbound,
+                         test_throttle_groups_speed);
+    g_test_add_data_func("/throttle-groups/benchmark/bound", &bound,
+                         test_throttle_groups_speed);
+
+    return g_test_run();
+}
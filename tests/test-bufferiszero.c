@@ -58,13 +58,56 @@ static void test_1(void)
     }
 }
 
+static void test_3(void)
+{
+    const size_t block = 512;
+    char *buf = buffer + 64;
+    size_t n, o;
+    bool is_zero;
+
+    /* A zero buffer is a single zero extent, even with a partial block */
+    n = buffer_find_zero_extent(buf, 16 * block + 100, block, &is_zero);
+    g_assert_cmpint(n, ==, 16 * block + 100);
+    g_assert(is_zero);
+
+    /* Data in any byte of a block ends the zero extent before that block */
+    for (o = 0; o < block; o++) {
+        buf[4 * block + o] = 1;
+        n = buffer_find_zero_extent(buf, 16 * block, block, &is_zero);
+        g_assert_cmpint(n, ==, 4 * block);
+        g_assert(is_zero);
+
+        n = buffer_find_zero_extent(buf + n, 16 * block - n, block, &is_zero);
+        g_assert_cmpint(n, ==, block);
+        g_assert(!is_zero);
+        buf[4 * block + o] = 0;
+    }
+
+    /* Consecutive data blocks form one data extent */
+    buf[0] = buf[block + 7] = buf[3 * block - 1] = 1;
+    n = buffer_find_zero_extent(buf, 16 * block, block, &is_zero);
+    g_assert_cmpint(n, ==, 3 * block);
+    g_assert(!is_zero);
+
+    /* A partial block at the end is checked on its own */
+    n = buffer_find_zero_extent(buf, 2 * block + 3, block, &is_zero);
+    g_assert_cmpint(n, ==, 2 * block);
+    g_assert(!is_zero);
+    n = buffer_find_zero_extent(buf + n, 3, block, &is_zero);
+    g_assert_cmpint(n, ==, 3);
+    g_assert(is_zero);
+    buf[0] = buf[block + 7] = buf[3 * block - 1] = 0;
+}
+
 static void test_2(void)
 {
     if (g_test_perf()) {
         test_1();
+        test_3();
     } else {
         do {
             test_1();
+            test_3();
         } while (test_buffer_is_zero_next_accel());
     }
 }
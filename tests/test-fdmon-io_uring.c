@@ -0,0 +1,92 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * fdmon-io_uring tests
+ */
+
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "block/aio.h"
+#include "qapi/error.h"
+#include "qemu/main-loop.h"
+
+static AioContext *ctx;
+
+typedef struct {
+    int fd;
+    int reads;
+} PartialReadData;
+
+/* Consume one byte per call, leaving the rest for the next one */
+static void partial_read_handler(void *opaque)
+{
+    PartialReadData *data = opaque;
+    char c;
+
+    g_assert_cmpint(read(data->fd, &c, 1), ==, 1);
+    data->reads++;
+}
+
+static void timeout_cb(void *opaque)
+{
+    bool *timed_out = opaque;
+
+    *timed_out = true;
+}
+
+/*
+ * Check that a handler that leaves data behind is called again, i.e. that
+ * monitoring is level-triggered like with the other fdmon implementations
+ */
+static void test_partial_read(void)
+{
+    PartialReadData data = { .reads = 0 };
+    bool timed_out = false;
+    QEMUTimer timer;
+    uint64_t sqes, cqes;
+    int fds[2];
+    int i;
+
+    if (!aio_context_get_fdmon_stats(ctx, &sqes, &cqes)) {
+        g_test_skip("io_uring is not available");
+        return;
+    }
+
+    g_assert_cmpint(qemu_pipe(fds), ==, 0);
+    data.fd = fds[0];
+    aio_set_fd_handler(ctx, fds[0], false, partial_read_handler, NULL, NULL,
+                       &data);
+
+    g_assert_cmpint(write(fds[1], "abc", 3), ==, 3);
+
+    aio_timer_init(ctx, &timer, QEMU_CLOCK_REALTIME, SCALE_NS,
+                   timeout_cb, &timed_out);
+    timer_mod(&timer, qemu_clock_get_ns(QEMU_CLOCK_REALTIME) +
+                      5 * NANOSECONDS_PER_SECOND);
+
+    for (i = 1; i <= 3; i++) {
+        while (data.reads < i && !timed_out) {
+            aio_poll(ctx, true);
+        }
+        g_assert_cmpint(data.reads, ==, i);
+    }
+
+    timer_del(&timer);
+    aio_set_fd_handler(ctx, fds[0], false, NULL, NULL, NULL, NULL);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+int main(int argc, char **argv)
+{
+    qemu_init_main_loop(&error_fatal);
+
+    /*
+     * fdmon-io_uring disables itself when the glib main loop is in use, so
+     * use an AioContext that is only ever polled with aio_poll()
+     */
+    ctx = aio_context_new(&error_fatal);
+
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/fdmon-io_uring/partial-read", test_partial_read);
+    return g_test_run();
+}
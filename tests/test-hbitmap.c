@@ -920,6 +920,78 @@ static void test_hbitmap_next_x_after_truncate(TestHBitmapData *data,
     test_hbitmap_next_x_check(data, 0);
 }
 
+/*
+ * A single clear bit in a long run of set bits, at every word position around
+ * the boundaries of the vectorized search
+ */
+static void test_hbitmap_next_zero_long_run_do(TestHBitmapData *data)
+{
+    int64_t word;
+    int bit;
+
+    hbitmap_test_init(data, L3, 0);
+    hbitmap_set(data->hb, 0, L3);
+    test_hbitmap_next_x_check(data, 0);
+
+    for (word = 0; word < 3 * L1; word++) {
+        for (bit = 0; bit < BITS_PER_LONG; bit += BITS_PER_LONG - 1) {
+            int64_t pos = word * BITS_PER_LONG + bit;
+
+            hbitmap_reset(data->hb, pos, 1);
+            test_hbitmap_next_x_check(data, 0);
+            test_hbitmap_next_x_check(data, pos > 1 ? pos - 1 : 0);
+            test_hbitmap_next_x_check(data, pos + 1);
+            test_hbitmap_next_x_check_range(data, 0, pos + 1);
+            hbitmap_set(data->hb, pos, 1);
+        }
+    }
+    hbitmap_test_teardown(data, NULL);
+}
+
+/* hbitmap_deserialize_finish must find every set word of the last level */
+static void test_hbitmap_deserialize_sparse_do(TestHBitmapData *data)
+{
+    size_t buf_size;
+    uint8_t *buf;
+    int64_t word;
+    int bit;
+
+    hbitmap_test_init(data, L3, 0);
+    buf_size = hbitmap_serialization_size(data->hb, 0, data->size);
+    buf = g_malloc0(buf_size);
+
+    for (word = 0; word < 3 * L1; word++) {
+        for (bit = 0; bit < BITS_PER_LONG; bit += BITS_PER_LONG - 1) {
+            int64_t pos = word * BITS_PER_LONG + bit;
+
+            /* The serialized format is little endian */
+            memset(buf, 0, buf_size);
+            buf[pos / 8] |= 1 << (pos % 8);
+            buf[(L3 - 1) / 8] |= 1 << ((L3 - 1) % 8);
+
+            hbitmap_deserialize_part(data->hb, buf, 0, data->size, true);
+            g_assert_cmpint(hbitmap_count(data->hb), ==, 2);
+            g_assert_cmpint(hbitmap_next_dirty(data->hb, 0, INT64_MAX), ==,
+                            pos);
+            g_assert_cmpint(hbitmap_next_dirty(data->hb, pos + 1, INT64_MAX),
+                            ==, L3 - 1);
+        }
+    }
+
+    g_free(buf);
+    hbitmap_test_teardown(data, NULL);
+}
+
+/* Run the word search dependent tests with every implementation */
+static void test_hbitmap_word_search(TestHBitmapData *data,
+                                     const void *unused)
+{
+    do {
+        test_hbitmap_next_zero_long_run_do(data);
+        test_hbitmap_deserialize_sparse_do(data);
+    } while (test_hbitmap_next_accel());
+}
+
 static void test_hbitmap_next_dirty_area_check_limited(TestHBitmapData *data,
                                                        int64_t offset,
                                                        int64_t count,
@@ -1113,6 +1185,9 @@ int main(int argc, char **argv)
     hbitmap_test_add("/hbitmap/next_dirty_area/next_dirty_area_after_truncate",
                      test_hbitmap_next_dirty_area_after_truncate);
 
+    /* This one switches implementations as it goes, so keep it last */
+    hbitmap_test_add("/hbitmap/word_search", test_hbitmap_word_search);
+
     g_test_run();
 
     return 0;
@@ -232,6 +232,76 @@ static void test_cancel_async(void)
     do_test_cancel(false);
 }
 
+static void test_stats(void)
+{
+    ThreadPoolStats before, after;
+
+    g_assert_true(aio_context_get_thread_pool_stats(ctx, &before));
+    test_submit_many();
+    g_assert_true(aio_context_get_thread_pool_stats(ctx, &after));
+
+    g_assert_cmpint(after.requests - before.requests, ==, 100);
+    g_assert_cmpint(after.queue_depth, ==, 0);
+    g_assert_cmpint(after.max_queue_depth, >=, 1);
+    g_assert_cmpint(after.max_queue_depth, <=, 100);
+    g_assert_cmpint(after.threads, <=, THREAD_POOL_MAX_THREADS_DEFAULT);
+    g_assert_cmpuint(after.wait_ns, >=, before.wait_ns);
+    g_assert_cmpuint(after.max_wait_ns, >=, before.max_wait_ns);
+}
+
+static void test_params(void)
+{
+    ThreadPoolStats stats;
+    Error *local_err = NULL;
+
+    aio_context_set_thread_pool_params(ctx, 4, 2, NULL, 0, &local_err);
+    g_assert_nonnull(local_err);
+    error_free(local_err);
+
+    aio_context_set_thread_pool_params(ctx, 2, 4, NULL, 0, &error_abort);
+
+    /* Surplus workers exit, and the minimum is spawned from a BH */
+    do {
+        aio_poll(ctx, false);
+        g_usleep(1000);
+        g_assert_true(aio_context_get_thread_pool_stats(ctx, &stats));
+    } while (stats.threads > 4 || stats.threads < 2);
+
+    test_submit_many();
+    g_assert_true(aio_context_get_thread_pool_stats(ctx, &stats));
+    g_assert_cmpint(stats.threads, >=, 2);
+    g_assert_cmpint(stats.threads, <=, 4);
+
+    aio_context_set_thread_pool_params(ctx, 0,
+                                       THREAD_POOL_MAX_THREADS_DEFAULT,
+                                       NULL, 0, &error_abort);
+}
+
+static void test_params_lower_raise(void)
+{
+    ThreadPoolStats stats;
+    int i;
+
+    /* Get some workers going */
+    test_submit_many();
+
+    /*
+     * Ask surplus workers to exit, then raise the limit again before they
+     * all did, several times.  The tokens that were posted to make workers
+     * exit must not be mistaken for requests.
+     */
+    for (i = 0; i < 10; i++) {
+        aio_context_set_thread_pool_params(ctx, 0, 1, NULL, 0, &error_abort);
+        aio_context_set_thread_pool_params(ctx, 0,
+                                           THREAD_POOL_MAX_THREADS_DEFAULT,
+                                           NULL, 0, &error_abort);
+    }
+
+    test_submit_many();
+    g_assert_true(aio_context_get_thread_pool_stats(ctx, &stats));
+    g_assert_cmpint(stats.queue_depth, ==, 0);
+}
+
 int main(int argc, char **argv)
 {
     qemu_init_main_loop(&error_abort);
@@ -245,6 +315,10 @@ int main(int argc, char **argv)
     g_test_add_func("/thread-pool/submit-many", test_submit_many);
     g_test_add_func("/thread-pool/cancel", test_cancel);
     g_test_add_func("/thread-pool/cancel-async", test_cancel_async);
+    g_test_add_func("/thread-pool/stats", test_stats);
+    g_test_add_func("/thread-pool/params", test_params);
+    g_test_add_func("/thread-pool/params-lower-raise",
+                    test_params_lower_raise);
 
     return g_test_run();
 }
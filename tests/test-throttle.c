@@ -671,6 +671,66 @@ static void test_accounting(void)
                                 (64.0 / 13)));
 }
 
+static void test_headroom(void)
+{
+    ThrottleConfig cfg;
+    ThrottleState ts;
+    double bytes, units;
+
+    throttle_config_init(&cfg);
+    cfg.buckets[THROTTLE_OPS_TOTAL].avg = 100;
+    cfg.buckets[THROTTLE_BPS_READ].avg = 1000;
+
+    throttle_init(&ts);
+    throttle_config(&ts, QEMU_CLOCK_VIRTUAL, &cfg);
+
+    /* Buckets without a limit do not restrict the headroom */
+    throttle_get_headroom(&ts, false, ts.previous_leak, &bytes, &units);
+    g_assert(double_cmp(bytes, 100));
+    g_assert(double_cmp(units, 10));
+    throttle_get_headroom(&ts, true, ts.previous_leak, &bytes, &units);
+    g_assert(isinf(bytes));
+    g_assert(double_cmp(units, 10));
+
+    /* The total bucket is shared by reads and writes */
+    throttle_account(&ts, false, 40);
+    throttle_get_headroom(&ts, false, ts.previous_leak, &bytes, &units);
+    g_assert(double_cmp(bytes, 60));
+    g_assert(double_cmp(units, 9));
+    throttle_get_headroom(&ts, true, ts.previous_leak, &bytes, &units);
+    g_assert(double_cmp(units, 9));
+
+    /* A full bucket leaves no headroom */
+    throttle_account_units(&ts, false, 100, 0);
+    throttle_get_headroom(&ts, false, ts.previous_leak, &bytes, &units);
+    g_assert(double_cmp(bytes, 0));
+
+    /* A refund gives back at most what was charged */
+    throttle_refund_units(&ts, false, ts.previous_leak, ts.previous_leak,
+                          100, 0, 1000, 0);
+    throttle_get_headroom(&ts, false, ts.previous_leak, &bytes, &units);
+    g_assert(double_cmp(bytes, 60));
+    g_assert(double_cmp(units, 9));
+
+    /* Leaking makes room again */
+    throttle_account_units(&ts, false, 100, 10);
+    throttle_get_headroom(&ts, false, ts.previous_leak +
+                          NANOSECONDS_PER_SECOND / 20, &bytes, &units);
+    g_assert(double_cmp(bytes, 10));
+    g_assert(double_cmp(units, 4));
+
+    /*
+     * What leaked since the charge is not given back, so the first 40
+     * bytes and operation stay accounted
+     */
+    throttle_refund_units(&ts, false,
+                          ts.previous_leak - NANOSECONDS_PER_SECOND / 20,
+                          ts.previous_leak, 100, 10, 100, 10);
+    throttle_get_headroom(&ts, false, ts.previous_leak, &bytes, &units);
+    g_assert(double_cmp(bytes, 60));
+    g_assert(double_cmp(units, 9));
+}
+
 static void test_groups(void)
 {
     ThrottleConfig cfg1, cfg2;
@@ -738,8 +798,113 @@ static void test_groups(void)
     g_assert(tgm3->throttle_state == NULL);
 }
 
+typedef struct {
+    BucketType type;
+    uint64_t avg;
+    uint64_t request_size;
+} GroupLimitsOpts;
+
+typedef struct {
+    ThrottleGroupMember *tgm;
+    const GroupLimitsOpts *opts;
+    uint64_t nb_requests;
+    bool leased;
+    bool done;
+} GroupLimitsMember;
+
+static bool group_limits_stop;
+
+static void coroutine_fn group_limits_entry(void *opaque)
+{
+    GroupLimitsMember *m = opaque;
+
+    while (!group_limits_stop) {
+        throttle_group_co_io_limits_intercept(m->tgm, m->opts->request_size,
+                                              false);
+        m->nb_requests++;
+#ifdef CONFIG_ATOMIC64
+        m->leased |= !!qatomic_read__nocheck(&m->tgm->lease[0]);
+#endif
+
+        /* Let the other member run */
+        aio_co_schedule(ctx, qemu_coroutine_self());
+        qemu_coroutine_yield();
+    }
+    m->done = true;
+}
+
+/* The limits of a group must hold while its members use leases */
+static void test_groups_limits(const void *opaque)
+{
+    const GroupLimitsOpts *opts = opaque;
+    GroupLimitsMember members[2] = {};
+    BlockBackend *blk[2];
+    ThrottleConfig cfg;
+    int64_t start, deadline;
+    double elapsed, done, unit, allowed;
+    int i;
+
+    throttle_config_init(&cfg);
+    cfg.buckets[opts->type].avg = opts->avg;
+
+    for (i = 0; i < 2; i++) {
+        /* No actual I/O is performed on these devices */
+        blk[i] = blk_new(ctx, 0, BLK_PERM_ALL);
+        members[i].tgm = &blk_get_public(blk[i])->throttle_group_member;
+        members[i].opts = opts;
+        throttle_group_register_tgm(members[i].tgm, "limits", ctx);
+    }
+    throttle_group_config(members[0].tgm, &cfg);
+
+    group_limits_stop = false;
+    start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    deadline = start + NANOSECONDS_PER_SECOND / 2;
+    for (i = 0; i < 2; i++) {
+        aio_co_enter(ctx, qemu_coroutine_create(group_limits_entry,
+                                                &members[i]));
+    }
+    while (qemu_clock_get_ns(QEMU_CLOCK_REALTIME) < deadline) {
+        aio_poll(ctx, true);
+    }
+    group_limits_stop = true;
+    while (!members[0].done || !members[1].done) {
+        aio_poll(ctx, true);
+    }
+    elapsed = (double) (qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start) /
+              NANOSECONDS_PER_SECOND;
+
+    done = 0;
+    for (i = 0; i < 2; i++) {
+        done += members[i].nb_requests;
+        throttle_group_unregister_tgm(members[i].tgm);
+        blk_unref(blk[i]);
+    }
+    unit = opts->type == THROTTLE_BPS_TOTAL ? opts->request_size : 1;
+    done *= unit;
+
+    /*
+     * The average rate, plus the burst that an empty bucket allows, plus
+     * the request of each member that fills the bucket over the top
+     */
+    allowed = opts->avg * elapsed + opts->avg / 10.0 + 2 * unit;
+    g_assert_cmpfloat(done, <=, allowed);
+    /* ...but throttling must not stall the members either */
+    g_assert_cmpfloat(done, >=, allowed / 2);
+#ifdef CONFIG_ATOMIC64
+    g_assert(members[0].leased || members[1].leased);
+#endif
+}
+
 int main(int argc, char **argv)
 {
+    static const GroupLimitsOpts iops_limit = {
+        .type = THROTTLE_OPS_TOTAL, .avg = 1000, .request_size = 4096,
+    };
+    static const GroupLimitsOpts bps_limit = {
+        .type = THROTTLE_BPS_TOTAL, .avg = 4 * 1024 * 1024,
+        .request_size = 4096,
+    };
+
     qemu_init_main_loop(&error_fatal);
     ctx = qemu_get_aio_context();
     bdrv_init();
@@ -764,7 +929,12 @@ int main(int argc, char **argv)
                     test_iops_size_is_missing_limit);
     g_test_add_func("/throttle/config_functions",   test_config_functions);
     g_test_add_func("/throttle/accounting",         test_accounting);
+    g_test_add_func("/throttle/headroom",           test_headroom);
     g_test_add_func("/throttle/groups",             test_groups);
+    g_test_add_data_func("/throttle/groups/limits/iops", &iops_limit,
+                         test_groups_limits);
+    g_test_add_data_func("/throttle/groups/limits/bps", &bps_limit,
+                         test_groups_limits);
     return g_test_run();
 }
 
@@ -0,0 +1,147 @@
+/*
+ * Unit tests for the vhost-user server
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "qapi/error.h"
+#include "qemu/main-loop.h"
+#include "qemu/sockets.h"
+#include "qemu/vhost-user-server.h"
+
+static AioContext *ctx;
+static char *socket_path;
+
+/* No device behind it, only the vhost-user protocol */
+static const VuDevIface test_iface;
+
+typedef struct {
+    VuServer *server;
+    bool done;
+} CompleteData;
+
+/*
+ * Complete a request the way device code does once vu_client_trip() waits
+ * for it: the connection must still be there, and so must vu_lock.
+ */
+static void complete_bh(void *opaque)
+{
+    CompleteData *data = opaque;
+    VuServer *server = data->server;
+
+    if (!qatomic_read(&server->wait_idle)) {
+        aio_bh_schedule_oneshot(ctx, complete_bh, data);
+        return;
+    }
+
+    g_assert(server->sioc);
+    qemu_rec_mutex_lock(&server->vu_lock);
+    qemu_rec_mutex_unlock(&server->vu_lock);
+
+    data->done = true;
+    vhost_user_server_dec_in_flight(server);
+}
+
+static int client_connect(VuServer *server)
+{
+    VhostUserMsg msg = {
+        .request = VHOST_USER_GET_FEATURES,
+        .flags = 0x1,
+    };
+    size_t len = VHOST_USER_HDR_SIZE + sizeof(msg.payload.u64);
+    size_t done = 0;
+    int fd;
+
+    fd = unix_connect(socket_path, &error_abort);
+    g_assert_cmpint(write(fd, &msg, VHOST_USER_HDR_SIZE), ==,
+                    VHOST_USER_HDR_SIZE);
+
+    /* The reply shows that the server is processing messages */
+    qemu_set_nonblock(fd);
+    while (done < len) {
+        ssize_t ret;
+
+        main_loop_wait(false);
+        ret = read(fd, (char *)&msg + done, len - done);
+        if (ret < 0 && errno == EAGAIN) {
+            continue;
+        }
+        g_assert_cmpint(ret, >, 0);
+        done += ret;
+    }
+    g_assert(msg.flags & VHOST_USER_REPLY_MASK);
+    g_assert(server->sioc);
+
+    return fd;
+}
+
+static void start_server(VuServer *server)
+{
+    SocketAddress addr = {
+        .type = SOCKET_ADDRESS_TYPE_UNIX,
+        .u.q_unix.path = socket_path,
+    };
+
+    g_assert(vhost_user_server_start(server, &addr, ctx, 1, NULL,
+                                     &test_iface, &error_abort));
+}
+
+static void test_stop(void)
+{
+    VuServer server;
+    int fd;
+
+    start_server(&server);
+    fd = client_connect(&server);
+
+    vhost_user_server_stop(&server);
+    g_assert(!server.sioc);
+    close(fd);
+}
+
+static void test_stop_in_flight(void)
+{
+    VuServer server;
+    CompleteData data = { .server = &server };
+    int fd;
+
+    start_server(&server);
+    fd = client_connect(&server);
+
+    /* A request taken from a virtqueue, its I/O still running */
+    vhost_user_server_inc_in_flight(&server);
+    aio_bh_schedule_oneshot(ctx, complete_bh, &data);
+
+    vhost_user_server_stop(&server);
+    g_assert(data.done);
+    g_assert(!server.sioc);
+    close(fd);
+}
+
+int main(int argc, char **argv)
+{
+    char *dir;
+    int ret;
+
+    qemu_init_main_loop(&error_abort);
+    ctx = qemu_get_aio_context();
+
+    dir = g_dir_make_tmp("qemu-test-vhost-user-server.XXXXXX", NULL);
+    g_assert(dir);
+    socket_path = g_build_filename(dir, "sock", NULL);
+
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/vhost-user-server/stop", test_stop);
+    g_test_add_func("/vhost-user-server/stop-in-flight", test_stop_in_flight);
+
+    ret = g_test_run();
+
+    unlink(socket_path);
+    rmdir(dir);
+    g_free(socket_path);
+    g_free(dir);
+    return ret;
+}
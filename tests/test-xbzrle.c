@@ -174,6 +174,70 @@ static void test_encode_decode(void)
     }
 }
 
+#define XBZRLE_ACCEL_PAGES 64
+
+static void test_encode_accel(void)
+{
+    uint8_t *old = g_malloc(XBZRLE_ACCEL_PAGES * XBZRLE_PAGE_SIZE);
+    uint8_t *new = g_malloc(XBZRLE_ACCEL_PAGES * XBZRLE_PAGE_SIZE);
+    uint8_t *expected = g_malloc(XBZRLE_ACCEL_PAGES * XBZRLE_PAGE_SIZE);
+    uint8_t *compressed = g_malloc(XBZRLE_PAGE_SIZE);
+    int expected_len[XBZRLE_ACCEL_PAGES];
+    int dlen[XBZRLE_ACCEL_PAGES];
+    bool first = true;
+    int i, j;
+
+    for (i = 0; i < XBZRLE_ACCEL_PAGES * XBZRLE_PAGE_SIZE; i++) {
+        old[i] = g_test_rand_int();
+    }
+    memcpy(new, old, XBZRLE_ACCEL_PAGES * XBZRLE_PAGE_SIZE);
+
+    /* Runs of all lengths, at all alignments, including page boundaries */
+    for (i = 0; i < XBZRLE_ACCEL_PAGES; i++) {
+        uint8_t *page = new + i * XBZRLE_PAGE_SIZE;
+        int runs = g_test_rand_int_range(0, 64);
+        int max_run = i % 2 ? 8 : 300;
+
+        for (j = 0; j < runs; j++) {
+            int start = g_test_rand_int_range(0, XBZRLE_PAGE_SIZE);
+            int end = MIN(start + g_test_rand_int_range(1, max_run),
+                          XBZRLE_PAGE_SIZE);
+
+            for (; start < end; start++) {
+                page[start] ^= g_test_rand_int_range(1, 256);
+            }
+        }
+        /* Some of the pages do not fit in the output */
+        dlen[i] = i % 4 ? XBZRLE_PAGE_SIZE :
+                  g_test_rand_int_range(0, XBZRLE_PAGE_SIZE);
+    }
+
+    /* All implementations must produce the same output */
+    do {
+        for (i = 0; i < XBZRLE_ACCEL_PAGES; i++) {
+            uint8_t *out = expected + i * XBZRLE_PAGE_SIZE;
+            int rc;
+
+            rc = xbzrle_encode_buffer(old + i * XBZRLE_PAGE_SIZE,
+                                      new + i * XBZRLE_PAGE_SIZE,
+                                      XBZRLE_PAGE_SIZE,
+                                      first ? out : compressed, dlen[i]);
+            if (first) {
+                expected_len[i] = rc;
+            } else {
+                g_assert_cmpint(rc, ==, expected_len[i]);
+                g_assert(rc <= 0 || memcmp(compressed, out, rc) == 0);
+            }
+        }
+        first = false;
+    } while (test_xbzrle_encode_next_accel());
+
+    g_free(old);
+    g_free(new);
+    g_free(expected);
+    g_free(compressed);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -186,6 +250,7 @@ int main(int argc, char **argv)
     g_test_add_func("/xbzrle/encode_decode_overflow",
                     test_encode_decode_overflow);
     g_test_add_func("/xbzrle/encode_decode", test_encode_decode);
+    g_test_add_func("/xbzrle/encode_accel", test_encode_accel);
 
     return g_test_run();
 }
@@ -703,6 +703,12 @@ void aio_context_use_g_source(AioContext *ctx)
     aio_free_deleted_handlers(ctx);
 }
 
+bool aio_context_get_fdmon_stats(AioContext *ctx, uint64_t *sqes,
+                                 uint64_t *cqes)
+{
+    return fdmon_io_uring_get_stats(ctx, sqes, cqes);
+}
+
 void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
                                  int64_t grow, int64_t shrink, Error **errp)
 {
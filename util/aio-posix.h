@@ -67,12 +67,19 @@ static inline void fdmon_epoll_disable(AioContext *ctx)
 #ifdef CONFIG_LINUX_IO_URING
 bool fdmon_io_uring_setup(AioContext *ctx);
 void fdmon_io_uring_destroy(AioContext *ctx);
+bool fdmon_io_uring_get_stats(AioContext *ctx, uint64_t *sqes, uint64_t *cqes);
 #else
 static inline bool fdmon_io_uring_setup(AioContext *ctx)
 {
     return false;
 }
 
+static inline bool fdmon_io_uring_get_stats(AioContext *ctx, uint64_t *sqes,
+                                            uint64_t *cqes)
+{
+    return false;
+}
+
 static inline void fdmon_io_uring_destroy(AioContext *ctx)
 {
 }
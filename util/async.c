@@ -29,6 +29,8 @@
 #include "block/thread-pool.h"
 #include "qemu/main-loop.h"
 #include "qemu/atomic.h"
+#include "qemu/bitmap.h"
+#include "qemu/lockable.h"
 #include "qemu/rcu_queue.h"
 #include "block/raw-aio.h"
 #include "qemu/coroutine_int.h"
@@ -313,8 +315,13 @@ aio_ctx_finalize(GSource     *source)
     AioContext *ctx = (AioContext *) source;
     QEMUBH *bh;
     unsigned flags;
+#ifdef CONFIG_LINUX_IO_URING
+    size_t i;
+#endif
 
     thread_pool_free(ctx->thread_pool);
+    g_free(ctx->thread_pool_cpus);
+    qemu_mutex_destroy(&ctx->thread_pool_lock);
 
 #ifdef CONFIG_LINUX_AIO
     if (ctx->linux_aio) {
@@ -325,10 +332,12 @@ aio_ctx_finalize(GSource     *source)
 #endif
 
 #ifdef CONFIG_LINUX_IO_URING
-    if (ctx->linux_io_uring) {
-        luring_detach_aio_context(ctx->linux_io_uring, ctx);
-        luring_cleanup(ctx->linux_io_uring);
-        ctx->linux_io_uring = NULL;
+    for (i = 0; i < ARRAY_SIZE(ctx->linux_io_uring); i++) {
+        if (ctx->linux_io_uring[i]) {
+            luring_detach_aio_context(ctx->linux_io_uring[i], ctx);
+            luring_cleanup(ctx->linux_io_uring[i]);
+            ctx->linux_io_uring[i] = NULL;
+        }
     }
 #endif
 
@@ -370,11 +379,56 @@ GSource *aio_get_g_source(AioContext *ctx)
 ThreadPool *aio_get_thread_pool(AioContext *ctx)
 {
     if (!ctx->thread_pool) {
-        ctx->thread_pool = thread_pool_new(ctx);
+        QEMU_LOCK_GUARD(&ctx->thread_pool_lock);
+        /* Pairs with aio_context_get_thread_pool_stats() */
+        qatomic_store_release(&ctx->thread_pool, thread_pool_new(ctx));
     }
     return ctx->thread_pool;
 }
 
+void aio_context_set_thread_pool_params(AioContext *ctx, int64_t min,
+                                        int64_t max, unsigned long *cpus,
+                                        unsigned long nr_cpus, Error **errp)
+{
+    if (min < 0 || max <= 0 || min > max || max > INT_MAX) {
+        error_setg(errp, "thread pool needs 0 <= min <= max and "
+                   "0 < max <= %d", INT_MAX);
+        return;
+    }
+    if (cpus && find_first_bit(cpus, nr_cpus) >= nr_cpus) {
+        error_setg(errp, "thread pool CPU set must not be empty");
+        return;
+    }
+
+    QEMU_LOCK_GUARD(&ctx->thread_pool_lock);
+    ctx->thread_pool_min = min;
+    ctx->thread_pool_max = max;
+
+    g_free(ctx->thread_pool_cpus);
+    ctx->thread_pool_cpus = NULL;
+    ctx->thread_pool_nr_cpus = 0;
+    if (cpus) {
+        ctx->thread_pool_cpus = bitmap_new(nr_cpus);
+        bitmap_copy(ctx->thread_pool_cpus, cpus, nr_cpus);
+        ctx->thread_pool_nr_cpus = nr_cpus;
+    }
+
+    if (ctx->thread_pool) {
+        thread_pool_update_params(ctx->thread_pool, ctx);
+    }
+}
+
+bool aio_context_get_thread_pool_stats(AioContext *ctx, ThreadPoolStats *stats)
+{
+    ThreadPool *pool = qatomic_load_acquire(&ctx->thread_pool);
+
+    if (!pool) {
+        return false;
+    }
+    thread_pool_get_stats(pool, stats);
+    return true;
+}
+
 #ifdef CONFIG_LINUX_AIO
 LinuxAioState *aio_setup_linux_aio(AioContext *ctx, Error **errp)
 {
@@ -395,25 +449,28 @@ LinuxAioState *aio_get_linux_aio(AioContext *ctx)
 #endif
 
 #ifdef CONFIG_LINUX_IO_URING
-LuringState *aio_setup_linux_io_uring(AioContext *ctx, Error **errp)
+LuringState *aio_setup_linux_io_uring(AioContext *ctx, int flags,
+                                      Error **errp)
 {
-    if (ctx->linux_io_uring) {
-        return ctx->linux_io_uring;
+    assert(!(flags & ~LURING_SETUP_MASK));
+    if (ctx->linux_io_uring[flags]) {
+        return ctx->linux_io_uring[flags];
     }
 
-    ctx->linux_io_uring = luring_init(errp);
-    if (!ctx->linux_io_uring) {
+    ctx->linux_io_uring[flags] = luring_init(flags, errp);
+    if (!ctx->linux_io_uring[flags]) {
         return NULL;
     }
 
-    luring_attach_aio_context(ctx->linux_io_uring, ctx);
-    return ctx->linux_io_uring;
+    luring_attach_aio_context(ctx->linux_io_uring[flags], ctx);
+    return ctx->linux_io_uring[flags];
 }
 
-LuringState *aio_get_linux_io_uring(AioContext *ctx)
+LuringState *aio_get_linux_io_uring(AioContext *ctx, int flags)
 {
-    assert(ctx->linux_io_uring);
-    return ctx->linux_io_uring;
+    assert(!(flags & ~LURING_SETUP_MASK));
+    assert(ctx->linux_io_uring[flags]);
+    return ctx->linux_io_uring[flags];
 }
 #endif
 
@@ -525,10 +582,15 @@ AioContext *aio_context_new(Error **errp)
 #endif
 
 #ifdef CONFIG_LINUX_IO_URING
-    ctx->linux_io_uring = NULL;
+    memset(ctx->linux_io_uring, 0, sizeof(ctx->linux_io_uring));
 #endif
 
     ctx->thread_pool = NULL;
+    qemu_mutex_init(&ctx->thread_pool_lock);
+    ctx->thread_pool_min = 0;
+    ctx->thread_pool_max = THREAD_POOL_MAX_THREADS_DEFAULT;
+    ctx->thread_pool_cpus = NULL;
+    ctx->thread_pool_nr_cpus = 0;
     qemu_rec_mutex_init(&ctx->lock);
     timerlistgroup_init(&ctx->tlg, aio_timerlist_notify, ctx);
 
@@ -272,36 +272,20 @@ static void init_accel(unsigned cache)
 
 static void __attribute__((constructor)) init_cpuid_cache(void)
 {
-    int max = __get_cpuid_max(0, NULL);
-    int a, b, c, d;
+    unsigned features = cpuid_vector_features();
     unsigned cache = 0;
 
-    if (max >= 1) {
-        __cpuid(1, a, b, c, d);
-        if (d & bit_SSE2) {
-            cache |= CACHE_SSE2;
-        }
-        if (c & bit_SSE4_1) {
-            cache |= CACHE_SSE4;
-        }
-
-        /* We must check that AVX is not just available, but usable.  */
-        if ((c & bit_OSXSAVE) && (c & bit_AVX) && max >= 7) {
-            int bv;
-            __asm("xgetbv" : "=a"(bv), "=d"(d) : "c"(0));
-            __cpuid_count(7, 0, a, b, c, d);
-            if ((bv & 0x6) == 0x6 && (b & bit_AVX2)) {
-                cache |= CACHE_AVX2;
-            }
-            /* 0xe6:
-            *  XCR0[7:5] = 111b (OPMASK state, upper 256-bit of ZMM0-ZMM15
-            *                    and ZMM16-ZMM31 state are enabled by OS)
-            *  XCR0[2:1] = 11b (XMM state and YMM state are enabled by OS)
-            */
-            if ((bv & 0xe6) == 0xe6 && (b & bit_AVX512F)) {
-                cache |= CACHE_AVX512F;
-            }
-        }
+    if (features & CPUID_VEC_SSE2) {
+        cache |= CACHE_SSE2;
+    }
+    if (features & CPUID_VEC_SSE4_1) {
+        cache |= CACHE_SSE4;
+    }
+    if (features & CPUID_VEC_AVX2) {
+        cache |= CACHE_AVX2;
+    }
+    if (features & CPUID_VEC_AVX512F) {
+        cache |= CACHE_AVX512F;
     }
     cpuid_cache = cache;
     init_accel(cache);
@@ -353,3 +337,38 @@ bool buffer_is_zero(const void *buf, size_t len)
        includes a check for an unrolled loop over 64-bit integers.  */
     return select_accel_fn(buf, len);
 }
+
+/*
+ * Find the run of blocks at the start of a buffer that are either all zero
+ * or all contain data.  Each block is checked once with the accelerated
+ * function, so splitting a buffer into extents takes a single pass.
+ *
+ * @buf:        the buffer
+ * @len:        its length in bytes, which need not be a multiple of @block
+ * @block:      the granularity of the extents in bytes
+ * @is_zero:    set to whether the run is zero
+ *
+ * Returns the length of the run in bytes.
+ */
+size_t buffer_find_zero_extent(const void *buf, size_t len, size_t block,
+                               bool *is_zero)
+{
+    size_t pos, n;
+    bool zero;
+
+    assert(len > 0 && block > 0);
+
+    __builtin_prefetch(buf);
+
+    n = MIN(block, len);
+    zero = select_accel_fn(buf, n);
+    for (pos = n; pos < len; pos += n) {
+        n = MIN(block, len - pos);
+        if (select_accel_fn(buf + pos, n) != zero) {
+            break;
+        }
+    }
+
+    *is_zero = zero;
+    return pos;
+}
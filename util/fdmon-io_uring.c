@@ -25,7 +25,12 @@
  *
  * File descriptor monitoring is implemented using the following operations:
  *
- * 1. IORING_OP_POLL_ADD - adds a file descriptor to be monitored.
+ * 1. IORING_OP_POLL_ADD - adds a file descriptor to be monitored.  The poll
+ *    is one-shot and re-armed after every event.  Multishot polls
+ *    (IORING_POLL_ADD_MULTI) are not used because they only complete when
+ *    the file descriptor is woken up again, i.e. they are edge-triggered.
+ *    AioHandlers expect level-triggered monitoring: a handler that does not
+ *    consume all pending data must be called again.
  * 2. IORING_OP_POLL_REMOVE - removes a file descriptor being monitored.  When
  *    the poll mask changes for a file descriptor it is first removed and then
  *    re-added with the new poll mask, so this operation is also used as part
@@ -93,6 +98,7 @@ static struct io_uring_sqe *get_sqe(AioContext *ctx)
     } while (ret == -EINTR);
 
     assert(ret > 1);
+    stat64_add(&ctx->fdmon_io_uring_sqes, ret);
     sqe = io_uring_get_sqe(ring);
     assert(sqe);
     return sqe;
@@ -263,6 +269,7 @@ static int process_cq_ring(AioContext *ctx, AioHandlerList *ready_list)
     }
 
     io_uring_cq_advance(ring, num_cqes);
+    stat64_add(&ctx->fdmon_io_uring_cqes, num_cqes);
     return num_ready;
 }
 
@@ -290,6 +297,7 @@ static int fdmon_io_uring_wait(AioContext *ctx, AioHandlerList *ready_list,
     } while (ret == -EINTR);
 
     assert(ret >= 0);
+    stat64_add(&ctx->fdmon_io_uring_sqes, ret);
 
     return process_cq_ring(ctx, ready_list);
 }
@@ -331,10 +339,23 @@ bool fdmon_io_uring_setup(AioContext *ctx)
     }
 
     QSLIST_INIT(&ctx->submit_list);
+    stat64_init(&ctx->fdmon_io_uring_sqes, 0);
+    stat64_init(&ctx->fdmon_io_uring_cqes, 0);
     ctx->fdmon_ops = &fdmon_io_uring_ops;
     return true;
 }
 
+bool fdmon_io_uring_get_stats(AioContext *ctx, uint64_t *sqes, uint64_t *cqes)
+{
+    if (qatomic_read(&ctx->fdmon_ops) != &fdmon_io_uring_ops) {
+        return false;
+    }
+
+    *sqes = stat64_get(&ctx->fdmon_io_uring_sqes);
+    *cqes = stat64_get(&ctx->fdmon_io_uring_cqes);
+    return true;
+}
+
 void fdmon_io_uring_destroy(AioContext *ctx)
 {
     if (ctx->fdmon_ops == &fdmon_io_uring_ops) {
@@ -217,6 +217,182 @@ int64_t hbitmap_next_dirty(const HBitmap *hb, int64_t start, int64_t count)
     return MAX(start, first_dirty_off);
 }
 
+/*
+ * Return the index of the first word in @words[@pos..@end) that is not equal
+ * to @skip, or @end if there is none.  @skip is either 0 or all ones.
+ *
+ * The last level of a bitmap that tracks a large disk often contains long
+ * runs of such words: all ones when a full backup starts from a bitmap with
+ * every bit set, all zeroes when the upper levels of a sparse bitmap are
+ * rebuilt after loading it.  The search is vectorized where possible.
+ */
+static size_t hb_find_word_int(const unsigned long *words, size_t pos,
+                               size_t end, unsigned long skip)
+{
+    while (pos + 4 <= end &&
+           ((words[pos] ^ skip) | (words[pos + 1] ^ skip) |
+            (words[pos + 2] ^ skip) | (words[pos + 3] ^ skip)) == 0) {
+        pos += 4;
+    }
+    while (pos < end && words[pos] == skip) {
+        pos++;
+    }
+    return pos;
+}
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+
+static size_t hb_find_word_sse2(const unsigned long *words, size_t pos,
+                                size_t end, unsigned long skip)
+{
+    const size_t n = 32 / sizeof(unsigned long);
+    __m128i s = _mm_set1_epi8(skip ? -1 : 0);
+
+    /* Compare 32 bytes per iteration */
+    while (pos + n <= end) {
+        const __m128i *p = (const __m128i *)(words + pos);
+        __m128i t = _mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128(p), s),
+                                  _mm_cmpeq_epi8(_mm_loadu_si128(p + 1), s));
+
+        if (_mm_movemask_epi8(t) != 0xffff) {
+            break;
+        }
+        pos += n;
+    }
+    return hb_find_word_int(words, pos, end, skip);
+}
+#endif /* __SSE2__ */
+
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+static size_t hb_find_word_avx2(const unsigned long *words, size_t pos,
+                                size_t end, unsigned long skip)
+{
+    const size_t n = 64 / sizeof(unsigned long);
+    __m256i s = _mm256_set1_epi8(skip ? -1 : 0);
+
+    /* Compare 64 bytes per iteration */
+    while (pos + n <= end) {
+        const __m256i *p = (const __m256i *)(words + pos);
+        __m256i t = _mm256_or_si256(
+            _mm256_xor_si256(_mm256_loadu_si256(p), s),
+            _mm256_xor_si256(_mm256_loadu_si256(p + 1), s));
+
+        if (!_mm256_testz_si256(t, t)) {
+            break;
+        }
+        pos += n;
+    }
+    return hb_find_word_int(words, pos, end, skip);
+}
+#pragma GCC pop_options
+#endif /* CONFIG_AVX2_OPT */
+
+#ifdef CONFIG_AVX512F_OPT
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+#include <immintrin.h>
+
+static size_t hb_find_word_avx512(const unsigned long *words, size_t pos,
+                                  size_t end, unsigned long skip)
+{
+    const size_t n = 128 / sizeof(unsigned long);
+    __m512i s = _mm512_set1_epi64(skip ? -1 : 0);
+
+    /* Compare 128 bytes per iteration */
+    while (pos + n <= end) {
+        const __m512i *p = (const __m512i *)(words + pos);
+        __m512i t = _mm512_or_si512(
+            _mm512_xor_si512(_mm512_loadu_si512(p), s),
+            _mm512_xor_si512(_mm512_loadu_si512(p + 1), s));
+
+        if (_mm512_test_epi64_mask(t, t)) {
+            break;
+        }
+        pos += n;
+    }
+    return hb_find_word_int(words, pos, end, skip);
+}
+#pragma GCC pop_options
+#endif /* CONFIG_AVX512F_OPT */
+
+/* Note that for test_hbitmap_next_accel, the most preferred
+ * ISA must have the least significant bit.
+ */
+#define CACHE_AVX512F 1
+#define CACHE_AVX2    2
+#define CACHE_SSE2    4
+
+#ifdef __SSE2__
+# define INIT_CACHE CACHE_SSE2
+# define INIT_ACCEL hb_find_word_sse2
+#else
+# define INIT_CACHE 0
+# define INIT_ACCEL hb_find_word_int
+#endif
+
+static unsigned cpuid_cache = INIT_CACHE;
+static size_t (*hb_find_word)(const unsigned long *words, size_t pos,
+                              size_t end, unsigned long skip) = INIT_ACCEL;
+
+static void init_accel(unsigned cache)
+{
+    size_t (*fn)(const unsigned long *, size_t, size_t, unsigned long) =
+        hb_find_word_int;
+
+#ifdef __SSE2__
+    if (cache & CACHE_SSE2) {
+        fn = hb_find_word_sse2;
+    }
+#endif
+#ifdef CONFIG_AVX2_OPT
+    if (cache & CACHE_AVX2) {
+        fn = hb_find_word_avx2;
+    }
+#endif
+#ifdef CONFIG_AVX512F_OPT
+    if (cache & CACHE_AVX512F) {
+        fn = hb_find_word_avx512;
+    }
+#endif
+    hb_find_word = fn;
+}
+
+#if defined(CONFIG_AVX512F_OPT) || defined(CONFIG_AVX2_OPT)
+#include "qemu/cpuid.h"
+
+static void __attribute__((constructor)) init_cpuid_cache(void)
+{
+    unsigned features = cpuid_vector_features();
+    unsigned cache = INIT_CACHE;
+
+    if (features & CPUID_VEC_AVX2) {
+        cache |= CACHE_AVX2;
+    }
+    if (features & CPUID_VEC_AVX512F) {
+        cache |= CACHE_AVX512F;
+    }
+    cpuid_cache = cache;
+    init_accel(cache);
+}
+#endif /* CONFIG_AVX512F_OPT || CONFIG_AVX2_OPT */
+
+bool test_hbitmap_next_accel(void)
+{
+    /* If no bits set, we just tested hb_find_word_int.  */
+    if (cpuid_cache == 0) {
+        return false;
+    }
+    /* Disable the accelerator we used before and select a new one.  */
+    cpuid_cache &= cpuid_cache - 1;
+    init_accel(cpuid_cache);
+    return true;
+}
+
 int64_t hbitmap_next_zero(const HBitmap *hb, int64_t start, int64_t count)
 {
     size_t pos = (start >> hb->granularity) >> BITS_PER_LEVEL;
@@ -245,10 +421,7 @@ int64_t hbitmap_next_zero(const HBitmap *hb, int64_t start, int64_t count)
     assert((start >> hb->granularity) < hb->size);
 
     if (cur == (unsigned long)-1) {
-        do {
-            pos++;
-        } while (pos < sz && last_lev[pos] == (unsigned long)-1);
-
+        pos = hb_find_word(last_lev, pos + 1, sz, (unsigned long)-1);
         if (pos >= sz) {
             return -1;
         }
@@ -736,11 +909,11 @@ void hbitmap_deserialize_finish(HBitmap *bitmap)
         size = MAX((size + BITS_PER_LONG - 1) >> BITS_PER_LEVEL, 1);
         memset(bitmap->levels[lev], 0, size * sizeof(unsigned long));
 
-        for (i = 0; i < prev_size; ++i) {
-            if (bitmap->levels[lev + 1][i]) {
-                bitmap->levels[lev][i >> BITS_PER_LEVEL] |=
-                    1UL << (i & (BITS_PER_LONG - 1));
-            }
+        for (i = hb_find_word(bitmap->levels[lev + 1], 0, prev_size, 0);
+             i < prev_size;
+             i = hb_find_word(bitmap->levels[lev + 1], i + 1, prev_size, 0)) {
+            bitmap->levels[lev][i >> BITS_PER_LEVEL] |=
+                1UL << (i & (BITS_PER_LONG - 1));
         }
     }
 
@@ -15,9 +15,11 @@
  * GNU GPL, version 2 or (at your option) any later version.
  */
 #include "qemu/osdep.h"
+#include "qemu/bitmap.h"
 #include "qemu/queue.h"
 #include "qemu/thread.h"
 #include "qemu/coroutine.h"
+#include "qemu/timer.h"
 #include "trace.h"
 #include "block/thread-pool.h"
 #include "qemu/main-loop.h"
@@ -45,6 +47,9 @@ struct ThreadPoolElement {
     enum ThreadState state;
     int ret;
 
+    /* get_clock() at submission, for the wait time statistics */
+    int64_t submit_ns;
+
     /* Access to this list is protected by lock.  */
     QTAILQ_ENTRY(ThreadPoolElement) reqs;
 
@@ -58,7 +63,6 @@ struct ThreadPool {
     QemuMutex lock;
     QemuCond worker_stopped;
     QemuSemaphore sem;
-    int max_threads;
     QEMUBH *new_thread_bh;
 
     /* The following variables are only accessed from one AioContext. */
@@ -70,12 +74,67 @@ struct ThreadPool {
     int idle_threads;
     int new_threads;     /* backlog of threads we need to create */
     int pending_threads; /* threads created but not running yet */
+    int exit_threads;    /* sem tokens posted to make surplus workers exit */
     bool stopping;
+
+    /* Copied from the AioContext by thread_pool_update_params() */
+    int min_threads;     /* idle workers are kept around up to this number */
+    int max_threads;
+    unsigned long *cpus; /* host CPUs for the workers, NULL for no binding */
+    unsigned long nr_cpus;
+    unsigned cpus_gen;   /* incremented whenever cpus changes */
+
+    /* Statistics, see thread_pool_get_stats() */
+    int queue_depth;
+    int max_queue_depth;
+    uint64_t requests;
+    uint64_t wait_ns;
+    uint64_t max_wait_ns;
 };
 
+/*
+ * Bind the calling worker to pool->cpus if that changed since the last call.
+ * Runs with lock taken.
+ */
+static void worker_update_affinity(ThreadPool *pool, unsigned *cpus_gen)
+{
+    QemuThread self;
+    int ret;
+
+    if (*cpus_gen == pool->cpus_gen) {
+        return;
+    }
+    *cpus_gen = pool->cpus_gen;
+
+    /* Workers keep their binding when it is removed, until they exit */
+    if (!pool->cpus) {
+        return;
+    }
+
+    qemu_thread_get_self(&self);
+    ret = qemu_thread_set_affinity(&self, pool->cpus, pool->nr_cpus);
+    trace_thread_pool_set_affinity(pool, ret);
+}
+
+/*
+ * Called with lock taken when waiting for a request timed out.  Returns true
+ * if the worker must wait again instead of exiting.
+ */
+static bool worker_keep_waiting(ThreadPool *pool)
+{
+    /*
+     * We raced with a submission, or with thread_pool_update_params() asking
+     * surplus workers to exit, or we are one of the min_threads workers.
+     */
+    return !QTAILQ_EMPTY(&pool->request_list) ||
+           pool->cur_threads > pool->max_threads ||
+           pool->cur_threads <= pool->min_threads;
+}
+
 static void *worker_thread(void *opaque)
 {
     ThreadPool *pool = opaque;
+    unsigned cpus_gen = 0;
 
     qemu_mutex_lock(&pool->lock);
     pool->pending_threads--;
@@ -83,22 +142,53 @@ static void *worker_thread(void *opaque)
 
     while (!pool->stopping) {
         ThreadPoolElement *req;
+        int64_t wait_ns;
         int ret;
 
+        worker_update_affinity(pool, &cpus_gen);
+
         do {
             pool->idle_threads++;
             qemu_mutex_unlock(&pool->lock);
             ret = qemu_sem_timedwait(&pool->sem, 10000);
             qemu_mutex_lock(&pool->lock);
             pool->idle_threads--;
-        } while (ret == -1 && !QTAILQ_EMPTY(&pool->request_list));
+        } while (ret == -1 && !pool->stopping && worker_keep_waiting(pool));
         if (ret == -1 || pool->stopping) {
             break;
         }
 
+        /*
+         * The semaphore counts the queued requests plus exit_threads.  Any
+         * worker may take any token, so only exit if an exit token is still
+         * outstanding; otherwise a queued request would lose its token.
+         */
+        if (pool->exit_threads > 0 && pool->cur_threads > pool->max_threads) {
+            pool->exit_threads--;
+            break;
+        }
+
         req = QTAILQ_FIRST(&pool->request_list);
+        if (!req) {
+            /*
+             * An exit token that is not needed anymore because max_threads
+             * was raised again before the surplus workers exited.
+             */
+            if (pool->exit_threads > 0) {
+                pool->exit_threads--;
+            }
+            continue;
+        }
         QTAILQ_REMOVE(&pool->request_list, req, reqs);
         req->state = THREAD_ACTIVE;
+
+        pool->queue_depth--;
+        pool->requests++;
+        wait_ns = get_clock() - req->submit_ns;
+        pool->wait_ns += wait_ns;
+        pool->max_wait_ns = MAX(pool->max_wait_ns, wait_ns);
+
+        worker_update_affinity(pool, &cpus_gen);
         qemu_mutex_unlock(&pool->lock);
 
         ret = req->func(req->arg);
@@ -219,6 +309,7 @@ static void thread_pool_cancel(BlockAIOCB *acb)
          */
         qemu_sem_timedwait(&pool->sem, 0) == 0) {
         QTAILQ_REMOVE(&pool->request_list, elem, reqs);
+        pool->queue_depth--;
         qemu_bh_schedule(pool->completion_bh);
 
         elem->state = THREAD_DONE;
@@ -251,6 +342,7 @@ BlockAIOCB *thread_pool_submit_aio(ThreadPool *pool,
     req->arg = arg;
     req->state = THREAD_QUEUED;
     req->pool = pool;
+    req->submit_ns = get_clock();
 
     QLIST_INSERT_HEAD(&pool->head, req, all);
 
@@ -261,6 +353,8 @@ BlockAIOCB *thread_pool_submit_aio(ThreadPool *pool,
         spawn_thread(pool);
     }
     QTAILQ_INSERT_TAIL(&pool->request_list, req, reqs);
+    pool->queue_depth++;
+    pool->max_queue_depth = MAX(pool->max_queue_depth, pool->queue_depth);
     qemu_mutex_unlock(&pool->lock);
     qemu_sem_post(&pool->sem);
     return &req->common;
@@ -306,11 +400,65 @@ static void thread_pool_init_one(ThreadPool *pool, AioContext *ctx)
     qemu_mutex_init(&pool->lock);
     qemu_cond_init(&pool->worker_stopped);
     qemu_sem_init(&pool->sem, 0);
-    pool->max_threads = 64;
     pool->new_thread_bh = aio_bh_new(ctx, spawn_thread_bh_fn, pool);
 
     QLIST_INIT(&pool->head);
     QTAILQ_INIT(&pool->request_list);
+
+    thread_pool_update_params(pool, ctx);
+}
+
+void thread_pool_update_params(ThreadPool *pool, AioContext *ctx)
+{
+    int i;
+
+    qemu_mutex_lock(&pool->lock);
+
+    pool->min_threads = ctx->thread_pool_min;
+    pool->max_threads = ctx->thread_pool_max;
+
+    if (pool->cpus || ctx->thread_pool_cpus) {
+        g_free(pool->cpus);
+        pool->cpus = NULL;
+        pool->nr_cpus = ctx->thread_pool_nr_cpus;
+        if (ctx->thread_pool_cpus) {
+            pool->cpus = bitmap_new(pool->nr_cpus);
+            bitmap_copy(pool->cpus, ctx->thread_pool_cpus, pool->nr_cpus);
+        }
+        pool->cpus_gen++;
+
+        /* Idle workers rebind when they next pick up a request */
+    }
+
+    /*
+     * Spawn workers up to the minimum, and wake up surplus ones so that they
+     * notice they must exit.
+     */
+    for (i = pool->cur_threads; i < pool->min_threads; i++) {
+        spawn_thread(pool);
+    }
+    for (i = pool->cur_threads - pool->exit_threads; i > pool->max_threads;
+         i--) {
+        pool->exit_threads++;
+        qemu_sem_post(&pool->sem);
+    }
+
+    qemu_mutex_unlock(&pool->lock);
+}
+
+void thread_pool_get_stats(ThreadPool *pool, ThreadPoolStats *stats)
+{
+    QEMU_LOCK_GUARD(&pool->lock);
+
+    *stats = (ThreadPoolStats) {
+        .threads            = pool->cur_threads,
+        .idle_threads       = pool->idle_threads,
+        .queue_depth        = pool->queue_depth,
+        .max_queue_depth    = pool->max_queue_depth,
+        .requests           = pool->requests,
+        .wait_ns            = pool->wait_ns,
+        .max_wait_ns        = pool->max_wait_ns,
+    };
 }
 
 ThreadPool *thread_pool_new(AioContext *ctx)
@@ -348,5 +496,6 @@ void thread_pool_free(ThreadPool *pool)
     qemu_sem_destroy(&pool->sem);
     qemu_cond_destroy(&pool->worker_stopped);
     qemu_mutex_destroy(&pool->lock);
+    g_free(pool->cpus);
     g_free(pool);
 }
@@ -23,6 +23,7 @@
  */
 
 #include "qemu/osdep.h"
+#include <math.h>
 #include "qapi/error.h"
 #include "qemu/throttle.h"
 #include "qemu/timer.h"
@@ -87,6 +88,29 @@ static int64_t throttle_do_compute_wait(double limit, double extra)
     return wait;
 }
 
+/* Compute the sizes of the main and burst buckets of a leaky bucket
+ *
+ * @bkt:               the leaky bucket we operate on
+ * @bucket_size:       I/O before throttling to bkt->avg
+ * @burst_bucket_size: I/O before throttling to bkt->max
+ */
+static void throttle_get_bucket_sizes(LeakyBucket *bkt, double *bucket_size,
+                                      double *burst_bucket_size)
+{
+    if (!bkt->max) {
+        /* If bkt->max is 0 we still want to allow short bursts of I/O
+         * from the guest, otherwise every other request will be throttled
+         * and performance will suffer considerably. */
+        *bucket_size = (double) bkt->avg / 10;
+        *burst_bucket_size = 0;
+    } else {
+        /* If we have a burst limit then we have to wait until all I/O
+         * at burst rate has finished before throttling to bkt->avg */
+        *bucket_size = bkt->max * bkt->burst_length;
+        *burst_bucket_size = (double) bkt->max / 10;
+    }
+}
+
 /* This function compute the wait time in ns that a leaky bucket should trigger
  *
  * @bkt: the leaky bucket we operate on
@@ -102,18 +126,7 @@ int64_t throttle_compute_wait(LeakyBucket *bkt)
         return 0;
     }
 
-    if (!bkt->max) {
-        /* If bkt->max is 0 we still want to allow short bursts of I/O
-         * from the guest, otherwise every other request will be throttled
-         * and performance will suffer considerably. */
-        bucket_size = (double) bkt->avg / 10;
-        burst_bucket_size = 0;
-    } else {
-        /* If we have a burst limit then we have to wait until all I/O
-         * at burst rate has finished before throttling to bkt->avg */
-        bucket_size = bkt->max * bkt->burst_length;
-        burst_bucket_size = (double) bkt->max / 10;
-    }
+    throttle_get_bucket_sizes(bkt, &bucket_size, &burst_bucket_size);
 
     /* If the main bucket is full then we have to wait */
     extra = bkt->level - bucket_size;
@@ -164,6 +177,67 @@ static int64_t throttle_compute_wait_for(ThrottleState *ts,
     return max_wait;
 }
 
+/* Compute how much I/O a leaky bucket still accepts before it throttles
+ *
+ * @bkt: the leaky bucket we operate on
+ * @ret: the headroom, or INFINITY if the bucket has no limit
+ */
+static double throttle_bucket_headroom(LeakyBucket *bkt)
+{
+    double bucket_size, burst_bucket_size;
+    double headroom;
+
+    if (!bkt->avg) {
+        return INFINITY;
+    }
+
+    throttle_get_bucket_sizes(bkt, &bucket_size, &burst_bucket_size);
+
+    headroom = bucket_size - bkt->level;
+    if (bkt->burst_length > 1) {
+        headroom = MIN(headroom, burst_bucket_size - bkt->burst_level);
+    }
+
+    return MAX(headroom, 0);
+}
+
+/* Compute how many bytes and operations can be accounted for a type of
+ * operation before any of its buckets starts throttling
+ *
+ * @is_write: the type of operation
+ * @now:      the current clock timestamp
+ * @bytes:    the number of bytes left, or INFINITY if unlimited
+ * @units:    the number of operations left, or INFINITY if unlimited
+ */
+void throttle_get_headroom(ThrottleState *ts, bool is_write, int64_t now,
+                           double *bytes, double *units)
+{
+    const BucketType bucket_types_size[2][2] = {
+        { THROTTLE_BPS_TOTAL, THROTTLE_BPS_READ },
+        { THROTTLE_BPS_TOTAL, THROTTLE_BPS_WRITE }
+    };
+    const BucketType bucket_types_units[2][2] = {
+        { THROTTLE_OPS_TOTAL, THROTTLE_OPS_READ },
+        { THROTTLE_OPS_TOTAL, THROTTLE_OPS_WRITE }
+    };
+    unsigned i;
+
+    /* leak proportionally to the time elapsed */
+    throttle_do_leak(ts, now);
+
+    *bytes = INFINITY;
+    *units = INFINITY;
+    for (i = 0; i < 2; i++) {
+        LeakyBucket *bkt;
+
+        bkt = &ts->cfg.buckets[bucket_types_size[is_write][i]];
+        *bytes = MIN(*bytes, throttle_bucket_headroom(bkt));
+
+        bkt = &ts->cfg.buckets[bucket_types_units[is_write][i]];
+        *units = MIN(*units, throttle_bucket_headroom(bkt));
+    }
+}
+
 /* compute the timer for this type of operation
  *
  * @is_write:   the type of operation
@@ -444,12 +518,15 @@ bool throttle_schedule_timer(ThrottleState *ts,
     return true;
 }
 
-/* do the accounting for this operation
+/* Add a number of bytes and operations to the buckets of a type of
+ * operation. Negative values give back what was accounted before.
  *
  * @is_write: the type of operation (read/write)
- * @size:     the size of the operation
+ * @bytes:    the number of bytes
+ * @units:    the number of operations
  */
-void throttle_account(ThrottleState *ts, bool is_write, uint64_t size)
+void throttle_account_units(ThrottleState *ts, bool is_write,
+                            double bytes, double units)
 {
     const BucketType bucket_types_size[2][2] = {
         { THROTTLE_BPS_TOTAL, THROTTLE_BPS_READ },
@@ -459,21 +536,15 @@ void throttle_account(ThrottleState *ts, bool is_write, uint64_t size)
         { THROTTLE_OPS_TOTAL, THROTTLE_OPS_READ },
         { THROTTLE_OPS_TOTAL, THROTTLE_OPS_WRITE }
     };
-    double units = 1.0;
     unsigned i;
 
-    /* if cfg.op_size is defined and smaller than size we compute unit count */
-    if (ts->cfg.op_size && size > ts->cfg.op_size) {
-        units = (double) size / ts->cfg.op_size;
-    }
-
     for (i = 0; i < 2; i++) {
         LeakyBucket *bkt;
 
         bkt = &ts->cfg.buckets[bucket_types_size[is_write][i]];
-        bkt->level += size;
+        bkt->level += bytes;
         if (bkt->burst_length > 1) {
-            bkt->burst_level += size;
+            bkt->burst_level += bytes;
         }
 
         bkt = &ts->cfg.buckets[bucket_types_units[is_write][i]];
@@ -484,6 +555,92 @@ void throttle_account(ThrottleState *ts, bool is_write, uint64_t size)
     }
 }
 
+/* Give back to a bucket part of an earlier charge
+ *
+ * @bkt:      the leaky bucket we operate on
+ * @delta_ns: the time elapsed since the charge
+ * @charged:  the amount that was charged
+ * @amount:   the amount to give back
+ */
+static void throttle_refund_bucket(LeakyBucket *bkt, int64_t delta_ns,
+                                   double charged, double amount)
+{
+    double left;
+
+    left = charged - (bkt->avg * (double) delta_ns) / NANOSECONDS_PER_SECOND;
+    bkt->level = MAX(bkt->level - MIN(amount, MAX(left, 0)), 0);
+
+    if (bkt->burst_length > 1) {
+        left = charged -
+               (bkt->max * (double) delta_ns) / NANOSECONDS_PER_SECOND;
+        bkt->burst_level = MAX(bkt->burst_level - MIN(amount, MAX(left, 0)),
+                               0);
+    }
+}
+
+/* Give back budget that was charged with throttle_account_units() but
+ * turned out not to be needed
+ *
+ * The buckets have been leaking since the charge, and what they leaked
+ * cannot be told apart from what other I/O was charged.  Assume that the
+ * charge leaked first, so that each bucket gives back at most what can
+ * still be left of it and never what other I/O was charged.
+ *
+ * @is_write:      the type of operation (read/write)
+ * @charged_at:    the clock timestamp of the charge
+ * @now:           the current clock timestamp
+ * @charged_bytes: the number of bytes that were charged
+ * @charged_units: the number of operations that were charged
+ * @bytes:         the number of bytes to give back
+ * @units:         the number of operations to give back
+ */
+void throttle_refund_units(ThrottleState *ts, bool is_write,
+                           int64_t charged_at, int64_t now,
+                           double charged_bytes, double charged_units,
+                           double bytes, double units)
+{
+    const BucketType bucket_types_size[2][2] = {
+        { THROTTLE_BPS_TOTAL, THROTTLE_BPS_READ },
+        { THROTTLE_BPS_TOTAL, THROTTLE_BPS_WRITE }
+    };
+    const BucketType bucket_types_units[2][2] = {
+        { THROTTLE_OPS_TOTAL, THROTTLE_OPS_READ },
+        { THROTTLE_OPS_TOTAL, THROTTLE_OPS_WRITE }
+    };
+    int64_t delta_ns = MAX(now - charged_at, 0);
+    unsigned i;
+
+    /* bring the levels up to date before comparing them to the charge */
+    throttle_do_leak(ts, now);
+
+    for (i = 0; i < 2; i++) {
+        LeakyBucket *bkt;
+
+        bkt = &ts->cfg.buckets[bucket_types_size[is_write][i]];
+        throttle_refund_bucket(bkt, delta_ns, charged_bytes, bytes);
+
+        bkt = &ts->cfg.buckets[bucket_types_units[is_write][i]];
+        throttle_refund_bucket(bkt, delta_ns, charged_units, units);
+    }
+}
+
+/* do the accounting for this operation
+ *
+ * @is_write: the type of operation (read/write)
+ * @size:     the size of the operation
+ */
+void throttle_account(ThrottleState *ts, bool is_write, uint64_t size)
+{
+    double units = 1.0;
+
+    /* if cfg.op_size is defined and smaller than size we compute unit count */
+    if (ts->cfg.op_size && size > ts->cfg.op_size) {
+        units = (double) size / ts->cfg.op_size;
+    }
+
+    throttle_account_units(ts, is_write, size, units);
+}
+
 /* return a ThrottleConfig based on the options in a ThrottleLimits
  *
  * @arg:    the ThrottleLimits object to read from
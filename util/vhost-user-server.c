@@ -26,15 +26,20 @@
  * protocol messages over the UNIX domain socket.
  *
  * When virtqueues are set up libvhost-user calls set_watch() to monitor kick
- * fds. These fds are also handled in the VuServer->ctx AioContext.
+ * fds. These fds are also handled in the VuServer->ctx AioContext, unless the
+ * virtqueue has been assigned its own AioContext in VuServer->queue_ctx. Kicks
+ * of such virtqueues are then handled in parallel to each other and to
+ * vu_client_trip(). Since libvhost-user is not thread-safe, VuServer->vu_lock
+ * serializes message processing and kick handling. Watches of virtqueues with
+ * their own AioContext stay there across AioContext switches of the server.
  *
  * Both vu_client_trip() and kick fd monitoring can be stopped by shutting down
  * the socket connection. Shutting down the socket connection causes
  * vu_message_read() to fail since no more data can be received from the socket.
- * After vu_dispatch() fails, vu_client_trip() calls vu_deinit() to stop
- * libvhost-user before terminating the coroutine. vu_deinit() calls
- * remove_watch() to stop monitoring kick fds and this stops virtqueue
- * processing.
+ * After vu_dispatch() fails, vu_client_trip() waits for the requests that are
+ * still in flight and then calls vu_deinit() to stop libvhost-user before
+ * terminating the coroutine. vu_deinit() calls remove_watch() to stop
+ * monitoring kick fds and this stops virtqueue processing.
  *
  * When vu_client_trip() has finished cleaning up it schedules a BH in the main
  * loop thread to accept the next client connection.
@@ -74,6 +79,15 @@ static void panic_cb(VuDev *vu_dev, const char *buf)
     error_report("vu_panic: %s", buf);
 }
 
+/* Drop vu_lock if it was taken for the message just processed */
+static void vu_msg_unlock(VuServer *server)
+{
+    if (server->msg_locked) {
+        server->msg_locked = false;
+        qemu_rec_mutex_unlock(&server->vu_lock);
+    }
+}
+
 static bool coroutine_fn
 vu_message_read(VuDev *vu_dev, int conn_fd, VhostUserMsg *vmsg)
 {
@@ -87,6 +101,12 @@ vu_message_read(VuDev *vu_dev, int conn_fd, VhostUserMsg *vmsg)
     VuServer *server = container_of(vu_dev, VuServer, vu_dev);
     QIOChannel *ioc = server->ioc;
 
+    /*
+     * libvhost-user may read a reply while processing a message, so release
+     * the lock until the next message has been received completely.
+     */
+    vu_msg_unlock(server);
+
     vmsg->fd_num = 0;
     if (!ioc) {
         error_report_err(local_err);
@@ -160,6 +180,9 @@ vu_message_read(VuDev *vu_dev, int conn_fd, VhostUserMsg *vmsg)
         }
     }
 
+    /* Held until vu_dispatch() has processed the message */
+    qemu_rec_mutex_lock(&server->vu_lock);
+    server->msg_locked = true;
     return true;
 
 fail:
@@ -168,15 +191,58 @@ fail:
     return false;
 }
 
+void vhost_user_server_inc_in_flight(VuServer *server)
+{
+    qatomic_inc(&server->in_flight);
+}
+
+/* May be called from any of the server's AioContexts */
+void vhost_user_server_dec_in_flight(VuServer *server)
+{
+    if (qatomic_fetch_dec(&server->in_flight) == 1 &&
+        qatomic_xchg(&server->wait_idle, false)) {
+        aio_co_wake(server->co_trip);
+    }
+}
+
+/* Wait until device code has completed all requests */
+static void coroutine_fn vu_wait_idle(VuServer *server)
+{
+    while (qatomic_read(&server->in_flight)) {
+        qatomic_set(&server->wait_idle, true);
+        smp_mb();
+
+        /*
+         * If the last request completed meanwhile, either we take back
+         * wait_idle, or vhost_user_server_dec_in_flight() did and is going
+         * to wake us
+         */
+        if (!qatomic_read(&server->in_flight) &&
+            qatomic_xchg(&server->wait_idle, false)) {
+            break;
+        }
+        qemu_coroutine_yield();
+    }
+}
+
 static coroutine_fn void vu_client_trip(void *opaque)
 {
     VuServer *server = opaque;
     VuDev *vu_dev = &server->vu_dev;
 
-    while (!vu_dev->broken && vu_dispatch(vu_dev)) {
-        /* Keep running */
+    while (!vu_dev->broken) {
+        bool ok = vu_dispatch(vu_dev);
+
+        vu_msg_unlock(server);
+        if (!ok) {
+            break;
+        }
     }
 
+    /* Completing the requests still needs the virtqueues */
+    vu_wait_idle(server);
+
+    qemu_rec_mutex_lock(&server->vu_lock);
     vu_deinit(vu_dev);
 
     /* vu_deinit() should have called remove_watch() */
@@ -187,6 +253,7 @@ static coroutine_fn void vu_client_trip(void *opaque)
 
     object_unref(OBJECT(server->ioc));
     server->ioc = NULL;
+    qemu_rec_mutex_unlock(&server->vu_lock);
 
     server->co_trip = NULL;
     if (server->restart_listener_bh) {
@@ -206,15 +273,42 @@ static void kick_handler(void *opaque)
 {
     VuFdWatch *vu_fd_watch = opaque;
     VuDev *vu_dev = vu_fd_watch->vu_dev;
+    VuServer *server = container_of(vu_dev, VuServer, vu_dev);
 
-    vu_fd_watch->cb(vu_dev, 0, vu_fd_watch->pvt);
+    qemu_rec_mutex_lock(&server->vu_lock);
 
-    /* Stop vu_client_trip() if an error occurred in vu_fd_watch->cb() */
-    if (vu_dev->broken) {
-        VuServer *server = container_of(vu_dev, VuServer, vu_dev);
+    /* The watch may have been removed from another thread meanwhile */
+    if (!vu_fd_watch->removed) {
+        vu_fd_watch->cb(vu_dev, 0, vu_fd_watch->pvt);
+    }
 
+    /* Stop vu_client_trip() if an error occurred in vu_fd_watch->cb() */
+    if (vu_dev->broken && server->ioc) {
         qio_channel_shutdown(server->ioc, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
     }
+
+    qemu_rec_mutex_unlock(&server->vu_lock);
+}
+
+/* Returns the AioContext a kick fd of the given virtqueue is fixed to */
+static AioContext *vu_queue_ctx(VuServer *server, void *pvt)
+{
+    intptr_t index = (intptr_t)pvt;
+
+    if (!server->queue_ctx || index < 0 || index >= server->max_queues) {
+        return NULL;
+    }
+    return server->queue_ctx[index];
+}
+
+static AioContext *vu_fd_watch_ctx(VuServer *server, VuFdWatch *vu_fd_watch)
+{
+    return vu_fd_watch->queue_ctx ?: server->ctx;
+}
+
+static void vu_fd_watch_free_bh(void *opaque)
+{
+    g_free(opaque);
 }
 
 static VuFdWatch *find_vu_fd_watch(VuServer *server, int fd)
@@ -248,11 +342,12 @@ set_watch(VuDev *vu_dev, int fd, int vu_evt,
 
         vu_fd_watch->fd = fd;
         vu_fd_watch->cb = cb;
-        qemu_set_nonblock(fd);
-        aio_set_fd_handler(server->ioc->ctx, fd, true, kick_handler,
-                           NULL, NULL, vu_fd_watch);
         vu_fd_watch->vu_dev = vu_dev;
         vu_fd_watch->pvt = pvt;
+        vu_fd_watch->queue_ctx = vu_queue_ctx(server, pvt);
+        qemu_set_nonblock(fd);
+        aio_set_fd_handler(vu_fd_watch_ctx(server, vu_fd_watch), fd, true,
+                           kick_handler, NULL, NULL, vu_fd_watch);
     }
 }
 
@@ -270,10 +365,22 @@ static void remove_watch(VuDev *vu_dev, int fd)
     if (!vu_fd_watch) {
         return;
     }
-    aio_set_fd_handler(server->ioc->ctx, fd, true, NULL, NULL, NULL, NULL);
+    aio_set_fd_handler(vu_fd_watch_ctx(server, vu_fd_watch), fd, true,
+                       NULL, NULL, NULL, NULL);
 
     QTAILQ_REMOVE(&server->vu_fd_watches, vu_fd_watch, next);
-    g_free(vu_fd_watch);
+
+    if (vu_fd_watch->queue_ctx) {
+        /*
+         * kick_handler() may be about to run in the queue's AioContext, so
+         * only free the watch from there once it can't be called any more.
+         */
+        vu_fd_watch->removed = true;
+        aio_bh_schedule_oneshot(vu_fd_watch->queue_ctx, vu_fd_watch_free_bh,
+                                vu_fd_watch);
+    } else {
+        g_free(vu_fd_watch);
+    }
 }
 
 
@@ -322,8 +429,15 @@ static void vu_accept(QIONetListener *listener, QIOChannelSocket *sioc,
     aio_context_release(server->ctx);
 }
 
+static void vu_queue_ctx_sync_bh(void *opaque)
+{
+    /* Nothing to do, kick handlers and BHs queued before us have run */
+}
+
 void vhost_user_server_stop(VuServer *server)
 {
+    int i;
+
     aio_context_acquire(server->ctx);
 
     qemu_bh_delete(server->restart_listener_bh);
@@ -332,10 +446,13 @@ void vhost_user_server_stop(VuServer *server)
     if (server->sioc) {
         VuFdWatch *vu_fd_watch;
 
+        qemu_rec_mutex_lock(&server->vu_lock);
         QTAILQ_FOREACH(vu_fd_watch, &server->vu_fd_watches, next) {
-            aio_set_fd_handler(server->ctx, vu_fd_watch->fd, true,
+            aio_set_fd_handler(vu_fd_watch_ctx(server, vu_fd_watch),
+                               vu_fd_watch->fd, true,
                                NULL, NULL, NULL, vu_fd_watch);
         }
+        qemu_rec_mutex_unlock(&server->vu_lock);
 
         qio_channel_shutdown(server->ioc, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
 
@@ -344,6 +461,23 @@ void vhost_user_server_stop(VuServer *server)
 
     aio_context_release(server->ctx);
 
+    /* Wait until watches removed from queue AioContexts have been freed */
+    for (i = 0; server->queue_ctx && i < server->max_queues; i++) {
+        AioContext *queue_ctx = server->queue_ctx[i];
+
+        if (queue_ctx) {
+            aio_context_acquire(queue_ctx);
+            aio_wait_bh_oneshot(queue_ctx, vu_queue_ctx_sync_bh, NULL);
+            aio_context_release(queue_ctx);
+        }
+    }
+    g_free(server->queue_ctx);
+    server->queue_ctx = NULL;
+
+    /* vu_client_trip() has waited for all requests, none can take the lock */
+    assert(qatomic_read(&server->in_flight) == 0);
+    qemu_rec_mutex_destroy(&server->vu_lock);
+
     if (server->listener) {
         qio_net_listener_disconnect(server->listener);
         object_unref(OBJECT(server->listener));
@@ -376,6 +510,9 @@ void vhost_user_server_attach_aio_context(VuServer *server, AioContext *ctx)
     qio_channel_attach_aio_context(server->ioc, ctx);
 
     QTAILQ_FOREACH(vu_fd_watch, &server->vu_fd_watches, next) {
+        if (vu_fd_watch->queue_ctx) {
+            continue;
+        }
         aio_set_fd_handler(ctx, vu_fd_watch->fd, true, kick_handler, NULL,
                            NULL, vu_fd_watch);
     }
@@ -390,6 +527,9 @@ void vhost_user_server_detach_aio_context(VuServer *server)
         VuFdWatch *vu_fd_watch;
 
         QTAILQ_FOREACH(vu_fd_watch, &server->vu_fd_watches, next) {
+            if (vu_fd_watch->queue_ctx) {
+                continue;
+            }
             aio_set_fd_handler(server->ctx, vu_fd_watch->fd, true,
                                NULL, NULL, NULL, vu_fd_watch);
         }
@@ -404,6 +544,7 @@ bool vhost_user_server_start(VuServer *server,
                              SocketAddress *socket_addr,
                              AioContext *ctx,
                              uint16_t max_queues,
+                             AioContext **queue_ctx,
                              const VuDevIface *vu_iface,
                              Error **errp)
 {
@@ -432,8 +573,14 @@ bool vhost_user_server_start(VuServer *server,
         .vu_iface              = vu_iface,
         .max_queues            = max_queues,
         .ctx                   = ctx,
+        .queue_ctx             = queue_ctx ?
+                                 g_memdup(queue_ctx,
+                                          max_queues * sizeof(queue_ctx[0])) :
+                                 NULL,
     };
 
+    qemu_rec_mutex_init(&server->vu_lock);
+
     qio_net_listener_set_name(server->listener, "vhost-user-backend-listener");
 
     qio_net_listener_set_client_func(server->listener,